@@ -35,17 +35,20 @@ AlignmentPairwise::AlignmentPairwise(PhyloTree *atree, int seq1, int seq2) : Ali
 
     if (tree->getRate()->isSiteSpecificRate() || tree->getModel()->isSiteSpecificModel()) return;
 
+    int nptn = tree->aln->size();
+    unsigned char *states1 = tree->getTipStates(seq_id1);
+    unsigned char *states2 = tree->getTipStates(seq_id2);
+
     // categorized rates
     if (tree->getRate()->getPtnCat(0) >= 0) {
         int size_sqr = num_states * num_states;
         int total_size = size_sqr * tree->getRate()->getNDiscreteRate();
         pair_freq = new double[total_size];
         memset(pair_freq, 0, sizeof(double)*total_size);
-        int i = 0;
-        for (Alignment::iterator it = tree->aln->begin(); it != tree->aln->end(); it++, i++) {
-            int state1 = (*it)[seq_id1];
-            int state2 = (*it)[seq_id2];
-            addPattern(state1, state2, it->frequency, tree->getRate()->getPtnCat(i));
+        for (int i = 0; i < nptn; i++) {
+            int state1 = states1[i];
+            int state2 = states2[i];
+            addPattern(state1, state2, tree->aln->at(i).frequency, tree->getRate()->getPtnCat(i));
             /*
             	if (state1 < num_states && state2 < num_states)
             		pair_freq[tree->getRate()->getPtnCat(i)*size_sqr + state1*num_states + state2] += it->frequency;*/
@@ -55,10 +58,10 @@ AlignmentPairwise::AlignmentPairwise(PhyloTree *atree, int seq1, int seq2) : Ali
 
     pair_freq = new double[num_states * num_states];
     memset(pair_freq, 0, sizeof(double) * num_states * num_states);
-    for (Alignment::iterator it = tree->aln->begin(); it != tree->aln->end(); it++) {
-        int state1 = (*it)[seq_id1];
-        int state2 = (*it)[seq_id2];
-        addPattern(state1, state2, it->frequency);
+    for (int i = 0; i < nptn; i++) {
+        int state1 = states1[i];
+        int state2 = states2[i];
+        addPattern(state1, state2, tree->aln->at(i).frequency);
         /*		if (state1 < num_states && state2 < num_states)
         			pair_freq[state1 * num_states + state2] += it->frequency;*/
     }
@@ -108,11 +111,14 @@ double AlignmentPairwise::computeFunction(double value) {
     int nptn = tree->aln->getNPattern();
     double lh = 0.0;
 
+    unsigned char *states1 = tree->getTipStates(seq_id1);
+    unsigned char *states2 = tree->getTipStates(seq_id2);
+
     // site-specific rates
     if (site_rate->isSiteSpecificRate()) {
         for (i = 0; i < nptn; i++) {
-            int state1 = tree->aln->at(i)[seq_id1];
-            int state2 = tree->aln->at(i)[seq_id2];
+            int state1 = states1[i];
+            int state2 = states2[i];
             if (state1 >= num_states || state2 >= num_states) continue;
             double trans = tree->getModelFactory()->computeTrans(value * site_rate->getPtnRate(i), state1, state2);
             lh -= log(trans) * tree->aln->at(i).frequency;
@@ -123,8 +129,8 @@ double AlignmentPairwise::computeFunction(double value) {
 
     if (tree->getModel()->isSiteSpecificModel()) {
         for (i = 0; i < nptn; i++) {
-            int state1 = tree->aln->at(i)[seq_id1];
-            int state2 = tree->aln->at(i)[seq_id2];
+            int state1 = states1[i];
+            int state2 = states2[i];
             if (state1 >= num_states || state2 >= num_states) continue;
             double trans = tree->getModel()->computeTrans(value, model->getPtnModelID(i), state1, state2);
             lh -= log(trans) * tree->aln->at(i).frequency;
@@ -181,10 +187,13 @@ double AlignmentPairwise::computeFuncDerv(double value, double &df, double &ddf)
     df = 0.0;
     ddf = 0.0;
 
+    unsigned char *states1 = tree->getTipStates(seq_id1);
+    unsigned char *states2 = tree->getTipStates(seq_id2);
+
     if (site_rate->isSiteSpecificRate()) {
         for (i = 0; i < nptn; i++) {
-            int state1 = tree->aln->at(i)[seq_id1];
-            int state2 = tree->aln->at(i)[seq_id2];
+            int state1 = states1[i];
+            int state2 = states2[i];
             if (state1 >= num_states || state2 >= num_states) continue;
             double rate_val = site_rate->getPtnRate(i);
             double rate_sqr = rate_val * rate_val;
@@ -202,8 +211,8 @@ double AlignmentPairwise::computeFuncDerv(double value, double &df, double &ddf)
     
     if (tree->getModel()->isSiteSpecificModel()) {
         for (i = 0; i < nptn; i++) {
-            int state1 = tree->aln->at(i)[seq_id1];
-            int state2 = tree->aln->at(i)[seq_id2];
+            int state1 = states1[i];
+            int state2 = states2[i];
             if (state1 >= num_states || state2 >= num_states) continue;
             double rate_val = site_rate->getPtnRate(i);
             double rate_sqr = rate_val * rate_val;
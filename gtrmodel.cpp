@@ -348,9 +348,9 @@ void GTRModel::getVariables(double *variables) {
 double GTRModel::targetFunk(double x[]) {
 	getVariables(x);
 	if (state_freq[num_states-1] < 1e-4) return 1.0e+12;
-	decomposeRateMatrix();
+	// a new parameter version makes the tree recompute its partial likelihoods
+	if (isChangedParameters()) decomposeRateMatrix();
 	assert(phylo_tree);
-	phylo_tree->clearAllPartialLH();
 	return -phylo_tree->computeLikelihood();
 }
 
@@ -391,8 +391,7 @@ double GTRModel::optimizeParameters(double epsilon) {
 
 	getVariables(variables);
 	//if (freq_type == FREQ_ESTIMATE) scaleStateFreq(true);
-	decomposeRateMatrix();
-	phylo_tree->clearAllPartialLH();
+	if (isChangedParameters()) decomposeRateMatrix();
 	
 	delete [] bound_check;
 	delete [] lower_bound;
@@ -405,6 +404,7 @@ double GTRModel::optimizeParameters(double epsilon) {
 
 
 void GTRModel::decomposeRateMatrix(){
+	increaseParamVersion();
 	double **rate_matrix = (double**) new double[num_states];
 	int i, j, k = 0;
 
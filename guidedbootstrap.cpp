@@ -293,7 +293,7 @@ void printTrees(const char *ofile, IQTree &tree, IntVector *weights, bool compre
         else
             ((ofstream*)out)->open(ofile);
         (*out) << "[ scale=" << tree.len_scale << " ]" << endl;
-        for (StringIntMap::iterator it = tree.treels.begin(); it != tree.treels.end(); it++)
+        for (TopologyIntMap::iterator it = tree.treels.begin(); it != tree.treels.end(); it++)
             if (!weights || weights->at(it->second)) {
                 int id = it->second;
                 out->precision(10);
@@ -340,7 +340,7 @@ void printPatternLh(const char *ofile, IQTree *tree, bool compression) {
             (*out) << " " << tree->aln->getPatternID(i);
         (*out) << endl;
         // DO NOT CHANGE
-        for (StringIntMap::iterator it = tree->treels.begin(); it != tree->treels.end(); it++)
+        for (TopologyIntMap::iterator it = tree->treels.begin(); it != tree->treels.end(); it++)
         {
             int id = it->second;
             assert(id < tree->treels_ptnlh.size());
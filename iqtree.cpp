@@ -22,6 +22,9 @@
 #include "phylosupertreeplen.h"
 #include "mexttree.h"
 #include "timeutil.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 extern double t_begin;
 
@@ -56,6 +59,7 @@ void IQTree::init() {
     len_scale = 10000;
     save_all_br_lens = false;
     duplication_counter = 0;
+    candidate_pool = NULL;
     phyloTree = NULL;
     //boot_splits = new SplitGraph;
     //initLeafFrequency();
@@ -356,7 +360,7 @@ void IQTree::deleteNonCherryLeaves(PhyloNodeVector &del_leaves) {
 		(*it) = startValue;
 		++startValue;
 	}
-	random_shuffle(indices_noncherry.begin(), indices_noncherry.end());
+	random_shuffle(indices_noncherry.begin(), indices_noncherry.end(), p_myrandom);
 	int i;
 	for (i = 0; i < num_delete && i < noncherry_taxa.size(); i++) {
 		PhyloNode *taxon = (PhyloNode*) noncherry_taxa[indices_noncherry[i]];
@@ -373,7 +377,7 @@ void IQTree::deleteNonCherryLeaves(PhyloNodeVector &del_leaves) {
 			(*it) = startValue;
 			++startValue;
 		}
-		random_shuffle(indices_cherry.begin(), indices_cherry.end());
+		random_shuffle(indices_cherry.begin(), indices_cherry.end(), p_myrandom);
 		while (i < num_delete) {
 			PhyloNode *taxon = (PhyloNode*) cherry_taxa[indices_cherry[j]];
 			del_leaves.push_back(taxon);
@@ -410,7 +414,7 @@ void IQTree::deleteNonTabuLeaves(PhyloNodeVector &del_leaves) {
         while (leaf_freqs[endIndex].freq == cur_freq && endIndex < leaf_freqs.size()) {
             endIndex++;
         }
-        random_shuffle(leaf_freqs.begin() + startIndex, leaf_freqs.begin() + endIndex);
+        random_shuffle(leaf_freqs.begin() + startIndex, leaf_freqs.begin() + endIndex, p_myrandom);
         if (endIndex == leaf_freqs.size())
             break;
         startIndex = endIndex;
@@ -893,9 +897,8 @@ void IQTree::doRandomRestart() {
     // keep the best tree into a string
     stringstream best_tree_string;
     printTree(best_tree_string, WT_TAXON_ID + WT_BR_LEN);
-    stringstream best_tree_topo_ss;
-    printTree(best_tree_topo_ss, WT_TAXON_ID + WT_SORT_TAXA);
-    string best_tree_topo = best_tree_topo_ss.str();
+    IntVector best_tree_topo;
+    getTopology(best_tree_topo);
     for (curIQPIter = 2; curIQPIter < params->min_iterations; curIQPIter++) {
         double min_elapsed = (getCPUTime() - params->startTime) / 60;
         if (min_elapsed > params->maxtime) {
@@ -906,9 +909,9 @@ void IQTree::doRandomRestart() {
         curScore = optimizeNNIRax();
         if (curScore > bestScore) {
         	curScore = optimizeAllBranches();
-            stringstream cur_tree_topo_ss;
-            printTree(cur_tree_topo_ss, WT_TAXON_ID | WT_SORT_TAXA);
-            if (cur_tree_topo_ss.str() != best_tree_topo) {
+            IntVector cur_tree_topo;
+            getTopology(cur_tree_topo);
+            if (cur_tree_topo != best_tree_topo) {
                 cout << "BETTER TREE FOUND: " << curScore << endl;
                 bestScore = curScore;
                 best_tree_string.seekp(0, ios::beg);
@@ -975,13 +978,12 @@ double IQTree::doIQPNNI() {
     //printTree(treels_name.c_str(), WT_NEWLINE | WT_BR_LEN);
 
     setRootNode(params->root);
-    // keep the best tree into a string
-    stringstream best_tree_string;
-    printTree(best_tree_string, WT_TAXON_ID + WT_BR_LEN);
+    // keep the best tree in memory
+    TreeSnapshot best_tree;
+    saveSnapshot(best_tree);
 
-    stringstream best_tree_topo_ss;
-    printTree(best_tree_topo_ss, WT_TAXON_ID + WT_SORT_TAXA);
-    string best_tree_topo = best_tree_topo_ss.str();
+    IntVector best_tree_topo;
+    getTopology(best_tree_topo);
 
     // write tree's loglikelihood to a file (if nni_lh option is enabled)
     ofstream lh_file;
@@ -1016,28 +1018,7 @@ double IQTree::doIQPNNI() {
             cout << "Maximal running time of " << params->maxtime << " minutes reached" << endl;
             break;
         }
-        // estimate logl_cutoff
-        if (params->avoid_duplicated_trees && max_candidate_trees > 0 && treels_logl.size() > 1000) {
-            int num_entries = floor(max_candidate_trees * ((double) curIQPIter / stop_rule.getNumIterations()));
-            if (num_entries < treels_logl.size() * 0.9) {
-                DoubleVector logl = treels_logl;
-                nth_element(logl.begin(), logl.begin() + (treels_logl.size() - num_entries), logl.end());
-                logl_cutoff = logl[treels_logl.size() - num_entries] - 1.0;
-            } else
-                logl_cutoff = 0.0;
-            if (verbose_mode >= VB_MED) {
-                if (curIQPIter % 10 == 0) {
-                    cout << treels.size() << " trees, " << treels_logl.size() << " logls, logl_cutoff= " << logl_cutoff;
-                    if (params->store_candidate_trees)
-                        cout << " duplicates= " << duplication_counter << " ("
-                                << (int) round(100 * ((double) duplication_counter / treels_logl.size())) << "%)"
-                                << endl;
-                    else
-                        cout << endl;
-                }
-            }
-
-        }
+        estimateLoglCutoff();
 
         if (estimate_nni_cutoff && nni_info.size() >= 500) {
             estimate_nni_cutoff = false;
@@ -1114,31 +1095,7 @@ double IQTree::doIQPNNI() {
                     speedupMsg = true;
                     cout << "SPEED UP HEURISTIC ENABLED!" << endl;
                 }
-                if (!params->new_heuristic) {
-                    nni_count_est = estN95();
-                    nni_delta_est = estDelta95();
-                } else {
-                    double nni_count_est95 = estN95();
-                    double nni_delta_est95 = estDelta95();
-                    double nni_count_estMedian = estNMedian();
-                    double nni_delta_estMedian = estDeltaMedian();
-                    double maxScore1 = nni_delta_est95 * nni_count_estMedian;
-                    double maxScore2 = nni_delta_estMedian * nni_count_est95;
-                    if (maxScore2 > maxScore1) {
-                        nni_count_est = nni_count_est95;
-                        nni_delta_est = nni_delta_estMedian;
-                    } else {
-                        nni_count_est = nni_count_estMedian;
-                        nni_delta_est = nni_delta_est95;
-                    }
-                    //nni_count_est = estN95();
-                    //nni_delta_est = estDelta95();
-                }
-                if (verbose_mode >= VB_MED) {
-                    if (curIQPIter % 10 == 0)
-                        cout << "Estimated number of NNIs: " << nni_count_est << ", delta-logl per NNI: "
-                                << nni_delta_est << endl;
-                }
+                estimateNNISpeedup();
 
                 if (params->phylolib) {
                     curScore = optimizeNNIRax(true, &skipped, &nni_count);
@@ -1257,10 +1214,10 @@ double IQTree::doIQPNNI() {
             }
 
             //curScore = optimizeAllBranches(100, 0.0001);
-            stringstream cur_tree_topo_ss;
-            printTree(cur_tree_topo_ss, WT_TAXON_ID | WT_SORT_TAXA);
-            if (cur_tree_topo_ss.str() != best_tree_topo) {
-                best_tree_topo = cur_tree_topo_ss.str();
+            IntVector cur_tree_topo;
+            getTopology(cur_tree_topo);
+            if (cur_tree_topo != best_tree_topo) {
+                best_tree_topo = cur_tree_topo;
                 cout << "BETTER TREE FOUND at iteration " << curIQPIter << ": " << curScore << endl;
                 if (params->phylolib) {
                 	treeEvaluate(phyloTree, 32);
@@ -1270,8 +1227,7 @@ double IQTree::doIQPNNI() {
                 }
                 //cout << "Saving new better tree ..." << endl;
                 bestScore = curScore;
-                best_tree_string.seekp(0, ios::beg);
-                printTree(best_tree_string, WT_TAXON_ID + WT_BR_LEN);
+                saveSnapshot(best_tree);
                 if (params->write_best_trees) {
                     ostringstream iter_string;
                     iter_string << curIQPIter;
@@ -1290,16 +1246,8 @@ double IQTree::doIQPNNI() {
             }
         } else {
             /* take back the current best tree */
-            best_tree_string.seekg(0, ios::beg);
-            freeNode();
-            readTree(best_tree_string, rooted);
-            assignLeafNames();
-            if (!params->phylolib) {
-                initializeAllPartialLh();
-                clearAllPartialLH();
-            }
+            restoreSnapshot(best_tree);
             //cout << "Rollback tree topology ..." << endl;
-            //cout << best_tree_string.str() << endl;
             //printTree(cout);
             //cout << endl;
             //cout << "Recompute best score: " << optimizeAllBranches() << endl;
@@ -1308,30 +1256,7 @@ double IQTree::doIQPNNI() {
             //if (curScore > bestScore - 1e-4) // if goes back, increase k_delete once more
             //increaseKDelete();
         }
-        if ((curIQPIter) % (params->step_iterations / 2) == 0 && params->gbo_replicates) {
-            SplitGraph *sg = new SplitGraph;
-            summarizeBootstrap(*sg);
-            boot_splits.push_back(sg);
-            if (params->max_candidate_trees == 0)
-            	max_candidate_trees = treels_logl.size()
-                    * (stop_rule.getNumIterations()) / curIQPIter;
-            cout << "Setting tau = " << max_candidate_trees << endl;
-        }
-        if (curIQPIter == stop_rule.getNumIterations() && params->gbo_replicates && !boot_splits.empty()
-                && stop_rule.getNumIterations() + params->step_iterations <= params->max_iterations) {
-            //SplitGraph *sg = new SplitGraph;
-            //summarizeBootstrap(*sg);
-            if (!checkBootstrapStopping()) {
-            	if (params->max_candidate_trees == 0)
-            		max_candidate_trees = treels_logl.size() * (stop_rule.getNumIterations() + params->step_iterations)
-                		/ stop_rule.getNumIterations();
-                stop_rule.setIterationNum(stop_rule.getNumIterations() + params->step_iterations, params->max_iterations);
-                cout << "INFO: Increase number of iterations to " << stop_rule.getNumIterations() << " tau = "
-                        << max_candidate_trees << endl;
-                //delete boot_splits;
-                //boot_splits = sg;
-            } //else delete sg;
-        }
+        checkBootstrapConvergence();
     }
 
     int predicted_iteration = stop_rule.getPredictedIteration();
@@ -1355,6 +1280,288 @@ double IQTree::doIQPNNI() {
     return bestScore;
 }
 
+void IQTree::estimateLoglCutoff() {
+    if (params->avoid_duplicated_trees && max_candidate_trees > 0 && treels_logl.size() > 1000) {
+        int num_entries = floor(max_candidate_trees * ((double) curIQPIter / stop_rule.getNumIterations()));
+        if (num_entries < treels_logl.size() * 0.9) {
+            DoubleVector logl = treels_logl;
+            nth_element(logl.begin(), logl.begin() + (treels_logl.size() - num_entries), logl.end());
+            logl_cutoff = logl[treels_logl.size() - num_entries] - 1.0;
+        } else
+            logl_cutoff = 0.0;
+        if (verbose_mode >= VB_MED) {
+            if (curIQPIter % 10 == 0) {
+                cout << treels.size() << " trees, " << treels_logl.size() << " logls, logl_cutoff= " << logl_cutoff;
+                if (params->store_candidate_trees)
+                    cout << " duplicates= " << duplication_counter << " ("
+                            << (int) round(100 * ((double) duplication_counter / treels_logl.size())) << "%)"
+                            << endl;
+                else
+                    cout << endl;
+            }
+        }
+
+    }
+}
+
+void IQTree::estimateNNISpeedup() {
+    if (!params->new_heuristic) {
+        nni_count_est = estN95();
+        nni_delta_est = estDelta95();
+    } else {
+        double nni_count_est95 = estN95();
+        double nni_delta_est95 = estDelta95();
+        double nni_count_estMedian = estNMedian();
+        double nni_delta_estMedian = estDeltaMedian();
+        double maxScore1 = nni_delta_est95 * nni_count_estMedian;
+        double maxScore2 = nni_delta_estMedian * nni_count_est95;
+        if (maxScore2 > maxScore1) {
+            nni_count_est = nni_count_est95;
+            nni_delta_est = nni_delta_estMedian;
+        } else {
+            nni_count_est = nni_count_estMedian;
+            nni_delta_est = nni_delta_est95;
+        }
+        //nni_count_est = estN95();
+        //nni_delta_est = estDelta95();
+    }
+    if (verbose_mode >= VB_MED) {
+        if (curIQPIter % 10 == 0)
+            cout << "Estimated number of NNIs: " << nni_count_est << ", delta-logl per NNI: "
+                    << nni_delta_est << endl;
+    }
+}
+
+void IQTree::checkBootstrapConvergence() {
+    if ((curIQPIter) % (params->step_iterations / 2) == 0 && params->gbo_replicates) {
+        SplitGraph *sg = new SplitGraph;
+        summarizeBootstrap(*sg);
+        boot_splits.push_back(sg);
+        if (params->max_candidate_trees == 0)
+        	max_candidate_trees = treels_logl.size()
+                * (stop_rule.getNumIterations()) / curIQPIter;
+        cout << "Setting tau = " << max_candidate_trees << endl;
+    }
+    if (curIQPIter == stop_rule.getNumIterations() && params->gbo_replicates && !boot_splits.empty()
+            && stop_rule.getNumIterations() + params->step_iterations <= params->max_iterations) {
+        //SplitGraph *sg = new SplitGraph;
+        //summarizeBootstrap(*sg);
+        if (!checkBootstrapStopping()) {
+        	if (params->max_candidate_trees == 0)
+        		max_candidate_trees = treels_logl.size() * (stop_rule.getNumIterations() + params->step_iterations)
+            		/ stop_rule.getNumIterations();
+            stop_rule.setIterationNum(stop_rule.getNumIterations() + params->step_iterations, params->max_iterations);
+            cout << "INFO: Increase number of iterations to " << stop_rule.getNumIterations() << " tau = "
+                    << max_candidate_trees << endl;
+            //delete boot_splits;
+            //boot_splits = sg;
+        } //else delete sg;
+    }
+}
+
+void IQTree::copyTrajectoryTree(IQTree *tree) {
+    copyWorkingTree(tree);
+    candidate_pool = tree;
+    // the distances for IQP are read-only and belong to the pool tree
+    dist_matrix = tree->dist_matrix;
+    var_matrix = tree->var_matrix;
+    k_represent = tree->k_represent;
+    k_delete = tree->k_delete;
+    k_delete_min = tree->k_delete_min;
+    k_delete_max = tree->k_delete_max;
+    k_delete_stay = tree->k_delete_stay;
+    iqp_assess_quartet = tree->iqp_assess_quartet;
+    nni_cutoff = tree->nni_cutoff;
+    nni_sort = tree->nni_sort;
+    startLambda = tree->startLambda;
+    enableHeuris = tree->enableHeuris;
+    speed_conf = tree->speed_conf;
+    enable_parsimony = tree->enable_parsimony;
+    save_all_trees = tree->save_all_trees;
+    save_all_br_lens = tree->save_all_br_lens;
+    root_state = tree->root_state;
+    bestScore = tree->bestScore;
+    // the NNI cutoff is estimated from the NNIs of one tree only
+    estimate_nni_cutoff = false;
+    nnicut.doNNICut = false;
+    setRootNode(params->root);
+    if (params->tabu)
+        initLeafFrequency();
+}
+
+bool IQTree::doTrajectoryIteration(TreeSnapshot &best_tree, IntVector &best_tree_topo) {
+    bool improved = false;
+    randomizeNeighbors();
+    curScore = doIQP();
+    setRootNode(params->root);
+    if (enableHeuris && curIQPIter > params->speedup_iter) {
+        estimateNNISpeedup();
+        curScore = optimizeNNI(true);
+    } else
+        curScore = optimizeNNI(false);
+
+    if (curScore > bestScore) {
+        IntVector cur_tree_topo;
+        getTopology(cur_tree_topo);
+        if (cur_tree_topo != best_tree_topo) {
+            best_tree_topo = cur_tree_topo;
+            curScore = optimizeAllBranches();
+            clearLeafFrequency();
+            improved = true;
+        }
+        bestScore = curScore;
+        saveSnapshot(best_tree);
+    } else {
+        /* take back the best tree of the trajectory */
+        restoreSnapshot(best_tree);
+    }
+    return improved;
+}
+
+double IQTree::doMultiStartIQPNNI() {
+#ifdef _OPENMP
+    const char *reason = NULL;
+    if (params->phylolib)
+        reason = "-phylolib";
+    else if (iqp_assess_quartet == IQP_BOOTSTRAP)
+        reason = "bootstrap IQP";
+    else if (isSuperTree())
+        reason = "partition models";
+    else if (params->reinsert_par || params->nni_lh || testNNI)
+        reason = "parsimony reinsertion and NNI logs";
+    else if (write_intermediate_trees || print_tree_lh || save_all_br_lens)
+        reason = "writing intermediate trees";
+    if (reason)
+        outWarning(string("Multiple starts are not supported with ") + reason + ", using one start");
+    if (reason || params->num_starts <= 1)
+        return doIQPNNI();
+
+    int num_starts = params->num_starts;
+    bestScore = curScore;
+    setRootNode(params->root);
+    // overall best tree, the trajectories get it every params->migration_interval iterations
+    TreeSnapshot best_tree;
+    saveSnapshot(best_tree);
+    IntVector best_tree_topo;
+    getTopology(best_tree_topo);
+    stop_rule.addImprovedIteration(1);
+
+    cout << "Running " << num_starts << " IQPNNI trajectories in parallel, best tree is exchanged every "
+            << params->migration_interval << " iterations" << endl;
+    vector<IQTree*> starts;
+    vector<TreeSnapshot> start_best(num_starts);
+    vector<IntVector> start_topo(num_starts, best_tree_topo);
+    vector<int*> streams;
+    for (int t = 0; t < num_starts; t++) {
+        IQTree *tree = new IQTree();
+        tree->copyTrajectoryTree(this);
+        tree->saveSnapshot(start_best[t]);
+        starts.push_back(tree);
+        streams.push_back(new_random_stream(params->ran_seed, t, num_starts));
+    }
+
+    double prev_time = 0.0;
+    int first = 2;
+    while (!stop_rule.meetStopCondition(first)) {
+        double min_elapsed = (getCPUTime() - params->startTime) / 60;
+        if (min_elapsed > params->maxtime) {
+            cout << "Maximal running time of " << params->maxtime << " minutes reached" << endl;
+            break;
+        }
+        curIQPIter = first;
+        estimateLoglCutoff();
+        // iterations first, first+1, ... are dealt out to the trajectories in turn
+        int last = min(first + num_starts * params->migration_interval - 1, stop_rule.getNumIterations());
+        // iteration of the last better tree of each trajectory, 0 if none
+        IntVector improved(num_starts, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int t = 0; t < num_starts; t++) {
+            set_thread_random_stream(streams[t]);
+            IQTree *tree = starts[t];
+            for (int iter = first + t; iter <= last; iter += num_starts) {
+                if ((getCPUTime() - params->startTime) / 60 > params->maxtime)
+                    break;
+                tree->curIQPIter = iter;
+                if (tree->doTrajectoryIteration(start_best[t], start_topo[t]))
+                    improved[t] = iter;
+            }
+            set_thread_random_stream(NULL);
+        }
+
+        // the best trajectory, ties go to the first one
+        int best = 0;
+        for (int t = 1; t < num_starts; t++)
+            if (starts[t]->bestScore > starts[best]->bestScore)
+                best = t;
+        if (starts[best]->bestScore > bestScore) {
+            bestScore = starts[best]->bestScore;
+            best_tree = start_best[best];
+            restoreSnapshot(best_tree);
+            if (start_topo[best] != best_tree_topo) {
+                best_tree_topo = start_topo[best];
+                curIQPIter = (improved[best]) ? improved[best] : last;
+                cout << "BETTER TREE FOUND at iteration " << curIQPIter << ": " << bestScore << endl;
+                if (params->write_best_trees) {
+                    ostringstream iter_string;
+                    iter_string << curIQPIter;
+                    printResultTree(iter_string.str());
+                }
+                printResultTree();
+                stop_rule.addImprovedIteration(curIQPIter);
+            } else
+                cout << "UPDATE BEST LOG-LIKELIHOOD: " << bestScore << endl;
+        }
+        // migration: the trajectories continue from the best tree
+        for (int t = 0; t < num_starts; t++)
+            if (starts[t]->bestScore < bestScore) {
+                start_best[t] = best_tree;
+                start_topo[t] = best_tree_topo;
+                starts[t]->restoreSnapshot(best_tree);
+                starts[t]->bestScore = bestScore;
+            }
+
+        for (curIQPIter = first; curIQPIter <= last; curIQPIter++)
+            checkBootstrapConvergence();
+        curIQPIter = last;
+        first = last + 1;
+
+        double cputime_secs = getCPUTime() - params->startTime;
+        if (cputime_secs >= prev_time + 10 || verbose_mode >= VB_MED) {
+            double cputime_remaining = (stop_rule.getNumIterations() - last) * cputime_secs / (last - 1);
+            cout.setf(ios::fixed, ios::floatfield);
+            cout << "Iteration " << last << " / LogL: " << bestScore << " / CPU time: " << (int) round(cputime_secs) << "s";
+            if (last > 10 && cputime_secs > 10)
+                cout << " (" << (int) round(cputime_remaining) << "s left)";
+            cout << endl;
+            prev_time = cputime_secs;
+        }
+    }
+
+    int predicted_iteration = stop_rule.getPredictedIteration();
+    if (predicted_iteration > curIQPIter) {
+        cout << endl << "WARNING: " << predicted_iteration << " iterations are needed to ensure that with a "
+                << floor(params->stop_confidence * 100) << "% confidence" << endl
+                << "         the IQPNNI search will not find a better tree" << endl;
+    }
+
+    for (int t = 0; t < num_starts; t++) {
+        // the distances belong to this tree
+        starts[t]->dist_matrix = NULL;
+        starts[t]->var_matrix = NULL;
+        delete starts[t];
+        free_random_stream(streams[t]);
+    }
+    restoreSnapshot(best_tree);
+    curScore = bestScore;
+    return bestScore;
+#else
+    outWarning("Multiple starts need a build with OpenMP, using one start");
+    return doIQPNNI();
+#endif
+}
+
 /****************************************************************************
  Fast Nearest Neighbor Interchange by maximum likelihood
  ****************************************************************************/
@@ -1732,8 +1939,7 @@ void IQTree::estDeltaMin() {
 void IQTree::changeBranLen(PhyloNode *node1, PhyloNode *node2, double newlen) {
     node1->findNeighbor(node2)->length = newlen;
     node2->findNeighbor(node1)->length = newlen;
-    node1->clearReversePartialLh(node2);
-    node2->clearReversePartialLh(node1);
+    markBranchDirty(node1, node2);
 }
 
 double IQTree::getBranLen(PhyloNode *node1, PhyloNode *node2) {
@@ -1766,8 +1972,13 @@ void IQTree::restoreAllBranLen(PhyloNode *node, PhyloNode *dad) {
         Neighbor* bran_it_back = dad->findNeighbor(node);
         assert(bran_it_back);
         assert(savedBranLens.count(key));
-        bran_it->length = savedBranLens[key];
-        bran_it_back->length = savedBranLens[key];
+        double len = savedBranLens[key];
+        if (bran_it->length != len) {
+            bran_it->length = len;
+            bran_it_back->length = len;
+            // only the vectors containing a changed branch become invalid
+            markBranchDirty(node, dad);
+        }
     }
 
     FOR_NEIGHBOR_IT(node, dad, it){
@@ -1798,6 +2009,20 @@ void IQTree::changeAllBranches(PhyloNode *node, PhyloNode *dad) {
 
 void IQTree::genNNIMoves(bool approx_nni, PhyloNode *node, PhyloNode *dad) {
 	if (!node) {
+#ifdef _OPENMP
+		// saving every NNI tree (save_all_trees == 2) has to go through this tree
+		if (params->parallel_nni && omp_get_max_threads() > 1 && !isSuperTree() && save_all_trees != 2) {
+			genNNIMovesParallel(approx_nni);
+			return;
+		}
+#endif
+		if (save_all_trees == 2) {
+			// lets getBestNNIForBran() hash every NNI tree in constant time
+			nni_topo_hash = computeTopologyHash(&nni_subtree_keys, &nni_dad_ids);
+			genNNIMoves(approx_nni, (PhyloNode*) root, NULL);
+			nni_subtree_keys.clear();
+			return;
+		}
 		node = (PhyloNode*) root;
 	}
 	// internal Branch
@@ -1813,6 +2038,68 @@ void IQTree::genNNIMoves(bool approx_nni, PhyloNode *node, PhyloNode *dad) {
 	}
 }
 
+void IQTree::getNNIBranches(PhyloNodeVector &nodes1, PhyloNodeVector &nodes2, PhyloNode *node, PhyloNode *dad) {
+	if (!node) {
+		node = (PhyloNode*) root;
+	}
+	if (!node->isLeaf() && dad && !dad->isLeaf()) {
+		nodes1.push_back(node);
+		nodes2.push_back(dad);
+	}
+	FOR_NEIGHBOR_IT(node, dad, it){
+		getNNIBranches(nodes1, nodes2, (PhyloNode*) (*it)->node, node);
+	}
+}
+
+void IQTree::genNNIMovesParallel(bool approx_nni) {
+	PhyloNodeVector nodes1, nodes2;
+	getNNIBranches(nodes1, nodes2);
+	int num_branches = nodes1.size();
+	if (num_branches == 0)
+		return;
+	vector<NNIMove> moves(num_branches);
+	int num_threads = 1;
+#ifdef _OPENMP
+	num_threads = min(omp_get_max_threads(), num_branches);
+#endif
+	while (thread_trees.size() < num_threads)
+		thread_trees.push_back(new PhyloTree());
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(num_threads)
+#endif
+	{
+		int thread_id = 0;
+#ifdef _OPENMP
+		thread_id = omp_get_thread_num();
+#endif
+		// every thread copies its tree, so that the partial likelihoods are local to it
+		PhyloTree *tree = thread_trees[thread_id];
+		tree->copyWorkingTree(this);
+		NodeVector tree_nodes;
+		tree->getNodesByID(tree_nodes);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int i = 0; i < num_branches; i++) {
+			PhyloNode *node1 = (PhyloNode*) tree_nodes[nodes1[i]->id];
+			PhyloNode *node2 = (PhyloNode*) tree_nodes[nodes2[i]->id];
+			NNIMove move = tree->getBestNNIForBran(node1, node2, NULL, approx_nni, params->leastSquareNNI);
+			// translate the move to the nodes of this tree, which have the same neighbor order
+			move.node1Nei_it = nodes1[i]->neighbors.begin() + (move.node1Nei_it - node1->neighbors.begin());
+			move.node2Nei_it = nodes2[i]->neighbors.begin() + (move.node2Nei_it - node2->neighbors.begin());
+			move.node1 = nodes1[i];
+			move.node2 = nodes2[i];
+			moves[i] = move;
+		}
+	}
+
+	for (int i = 0; i < num_branches; i++)
+		if (moves[i].newloglh > curScore + params->loglh_epsilon) {
+			addPositiveNNIMove(moves[i]);
+		}
+}
+
 void IQTree::genNNIMovesSort(bool approx_nni) {
     NodeVector nodes1, nodes2;
     int i;
@@ -2133,66 +2420,78 @@ void IQTree::estimateNNICutoff(Params* params) {
 //    return (nniMoves[chosenSwap]);
 //}
 
-void IQTree::saveCurrentTree(double cur_logl) {
+void IQTree::saveCurrentTree(double cur_logl, TopologyHash *hash) {
+    // trajectories of doMultiStartIQPNNI() save into the candidate trees of their pool tree,
+    // which are only touched inside critical(candidate_pool)
+    IQTree *pool = (candidate_pool) ? candidate_pool : this;
     ostringstream ostr;
-    string tree_str;
-    StringIntMap::iterator it = treels.end();
-    if (params->store_candidate_trees) {
-        printTree(ostr, WT_TAXON_ID | WT_SORT_TAXA);
-        tree_str = ostr.str();
-        it = treels.find(tree_str);
-    }
+    TopologyHash topo_hash;
+    bool in_treels = params->store_candidate_trees;
+    bool done = false;
+    bool new_tree = false;
     int tree_index = -1;
-    if (it != treels.end()) { // already in treels
-        duplication_counter++;
-        tree_index = it->second;
-        if (cur_logl <= treels_logl[it->second] + 1e-4) {
-            if (cur_logl < treels_logl[it->second] - 5.0)
-                if (verbose_mode >= VB_MED)
-                    cout << "Current lh " << cur_logl << " is much worse than expected " << treels_logl[it->second]
-                            << endl;
-            return;
-        }
-        if (verbose_mode >= VB_MAX)
-            cout << "Updated logl " << treels_logl[it->second] << " to " << cur_logl << endl;
-        treels_logl[it->second] = cur_logl;
-        if (save_all_br_lens) {
-            ostr.seekp(ios::beg);
-            printTree(ostr, WT_TAXON_ID | WT_SORT_TAXA | WT_BR_LEN | WT_BR_SCALE | WT_BR_LEN_ROUNDING);
-            treels_newick[it->second] = ostr.str();
-        }
-        if (boot_samples.empty()) {
-            computePatternLikelihood(treels_ptnlh[it->second], &cur_logl);
-            return;
+    if (in_treels)
+        topo_hash = (hash) ? *hash : computeTopologyHash();
+#ifdef _OPENMP
+#pragma omp critical(candidate_pool)
+#endif
+    {
+        if (in_treels)
+            tree_index = pool->treels.findTopology(topo_hash);
+        if (tree_index >= 0) { // already in treels
+            pool->duplication_counter++;
+            if (cur_logl <= pool->treels_logl[tree_index] + 1e-4) {
+                if (cur_logl < pool->treels_logl[tree_index] - 5.0)
+                    if (verbose_mode >= VB_MED)
+                        cout << "Current lh " << cur_logl << " is much worse than expected " << pool->treels_logl[tree_index]
+                                << endl;
+                done = true;
+            } else {
+                if (verbose_mode >= VB_MAX)
+                    cout << "Updated logl " << pool->treels_logl[tree_index] << " to " << cur_logl << endl;
+                pool->treels_logl[tree_index] = cur_logl;
+                if (save_all_br_lens) {
+                    ostr.seekp(ios::beg);
+                    printTree(ostr, WT_TAXON_ID | WT_SORT_TAXA | WT_BR_LEN | WT_BR_SCALE | WT_BR_LEN_ROUNDING);
+                    pool->treels_newick[tree_index] = ostr.str();
+                }
+                if (verbose_mode >= VB_MAX && !pool->boot_samples.empty())
+                    cout << "Update treels_logl[" << tree_index << "] := " << cur_logl << endl;
+            }
+        } else if (pool->logl_cutoff != 0.0 && cur_logl <= pool->logl_cutoff + 1e-4) {
+            done = true;
+        } else {
+            new_tree = true;
+            tree_index = pool->treels_logl.size();
+            if (in_treels)
+                pool->treels.insertTopology(topo_hash, tree_index);
+            pool->treels_logl.push_back(cur_logl);
+            // pattern likelihoods follow below, outside of the critical section
+            if (pool->boot_samples.empty()) {
+                pool->treels_ptnlh.push_back(NULL);
+                // all candidate trees are converted back for runGuidedBootstrap
+                if (in_treels)
+                    pool->treels.storeTopology(this, tree_index);
+            }
+            if (verbose_mode >= VB_MAX)
+                cout << "Add    treels_logl[" << tree_index << "] := " << cur_logl << endl;
         }
-        if (verbose_mode >= VB_MAX)
-            cout << "Update treels_logl[" << tree_index << "] := " << cur_logl << endl;
-    } else {
-        if (logl_cutoff != 0.0 && cur_logl <= logl_cutoff + 1e-4)
-            return;
-        tree_index = treels_logl.size();
-        if (params->store_candidate_trees)
-            treels[tree_str] = tree_index;
-        treels_logl.push_back(cur_logl);
-        if (verbose_mode >= VB_MAX)
-            cout << "Add    treels_logl[" << tree_index << "] := " << cur_logl << endl;
     }
+    if (done)
+        return;
+    // better duplicates without bootstrap samples only update the pattern likelihoods
+    bool save_tree = new_tree || !pool->boot_samples.empty();
 
-    if (write_intermediate_trees)
+    if (write_intermediate_trees && save_tree)
         printTree(out_treels, WT_NEWLINE | WT_BR_LEN);
 
     double *pattern_lh = new double[getAlnNPattern()];
     computePatternLikelihood(pattern_lh, &cur_logl);
 
-    if (boot_samples.empty()) {
-        // for runGuidedBootstrap
-        treels_ptnlh.push_back(pattern_lh);
-    } else {
-        // online bootstrap
+    int nsamples = pool->boot_samples.size();
+    DoubleVector rell_samples(nsamples, 0.0);
+    if (nsamples) {
         int nptn = getAlnNPattern();
-        int updated = 0;
-        int nsamples = boot_samples.size();
-
         for (int sample = 0; sample < nsamples; sample++) {
             double rell = 0.0;
 
@@ -2201,48 +2500,66 @@ void IQTree::saveCurrentTree(double cur_logl) {
 			#pragma omp parallel for reduction(+: rell)
 			#endif
             for (int ptn = 0; ptn < nptn; ptn++)
-                rell += pattern_lh[ptn] * boot_samples[sample][ptn];
-
-            if (rell > boot_logl[sample] + params->ufboot_epsilon ||
-            	(rell > boot_logl[sample] - params->ufboot_epsilon && random_double() <= 1.0/(boot_counts[sample]+1))) {
-                if (tree_str == "") {
-                    printTree(ostr, WT_TAXON_ID | WT_SORT_TAXA);
-                    tree_str = ostr.str();
-                    it = treels.find(tree_str);
-                    if (it != treels.end()) {
-                        tree_index = it->second;
+                rell += pattern_lh[ptn] * pool->boot_samples[sample][ptn];
+            rell_samples[sample] = rell;
+        }
+    }
+
+#ifdef _OPENMP
+#pragma omp critical(candidate_pool)
+#endif
+    {
+        if (!nsamples) {
+            // for runGuidedBootstrap
+            if (!new_tree)
+                delete[] pool->treels_ptnlh[tree_index];
+            pool->treels_ptnlh[tree_index] = pattern_lh;
+        } else {
+            // online bootstrap
+            int updated = 0;
+            DoubleVector &boot_logl = pool->boot_logl;
+            IntVector &boot_counts = pool->boot_counts;
+            for (int sample = 0; sample < nsamples; sample++) {
+                double rell = rell_samples[sample];
+                if (rell > boot_logl[sample] + params->ufboot_epsilon ||
+                    (rell > boot_logl[sample] - params->ufboot_epsilon && random_double() <= 1.0/(boot_counts[sample]+1))) {
+                    if (!in_treels) {
+                        topo_hash = (hash) ? *hash : computeTopologyHash();
+                        tree_index = pool->treels.findTopology(topo_hash);
+                        if (tree_index < 0) {
+                            tree_index = pool->treels.size();
+                            pool->treels.insertTopology(topo_hash, tree_index);
+                        }
+                        in_treels = true;
+                    }
+                    if (rell <= boot_logl[sample] + params->ufboot_epsilon) {
+                        boot_counts[sample]++;
                     } else {
-                        tree_index = treels.size();
-                        treels[tree_str] = tree_index;
+                        boot_counts[sample] = 1;
                     }
-                }
-                if (rell <= boot_logl[sample] + params->ufboot_epsilon) {
-                	boot_counts[sample]++;
-                } else {
-                	boot_counts[sample] = 1;
-                }
-                boot_logl[sample] = max(boot_logl[sample],rell);
-                boot_trees[sample] = tree_index;
-                updated++;
-            } /*else if (verbose_mode >= VB_MED && rell > boot_logl[sample] - 0.01) {
-            	cout << "Info: multiple RELL score trees detected" << endl;
-            }*/
+                    boot_logl[sample] = max(boot_logl[sample],rell);
+                    // only the topologies of the bootstrap trees are needed by summarizeBootstrap()
+                    if (pool->boot_trees[sample] != tree_index) {
+                        pool->treels.storeTopology(this, tree_index);
+                        if (pool->boot_trees[sample] >= 0)
+                            pool->treels.releaseTopology(pool->boot_trees[sample]);
+                    }
+                    pool->boot_trees[sample] = tree_index;
+                    updated++;
+                } /*else if (verbose_mode >= VB_MED && rell > boot_logl[sample] - 0.01) {
+                    cout << "Info: multiple RELL score trees detected" << endl;
+                }*/
+            }
+            if (updated && verbose_mode >= VB_MAX)
+                cout << updated << " boot trees updated" << endl;
+        }
+        if (save_all_br_lens && save_tree) {
+            ostr.seekp(ios::beg);
+            printTree(ostr, WT_TAXON_ID | WT_SORT_TAXA | WT_BR_LEN | WT_BR_SCALE | WT_BR_LEN_ROUNDING);
+            pool->treels_newick.push_back(ostr.str());
         }
-        if (updated && verbose_mode >= VB_MAX)
-            cout << updated << " boot trees updated" << endl;
-        /*
-         if (tree_index >= max_candidate_trees/2 && boot_splits->empty()) {
-         // summarize split support half way for stopping criterion
-         cout << "Summarizing current bootstrap supports..." << endl;
-         summarizeBootstrap(*boot_splits);
-         }*/
-    }
-    if (save_all_br_lens) {
-        ostr.seekp(ios::beg);
-        printTree(ostr, WT_TAXON_ID | WT_SORT_TAXA | WT_BR_LEN | WT_BR_SCALE | WT_BR_LEN_ROUNDING);
-        treels_newick.push_back(ostr.str());
     }
-    if (print_tree_lh) {
+    if (print_tree_lh && save_tree) {
         out_treelh << cur_logl;
         double prob;
         aln->multinomialProb(pattern_lh, prob);
@@ -2255,7 +2572,7 @@ void IQTree::saveCurrentTree(double cur_logl) {
             out_sitelh << " " << pattern_lh[pattern_index[i]];
         out_sitelh << endl;
     }
-    if (!boot_samples.empty())
+    if (nsamples)
         delete[] pattern_lh;
 }
 
@@ -2590,41 +2907,38 @@ void IQTree::printIntermediateTree(int brtype) {
     if (params->avoid_duplicated_trees) {
         // estimate logl_cutoff
         stringstream ostr;
-        printTree(ostr, WT_TAXON_ID | WT_SORT_TAXA);
-        string tree_str = ostr.str();
-        StringIntMap::iterator it = treels.find(tree_str);
-        if (it != treels.end()) { // already in treels
+        TopologyHash topo_hash = computeTopologyHash();
+        int tree_index = treels.findTopology(topo_hash);
+        if (tree_index >= 0) { // already in treels
             duplicated_tree = true;
-            if (curScore > treels_logl[it->second] + 1e-4) {
+            if (curScore > treels_logl[tree_index] + 1e-4) {
                 if (verbose_mode >= VB_MAX)
-                    cout << "Updated logl " << treels_logl[it->second] << " to " << curScore << endl;
-                treels_logl[it->second] = curScore;
-                computeLikelihood(treels_ptnlh[it->second]);
+                    cout << "Updated logl " << treels_logl[tree_index] << " to " << curScore << endl;
+                treels_logl[tree_index] = curScore;
+                computeLikelihood(treels_ptnlh[tree_index]);
                 if (save_all_br_lens) {
-                    ostr.seekp(ios::beg);
                     printTree(ostr, WT_TAXON_ID | WT_SORT_TAXA | WT_BR_LEN | WT_BR_SCALE | WT_BR_LEN_ROUNDING);
-                    treels_newick[it->second] = ostr.str();
+                    treels_newick[tree_index] = ostr.str();
                 }
             }
-            //pattern_lh = treels_ptnlh[treels[tree_str]];
+            //pattern_lh = treels_ptnlh[tree_index];
         } else {
             //cout << __func__ << ": new tree" << endl;
             if (logl_cutoff != 0.0 && curScore <= logl_cutoff + 1e-4)
                 duplicated_tree = true;
             else {
-                treels[tree_str] = treels_ptnlh.size();
+                treels.insertTopology(topo_hash, treels_ptnlh.size());
+                treels.storeTopology(this, treels_ptnlh.size());
                 pattern_lh = new double[aln->getNPattern()];
                 computePatternLikelihood(pattern_lh, &logl);
                 treels_ptnlh.push_back(pattern_lh);
                 treels_logl.push_back(logl);
                 if (save_all_br_lens) {
-                    ostr.seekp(ios::beg);
                     printTree(ostr, WT_TAXON_ID | WT_SORT_TAXA | WT_BR_LEN | WT_BR_SCALE | WT_BR_LEN_ROUNDING);
                     treels_newick.push_back(ostr.str());
                 }
             }
         }
-        //cout << tree_str << endl;
     } else {
         if (params->print_tree_lh) {
             pattern_lh = new double[aln->getNPattern()];
@@ -240,6 +240,49 @@ public:
      */
     void doRandomRestart();
 
+    /**
+            perform the IQPNNI iterations with params->num_starts trajectories in parallel threads, each on
+            its own working copy of the tree (see copyTrajectoryTree()). All trajectories save their trees
+            into the candidate and bootstrap trees of this tree. Every params->migration_interval iterations
+            of each trajectory, the best tree found so far replaces the worse trees of the trajectories
+            @return best likelihood found
+     */
+    double doMultiStartIQPNNI();
+
+    /**
+            make this tree a working copy of another tree for one trajectory of doMultiStartIQPNNI():
+            see PhyloTree::copyWorkingTree(), plus the IQP and NNI settings. The distance matrix
+            belongs to the other tree, which also keeps the candidate trees saved by this tree
+            @param tree the tree to copy
+     */
+    void copyTrajectoryTree(IQTree *tree);
+
+    /**
+            one iteration (curIQPIter) of a trajectory of doMultiStartIQPNNI(): IQP and NNI search,
+            then back to the best tree of the trajectory if no better tree was found
+            @param best_tree (IN/OUT) best tree of the trajectory
+            @param best_tree_topo (IN/OUT) topology of best_tree, see getTopology()
+            @return TRUE if a better tree of another topology was found
+     */
+    bool doTrajectoryIteration(TreeSnapshot &best_tree, IntVector &best_tree_topo);
+
+    /**
+            estimate logl_cutoff at the start of iteration curIQPIter, trees below it are not saved
+     */
+    void estimateLoglCutoff();
+
+    /**
+            estimate nni_count_est and nni_delta_est of the NNI speed-up heuristic
+     */
+    void estimateNNISpeedup();
+
+    /**
+            at the end of iteration curIQPIter: summarize the bootstrap trees every params->step_iterations/2
+            iterations, and increase the number of iterations after the last one if the bootstrap supports
+            have not converged (see checkBootstrapStopping())
+     */
+    void checkBootstrapConvergence();
+
     /****************************************************************************
             Fast Nearest Neighbor Interchange by maximum likelihood
      ****************************************************************************/
@@ -268,6 +311,20 @@ public:
      */
     void genNNIMoves(bool approx_nni, PhyloNode *node = NULL, PhyloNode *dad = NULL);
 
+    /**
+            same as genNNIMoves() but the inner branches are evaluated concurrently, each thread
+            on its own working copy of the tree (see PhyloTree::copyWorkingTree()).
+            Positive NNIs are added in the same order as by genNNIMoves()
+     */
+    void genNNIMovesParallel(bool approx_nni);
+
+    /**
+            collect the inner branches in the order in which genNNIMoves() evaluates them
+            @param nodes1 (OUT) first node of each branch
+            @param nodes2 (OUT) second node of each branch
+     */
+    void getNNIBranches(PhyloNodeVector &nodes1, PhyloNodeVector &nodes2, PhyloNode *node = NULL, PhyloNode *dad = NULL);
+
     /**
             search all positive NNI move on the current tree and save them
             on the possilbleNNIMoves list
@@ -565,11 +622,17 @@ public:
     /** TRUE to save also branch lengths into treels_newick */
     bool save_all_br_lens;
 
+    /**
+        tree keeping the candidate and bootstrap trees saved by this tree, NULL if this tree
+        keeps them itself (see doMultiStartIQPNNI())
+     */
+    IQTree *candidate_pool;
+
     /**
         this keeps the list of intermediate trees.
         it will be activated if params.avoid_duplicated_trees is TRUE.
      */
-    StringIntMap treels;
+    TopologyIntMap treels;
 
     /** pattern log-likelihood vector for each treels */
     vector<double* > treels_ptnlh;
@@ -645,7 +708,7 @@ protected:
 
     void estimateNNICutoff(Params* params);
 
-    virtual void saveCurrentTree(double logl); // save current tree
+    virtual void saveCurrentTree(double logl, TopologyHash *hash = NULL); // save current tree
 
     void saveNNITrees(PhyloNode *node = NULL, PhyloNode *dad = NULL);
 
@@ -0,0 +1,194 @@
+/***************************************************************************
+ *   Copyright (C) 2009 by BUI Quang Minh   *
+ *   minh.bui@univie.ac.at   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <map>
+#include "tools.h"
+#include "memarena.h"
+
+#if defined WIN32 || defined _WIN32 || defined __WIN32__
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#define MEM_ARENA_MMAP
+#endif
+
+using namespace std;
+
+int MemArena::huge_page_mode = HUGE_PAGE_NONE;
+
+#ifdef MEM_ARENA_MMAP
+/**
+	size of every mapping of MemArena by its start. Kept out of line, so that a mapped buffer starts
+	at the mapping itself (at a huge page boundary with huge pages); buffers not found are heap blocks
+*/
+static map<char*, size_t> mem_arena_mappings;
+#endif
+
+void MemArena::setHugePageMode(int mode) {
+	huge_page_mode = mode;
+}
+
+static inline size_t roundUp(size_t size, size_t unit) {
+	return (size + unit - 1) / unit * unit;
+}
+
+void *MemArena::allocate(size_t bytes) {
+	size_t total = roundUp(max(bytes, (size_t) 1), MEM_ARENA_ALIGN);
+#ifdef MEM_ARENA_MMAP
+	char *base = NULL;
+	size_t map_bytes = 0;
+	if (bytes >= MEM_ARENA_MAP_MIN) {
+#ifdef MAP_HUGETLB
+		if (huge_page_mode == HUGE_PAGE_EXPLICIT) {
+			map_bytes = roundUp(total, MEM_ARENA_HUGE_PAGE);
+			void *mem = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (mem != MAP_FAILED)
+				base = (char*) mem;
+			else {
+				static bool warned = false;
+				if (!warned)
+					cout << "NOTE: Not enough huge pages reserved (see /proc/sys/vm/nr_hugepages), using normal pages" << endl;
+				warned = true;
+			}
+		}
+#endif
+		if (!base && huge_page_mode != HUGE_PAGE_NONE) {
+			// map one huge page more and trim the ends, so that the buffer starts at a huge page boundary
+			map_bytes = roundUp(total, MEM_ARENA_HUGE_PAGE);
+			void *mem = mmap(NULL, map_bytes + MEM_ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mem != MAP_FAILED) {
+				char *raw = (char*) mem;
+				base = (char*) roundUp((uintptr_t) raw, MEM_ARENA_HUGE_PAGE);
+				if (base > raw)
+					munmap(raw, base - raw);
+				if (raw + MEM_ARENA_HUGE_PAGE > base)
+					munmap(base + map_bytes, raw + MEM_ARENA_HUGE_PAGE - base);
+#ifdef MADV_HUGEPAGE
+				madvise(base, map_bytes, MADV_HUGEPAGE);
+#endif
+			}
+		}
+		if (!base) {
+			map_bytes = total;
+			void *mem = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mem != MAP_FAILED)
+				base = (char*) mem;
+		}
+	}
+	if (base) {
+		// the trees of several threads may allocate at the same time
+#ifdef _OPENMP
+#pragma omp critical(mem_arena)
+#endif
+		mem_arena_mappings[base] = map_bytes;
+		return base;
+	}
+	void *mem;
+	if (posix_memalign(&mem, MEM_ARENA_ALIGN, total) != 0)
+		return NULL;
+	return mem;
+#else
+	return _aligned_malloc(total, MEM_ARENA_ALIGN);
+#endif
+}
+
+void MemArena::release(void *ptr) {
+	if (!ptr)
+		return;
+#ifdef MEM_ARENA_MMAP
+	size_t map_bytes = 0;
+#ifdef _OPENMP
+#pragma omp critical(mem_arena)
+#endif
+	{
+		map<char*, size_t>::iterator it = mem_arena_mappings.find((char*) ptr);
+		if (it != mem_arena_mappings.end()) {
+			map_bytes = it->second;
+			mem_arena_mappings.erase(it);
+		}
+	}
+	if (map_bytes)
+		munmap(ptr, map_bytes);
+	else
+		free(ptr);
+#else
+	_aligned_free(ptr);
+#endif
+}
+
+ScratchStack::ScratchStack() {
+	top = 0;
+}
+
+ScratchStack::~ScratchStack() {
+	for (int i = 0; i < chunks.size(); i++)
+		MemArena::release(chunks[i].mem);
+}
+
+double *ScratchStack::push(size_t count) {
+	size_t bytes = roundUp(count * sizeof(double), MEM_ARENA_ALIGN);
+	while (top < chunks.size() && chunks[top].used + bytes > chunks[top].size)
+		top++;
+	if (top == chunks.size()) {
+		ScratchChunk chunk;
+		chunk.size = SCRATCH_CHUNK_MIN;
+		if (!chunks.empty())
+			chunk.size = chunks.back().size * 2;
+		if (chunk.size < bytes)
+			chunk.size = bytes;
+		chunk.mem = (char*) MemArena::allocate(chunk.size);
+		if (!chunk.mem)
+			outError("Not enough memory for temporary likelihood buffers");
+		chunk.used = 0;
+		chunks.push_back(chunk);
+	}
+	ScratchChunk &chunk = chunks[top];
+	double *buffer = (double*) (chunk.mem + chunk.used);
+	chunk.used += bytes;
+	return buffer;
+}
+
+void ScratchStack::pop(void *buffer) {
+	if (!buffer)
+		return;
+	char *ptr = (char*) buffer;
+	while (top > 0 && (ptr < chunks[top].mem || ptr > chunks[top].mem + chunks[top].size)) {
+		chunks[top].used = 0;
+		top--;
+	}
+	// buffers must be released in the reverse order of push()
+	assert(!chunks.empty() && ptr >= chunks[top].mem && ptr <= chunks[top].mem + chunks[top].used);
+	chunks[top].used = ptr - chunks[top].mem;
+	if (top == 0 && chunks[0].used == 0 && chunks.size() > 1) {
+		// stack is empty: replace the chunks by one that holds all of them
+		size_t size = 0;
+		for (int i = 0; i < chunks.size(); i++) {
+			size += chunks[i].size;
+			MemArena::release(chunks[i].mem);
+		}
+		chunks.resize(1);
+		chunks[0].size = size;
+		chunks[0].mem = (char*) MemArena::allocate(size);
+		if (!chunks[0].mem)
+			outError("Not enough memory for temporary likelihood buffers");
+	}
+}
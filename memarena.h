@@ -0,0 +1,139 @@
+/***************************************************************************
+ *   Copyright (C) 2009 by BUI Quang Minh   *
+ *   minh.bui@univie.ac.at   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef MEMARENA_H
+#define MEMARENA_H
+
+#include <stddef.h>
+#include <vector>
+
+/** alignment of all buffers of MemArena and ScratchStack in bytes (one cache line) */
+#define MEM_ARENA_ALIGN 64
+
+/** buffers of at least this size are mapped directly and can be backed by huge pages */
+#define MEM_ARENA_MAP_MIN (1 << 20)
+
+/** size of a huge page, mappings for transparent huge pages are aligned to it */
+#define MEM_ARENA_HUGE_PAGE (2 << 20)
+
+/** size of the first chunk of a ScratchStack */
+#define SCRATCH_CHUNK_MIN (64 << 10)
+
+/**
+	how the large buffers of MemArena are backed by huge pages
+*/
+enum HugePageMode {HUGE_PAGE_NONE, HUGE_PAGE_TRANSPARENT, HUGE_PAGE_EXPLICIT};
+
+/**
+Allocator of the long-lived likelihood buffers (partial likelihood vectors, tip partial likelihoods,
+pattern likelihoods, ...). All buffers are 64-byte aligned, so that no pointer has to be shifted by hand.
+Buffers of at least MEM_ARENA_MAP_MIN bytes get their own memory mapping, which is backed by
+transparent huge pages (madvise) or explicit huge pages (MAP_HUGETLB, falling back to normal pages
+if none are reserved) depending on the process-wide HugePageMode. Such a buffer starts at its mapping,
+i.e. at a huge page boundary if huge pages are used.
+*/
+class MemArena
+{
+public:
+
+	/**
+		@param mode one of HugePageMode, used for all later allocations
+	*/
+	static void setHugePageMode(int mode);
+
+	/**
+		@param bytes size of the buffer
+		@return 64-byte aligned buffer, to be released with release()
+	*/
+	static void *allocate(size_t bytes);
+
+	/**
+		@param count number of elements
+		@return 64-byte aligned array, to be released with release()
+	*/
+	template<class T>
+	static T *allocArray(size_t count) {
+		return (T*) allocate(count * sizeof(T));
+	}
+
+	/**
+		release a buffer of allocate(), NULL is ignored
+	*/
+	static void release(void *ptr);
+
+protected:
+
+	/** current HugePageMode */
+	static int huge_page_mode;
+};
+
+/**
+one chunk of memory of a ScratchStack
+*/
+struct ScratchChunk {
+	/** start of the chunk */
+	char *mem;
+	/** size of the chunk in bytes */
+	size_t size;
+	/** number of bytes in use */
+	size_t used;
+};
+
+/**
+Stack of temporary buffers of the likelihood functions (lookup tables, transposed matrices, ...),
+released in the reverse order of their allocation. The memory is kept between calls, so that
+the kernels do not call the allocator every time. Not thread-safe: every tree has its own stack,
+which is only used outside of parallel regions.
+*/
+class ScratchStack
+{
+public:
+
+	ScratchStack();
+
+	~ScratchStack();
+
+	/**
+		@param count number of doubles, 0 to get a mark for pop()
+		@return 64-byte aligned buffer, valid until it or a buffer pushed before is popped
+	*/
+	double *push(size_t count);
+
+	/**
+		release a buffer and all buffers pushed after it, NULL is ignored
+		@param buffer a buffer of push()
+	*/
+	void pop(void *buffer);
+
+protected:
+
+	/** chunks of increasing size, those after top are empty */
+	std::vector<ScratchChunk> chunks;
+
+	/** index of the chunk of the last push() */
+	int top;
+
+private:
+
+	/** chunks must not be shared between stacks */
+	ScratchStack(const ScratchStack &);
+	ScratchStack &operator=(const ScratchStack &);
+};
+
+#endif
@@ -43,6 +43,7 @@ ModelFactory::ModelFactory() {
 	site_rate = NULL;
 	store_trans_matrix = false;
 	is_storing = false;
+	trans_cache_size = 0;
 	joint_optimize = false;
 }
 
@@ -103,6 +104,7 @@ ModelSubst* ModelFactory::createModel(string model_str, StateFreqType freq_type,
 ModelFactory::ModelFactory(Params &params, PhyloTree *tree) { 
 	store_trans_matrix = params.store_trans_matrix;
 	is_storing = false;
+	trans_cache_size = params.trans_cache_size;
 	joint_optimize = params.optimize_model_rate_joint;
 
 	string model_str = params.model_name;
@@ -411,8 +413,7 @@ double ModelFactory::optimizeParametersOnly(double epsilon) {
 
 	getVariables(variables);
 	//if (freq_type == FREQ_ESTIMATE) scaleStateFreq(true);
-	model->decomposeRateMatrix();
-	site_rate->phylo_tree->clearAllPartialLH();
+	if (model->isChangedParameters()) model->decomposeRateMatrix();
 
 	delete [] bound_check;
 	delete [] lower_bound;
@@ -500,19 +501,33 @@ double ModelFactory::optimizeParameters(bool fixed_len, bool write_info, double
 
 void ModelFactory::startStoringTransMatrix() {
 	if (!store_trans_matrix) return;
+	int mat_size = model->num_states * model->num_states;
+	if (!trans_cache.isInitialized(mat_size))
+		trans_cache.init(mat_size, trans_cache_size);
 	is_storing = true;
 }
 
 void ModelFactory::stopStoringTransMatrix() {
 	if (!store_trans_matrix) return;
+	// entries are keyed by the model parameter version, so stale ones are never returned
+	// and will be evicted when needed
 	is_storing = false;
-	if (!empty()) {
-		for (iterator it = begin(); it != end(); it++)
-			delete it->second;
-		clear();
-	}
 }
 
+bool ModelFactory::isCachingTransMatrix() {
+	return store_trans_matrix && is_storing && !model->isSiteSpecificModel() &&
+		trans_cache.isInitialized(model->num_states * model->num_states);
+}
+
+void ModelFactory::writeTransMatrixCacheInfo(ostream &out) {
+	if (!store_trans_matrix) return;
+	uint64_t hits = trans_cache.getNumHits(), misses = trans_cache.getNumMisses();
+	out << "Transition matrix cache: " << trans_cache.getCapacity() << " entries, "
+		<< hits << " hits, " << misses << " misses";
+	if (hits + misses > 0)
+		out << " (" << (100.0 * hits) / (hits + misses) << "% hit rate)";
+	out << endl;
+}
 
 double ModelFactory::computeTrans(double time, int state1, int state2) {
 	return model->computeTrans(time, state1, state2);
@@ -523,24 +538,15 @@ double ModelFactory::computeTrans(double time, int state1, int state2, double &d
 }
 
 void ModelFactory::computeTransMatrix(double time, double *trans_matrix) {
-	if (!store_trans_matrix || !is_storing || model->isSiteSpecificModel()) {
+	if (!isCachingTransMatrix()) {
 		model->computeTransMatrix(time, trans_matrix);
 		return;
 	}
-	int mat_size = model->num_states * model->num_states;
-	iterator ass_it = find(round(time * 1e6));
-	if (ass_it == end()) {
-		// allocate memory for 3 matricies
-		double *trans_entry = new double[mat_size * 3];
-		trans_entry[mat_size] = trans_entry[mat_size+1] = 0.0;
-		model->computeTransMatrix(time, trans_entry);
-		ass_it = insert(value_type(round(time * 1e6), trans_entry)).first;
-	} else {
-		//if (verbose_mode >= VB_MAX) 
-			//cout << "ModelFactory bingo" << endl;
-	} 
-	
-	memcpy(trans_matrix, ass_it->second, mat_size * sizeof(double));
+	int version = model->getParamVersion();
+	if (trans_cache.lookup(time, version, TRANS_CACHE_MATRIX, trans_matrix))
+		return;
+	model->computeTransMatrix(time, trans_matrix);
+	trans_cache.insert(time, version, TRANS_CACHE_MATRIX, trans_matrix);
 }
 
 void ModelFactory::computeTransMatrixFreq(double time, double *state_freq, double *trans_matrix) {
@@ -549,7 +555,20 @@ void ModelFactory::computeTransMatrixFreq(double time, double *state_freq, doubl
 		return;
 	}
 	int nstates = model->num_states;
-	computeTransMatrix(time, trans_matrix);
+	if (!isCachingTransMatrix()) {
+		model->computeTransMatrix(time, trans_matrix);
+		for (int state1 = 0; state1 < nstates; state1++) {
+			double *trans_mat_state = trans_matrix + (state1 * nstates);
+			for (int state2 = 0; state2 < nstates; state2++)
+				trans_mat_state[state2] *= state_freq[state1];
+		}
+		return;
+	}
+	int version = model->getParamVersion();
+	if (!trans_cache.lookup(time, version, TRANS_CACHE_MATRIX, trans_matrix)) {
+		model->computeTransMatrix(time, trans_matrix);
+		trans_cache.insert(time, version, TRANS_CACHE_MATRIX, trans_matrix);
+	}
 	for (int state1 = 0; state1 < nstates; state1++) {
 		double *trans_mat_state = trans_matrix + (state1 * nstates);
 		for (int state2 = 0; state2 < nstates; state2++)
@@ -559,25 +578,15 @@ void ModelFactory::computeTransMatrixFreq(double time, double *state_freq, doubl
 
 void ModelFactory::computeTransDerv(double time, double *trans_matrix, 
 	double *trans_derv1, double *trans_derv2) {
-	if (!store_trans_matrix || !is_storing || model->isSiteSpecificModel()) {
+	if (!isCachingTransMatrix()) {
 		model->computeTransDerv(time, trans_matrix, trans_derv1, trans_derv2);
 		return;
 	}
-	int mat_size = model->num_states * model->num_states;
-	iterator ass_it = find(round(time * 1e6));
-	if (ass_it == end()) {
-		// allocate memory for 3 matricies
-		double *trans_entry = new double[mat_size * 3];
-		trans_entry[mat_size] = trans_entry[mat_size+1] = 0.0;
-		model->computeTransDerv(time, trans_entry, trans_entry+mat_size, trans_entry+(mat_size*2));
-		ass_it = insert(value_type(round(time * 1e6), trans_entry)).first;
-	} else if (ass_it->second[mat_size] == 0.0 && ass_it->second[mat_size+1] == 0.0) {
-		double *trans_entry = ass_it->second;
-		model->computeTransDerv(time, trans_entry, trans_entry+mat_size, trans_entry+(mat_size*2));
-	}
-	memcpy(trans_matrix, ass_it->second, mat_size * sizeof(double));
-	memcpy(trans_derv1, ass_it->second + mat_size, mat_size * sizeof(double));
-	memcpy(trans_derv2, ass_it->second + (mat_size*2), mat_size * sizeof(double));
+	int version = model->getParamVersion();
+	if (trans_cache.lookup(time, version, TRANS_CACHE_DERV, trans_matrix, trans_derv1, trans_derv2))
+		return;
+	model->computeTransDerv(time, trans_matrix, trans_derv1, trans_derv2);
+	trans_cache.insert(time, version, TRANS_CACHE_DERV, trans_matrix, trans_derv1, trans_derv2);
 }
 
 void ModelFactory::computeTransDervFreq(double time, double rate_val, double *state_freq, double *trans_matrix, 
@@ -589,24 +598,27 @@ void ModelFactory::computeTransDervFreq(double time, double rate_val, double *st
 	}
 	int nstates = model->num_states;	
 	double rate_sqr = rate_val*rate_val;
-	computeTransDerv(time * rate_val, trans_matrix, trans_derv1, trans_derv2);
+	int version = model->getParamVersion();
+	bool caching = isCachingTransMatrix();
+	if (!caching || !trans_cache.lookup(time * rate_val, version, TRANS_CACHE_DERV, trans_matrix, trans_derv1, trans_derv2)) {
+		model->computeTransDerv(time * rate_val, trans_matrix, trans_derv1, trans_derv2);
+		if (caching)
+			trans_cache.insert(time * rate_val, version, TRANS_CACHE_DERV, trans_matrix, trans_derv1, trans_derv2);
+	}
 	for (int state1 = 0; state1 < nstates; state1++) {
 		double *trans_mat_state = trans_matrix + (state1 * nstates);
 		double *trans_derv1_state = trans_derv1 + (state1 * nstates);
 		double *trans_derv2_state = trans_derv2 + (state1 * nstates);
 		for (int state2 = 0; state2 < nstates; state2++) {
 			trans_mat_state[state2] *= state_freq[state1];
-			trans_derv1_state[state2] *= (state_freq[state1] * rate_val);
-			trans_derv2_state[state2] *= (state_freq[state1] * rate_sqr);
+			trans_derv1_state[state2] *= state_freq[state1] * rate_val;
+			trans_derv2_state[state2] *= state_freq[state1] * rate_sqr;
 		}
 	}
 }
 
 ModelFactory::~ModelFactory()
 {
-	for (iterator it = begin(); it != end(); it++)
-		delete it->second;
-	clear();
 }
 
 /************* FOLLOWING SERVE FOR JOINT OPTIMIZATION OF MODEL AND RATE PARAMETERS *******/
@@ -619,8 +631,8 @@ double ModelFactory::targetFunk(double x[]) {
 	model->getVariables(x);
 	// need to compute rates again if p_inv or Gamma shape changes!
 	if (model->state_freq[model->num_states-1] < MIN_RATE) return 1.0e+12;
-	model->decomposeRateMatrix();
-	site_rate->phylo_tree->clearAllPartialLH();
+	// keep the eigen decomposition if only the rate parameters changed
+	if (model->isChangedParameters()) model->decomposeRateMatrix();
 	return site_rate->targetFunk(x + model->getNDim());
 }
 
@@ -23,15 +23,16 @@
 #include "tools.h"
 #include "modelsubst.h"
 #include "rateheterogeneity.h"
+#include "transmatrixcache.h"
 
 /**
 Store the transition matrix corresponding to evolutionary time so that one must not compute again. 
 For efficiency purpose esp. for protein (20x20) or codon (61x61).
-The values of the map contain 3 matricies consecutively: transition matrix, 1st, and 2nd derivative
+The matrices are kept in a bounded TransMatrixCache keyed by time and model parameter version
 
 	@author BUI Quang Minh <minh.bui@univie.ac.at>
 */
-class ModelFactory : public unordered_map<int, double*>, public Optimization
+class ModelFactory : public Optimization
 {
 public:
 
@@ -89,6 +90,17 @@ public:
 	*/
 	void stopStoringTransMatrix();
 
+	/**
+		@return TRUE if transition matrices are currently taken from the cache
+	*/
+	bool isCachingTransMatrix();
+
+	/**
+		print the hit/miss counters of the transition matrix cache
+		@param out output stream
+	*/
+	void writeTransMatrixCacheInfo(ostream &out);
+
 	/**
 		Wrapper for computing the transition probability matrix from the model. It use ModelFactory
 		that stores matrix computed before for effiency purpose.
@@ -178,6 +190,16 @@ public:
 	*/
 	bool is_storing;
 
+	/**
+		memory limit of the transition matrix cache in MB
+	*/
+	int trans_cache_size;
+
+	/**
+		bounded cache of transition matrices and their derivatives
+	*/
+	TransMatrixCache trans_cache;
+
 
 	/**
 	 * optimize model and site_rate parameters
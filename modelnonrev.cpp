@@ -126,6 +126,7 @@ int QtoPi (double Q[], double pi[], int n, double space[])
 /* End of Ziheng Yang code */
 
 void ModelNonRev::decomposeRateMatrix() {
+    increaseParamVersion();
     int i, j, k;
     double sum;
     //double m[num_states];
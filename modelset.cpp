@@ -101,6 +101,7 @@ void ModelSet::writeInfo(ostream& out)
 
 void ModelSet::decomposeRateMatrix()
 {
+	increaseParamVersion();
 	for (iterator it = begin(); it != end(); it++)
 		(*it)->decomposeRateMatrix();
 }
@@ -9,6 +9,7 @@
 // Copyright: See COPYING file that comes with this distribution
 //
 //
+#include <string.h>
 #include "modelsubst.h"
 #include "tools.h"
 
@@ -21,6 +22,31 @@ ModelSubst::ModelSubst(int nstates) : Optimization()
 	for (int i = 0; i < num_states; i++)
 		state_freq[i] = 1.0 / num_states;
 	freq_type = FREQ_EQUAL;
+	increaseParamVersion();
+}
+
+bool ModelSubst::isChangedParameters() {
+	int nrates = getNumRateEntries();
+	if (param_values.size() != nrates + num_states) return true;
+	DoubleVector values(nrates + num_states);
+	getRateMatrix(&values[0]);
+	memcpy(&values[nrates], state_freq, num_states * sizeof(double));
+	return values != param_values;
+}
+
+int ModelSubst::last_param_version = 0;
+
+void ModelSubst::increaseParamVersion() {
+	// the models of the partitions may be optimized by several threads
+#ifdef _OPENMP
+#pragma omp critical(param_version)
+#endif
+	param_version = ++last_param_version;
+	// the parameters may be changed without a new decomposition, hence they are stored here
+	int nrates = getNumRateEntries();
+	param_values.resize(nrates + num_states);
+	getRateMatrix(&param_values[0]);
+	memcpy(&param_values[nrates], state_freq, num_states * sizeof(double));
 }
 
 // here the simplest Juke-Cantor model is implemented, valid for all kind of data (DNA, AA,...)
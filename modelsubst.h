@@ -198,6 +198,18 @@ public:
 	*/
 	virtual void decomposeRateMatrix() {}
 
+	/**
+		@return TRUE if the rate matrix or the state frequencies differ from those of the last
+		decomposeRateMatrix(), i.e. the rate matrix must be decomposed again
+	*/
+	bool isChangedParameters();
+
+	/**
+		@return a number identifying the current model parameters. It is unique over all models
+		and changes whenever the transition matrices may change, i.e. in decomposeRateMatrix()
+	*/
+	int getParamVersion() { return param_version; }
+
 	/**
 		optimize model parameters. One should override this function when defining new model.
 		The default does nothing since it is a Juke-Cantor type model, hence no parameters involved.
@@ -246,6 +258,28 @@ public:
 
 protected:
 
+	/**
+		assign a new parameter version, see getParamVersion()
+	*/
+	void increaseParamVersion();
+
+	/**
+		parameter version, see getParamVersion()
+	*/
+	int param_version;
+
+	/**
+		last parameter version assigned to any model, so that a version also identifies the model.
+		Only changed by increaseParamVersion() in a critical section
+	*/
+	static int last_param_version;
+
+	/**
+		rate matrix (see getRateMatrix()) followed by the state frequencies belonging to
+		param_version
+	*/
+	DoubleVector param_values;
+
 	/**
 		this function is served for the multi-dimension optimization. It should pack the model parameters
 		into a vector that is index from 1 (NOTE: not from 0)
@@ -89,6 +89,242 @@ void MTree::copyTree(MTree *tree, string &taxa_set) {
     root = copyTree(tree, taxa_set, new_len);
 }
 
+void MTree::copyTreeExact(MTree *tree) {
+    if (root) freeNode();
+    NodeVector nodes;
+    if (!tree->getNodesByID(nodes))
+        outError("Node IDs of the tree to copy are not consecutive");
+    NodeVector new_nodes(nodes.size(), NULL);
+    NodeVector::iterator it;
+    for (it = nodes.begin(); it != nodes.end(); it++)
+        new_nodes[(*it)->id] = newNode((*it)->id, (*it)->name.c_str());
+    for (it = nodes.begin(); it != nodes.end(); it++)
+        for (NeighborVec::iterator nei = (*it)->neighbors.begin(); nei != (*it)->neighbors.end(); nei++)
+            new_nodes[(*it)->id]->addNeighbor(new_nodes[(*nei)->node->id], (*nei)->length, (*nei)->id);
+    root = new_nodes[tree->root->id];
+    leafNum = tree->leafNum;
+    nodeNum = tree->nodeNum;
+    branchNum = tree->branchNum;
+    rooted = tree->rooted;
+}
+
+void MTree::saveSnapshot(TreeSnapshot &snapshot) {
+    NodeVector nodes;
+    if (!getNodesByID(nodes))
+        outError("Node IDs of the tree are not consecutive, cannot save a snapshot");
+    snapshot.nei_start.resize(nodeNum + 1);
+    snapshot.nei_node.clear();
+    snapshot.nei_length.clear();
+    snapshot.nei_id.clear();
+    for (int i = 0; i < nodeNum; i++) {
+        snapshot.nei_start[i] = snapshot.nei_node.size();
+        for (NeighborVec::iterator it = nodes[i]->neighbors.begin(); it != nodes[i]->neighbors.end(); it++) {
+            snapshot.nei_node.push_back((*it)->node->id);
+            snapshot.nei_length.push_back((*it)->length);
+            snapshot.nei_id.push_back((*it)->id);
+        }
+    }
+    snapshot.nei_start[nodeNum] = snapshot.nei_node.size();
+    snapshot.root_id = root->id;
+}
+
+void MTree::restoreSnapshot(TreeSnapshot &snapshot, NodeVector *changed_nodes) {
+    NodeVector nodes;
+    if (snapshot.nei_start.size() != nodeNum + 1 || !getNodesByID(nodes))
+        outError("Tree snapshot does not match the nodes of the tree");
+    for (int i = 0; i < nodeNum; i++) {
+        NeighborVec &neighbors = nodes[i]->neighbors;
+        int start = snapshot.nei_start[i];
+        int degree = neighbors.size();
+        assert(snapshot.nei_start[i + 1] - start == degree);
+        int j, k;
+        // first move the neighbors that stay to their positions in the snapshot
+        for (j = 0; j < degree; j++) {
+            Node *node = nodes[snapshot.nei_node[start + j]];
+            if (neighbors[j]->node == node)
+                continue;
+            for (k = j + 1; k < degree; k++)
+                if (neighbors[k]->node == node) {
+                    swap(neighbors[j], neighbors[k]);
+                    break;
+                }
+        }
+        bool changed = false;
+        for (j = 0; j < degree; j++) {
+            Neighbor *nei = neighbors[j];
+            Node *node = nodes[snapshot.nei_node[start + j]];
+            if (nei->node != node || nei->length != snapshot.nei_length[start + j]) {
+                nei->node = node;
+                nei->length = snapshot.nei_length[start + j];
+                changed = true;
+            }
+            nei->id = snapshot.nei_id[start + j];
+        }
+        if (changed && changed_nodes)
+            changed_nodes->push_back(nodes[i]);
+    }
+    root = nodes[snapshot.root_id];
+}
+
+TopologyHash MTree::computeTopologyHash(vector<TopologyHash> *subtree_keys, IntVector *dad_ids) {
+    Node *taxon0 = (root->isLeaf() && root->id == 0) ? root : findNodeID(0);
+    assert(taxon0 && taxon0->isLeaf());
+    if (subtree_keys) subtree_keys->resize(nodeNum);
+    if (dad_ids) dad_ids->resize(nodeNum);
+    TopologyHash hash;
+    computeTopologyHash(taxon0, NULL, hash, subtree_keys, dad_ids);
+    return hash;
+}
+
+TopologyHash MTree::computeTopologyHash(Node *node, Node *dad, TopologyHash &hash,
+        vector<TopologyHash> *subtree_keys, IntVector *dad_ids) {
+    TopologyHash keys;
+    if (node->isLeaf())
+        keys = TopologyHash::taxonKey(node->id);
+    FOR_NEIGHBOR_IT(node, dad, it) {
+        keys += computeTopologyHash((*it)->node, node, hash, subtree_keys, dad_ids);
+    }
+    // trivial splits are the same in all trees
+    if (dad && !dad->isLeaf() && !node->isLeaf())
+        hash += TopologyHash::splitHash(keys);
+    if (subtree_keys) {
+        if (node->id >= subtree_keys->size()) subtree_keys->resize(node->id + 1);
+        (*subtree_keys)[node->id] = keys;
+    }
+    if (dad_ids) {
+        if (node->id >= dad_ids->size()) dad_ids->resize(node->id + 1);
+        (*dad_ids)[node->id] = (dad) ? dad->id : -1;
+    }
+    return keys;
+}
+
+TopologyHash MTree::getSubtreeKeys(vector<TopologyHash> &subtree_keys, IntVector &dad_ids, Node *node, Node *dad,
+        bool &contain_taxon0) {
+    return getSubtreeKeys(subtree_keys, dad_ids, node->id, dad->id, contain_taxon0);
+}
+
+TopologyHash MTree::getSubtreeKeys(vector<TopologyHash> &subtree_keys, IntVector &dad_ids, int node_id, int dad_id,
+        bool &contain_taxon0) {
+    if (dad_ids[node_id] == dad_id) {
+        contain_taxon0 = false;
+        return subtree_keys[node_id];
+    }
+    // node is on the path from dad to taxon 0, which has ID 0 and holds the sum of all keys
+    assert(dad_ids[dad_id] == node_id);
+    contain_taxon0 = true;
+    TopologyHash keys = subtree_keys[0];
+    keys -= subtree_keys[dad_id];
+    return keys;
+}
+
+TopologyHash MTree::computeNNITopologyHash(TopologyHash hash, vector<TopologyHash> &subtree_keys, IntVector &dad_ids,
+        Node *node1, Node *node2, Node *nei1, Node *nei2) {
+    bool zero1, zero2, zero_nei1, zero_nei2;
+    TopologyHash side1 = getSubtreeKeys(subtree_keys, dad_ids, node1, node2, zero1);
+    TopologyHash side2 = getSubtreeKeys(subtree_keys, dad_ids, node2, node1, zero2);
+    TopologyHash keys1 = getSubtreeKeys(subtree_keys, dad_ids, nei1, node1, zero_nei1);
+    TopologyHash keys2 = getSubtreeKeys(subtree_keys, dad_ids, nei2, node2, zero_nei2);
+    // only the split of the NNI branch changes, its side without taxon 0 is hashed
+    hash -= TopologyHash::splitHash((zero1) ? side2 : side1);
+    side1 -= keys1;
+    side1 += keys2;
+    side2 -= keys2;
+    side2 += keys1;
+    zero1 = (zero1 && !zero_nei1) || zero_nei2;
+    hash += TopologyHash::splitHash((zero1) ? side2 : side1);
+    return hash;
+}
+
+TopologyHash MTree::computeSPRTopologyHash(TopologyHash hash, vector<TopologyHash> &subtree_keys, IntVector &dad_ids,
+        Node *prune_node, Node *prune_dad, Node *regraft_node, Node *regraft_dad) {
+    // climb from prune_dad and regraft_dad towards taxon 0 in turn, until one reaches a node of the other
+    IntVector path(1, prune_dad->id), path2(1, regraft_dad->id);
+    while (true) {
+        IntVector::iterator it = find(path.begin(), path.end(), path2.back());
+        if (it != path.end()) {
+            path.erase(it + 1, path.end());
+            break;
+        }
+        it = find(path2.begin(), path2.end(), path.back());
+        if (it != path2.end()) {
+            path2.erase(it + 1, path2.end());
+            break;
+        }
+        if (dad_ids[path.back()] >= 0)
+            path.push_back(dad_ids[path.back()]);
+        if (dad_ids[path2.back()] >= 0)
+            path2.push_back(dad_ids[path2.back()]);
+    }
+    // path from prune_dad to the end of the regrafting branch next to it, then the other end
+    path.insert(path.end(), path2.rbegin() + 1, path2.rend());
+    int other_end = regraft_node->id;
+    if (path.size() > 1 && path[path.size() - 2] == regraft_node->id) {
+        path.pop_back();
+        other_end = regraft_dad->id;
+    }
+    int k = path.size() - 1;
+    if (k == 0)
+        return hash;
+    // the subtree leaves the splits of the path branches, the first branch is merged with another
+    // one at prune_dad and the regrafting branch gets a new branch with the subtree on one side
+    TopologyHash all_keys = subtree_keys[0];
+    bool zero_sub, zero;
+    TopologyHash sub = getSubtreeKeys(subtree_keys, dad_ids, prune_node->id, prune_dad->id, zero_sub);
+    for (int i = 0; i < k; i++) {
+        TopologyHash keys = getSubtreeKeys(subtree_keys, dad_ids, path[i + 1], path[i], zero);
+        TopologyHash side = all_keys;
+        side -= keys;
+        hash -= TopologyHash::splitHash((zero) ? side : keys);
+        if (i == 0)
+            continue;
+        keys += sub;
+        side = all_keys;
+        side -= keys;
+        hash += TopologyHash::splitHash((zero || zero_sub) ? side : keys);
+    }
+    TopologyHash keys = getSubtreeKeys(subtree_keys, dad_ids, other_end, path[k], zero);
+    keys += sub;
+    TopologyHash side = all_keys;
+    side -= keys;
+    hash += TopologyHash::splitHash((zero || zero_sub) ? side : keys);
+    return hash;
+}
+
+void MTree::getTopology(IntVector &topo) {
+    Node *taxon0 = (root->isLeaf() && root->id == 0) ? root : findNodeID(0);
+    assert(taxon0 && taxon0->isLeaf());
+    IntVector min_taxa(nodeNum, 0);
+    getTopologyMinTaxa(taxon0, NULL, min_taxa);
+    topo.clear();
+    topo.reserve(nodeNum);
+    getTopology(taxon0, NULL, min_taxa, topo);
+}
+
+int MTree::getTopologyMinTaxa(Node *node, Node *dad, IntVector &min_taxa) {
+    int min_taxon = (node->isLeaf()) ? node->id : nodeNum;
+    FOR_NEIGHBOR_IT(node, dad, it) {
+        int taxon = getTopologyMinTaxa((*it)->node, node, min_taxa);
+        if (taxon < min_taxon) min_taxon = taxon;
+    }
+    if (node->id >= min_taxa.size()) min_taxa.resize(node->id + 1);
+    min_taxa[node->id] = min_taxon;
+    return min_taxon;
+}
+
+void MTree::getTopology(Node *node, Node *dad, IntVector &min_taxa, IntVector &topo) {
+    vector<pair<int, Node*> > children;
+    FOR_NEIGHBOR_IT(node, dad, it) {
+        children.push_back(make_pair(min_taxa[(*it)->node->id], (*it)->node));
+    }
+    if (node->isLeaf())
+        topo.push_back(node->id);
+    else
+        topo.push_back(-(int)children.size());
+    sort(children.begin(), children.end());
+    for (vector<pair<int, Node*> >::iterator it = children.begin(); it != children.end(); it++)
+        getTopology(it->second, node, min_taxa, topo);
+}
+
 Node* MTree::copyTree(MTree *tree, string &taxa_set, double &len, Node *node, Node *dad) {
     if (!node) {
         if (taxa_set[tree->root->id]) {
@@ -746,6 +982,23 @@ void MTree::getAllNodesInSubtree(Node *node, Node *dad, NodeVector &nodeList) {
     }
 }
 
+bool MTree::getNodesByID(NodeVector &nodes) {
+    NodeVector all_nodes;
+    getTaxa(all_nodes);
+    if (!root->isLeaf())
+        all_nodes.push_back(root);
+    getInternalNodes(all_nodes);
+    if (all_nodes.size() != nodeNum)
+        return false;
+    nodes.assign(nodeNum, NULL);
+    for (NodeVector::iterator it = all_nodes.begin(); it != all_nodes.end(); it++) {
+        if ((*it)->id < 0 || (*it)->id >= nodeNum || nodes[(*it)->id])
+            return false;
+        nodes[(*it)->id] = *it;
+    }
+    return true;
+}
+
 int MTree::getNumTaxa(Node *node, Node *dad) {
     if (!node) node = root;
     if (node->isLeaf()) {
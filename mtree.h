@@ -27,11 +27,35 @@
 #include <sstream>
 #include "hashsplitset.h"
 #include "splitset.h"
+#include "topologyhash.h"
 
 const char ROOT_NAME[] = "_root";
 
 class SplitGraph;
 
+/**
+topology and branch lengths of a tree, see MTree::saveSnapshot()
+ */
+struct TreeSnapshot {
+    /**
+            the neighbors of the node with ID i are at positions nei_start[i], ..., nei_start[i+1]-1
+            of the other vectors, in the order of Node::neighbors
+     */
+    vector<int> nei_start;
+
+    /** ID of the neighbor node */
+    vector<int> nei_node;
+
+    /** branch length */
+    vector<double> nei_length;
+
+    /** branch ID */
+    vector<int> nei_id;
+
+    /** ID of the root */
+    int root_id;
+};
+
 /**
 General-purposed tree
 @author BUI Quang Minh, Steffen Klaere, Arndt von Haeseler
@@ -76,6 +100,73 @@ public:
 
     Node* copyTree(MTree *tree, string &taxa_set, double &len, Node *node = NULL, Node *dad = NULL);
 
+    /**
+            copy the tree node by node into this tree, keeping the node and branch IDs, the exact
+            branch lengths and the order of the neighbors (copyTree() goes through a NEWICK string)
+            @param tree the tree to copy
+     */
+    void copyTreeExact(MTree *tree);
+
+    /**
+            save the topology and the branch lengths of the tree, e.g. to keep the best tree during the search
+            @param snapshot (OUT) the snapshot
+     */
+    void saveSnapshot(TreeSnapshot &snapshot);
+
+    /**
+            restore a snapshot of saveSnapshot() in linear time. The Node and Neighbor objects are reused,
+            so the tree must still have the same node IDs, as after NNIs, SPRs or leaf reinsertions.
+            Neighbors that lead to the same node as in the snapshot are kept
+            @param snapshot the snapshot
+            @param changed_nodes (OUT) if not NULL, the nodes whose neighbors or branch lengths were changed
+     */
+    virtual void restoreSnapshot(TreeSnapshot &snapshot, NodeVector *changed_nodes = NULL);
+
+    /**
+            compute the hash of the unrooted topology: the sum of TopologyHash::splitHash() over all internal
+            branches, applied to the sum of the taxon keys on the side without taxon 0. An NNI only changes
+            the term of its branch, see computeNNITopologyHash()
+            @param subtree_keys (OUT) if not NULL, for each node ID the sum of the taxon keys below the node
+            when the tree is rooted at taxon 0 (all keys for taxon 0)
+            @param dad_ids (OUT) if not NULL, for each node ID the ID of its neighbor towards taxon 0
+            @return hash of the topology
+     */
+    TopologyHash computeTopologyHash(vector<TopologyHash> *subtree_keys = NULL, IntVector *dad_ids = NULL);
+
+    /**
+            compute the hash of the topology after an NNI in constant time
+            @param hash hash of the tree before the NNI
+            @param subtree_keys, dad_ids computed by computeTopologyHash() before the NNI
+            @param node1 one end of the NNI branch
+            @param node2 the other end of the NNI branch
+            @param nei1 neighbor of node1 that the NNI moves to node2
+            @param nei2 neighbor of node2 that the NNI moves to node1
+            @return hash of the tree after the NNI
+     */
+    TopologyHash computeNNITopologyHash(TopologyHash hash, vector<TopologyHash> &subtree_keys, IntVector &dad_ids,
+            Node *node1, Node *node2, Node *nei1, Node *nei2);
+
+    /**
+            compute the hash of the topology after an SPR in time linear in the length of the path
+            between the pruning and the regrafting point
+            @param hash hash of the tree before the SPR
+            @param subtree_keys, dad_ids computed by computeTopologyHash() before the SPR
+            @param prune_node root of the pruned subtree
+            @param prune_dad neighbor of prune_node, removed from its branches with the subtree
+            @param regraft_node, regraft_dad ends of the branch where the subtree is regrafted
+            @return hash of the tree after the SPR
+     */
+    TopologyHash computeSPRTopologyHash(TopologyHash hash, vector<TopologyHash> &subtree_keys, IntVector &dad_ids,
+            Node *prune_node, Node *prune_dad, Node *regraft_node, Node *regraft_dad);
+
+    /**
+            get the canonical form of the unrooted topology: the tree is rooted at taxon 0 and listed in preorder,
+            taxa by their IDs and internal nodes by minus their number of children, the children sorted by their
+            smallest taxon ID. Two trees have the same topology if and only if their canonical forms are equal
+            @param topo (OUT) the canonical form
+     */
+    void getTopology(IntVector &topo);
+
     /**
             initialize the tree from a NEWICK tree file
             @param userTreeFile the name of the user tree
@@ -306,6 +397,12 @@ public:
      */
     void getAllNodesInSubtree(Node *node, Node *dad, NodeVector &nodeList);
 
+    /**
+     * @param nodes (OUT) all nodes of the tree, indexed by node ID
+     * @return FALSE if the node IDs are not 0, ..., nodeNum-1
+     */
+    bool getNodesByID(NodeVector &nodes);
+
     /**
      * get number of taxa below the node
      * @param node the starting node, NULL to start from the root
@@ -589,6 +686,42 @@ public:
 
 protected:
 
+    /**
+            recursive part of computeTopologyHash()
+            @param hash (IN/OUT) sum of the split hashes
+            @return sum of the taxon keys below node
+     */
+    TopologyHash computeTopologyHash(Node *node, Node *dad, TopologyHash &hash,
+            vector<TopologyHash> *subtree_keys, IntVector *dad_ids);
+
+    /**
+            @param subtree_keys, dad_ids computed by computeTopologyHash()
+            @param contain_taxon0 (OUT) TRUE if the subtree contains taxon 0
+            @return sum of the taxon keys of the subtree at node away from its neighbor dad
+     */
+    TopologyHash getSubtreeKeys(vector<TopologyHash> &subtree_keys, IntVector &dad_ids, Node *node, Node *dad,
+            bool &contain_taxon0);
+
+    /**
+            getSubtreeKeys() for node IDs
+     */
+    TopologyHash getSubtreeKeys(vector<TopologyHash> &subtree_keys, IntVector &dad_ids, int node_id, int dad_id,
+            bool &contain_taxon0);
+
+    /**
+            recursive part of getTopology()
+            @param min_taxa (OUT) for each node ID the smallest taxon ID below it
+            @return smallest taxon ID below node
+     */
+    int getTopologyMinTaxa(Node *node, Node *dad, IntVector &min_taxa);
+
+    /**
+            recursive part of getTopology()
+            @param min_taxa computed by getTopologyMinTaxa()
+            @param topo (IN/OUT) the canonical form
+     */
+    void getTopology(Node *node, Node *dad, IntVector &min_taxa, IntVector &topo);
+
     /**
             line number of the input file, used to output errors in input file
      */
@@ -75,18 +75,25 @@ void MTreeSet::init(const char *userTreeFile, bool &is_rooted, int burnin, int m
 
 }
 
-void MTreeSet::init(StringIntMap &treels, bool &is_rooted, IntVector &weights) {
+void MTreeSet::init(TopologyIntMap &treels, bool &is_rooted, IntVector &weights) {
 	//resize(treels.size(), NULL);
 	int count = 0;
 	//IntVector ok_trees;
 	//ok_trees.resize(treels.size(), 0);
 	//for (i = 0; i < trees_id.size(); i++) ok_trees[trees_id[i]] = 1;
 
-	for (StringIntMap::iterator it = treels.begin(); it != treels.end(); it++) 
-	if (weights[it->second]) {
+	// convert the trees in the order of their indices
+	IntVector tree_ids;
+	for (TopologyIntMap::iterator it = treels.begin(); it != treels.end(); it++)
+		tree_ids.push_back(it->second);
+	sort(tree_ids.begin(), tree_ids.end());
+
+	for (IntVector::iterator it = tree_ids.begin(); it != tree_ids.end(); it++)
+	if (weights[*it]) {
 		count++;
 		MTree *tree = newTree();
-		stringstream ss(it->first);
+		stringstream ss;
+		treels.printTopology(ss, *it);
 		bool myrooted = is_rooted;
 		tree->readTree(ss, myrooted);
 		NodeVector taxa;
@@ -95,7 +102,7 @@ void MTreeSet::init(StringIntMap &treels, bool &is_rooted, IntVector &weights) {
 			(*taxit)->id = atoi((*taxit)->name.c_str());
 		//at(it->second) = tree;
 		push_back(tree);
-		tree_weights.push_back(weights[it->second]);
+		tree_weights.push_back(weights[*it]);
 		//cout << "Tree " << it->second << ": ";
 		//tree->printTree(cout, WT_NEWLINE);
 	}
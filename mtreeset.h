@@ -56,7 +56,13 @@ public:
 	void init(const char *userTreeFile, bool &is_rooted, int burnin, int max_count, 
 		const char *tree_weight_file = NULL, IntVector *weights = NULL, bool compressed = false);
 
-	void init(StringIntMap &treels, bool &is_rooted, IntVector &weights);
+	/**
+		convert the topologies with positive weight of a TopologyIntMap into trees
+		@param treels the topologies
+		@param is_rooted (IN/OUT) true if tree is rooted
+		@param weights weight of each topology index
+	*/
+	void init(TopologyIntMap &treels, bool &is_rooted, IntVector &weights);
 
 
 	/**
@@ -56,18 +56,22 @@ int PartitionModel::getNParameters() {
 
 double PartitionModel::optimizeParameters(bool fixed_len, bool write_info, double epsilon) {
     PhyloSuperTree *tree = (PhyloSuperTree*)site_rate->getTree();
-    double tree_lh = 0.0;
     int ntrees = tree->size();
+    DoubleVector part_lh(ntrees);
 
 	#ifdef _OPENMP
-	#pragma omp parallel for reduction(+: tree_lh)
+	#pragma omp parallel for
 	#endif
     for (int part = 0; part < ntrees; part++) {
         cout << "Optimizing " << tree->at(part)->getModelName() <<
         		" parameters for partition " << tree->part_info[part].name <<
         		" (" << tree->at(part)->getModelFactory()->getNParameters() << " free parameters)" << endl;
-        tree_lh += tree->at(part)->getModelFactory()->optimizeParameters(fixed_len, write_info, epsilon);
+        part_lh[part] = tree->at(part)->getModelFactory()->optimizeParameters(fixed_len, write_info, epsilon);
     }
+    // added up in partition order, independent of the number of threads
+    double tree_lh = 0.0;
+    for (int part = 0; part < ntrees; part++)
+        tree_lh += part_lh[part];
     //return ModelFactory::optimizeParameters(fixed_len, write_info);
     return tree_lh;
 }
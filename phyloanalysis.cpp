@@ -1010,8 +1010,6 @@ double doModelOptimization(IQTree& iqtree, Params& params) {
 
 void computeMLDist(double &longest_dist, string &dist_file, double begin_time,
 		IQTree& iqtree, Params& params, Alignment* alignment, double &bestTreeScore) {
-	stringstream best_tree_string;
-	iqtree.printTree(best_tree_string, WT_BR_LEN + WT_TAXON_ID);
 	cout << "Computing ML distances based on estimated model parameters...";
 	double *ml_dist = NULL;
     double *ml_var = NULL;
@@ -1193,6 +1191,18 @@ void runPhyloAnalysis(Params &params, string &original_model,
 	assert(iqtree.aln);
 	iqtree.optimize_by_newton = params.optimize_by_newton;
 	iqtree.sse = params.SSE;
+	if (!params.AVX)
+		iqtree.lk_kernel = LK_SSE3;
+	iqtree.lh_layout = params.lh_block_layout ? LH_LAYOUT_BLOCKED : LH_LAYOUT_PATTERN;
+	iqtree.lh_float = params.lh_float;
+	iqtree.lh_mem_limit = params.lh_mem_limit;
+	if (params.lh_mem_limit && iqtree.isSuperTree()) {
+		cout << "NOTE: Memory limit of partial likelihoods is ignored for partitioned analyses" << endl;
+		iqtree.lh_mem_limit = 0;
+	}
+	iqtree.site_repeats = params.site_repeats;
+	iqtree.lh_slice_traversal = params.lh_slice_traversal;
+	MemArena::setHugePageMode(params.huge_page);
 	if (params.gbo_replicates)
 		params.speed_conf = 1.0;
 	if (params.speed_conf == 1.0)
@@ -1227,8 +1237,8 @@ void runPhyloAnalysis(Params &params, string &original_model,
 	if (iqtree.isSuperTree())
 			((PhyloSuperTree*) &iqtree)->mapTrees();
 
-    // string to store the current tree with taxon id and branch lengths
-    stringstream best_tree_string;
+    // the current tree with branch lengths
+    TreeSnapshot best_tree;
     iqtree.setParams(params);
     double bestTreeScore;
 
@@ -1252,7 +1262,7 @@ void runPhyloAnalysis(Params &params, string &original_model,
 
 	// Save current tree to a string
     iqtree.curScore = bestTreeScore;
-	iqtree.printTree(best_tree_string, WT_TAXON_ID + WT_BR_LEN);
+	iqtree.saveSnapshot(best_tree);
 
 	// Compute maximum likelihood distance
 	if (!params.dist_file && params.compute_ml_dist) {
@@ -1291,7 +1301,7 @@ void runPhyloAnalysis(Params &params, string &original_model,
         }
         cout << "Log-likelihood of the BIONJ tree created from ML distances: " << iqtree.curScore << endl;
         if (iqtree.curScore < (bestTreeScore - params.loglh_epsilon) && !params.leastSquareBranch) {
-			iqtree.rollBack(best_tree_string);
+			iqtree.restoreSnapshot(best_tree);
 			if (iqtree.isSuperTree()) {
 				if(params.partition_type){
 					((PhyloSuperTreePlen*) (&iqtree))->mapTrees();
@@ -1316,6 +1326,13 @@ void runPhyloAnalysis(Params &params, string &original_model,
         iqtree.printResultTree("LeastSquareTree");
 	}
 
+	if (params.numa_benchmark) {
+		if (iqtree.isSuperTree())
+			cout << "NOTE: NUMA benchmark is not available for partitioned analyses" << endl;
+		else
+			iqtree.benchmarkNumaPlacement(params.numa_benchmark, cout);
+	}
+
 	double t_tree_search_start, t_tree_search_end;
 	t_tree_search_start = getCPUTime();
 
@@ -1508,7 +1525,7 @@ void runPhyloAnalysis(Params &params, string &original_model,
 	/* evaluating all trees in user tree file */
 
 	/* DO IQPNNI */
-	if (params.k_representative > 0) {
+	if (params.k_representative > 0 && !params.tree_spr) {
 		cout << endl << "START IQPNNI SEARCH WITH THE FOLLOWING PARAMETERS"
 				<< endl;
 		cout << "Number of representative leaves   : "
@@ -1530,12 +1547,14 @@ void runPhyloAnalysis(Params &params, string &original_model,
 								"Parsimony" : "Bootstrap")) << endl;
 		cout << "NNI assessed on                   : " << ((params.nni5Branches) ? "5 branches" : "1 branch") << endl;
 		cout << "SSE instructions                  : "
-				<< ((iqtree.sse) ? "Yes" : "No") << endl;
+				<< ((iqtree.sse) ? string("Yes (") + getLikelihoodKernelName(iqtree.lk_kernel) + ")" : string("No")) << endl;
 		cout << "Branch length optimization method : "
 				<< ((iqtree.optimize_by_newton) ? "Newton" : "Brent") << endl;
 		cout << endl;
 		if (params.random_restart) {
 			iqtree.doRandomRestart();
+		} else if (params.num_starts > 1) {
+			iqtree.doMultiStartIQPNNI();
 		} else {
 			iqtree.doIQPNNI();
 		}
@@ -1687,6 +1706,10 @@ void runPhyloAnalysis(Params &params, string &original_model,
 	}
 
 	cout << "Total tree length: " << iqtree.treeLength() << endl;
+	if (verbose_mode >= VB_MED) {
+		iqtree.getModelFactory()->writeTransMatrixCacheInfo(cout);
+		iqtree.writePartialLhInfo(cout);
+	}
 
 	t_end = getCPUTime();
 	params.run_time = (t_end - t_begin);
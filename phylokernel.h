@@ -0,0 +1,130 @@
+//
+// C++ Interface: phylokernel
+//
+// Description: hand-vectorized per-pattern likelihood kernels for
+// AVX2/FMA and AVX-512 capable CPUs, selected at runtime.
+//
+// The kernels work on the same memory layout as the Eigen based SSE code
+// in phylotreesse.cpp: partial likelihoods are stored [category][state]
+// for one pattern and each transition matrix is stored row-major, so that
+// the partial likelihood vector at the parent is
+//      parent[j] *= sum_i trans[j*nstates+i] * child[i]
+//
+// In the pattern-blocked layout (LH_LAYOUT_BLOCKED) LH_BLOCK_PATTERNS
+// consecutive patterns are interleaved, i.e. a partial likelihood vector is
+// stored [pattern block][category][state][pattern in block]. The *Block
+// kernels then process one pattern block with whole vector registers.
+//
+// The AVX translation units must NOT include Eigen or any other header with
+// inline functions, otherwise the linker may pick an AVX-compiled copy for
+// the generic code path.
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+
+#ifndef PHYLOKERNEL_H
+#define PHYLOKERNEL_H
+
+/**
+	instruction set of the likelihood kernels, in increasing order of vector width
+*/
+enum LikelihoodKernel {LK_SSE3, LK_AVX2, LK_AVX512};
+
+/**
+	number of patterns interleaved in one block of the pattern-blocked layout
+*/
+#define LH_BLOCK_PATTERNS 4
+
+/**
+	memory layout of partial likelihood vectors:
+	LH_LAYOUT_PATTERN: [pattern][category][state]
+	LH_LAYOUT_BLOCKED: [pattern block][category][state][pattern in block]
+*/
+enum LikelihoodLayout {LH_LAYOUT_PATTERN, LH_LAYOUT_BLOCKED};
+
+/**
+	update partial likelihood of one pattern by one child:
+	partial_lh[c][j] *= sum_i trans_mat[c][j][i] * partial_lh_child[c][i] for all categories c
+*/
+typedef void (*PartialLhProductFunc)(double *partial_lh, const double *partial_lh_child,
+		const double *trans_mat, int ncat);
+
+/**
+	likelihood of one pattern at a branch: sum_c (trans_mat[c] * partial_lh_child[c]) . partial_lh_site[c]
+*/
+typedef double (*BranchLhFunc)(const double *partial_lh_site, const double *partial_lh_child,
+		const double *trans_mat, int ncat);
+
+/**
+	likelihood of one pattern at a branch together with its first and second derivatives
+	@param lh_derv1 (OUT) first derivative
+	@param lh_derv2 (OUT) second derivative
+	@return likelihood of the pattern (without invariant sites and category weights)
+*/
+typedef double (*BranchDervFunc)(const double *partial_lh_site, const double *partial_lh_child,
+		const double *trans_mat, const double *trans_derv1, const double *trans_derv2, int ncat,
+		double &lh_derv1, double &lh_derv2);
+
+/**
+	likelihood of one block of LH_BLOCK_PATTERNS patterns at a branch (pattern-blocked layout)
+	@param lh (OUT) likelihood of each pattern of the block
+*/
+typedef void (*BranchLhBlockFunc)(const double *partial_lh_site, const double *partial_lh_child,
+		const double *trans_mat, int ncat, double *lh);
+
+/**
+	likelihood and derivatives of one block of LH_BLOCK_PATTERNS patterns at a branch (pattern-blocked layout)
+	@param lh (OUT) likelihood of each pattern of the block
+	@param lh_derv1 (OUT) first derivative of each pattern of the block
+	@param lh_derv2 (OUT) second derivative of each pattern of the block
+*/
+typedef void (*BranchDervBlockFunc)(const double *partial_lh_site, const double *partial_lh_child,
+		const double *trans_mat, const double *trans_derv1, const double *trans_derv2, int ncat,
+		double *lh, double *lh_derv1, double *lh_derv2);
+
+/**
+	set of vectorized kernels for one instruction set and number of states.
+	A NULL member means that the Eigen code has to be used, which the SSE kernels
+	fill in with getLikelihoodKernelSSE().
+*/
+struct LikelihoodKernelFuncs {
+	PartialLhProductFunc partialLhProduct;
+	BranchLhFunc branchLh;
+	BranchDervFunc branchDerv;
+	/** kernels for the pattern-blocked layout, partialLhProductBlock updates one block of patterns */
+	PartialLhProductFunc partialLhProductBlock;
+	BranchLhBlockFunc branchLhBlock;
+	BranchDervBlockFunc branchDervBlock;
+};
+
+/**
+	@return the widest instruction set supported by both the CPU and the operating system
+*/
+LikelihoodKernel detectLikelihoodKernel();
+
+/**
+	@return name of the instruction set for printing
+*/
+const char *getLikelihoodKernelName(LikelihoodKernel kernel);
+
+/**
+	get the kernels for the given instruction set and number of states, falling back
+	to narrower instruction sets if no kernel is available
+	@param kernel instruction set
+	@param nstates number of states
+	@param funcs (OUT) kernel functions
+*/
+void getLikelihoodKernel(LikelihoodKernel kernel, int nstates, LikelihoodKernelFuncs &funcs);
+
+/**
+	AVX2/FMA kernels (phylokernelavx.cpp), members are NULL if nstates is not supported
+*/
+void getLikelihoodKernelAVX(int nstates, LikelihoodKernelFuncs &funcs);
+
+/**
+	AVX-512 kernels (phylokernelavx512.cpp), members are NULL if nstates is not supported
+*/
+void getLikelihoodKernelAVX512(int nstates, LikelihoodKernelFuncs &funcs);
+
+#endif
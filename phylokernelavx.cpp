@@ -0,0 +1,249 @@
+/***************************************************************************
+ *   Copyright (C) 2009 by BUI Quang Minh   *
+ *   minh.bui@univie.ac.at   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * AVX2/FMA likelihood kernels. This file is compiled with -mavx2 -mfma and
+ * is only called after detectLikelihoodKernel() confirmed CPU support.
+ * Do not include Eigen or other headers with inline code here.
+ *
+ * The *BlockAVX kernels for the pattern-blocked layout (the default) hold the
+ * LH_BLOCK_PATTERNS patterns of a block in the 4 lanes of a vector and need no
+ * horizontal sums. The per-pattern kernels for -nolhblock vectorize over the
+ * states of one pattern instead.
+ */
+#include <immintrin.h>
+#include "phylokernel.h"
+
+/**
+	horizontal sums of 4 vectors: returns [sum(a0), sum(a1), sum(a2), sum(a3)]
+*/
+static inline __m256d horizontalAdd4(__m256d a0, __m256d a1, __m256d a2, __m256d a3) {
+	__m256d h01 = _mm256_hadd_pd(a0, a1);
+	__m256d h23 = _mm256_hadd_pd(a2, a3);
+	return _mm256_add_pd(_mm256_permute2f128_pd(h01, h23, 0x20), _mm256_permute2f128_pd(h01, h23, 0x31));
+}
+
+static inline double horizontalAdd(__m256d a) {
+	__m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+	return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+/**
+	4 consecutive entries of trans_mat * child, starting at row trans_row
+*/
+template<int NSTATES>
+static inline __m256d productRows4(const double *trans_row, const __m256d *child) {
+	const double *row0 = trans_row, *row1 = row0 + NSTATES, *row2 = row1 + NSTATES, *row3 = row2 + NSTATES;
+	__m256d a0 = _mm256_mul_pd(_mm256_loadu_pd(row0), child[0]);
+	__m256d a1 = _mm256_mul_pd(_mm256_loadu_pd(row1), child[0]);
+	__m256d a2 = _mm256_mul_pd(_mm256_loadu_pd(row2), child[0]);
+	__m256d a3 = _mm256_mul_pd(_mm256_loadu_pd(row3), child[0]);
+	for (int i = 1; i < NSTATES / 4; i++) {
+		a0 = _mm256_fmadd_pd(_mm256_loadu_pd(row0 + i * 4), child[i], a0);
+		a1 = _mm256_fmadd_pd(_mm256_loadu_pd(row1 + i * 4), child[i], a1);
+		a2 = _mm256_fmadd_pd(_mm256_loadu_pd(row2 + i * 4), child[i], a2);
+		a3 = _mm256_fmadd_pd(_mm256_loadu_pd(row3 + i * 4), child[i], a3);
+	}
+	return horizontalAdd4(a0, a1, a2, a3);
+}
+
+template<int NSTATES>
+static void partialLhProductAVX(double *partial_lh, const double *partial_lh_child, const double *trans_mat, int ncat) {
+	__m256d child[NSTATES / 4];
+	for (int cat = 0; cat < ncat; cat++) {
+		for (int i = 0; i < NSTATES / 4; i++)
+			child[i] = _mm256_loadu_pd(partial_lh_child + i * 4);
+		for (int j = 0; j < NSTATES; j += 4) {
+			__m256d prod = productRows4<NSTATES>(trans_mat + j * NSTATES, child);
+			_mm256_storeu_pd(partial_lh + j, _mm256_mul_pd(_mm256_loadu_pd(partial_lh + j), prod));
+		}
+		partial_lh += NSTATES;
+		partial_lh_child += NSTATES;
+		trans_mat += NSTATES * NSTATES;
+	}
+}
+
+template<int NSTATES>
+static double branchLhAVX(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+		int ncat) {
+	__m256d child[NSTATES / 4];
+	__m256d lh = _mm256_setzero_pd();
+	for (int cat = 0; cat < ncat; cat++) {
+		for (int i = 0; i < NSTATES / 4; i++)
+			child[i] = _mm256_loadu_pd(partial_lh_child + i * 4);
+		for (int j = 0; j < NSTATES; j += 4)
+			lh = _mm256_fmadd_pd(productRows4<NSTATES>(trans_mat + j * NSTATES, child),
+					_mm256_loadu_pd(partial_lh_site + j), lh);
+		partial_lh_site += NSTATES;
+		partial_lh_child += NSTATES;
+		trans_mat += NSTATES * NSTATES;
+	}
+	return horizontalAdd(lh);
+}
+
+template<int NSTATES>
+static double branchDervAVX(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+		const double *trans_derv1, const double *trans_derv2, int ncat, double &lh_derv1, double &lh_derv2) {
+	__m256d child[NSTATES / 4];
+	__m256d lh = _mm256_setzero_pd();
+	__m256d derv1 = _mm256_setzero_pd();
+	__m256d derv2 = _mm256_setzero_pd();
+	for (int cat = 0; cat < ncat; cat++) {
+		for (int i = 0; i < NSTATES / 4; i++)
+			child[i] = _mm256_loadu_pd(partial_lh_child + i * 4);
+		for (int j = 0; j < NSTATES; j += 4) {
+			__m256d site = _mm256_loadu_pd(partial_lh_site + j);
+			lh = _mm256_fmadd_pd(productRows4<NSTATES>(trans_mat + j * NSTATES, child), site, lh);
+			derv1 = _mm256_fmadd_pd(productRows4<NSTATES>(trans_derv1 + j * NSTATES, child), site, derv1);
+			derv2 = _mm256_fmadd_pd(productRows4<NSTATES>(trans_derv2 + j * NSTATES, child), site, derv2);
+		}
+		partial_lh_site += NSTATES;
+		partial_lh_child += NSTATES;
+		trans_mat += NSTATES * NSTATES;
+		trans_derv1 += NSTATES * NSTATES;
+		trans_derv2 += NSTATES * NSTATES;
+	}
+	lh_derv1 = horizontalAdd(derv1);
+	lh_derv2 = horizontalAdd(derv2);
+	return horizontalAdd(lh);
+}
+
+/**
+	4 rows of trans_mat * child for one block of 4 patterns (pattern-blocked layout),
+	child points to NSTATES vectors of 4 patterns each
+*/
+template<int NSTATES>
+static inline void productRowsBlock4(const double *trans_row, const double *child, __m256d *prod) {
+	const double *row0 = trans_row, *row1 = row0 + NSTATES, *row2 = row1 + NSTATES, *row3 = row2 + NSTATES;
+	__m256d c = _mm256_loadu_pd(child);
+	prod[0] = _mm256_mul_pd(_mm256_broadcast_sd(row0), c);
+	prod[1] = _mm256_mul_pd(_mm256_broadcast_sd(row1), c);
+	prod[2] = _mm256_mul_pd(_mm256_broadcast_sd(row2), c);
+	prod[3] = _mm256_mul_pd(_mm256_broadcast_sd(row3), c);
+	for (int i = 1; i < NSTATES; i++) {
+		c = _mm256_loadu_pd(child + i * LH_BLOCK_PATTERNS);
+		prod[0] = _mm256_fmadd_pd(_mm256_broadcast_sd(row0 + i), c, prod[0]);
+		prod[1] = _mm256_fmadd_pd(_mm256_broadcast_sd(row1 + i), c, prod[1]);
+		prod[2] = _mm256_fmadd_pd(_mm256_broadcast_sd(row2 + i), c, prod[2]);
+		prod[3] = _mm256_fmadd_pd(_mm256_broadcast_sd(row3 + i), c, prod[3]);
+	}
+}
+
+/**
+	sum_j prod[j] * site[j] over 4 rows starting at site
+*/
+static inline __m256d dotRowsBlock4(const __m256d *prod, const double *site, __m256d sum) {
+	for (int k = 0; k < 4; k++)
+		sum = _mm256_fmadd_pd(prod[k], _mm256_loadu_pd(site + k * LH_BLOCK_PATTERNS), sum);
+	return sum;
+}
+
+template<int NSTATES>
+static void partialLhProductBlockAVX(double *partial_lh, const double *partial_lh_child, const double *trans_mat,
+		int ncat) {
+	__m256d prod[4];
+	for (int cat = 0; cat < ncat; cat++) {
+		for (int j = 0; j < NSTATES; j += 4) {
+			productRowsBlock4<NSTATES>(trans_mat + j * NSTATES, partial_lh_child, prod);
+			double *site = partial_lh + j * LH_BLOCK_PATTERNS;
+			for (int k = 0; k < 4; k++)
+				_mm256_storeu_pd(site + k * LH_BLOCK_PATTERNS,
+						_mm256_mul_pd(_mm256_loadu_pd(site + k * LH_BLOCK_PATTERNS), prod[k]));
+		}
+		partial_lh += NSTATES * LH_BLOCK_PATTERNS;
+		partial_lh_child += NSTATES * LH_BLOCK_PATTERNS;
+		trans_mat += NSTATES * NSTATES;
+	}
+}
+
+template<int NSTATES>
+static void branchLhBlockAVX(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+		int ncat, double *lh) {
+	__m256d prod[4];
+	__m256d lh_block = _mm256_setzero_pd();
+	for (int cat = 0; cat < ncat; cat++) {
+		for (int j = 0; j < NSTATES; j += 4) {
+			productRowsBlock4<NSTATES>(trans_mat + j * NSTATES, partial_lh_child, prod);
+			lh_block = dotRowsBlock4(prod, partial_lh_site + j * LH_BLOCK_PATTERNS, lh_block);
+		}
+		partial_lh_site += NSTATES * LH_BLOCK_PATTERNS;
+		partial_lh_child += NSTATES * LH_BLOCK_PATTERNS;
+		trans_mat += NSTATES * NSTATES;
+	}
+	_mm256_storeu_pd(lh, lh_block);
+}
+
+template<int NSTATES>
+static void branchDervBlockAVX(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+		const double *trans_derv1, const double *trans_derv2, int ncat, double *lh, double *lh_derv1,
+		double *lh_derv2) {
+	__m256d prod[4];
+	__m256d lh_block = _mm256_setzero_pd();
+	__m256d derv1 = _mm256_setzero_pd();
+	__m256d derv2 = _mm256_setzero_pd();
+	for (int cat = 0; cat < ncat; cat++) {
+		for (int j = 0; j < NSTATES; j += 4) {
+			const double *site = partial_lh_site + j * LH_BLOCK_PATTERNS;
+			productRowsBlock4<NSTATES>(trans_mat + j * NSTATES, partial_lh_child, prod);
+			lh_block = dotRowsBlock4(prod, site, lh_block);
+			productRowsBlock4<NSTATES>(trans_derv1 + j * NSTATES, partial_lh_child, prod);
+			derv1 = dotRowsBlock4(prod, site, derv1);
+			productRowsBlock4<NSTATES>(trans_derv2 + j * NSTATES, partial_lh_child, prod);
+			derv2 = dotRowsBlock4(prod, site, derv2);
+		}
+		partial_lh_site += NSTATES * LH_BLOCK_PATTERNS;
+		partial_lh_child += NSTATES * LH_BLOCK_PATTERNS;
+		trans_mat += NSTATES * NSTATES;
+		trans_derv1 += NSTATES * NSTATES;
+		trans_derv2 += NSTATES * NSTATES;
+	}
+	_mm256_storeu_pd(lh, lh_block);
+	_mm256_storeu_pd(lh_derv1, derv1);
+	_mm256_storeu_pd(lh_derv2, derv2);
+}
+
+void getLikelihoodKernelAVX(int nstates, LikelihoodKernelFuncs &funcs) {
+	switch (nstates) {
+	case 4:
+		funcs.partialLhProduct = partialLhProductAVX<4>;
+		funcs.branchLh = branchLhAVX<4>;
+		funcs.branchDerv = branchDervAVX<4>;
+		funcs.partialLhProductBlock = partialLhProductBlockAVX<4>;
+		funcs.branchLhBlock = branchLhBlockAVX<4>;
+		funcs.branchDervBlock = branchDervBlockAVX<4>;
+		break;
+	case 20:
+		funcs.partialLhProduct = partialLhProductAVX<20>;
+		funcs.branchLh = branchLhAVX<20>;
+		funcs.branchDerv = branchDervAVX<20>;
+		funcs.partialLhProductBlock = partialLhProductBlockAVX<20>;
+		funcs.branchLhBlock = branchLhBlockAVX<20>;
+		funcs.branchDervBlock = branchDervBlockAVX<20>;
+		break;
+	default:
+		funcs.partialLhProduct = NULL;
+		funcs.branchLh = NULL;
+		funcs.branchDerv = NULL;
+		funcs.partialLhProductBlock = NULL;
+		funcs.branchLhBlock = NULL;
+		funcs.branchDervBlock = NULL;
+		break;
+	}
+}
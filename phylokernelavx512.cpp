@@ -0,0 +1,287 @@
+/***************************************************************************
+ *   Copyright (C) 2009 by BUI Quang Minh   *
+ *   minh.bui@univie.ac.at   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * AVX-512 likelihood kernels. This file is compiled with -mavx512f -mfma and
+ * is only called after detectLikelihoodKernel() confirmed CPU support.
+ * Do not include Eigen or other headers with inline code here.
+ *
+ * In the pattern-blocked layout (the default) the lanes of a vector hold the
+ * LH_BLOCK_PATTERNS patterns of a block for two consecutive states, so each
+ * multiply-add does 8 useful products and the two halves are only added once
+ * per matrix row. Such kernels exist for every even number of states.
+ *
+ * In the pattern-by-pattern layout each row of a transition matrix is
+ * processed with full 8-wide vectors and one masked vector for the remaining
+ * states. These kernels need horizontal sums and only pay off for larger
+ * state spaces, they exist for amino acids only; DNA uses AVX2 instead.
+ */
+#include <immintrin.h>
+#include "phylokernel.h"
+
+static inline __m256d horizontalAdd4(__m256d a0, __m256d a1, __m256d a2, __m256d a3) {
+	__m256d h01 = _mm256_hadd_pd(a0, a1);
+	__m256d h23 = _mm256_hadd_pd(a2, a3);
+	return _mm256_add_pd(_mm256_permute2f128_pd(h01, h23, 0x20), _mm256_permute2f128_pd(h01, h23, 0x31));
+}
+
+static inline double horizontalAdd(__m256d a) {
+	__m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+	return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+/**
+	fold an 8-wide vector into 4 lanes. The masked extracts with a zero source avoid the
+	undefined upper lanes of the unmasked intrinsics (-Wuninitialized with GCC)
+*/
+static inline __m256d foldHalves(__m512d a) {
+	__m256d zero = _mm256_setzero_pd();
+	return _mm256_add_pd(_mm512_mask_extractf64x4_pd(zero, 0xF, a, 0), _mm512_mask_extractf64x4_pd(zero, 0xF, a, 1));
+}
+
+/** number of full 8-wide vectors and mask of the last partial vector in a row */
+#define NVEC8 (NSTATES / 8)
+#define TAIL_MASK ((__mmask8) ((1 << (NSTATES % 8)) - 1))
+
+template<int NSTATES>
+static inline void loadChild(const double *partial_lh_child, __m512d *child) {
+	for (int i = 0; i < NVEC8; i++)
+		child[i] = _mm512_loadu_pd(partial_lh_child + i * 8);
+	if (NSTATES % 8)
+		child[NVEC8] = _mm512_maskz_loadu_pd(TAIL_MASK, partial_lh_child + NVEC8 * 8);
+}
+
+template<int NSTATES>
+static inline __m512d productRow(const double *row, const __m512d *child) {
+	__m512d a;
+	if (NSTATES % 8)
+		a = _mm512_mul_pd(_mm512_maskz_loadu_pd(TAIL_MASK, row + NVEC8 * 8), child[NVEC8]);
+	else
+		a = _mm512_setzero_pd();
+	for (int i = 0; i < NVEC8; i++)
+		a = _mm512_fmadd_pd(_mm512_loadu_pd(row + i * 8), child[i], a);
+	return a;
+}
+
+/**
+	4 consecutive entries of trans_mat * child, starting at row trans_row
+*/
+template<int NSTATES>
+static inline __m256d productRows4(const double *trans_row, const __m512d *child) {
+	return horizontalAdd4(foldHalves(productRow<NSTATES>(trans_row, child)),
+			foldHalves(productRow<NSTATES>(trans_row + NSTATES, child)),
+			foldHalves(productRow<NSTATES>(trans_row + 2 * NSTATES, child)),
+			foldHalves(productRow<NSTATES>(trans_row + 3 * NSTATES, child)));
+}
+
+template<int NSTATES>
+static void partialLhProductAVX512(double *partial_lh, const double *partial_lh_child, const double *trans_mat,
+		int ncat) {
+	__m512d child[NVEC8 + 1];
+	for (int cat = 0; cat < ncat; cat++) {
+		loadChild<NSTATES>(partial_lh_child, child);
+		for (int j = 0; j < NSTATES; j += 4) {
+			__m256d prod = productRows4<NSTATES>(trans_mat + j * NSTATES, child);
+			_mm256_storeu_pd(partial_lh + j, _mm256_mul_pd(_mm256_loadu_pd(partial_lh + j), prod));
+		}
+		partial_lh += NSTATES;
+		partial_lh_child += NSTATES;
+		trans_mat += NSTATES * NSTATES;
+	}
+}
+
+template<int NSTATES>
+static double branchLhAVX512(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+		int ncat) {
+	__m512d child[NVEC8 + 1];
+	__m256d lh = _mm256_setzero_pd();
+	for (int cat = 0; cat < ncat; cat++) {
+		loadChild<NSTATES>(partial_lh_child, child);
+		for (int j = 0; j < NSTATES; j += 4)
+			lh = _mm256_fmadd_pd(productRows4<NSTATES>(trans_mat + j * NSTATES, child),
+					_mm256_loadu_pd(partial_lh_site + j), lh);
+		partial_lh_site += NSTATES;
+		partial_lh_child += NSTATES;
+		trans_mat += NSTATES * NSTATES;
+	}
+	return horizontalAdd(lh);
+}
+
+template<int NSTATES>
+static double branchDervAVX512(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+		const double *trans_derv1, const double *trans_derv2, int ncat, double &lh_derv1, double &lh_derv2) {
+	__m512d child[NVEC8 + 1];
+	__m256d lh = _mm256_setzero_pd();
+	__m256d derv1 = _mm256_setzero_pd();
+	__m256d derv2 = _mm256_setzero_pd();
+	for (int cat = 0; cat < ncat; cat++) {
+		loadChild<NSTATES>(partial_lh_child, child);
+		for (int j = 0; j < NSTATES; j += 4) {
+			__m256d site = _mm256_loadu_pd(partial_lh_site + j);
+			lh = _mm256_fmadd_pd(productRows4<NSTATES>(trans_mat + j * NSTATES, child), site, lh);
+			derv1 = _mm256_fmadd_pd(productRows4<NSTATES>(trans_derv1 + j * NSTATES, child), site, derv1);
+			derv2 = _mm256_fmadd_pd(productRows4<NSTATES>(trans_derv2 + j * NSTATES, child), site, derv2);
+		}
+		partial_lh_site += NSTATES;
+		partial_lh_child += NSTATES;
+		trans_mat += NSTATES * NSTATES;
+		trans_derv1 += NSTATES * NSTATES;
+		trans_derv2 += NSTATES * NSTATES;
+	}
+	lh_derv1 = horizontalAdd(derv1);
+	lh_derv2 = horizontalAdd(derv2);
+	return horizontalAdd(lh);
+}
+
+/**
+	entries trans_row[i] in the lower and trans_row[i+1] in the upper 4 lanes
+*/
+static inline __m512d broadcastPair(const double *trans_row) {
+	return _mm512_mask_blend_pd(0xF0, _mm512_set1_pd(trans_row[0]), _mm512_set1_pd(trans_row[1]));
+}
+
+/**
+	4 rows of trans_mat * child for one block of LH_BLOCK_PATTERNS patterns (pattern-blocked layout),
+	child points to NSTATES vectors of LH_BLOCK_PATTERNS patterns each. Two states are
+	processed per 8-wide vector, NSTATES must be even
+*/
+template<int NSTATES>
+static inline void productRowsBlock4(const double *trans_row, const double *child, __m256d *prod) {
+	const double *row0 = trans_row, *row1 = row0 + NSTATES, *row2 = row1 + NSTATES, *row3 = row2 + NSTATES;
+	__m512d c = _mm512_loadu_pd(child);
+	__m512d a0 = _mm512_mul_pd(broadcastPair(row0), c);
+	__m512d a1 = _mm512_mul_pd(broadcastPair(row1), c);
+	__m512d a2 = _mm512_mul_pd(broadcastPair(row2), c);
+	__m512d a3 = _mm512_mul_pd(broadcastPair(row3), c);
+	for (int i = 2; i < NSTATES; i += 2) {
+		c = _mm512_loadu_pd(child + i * LH_BLOCK_PATTERNS);
+		a0 = _mm512_fmadd_pd(broadcastPair(row0 + i), c, a0);
+		a1 = _mm512_fmadd_pd(broadcastPair(row1 + i), c, a1);
+		a2 = _mm512_fmadd_pd(broadcastPair(row2 + i), c, a2);
+		a3 = _mm512_fmadd_pd(broadcastPair(row3 + i), c, a3);
+	}
+	prod[0] = foldHalves(a0);
+	prod[1] = foldHalves(a1);
+	prod[2] = foldHalves(a2);
+	prod[3] = foldHalves(a3);
+}
+
+/**
+	sum_j prod[j] * site[j] over 4 rows starting at site
+*/
+static inline __m256d dotRowsBlock4(const __m256d *prod, const double *site, __m256d sum) {
+	for (int k = 0; k < 4; k++)
+		sum = _mm256_fmadd_pd(prod[k], _mm256_loadu_pd(site + k * LH_BLOCK_PATTERNS), sum);
+	return sum;
+}
+
+template<int NSTATES>
+static void partialLhProductBlockAVX512(double *partial_lh, const double *partial_lh_child, const double *trans_mat,
+		int ncat) {
+	__m256d prod[4];
+	for (int cat = 0; cat < ncat; cat++) {
+		for (int j = 0; j < NSTATES; j += 4) {
+			productRowsBlock4<NSTATES>(trans_mat + j * NSTATES, partial_lh_child, prod);
+			double *site = partial_lh + j * LH_BLOCK_PATTERNS;
+			for (int k = 0; k < 4; k++)
+				_mm256_storeu_pd(site + k * LH_BLOCK_PATTERNS,
+						_mm256_mul_pd(_mm256_loadu_pd(site + k * LH_BLOCK_PATTERNS), prod[k]));
+		}
+		partial_lh += NSTATES * LH_BLOCK_PATTERNS;
+		partial_lh_child += NSTATES * LH_BLOCK_PATTERNS;
+		trans_mat += NSTATES * NSTATES;
+	}
+}
+
+template<int NSTATES>
+static void branchLhBlockAVX512(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+		int ncat, double *lh) {
+	__m256d prod[4];
+	__m256d lh_block = _mm256_setzero_pd();
+	for (int cat = 0; cat < ncat; cat++) {
+		for (int j = 0; j < NSTATES; j += 4) {
+			productRowsBlock4<NSTATES>(trans_mat + j * NSTATES, partial_lh_child, prod);
+			lh_block = dotRowsBlock4(prod, partial_lh_site + j * LH_BLOCK_PATTERNS, lh_block);
+		}
+		partial_lh_site += NSTATES * LH_BLOCK_PATTERNS;
+		partial_lh_child += NSTATES * LH_BLOCK_PATTERNS;
+		trans_mat += NSTATES * NSTATES;
+	}
+	_mm256_storeu_pd(lh, lh_block);
+}
+
+template<int NSTATES>
+static void branchDervBlockAVX512(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+		const double *trans_derv1, const double *trans_derv2, int ncat, double *lh, double *lh_derv1,
+		double *lh_derv2) {
+	__m256d prod[4];
+	__m256d lh_block = _mm256_setzero_pd();
+	__m256d derv1 = _mm256_setzero_pd();
+	__m256d derv2 = _mm256_setzero_pd();
+	for (int cat = 0; cat < ncat; cat++) {
+		for (int j = 0; j < NSTATES; j += 4) {
+			const double *site = partial_lh_site + j * LH_BLOCK_PATTERNS;
+			productRowsBlock4<NSTATES>(trans_mat + j * NSTATES, partial_lh_child, prod);
+			lh_block = dotRowsBlock4(prod, site, lh_block);
+			productRowsBlock4<NSTATES>(trans_derv1 + j * NSTATES, partial_lh_child, prod);
+			derv1 = dotRowsBlock4(prod, site, derv1);
+			productRowsBlock4<NSTATES>(trans_derv2 + j * NSTATES, partial_lh_child, prod);
+			derv2 = dotRowsBlock4(prod, site, derv2);
+		}
+		partial_lh_site += NSTATES * LH_BLOCK_PATTERNS;
+		partial_lh_child += NSTATES * LH_BLOCK_PATTERNS;
+		trans_mat += NSTATES * NSTATES;
+		trans_derv1 += NSTATES * NSTATES;
+		trans_derv2 += NSTATES * NSTATES;
+	}
+	_mm256_storeu_pd(lh, lh_block);
+	_mm256_storeu_pd(lh_derv1, derv1);
+	_mm256_storeu_pd(lh_derv2, derv2);
+}
+
+void getLikelihoodKernelAVX512(int nstates, LikelihoodKernelFuncs &funcs) {
+	switch (nstates) {
+	case 4:
+		// too few states to fill the 8-wide vectors of a single pattern, AVX2 is used instead
+		funcs.partialLhProduct = NULL;
+		funcs.branchLh = NULL;
+		funcs.branchDerv = NULL;
+		funcs.partialLhProductBlock = partialLhProductBlockAVX512<4>;
+		funcs.branchLhBlock = branchLhBlockAVX512<4>;
+		funcs.branchDervBlock = branchDervBlockAVX512<4>;
+		break;
+	case 20:
+		funcs.partialLhProduct = partialLhProductAVX512<20>;
+		funcs.branchLh = branchLhAVX512<20>;
+		funcs.branchDerv = branchDervAVX512<20>;
+		funcs.partialLhProductBlock = partialLhProductBlockAVX512<20>;
+		funcs.branchLhBlock = branchLhBlockAVX512<20>;
+		funcs.branchDervBlock = branchDervBlockAVX512<20>;
+		break;
+	default:
+		funcs.partialLhProduct = NULL;
+		funcs.branchLh = NULL;
+		funcs.branchDerv = NULL;
+		funcs.partialLhProductBlock = NULL;
+		funcs.branchLhBlock = NULL;
+		funcs.branchDervBlock = NULL;
+		break;
+	}
+}
@@ -10,7 +10,29 @@
 //
 //
 #include "phylonode.h"
+#include "memarena.h"
 
+PhyloNeighbor::~PhyloNeighbor() {
+	deleteTransMatrix();
+	if (site_repeat)
+		delete [] site_repeat;
+	if (partial_lh_slot && partial_lh_slot->owner == this)
+		partial_lh_slot->owner = NULL;
+}
+
+void PhyloNeighbor::initTransMatrix() {
+	trans_mat = NULL;
+	trans_derv = NULL;
+	trans_mat_size = 0;
+	trans_mat_length = trans_derv_length = -1.0;
+	trans_mat_version = trans_derv_version = 0;
+}
+
+void PhyloNeighbor::deleteTransMatrix() {
+	if (trans_mat)
+		MemArena::release(trans_mat);
+	initTransMatrix();
+}
 
 void PhyloNeighbor::clearForwardPartialLh(Node *dad) {
 	clearPartialLh();
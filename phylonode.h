@@ -12,9 +12,33 @@
 #ifndef PHYLONODE_H
 #define PHYLONODE_H
 
+#include <stdint.h>
 #include "node.h"
 
-typedef short int UBYTE;
+/**
+    per-pattern sum of scaling exponents, see PhyloNeighbor::scale_num. 32 bits wide as every scaling
+    adds an exponent of several hundreds
+*/
+typedef int32_t ScaleNum;
+
+/**
+    value of PhyloNeighbor::partial_lh_computed for a vector invalidated by PhyloTree::markBranchDirty()
+*/
+#define PARTIAL_LH_DIRTY 4
+
+class PhyloNeighbor;
+
+/**
+    one block of the memory-bounded pool of partial likelihood vectors, see PhyloTree::lh_mem_limit
+*/
+struct PartialLhSlot {
+    /** memory of the block */
+    double *partial_lh;
+    /** neighbor the block is assigned to, NULL if the block is free */
+    PhyloNeighbor *owner;
+    /** neighbors in the list of PhyloTree::partial_lh_lru_first, ordered by the time of the last use */
+    PartialLhSlot *lru_prev, *lru_next;
+};
 
 /**
 A neighbor in a phylogenetic tree
@@ -41,6 +65,13 @@ public:
         partial_lh_computed = 0;
         lh_scale_factor = 0.0;
         partial_pars = NULL;
+        site_repeat = NULL;
+        num_site_repeats = 0;
+        site_repeat_lh = NULL;
+        dirty_path_epoch = -1;
+        partial_lh_slot = NULL;
+        partial_lh_pinned = 0;
+        initTransMatrix();
     }
 
     /**
@@ -54,8 +85,21 @@ public:
         partial_lh_computed = 0;
         lh_scale_factor = 0.0;
         partial_pars = NULL;
+        site_repeat = NULL;
+        num_site_repeats = 0;
+        site_repeat_lh = NULL;
+        dirty_path_epoch = -1;
+        partial_lh_slot = NULL;
+        partial_lh_pinned = 0;
+        initTransMatrix();
     }
 
+    /**
+        destructor, free the cached transition matrices and site repeats
+        and give the block of the memory-bounded pool back
+     */
+    virtual ~PhyloNeighbor();
+
     /**
         tell that the partial likelihood vector is not computed
      */
@@ -76,33 +120,107 @@ public:
      */
     void clearForwardPartialLh(Node *dad);
 
+    /**
+        release the transition matrix cache, see PhyloTree::prepareTransMatrix()
+     */
+    void deleteTransMatrix();
+
 private:
 
     /**
-        true if the partial likelihood was computed
+        initialize the transition matrix cache as empty
+     */
+    void initTransMatrix();
+
+    /**
+        bit 1 set if the partial likelihood was computed, bit 2 set if the partial parsimony was computed,
+        PARTIAL_LH_DIRTY if invalidated by PhyloTree::markBranchDirty()
      */
     int partial_lh_computed;
 
+    /**
+        epoch of PhyloTree::markBranchDirty() in which partial_lh_computed was set to PARTIAL_LH_DIRTY
+     */
+    int dirty_path_epoch;
+
     /**
         vector containing the partial likelihoods
      */
     double *partial_lh;
 
+    /**
+        block of the memory-bounded pool holding partial_lh, NULL if the storage is not bounded
+     */
+    PartialLhSlot *partial_lh_slot;
+
+    /**
+        number of likelihood computations in progress that need partial_lh,
+        a pinned vector is not evicted from the memory-bounded pool
+     */
+    int partial_lh_pinned;
+
     /**
         likelihood scaling factor
      */
     double lh_scale_factor;
 
     /**
-        vector containing number of scaling events per pattern // NEW!
+        vector containing the sum of the scaling exponents per pattern (the partial likelihoods were
+        multiplied by 2^scale_num), -1 for patterns ignored because of gaps
      */
-    UBYTE *scale_num;
+    ScaleNum *scale_num;
 
     /**
         vector containing the partial parsimony scores
      */
     UINT *partial_pars;
 
+    /**
+        transition matrices of all rate categories for the branch length, cached by PhyloTree::getTransMatrix().
+        Only one neighbor of a branch holds the cache (see PhyloTree::prepareTransMatrix()), the other has NULL
+     */
+    double *trans_mat;
+
+    /**
+        transition matrices times state frequencies and their 1st and 2nd derivatives
+        (3 consecutive blocks of the size of trans_mat), cached by PhyloTree::getTransDervFreq().
+        Allocated in one block with trans_mat
+     */
+    double *trans_derv;
+
+    /**
+        number of entries of trans_mat
+     */
+    int trans_mat_size;
+
+    /**
+        branch length and PhyloTree::trans_version for which trans_mat was computed
+     */
+    double trans_mat_length;
+    int trans_mat_version;
+
+    /**
+        branch length and PhyloTree::trans_version for which trans_derv was computed
+     */
+    double trans_derv_length;
+    int trans_derv_version;
+
+    /**
+        class of site repeats of each pattern, followed by the first pattern of each class,
+        see PhyloTree::computeSiteRepeats()
+     */
+    int *site_repeat;
+
+    /**
+        number of classes in site_repeat, 0 if not computed
+     */
+    int num_site_repeats;
+
+    /**
+        partial_lh for which site_repeat was computed, the classes are invalid if partial_lh was replaced
+     */
+    double *site_repeat_lh;
+
 };
 
 /**
@@ -185,6 +185,13 @@ void PhyloSuperTree::setParams(Params &params) {
 	for (iterator it = begin(); it != end(); it++) {
 		(*it)->params = &params;
 		(*it)->sse = params.SSE;
+		if (!params.AVX)
+			(*it)->lk_kernel = LK_SSE3;
+		(*it)->lh_layout = params.lh_block_layout ? LH_LAYOUT_BLOCKED : LH_LAYOUT_PATTERN;
+		// edge-linked partitions copy partial likelihoods between neighbors as doubles
+		(*it)->lh_float = params.partition_type ? 0 : params.lh_float;
+		(*it)->site_repeats = params.partition_type ? false : params.site_repeats;
+		(*it)->lh_slice_traversal = params.lh_slice_traversal;
 		(*it)->optimize_by_newton = params.optimize_by_newton;
 	}
 	
@@ -212,6 +219,11 @@ int PhyloSuperTree::getAlnNSite() {
 	return num;
 }
 
+void PhyloSuperTree::updateTipStates() {
+	for (iterator it = begin(); it != end(); it++)
+		(*it)->updateTipStates();
+}
+
 double PhyloSuperTree::computeDist(int seq1, int seq2, double initial_dist, double &var) {
     // if no model or site rate is specified, return JC distance
     if (initial_dist == 0.0) {
@@ -405,13 +417,17 @@ void PhyloSuperTree::mapTrees() {
 }
 
 double PhyloSuperTree::computeLikelihood(double *pattern_lh) {
-	double tree_lh = 0.0;
 	int ntrees = size();
+	// partition scores are added up in a fixed order, independent of the number of threads
+	DoubleVector part_lh(ntrees);
 	#ifdef _OPENMP
-	#pragma omp parallel for reduction(+: tree_lh)
+	#pragma omp parallel for
 	#endif
 	for (int i = 0; i < ntrees; i++)
-		tree_lh += at(i)->computeLikelihood();
+		part_lh[i] = at(i)->computeLikelihood();
+	double tree_lh = 0.0;
+	for (int i = 0; i < ntrees; i++)
+		tree_lh += part_lh[i];
 	return tree_lh;
 }
 
@@ -439,16 +455,19 @@ void PhyloSuperTree::computePatternLikelihood(double *pattern_lh, double *cur_lo
 }
 
 double PhyloSuperTree::optimizeAllBranches(int my_iterations, double tolerance) {
-	double tree_lh = 0.0;
 	int ntrees = size();
+	DoubleVector part_lh(ntrees);
 	#ifdef _OPENMP
-	#pragma omp parallel for reduction(+: tree_lh)
+	#pragma omp parallel for
 	#endif
 	for (int i = 0; i < ntrees; i++) {
-		tree_lh += at(i)->optimizeAllBranches(my_iterations, tolerance);
+		part_lh[i] = at(i)->optimizeAllBranches(my_iterations, tolerance);
 		if (verbose_mode >= VB_MAX)
 			at(i)->printTree(cout, WT_BR_LEN + WT_NEWLINE);
 	}
+	double tree_lh = 0.0;
+	for (int i = 0; i < ntrees; i++)
+		tree_lh += part_lh[i];
 
 	if (my_iterations >= 100) computeBranchLengths();
 	return tree_lh;
@@ -583,11 +602,11 @@ NNIMove PhyloSuperTree::getBestNNIForBran(PhyloNode *node1, PhyloNode *node2, NN
 
 	//double bestScore = optimizeOneBranch(node1, node2, false);
 
-	double nni1_score = 0.0, nni2_score = 0.0;
 	int ntrees = size(), part;
+	DoubleVector part_nni1_score(ntrees), part_nni2_score(ntrees);
 
 	#ifdef _OPENMP
-	#pragma omp parallel for reduction(+: nni1_score, nni2_score) private(part)
+	#pragma omp parallel for private(part)
 	#endif
 	for (part = 0; part < ntrees; part++) {
 		bool is_nni = true;
@@ -603,8 +622,8 @@ NNIMove PhyloSuperTree::getBestNNIForBran(PhyloNode *node1, PhyloNode *node2, NN
 				if (save_all_trees == 2)
 					at(part)->computePatternLikelihood(part_info[part].cur_ptnlh, &part_info[part].cur_score);
 			}
-			nni1_score += part_info[part].cur_score;
-			nni2_score += part_info[part].cur_score;
+			part_nni1_score[part] = part_info[part].cur_score;
+			part_nni2_score[part] = part_info[part].cur_score;
 			continue;
 		}
 
@@ -645,8 +664,8 @@ NNIMove PhyloSuperTree::getBestNNIForBran(PhyloNode *node1, PhyloNode *node2, NN
 			part_info[part].nniMoves[0] = part_info[part].nniMoves[1];
 			part_info[part].nniMoves[1] = tmp;
 		}
-		nni1_score += part_info[part].nniMoves[0].newloglh;
-		nni2_score += part_info[part].nniMoves[1].newloglh;
+		part_nni1_score[part] = part_info[part].nniMoves[0].newloglh;
+		part_nni2_score[part] = part_info[part].nniMoves[1].newloglh;
 		int numlen = 1;
 		if (params->nni5Branches) numlen = 5;
 		for (int i = 0; i < numlen; i++) {
@@ -655,6 +674,11 @@ NNIMove PhyloSuperTree::getBestNNIForBran(PhyloNode *node1, PhyloNode *node2, NN
 		}
 
 	}
+	double nni1_score = 0.0, nni2_score = 0.0;
+	for (part = 0; part < ntrees; part++) {
+		nni1_score += part_nni1_score[part];
+		nni2_score += part_nni2_score[part];
+	}
 	myMove.node1Nei_it = node1->findNeighborIt(node1_nei->node);
 	myMove.node1 = node1;
 	myMove.node2 = node2;
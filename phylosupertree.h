@@ -99,6 +99,11 @@ public:
      */
     virtual double computeDist(int seq1, int seq2, double initial_dist, double &var);
 
+    /**
+            build the leaf states of all partitions, the super tree itself has none
+     */
+    virtual void updateTipStates();
+
 	/**
 		create sub-trees T|Y_1,...,T|Y_k of the current super-tree T
 		and map F={f_1,...,f_k} the edges of supertree T to edges of subtrees T|Y_i
@@ -419,7 +419,14 @@ double PhyloSuperTreePlen::computeFuncDerv(double value, double &df, double &ddf
 					cout<<"NEGATIVE BRANCH len = "<<nei1_part->length<<endl<<" rate = "<<part_info[part].part_rate<<endl;
 					outError("shit!!   ",__func__);
 				}
-				part_info[part].cur_score = at(part)->computeLikelihoodDerv(nei2_part,(PhyloNode*)nei1_part->node, df_aux, ddf_aux);
+				if (at(part)->isFastBranchOpt()) {
+					if (!at(part)->theta_computed) {
+						at(part)->computeTheta(nei2_part,(PhyloNode*)nei1_part->node);
+						at(part)->theta_computed = true;
+					}
+					part_info[part].cur_score = at(part)->computeLikelihoodDervFast(nei2_part,(PhyloNode*)nei1_part->node, df_aux, ddf_aux);
+				} else
+					part_info[part].cur_score = at(part)->computeLikelihoodDerv(nei2_part,(PhyloNode*)nei1_part->node, df_aux, ddf_aux);
 				tree_lh += part_info[part].cur_score;
 				df -= part_info[part].part_rate*df_aux;
 				ddf -= part_info[part].part_rate*part_info[part].part_rate*ddf_aux;
@@ -915,6 +922,7 @@ double PhyloSuperTreePlen::swapNNIBranch(double cur_score, PhyloNode *node1, Phy
 								if (nei_link != saved_nei[0]->link_neighbors[part]->node && nei_link != saved_nei[1]->link_neighbors[part]->node) {
 									PhyloNeighbor *thisnei = ((PhyloNeighbor*) (*sub_saved_it[part*6 + id]));
 									memcpy(thisnei->partial_lh, savednei->partial_lh, at(part)->getPartialLhBytes());
+									at(part)->invalidateUnpackedLh();
 									memcpy(thisnei->scale_num , savednei->scale_num , at(part)->getScaleNumBytes());
 									thisnei->lh_scale_factor = savednei->lh_scale_factor;
 									thisnei->partial_lh_computed = savednei->partial_lh_computed;
@@ -924,6 +932,7 @@ double PhyloSuperTreePlen::swapNNIBranch(double cur_score, PhyloNode *node1, Phy
 								// Minh: for efficiency, if previous branch maps to NULL or after relinking it maps to the same branch, reuse partial_lh
 								PhyloNeighbor *thisnei = ((PhyloNeighbor*) (*sub_saved_it[part*6 + id]));
 								memcpy(thisnei->partial_lh, savednei->partial_lh, at(part)->getPartialLhBytes());
+								at(part)->invalidateUnpackedLh();
 								memcpy(thisnei->scale_num , savednei->scale_num , at(part)->getScaleNumBytes());
 								thisnei->lh_scale_factor = savednei->lh_scale_factor;
 								thisnei->partial_lh_computed = savednei->partial_lh_computed;
@@ -16,6 +16,7 @@
 #include "alignmentpairwise.h"
 #include <algorithm>
 #include <limits>
+#include <float.h>
 #include "timeutil.h"
 
 //const static int BINARY_SCALE = floor(log2(1/SCALING_THRESHOLD));
@@ -27,19 +28,20 @@
 
 void SPRMoves::add(PhyloNode *prune_node, PhyloNode *prune_dad, PhyloNode *regraft_node, PhyloNode *regraft_dad,
         double score) {
-    if (size() >= MAX_SPR_MOVES && score <= rbegin()->score)
-        return;
-    if (size() >= MAX_SPR_MOVES) {
-        iterator it = end();
-        it--;
-        erase(it);
-    }
     SPRMove spr;
     spr.prune_node = prune_node;
     spr.prune_dad = prune_dad;
     spr.regraft_node = regraft_node;
     spr.regraft_dad = regraft_dad;
     spr.score = score;
+    // the kept moves do not depend on the order in which they are added
+    if (size() >= MAX_SPR_MOVES && !key_comp()(spr, *rbegin()))
+        return;
+    if (size() >= MAX_SPR_MOVES) {
+        iterator it = end();
+        it--;
+        erase(it);
+    }
     insert(spr);
 }
 
@@ -58,6 +60,10 @@ void PhyloTree::init() {
     site_rate = NULL;
     optimize_by_newton = true;
     central_partial_lh = NULL;
+    central_tip_partial_lh = NULL;
+    central_partial_lh_size = central_tip_partial_lh_size = 0;
+    num_tip_states = 0;
+    tip_partial_lh_state = NULL;
     central_scale_num = NULL;
     central_partial_pars = NULL;
     model_factory = NULL;
@@ -71,12 +77,45 @@ void PhyloTree::init() {
     tmp_scale_num2 = NULL;
     discard_saturated_site = true;
     _pattern_lh = NULL;
+    _pattern_lh_derv = NULL;
+    ptn_invar = NULL;
+    ptn_invar_aln = NULL;
+    ptn_invar_version = 0;
+    ptn_invar_pinv = 0.0;
+    tip_states = NULL;
+    tip_states_stride = 0;
+    tip_states_aln = NULL;
+    tip_states_nptn = 0;
     root_state = STATE_UNKNOWN;
     theta_all = NULL;
+    theta_computed = false;
     subTreeDistComputed = false;
     dist_matrix = NULL;
     sse = true; // FOR TUNG: you forgot to initialize this variable!
+    lk_kernel = detectLikelihoodKernel();
+    lh_layout = LH_LAYOUT_BLOCKED;
+    lh_float = 0;
+    site_repeats = false;
+    lh_slice_traversal = true;
+    float_partial_lh = false;
+    float_scratch_lh = NULL;
+    invalidateUnpackedLh();
+    num_float_fallback = 0;
+    dirty_path_epoch = 0;
+    num_partial_lh_dirty = num_partial_lh_computed = num_partial_lh_reused = 0;
+    lh_mem_limit = 0;
+    partial_lh_slots = NULL;
+    num_partial_lh_slots = 0;
+    partial_lh_lru_first = partial_lh_lru_last = NULL;
+    num_partial_lh_evicted = num_partial_lh_overflow = 0;
+    scaling_threshold = SCALING_THRESHOLD;
+    tmp_trans_mat_freq = NULL;
+    tmp_trans_mat_freq_size = 0;
+    trans_version = 1;
+    partial_lh_version = 0;
+    trans_model_version = 0;
     save_all_trees = 0;
+    shares_model = false;
 }
 
 PhyloTree::PhyloTree(Alignment *aln) :
@@ -90,9 +129,25 @@ void PhyloTree::discardSaturatedSite(bool val) {
 }
 
 PhyloTree::~PhyloTree() {
-    if (central_partial_lh)
-        delete[] central_partial_lh;
+    for (vector<PhyloTree*>::reverse_iterator it = thread_trees.rbegin(); it != thread_trees.rend(); it++)
+        delete (*it);
+    thread_trees.clear();
+    // the neighbors are deleted later and must not touch the pool any more
+    clearPartialLhSlots();
+    if (partial_lh_slots)
+        delete[] partial_lh_slots;
+    partial_lh_slots = NULL;
+    MemArena::release(central_partial_lh);
     central_partial_lh = NULL;
+    invalidateUnpackedLh();
+    MemArena::release(central_tip_partial_lh);
+    central_tip_partial_lh = NULL;
+    for (vector<double*>::iterator it = extra_partial_lh.begin(); it != extra_partial_lh.end(); it++)
+        delete[] (*it);
+    extra_partial_lh.clear();
+    if (tip_partial_lh_state)
+        delete[] tip_partial_lh_state;
+    tip_partial_lh_state = NULL;
     if (central_scale_num)
         delete[] central_scale_num;
     central_scale_num = NULL;
@@ -100,16 +155,19 @@ PhyloTree::~PhyloTree() {
     if (central_partial_pars)
         delete[] central_partial_pars;
     central_partial_pars = NULL;
-    if (model_factory)
+    if (model_factory && !shares_model)
         delete model_factory;
-    if (model)
+    if (model && !shares_model)
         delete model;
-    if (site_rate)
+    if (site_rate && !shares_model)
         delete site_rate;
     if (tmp_scale_num1)
         delete[] tmp_scale_num1;
     if (tmp_scale_num2)
         delete[] tmp_scale_num2;
+    if (tmp_trans_mat_freq)
+        MemArena::release(tmp_trans_mat_freq);
+    MemArena::release(float_scratch_lh);
     if (tmp_partial_lh1)
         delete[] tmp_partial_lh1;
     if (tmp_partial_lh2)
@@ -120,12 +178,13 @@ PhyloTree::~PhyloTree() {
         delete[] tmp_anscentral_state_prob2;
     //if (tmp_ptn_rates)
     //	delete [] tmp_ptn_rates;
-    if (_pattern_lh)
-        delete[] _pattern_lh;
+    MemArena::release(_pattern_lh);
+    MemArena::release(_pattern_lh_derv);
+    MemArena::release(ptn_invar);
+    MemArena::release(tip_states);
     //if (state_freqs)
     //	delete [] state_freqs;
-    if (theta_all)
-        delete[] theta_all;
+    MemArena::release(theta_all);
     if (dist_matrix)
     	delete[] dist_matrix;
 }
@@ -164,8 +223,61 @@ void PhyloTree::copyPhyloTree(PhyloTree *tree) {
     setAlignment(tree->aln);
 }
 
+void PhyloTree::copyWorkingTree(PhyloTree *tree) {
+    bool same_nodes = root && nodeNum == tree->nodeNum && aln == tree->aln && model == tree->model
+            && site_rate == tree->site_rate && getCentralBlockSize() == tree->getCentralBlockSize();
+    if (same_nodes) {
+        // keep the vectors that are still valid from the previous copy
+        TreeSnapshot snapshot;
+        tree->saveSnapshot(snapshot);
+        restoreSnapshot(snapshot);
+        curScore = tree->curScore;
+        return;
+    }
+    // the neighbors are deleted with the old nodes and must not touch the pool any more
+    clearPartialLhSlots();
+    copyTreeExact(tree);
+    params = tree->params;
+    aln = tree->aln;
+    model = tree->model;
+    model_factory = tree->model_factory;
+    site_rate = tree->site_rate;
+    shares_model = true;
+    optimize_by_newton = tree->optimize_by_newton;
+    discard_saturated_site = tree->discard_saturated_site;
+    sse = tree->sse;
+    lk_kernel = tree->lk_kernel;
+    lh_layout = tree->lh_layout;
+    lh_float = tree->lh_float;
+    lh_mem_limit = tree->lh_mem_limit;
+    site_repeats = tree->site_repeats;
+    lh_slice_traversal = tree->lh_slice_traversal;
+    curScore = tree->curScore;
+    initializeAllPartialLh();
+    clearAllPartialLH();
+}
+
+void PhyloTree::restoreSnapshot(TreeSnapshot &snapshot, NodeVector *changed_nodes) {
+    NodeVector changed;
+    MTree::restoreSnapshot(snapshot, &changed);
+    if (!central_partial_lh || isSuperTree()) {
+        // super trees: the partition trees are mapped again by the caller
+        initializeAllPartialLh();
+        clearAllPartialLH();
+    } else {
+        for (NodeVector::iterator it = changed.begin(); it != changed.end(); it++) {
+            FOR_NEIGHBOR_IT(*it, NULL, nei)
+                markBranchDirty((PhyloNode*) (*it), (PhyloNode*) (*nei)->node, true);
+        }
+    }
+    if (changed_nodes)
+        changed_nodes->insert(changed_nodes->end(), changed.begin(), changed.end());
+}
+
 void PhyloTree::setAlignment(Alignment *alignment) {
     aln = alignment;
+    // tip states have to be recomputed for the new alignment
+    num_tip_states = 0;
     //alnSize = aln->size();
     //ptn_freqs.resize(alnSize);
     //numStates = aln->num_states;
@@ -190,6 +302,10 @@ void PhyloTree::setAlignment(Alignment *alignment) {
         assert(node->isLeaf());
         node->id = seq;
     }
+    // the alignment may have been changed in place
+    ptn_invar_aln = NULL;
+    tip_states_aln = NULL;
+    updateTipStates();
 }
 
 void PhyloTree::rollBack(istream &best_tree_string) {
@@ -240,8 +356,55 @@ void PhyloTree::clearAllPartialLH() {
     ((PhyloNode*) root->neighbors[0]->node)->clearAllPartialLh((PhyloNode*) root);
 }
 
+void PhyloTree::markBranchDirty(PhyloNode *node1, PhyloNode *node2, bool topology_changed) {
+    // after a topology change the vectors around the branch contain other vectors than at the time
+    // they were marked, so the walk must not stop there
+    int force_depth = topology_changed ? 2 : 0;
+    num_partial_lh_dirty += markReversePartialLhDirty(node1, node2, force_depth);
+    num_partial_lh_dirty += markReversePartialLhDirty(node2, node1, force_depth);
+}
+
+int PhyloTree::markReversePartialLhDirty(PhyloNode *node, PhyloNode *dad, int force_depth) {
+    PhyloNeighbor *node_nei = (PhyloNeighbor*) node->findNeighbor(dad);
+    assert(node_nei);
+    // the vectors containing this one were marked together with it. This does not hold for vectors
+    // of leaves, which are left unmarked when the SSE kernels use tip lookup tables instead
+    if (force_depth <= 0 && !dad->isLeaf() && node_nei->partial_lh_computed == PARTIAL_LH_DIRTY &&
+            node_nei->dirty_path_epoch == dirty_path_epoch)
+        return 0;
+    int num_dirty = node_nei->partial_lh_computed & 1;
+    // the vector has to be recomputed anyway, evict it before the valid ones
+    if (num_dirty && node_nei->partial_lh_slot)
+        touchPartialLhSlot(node_nei->partial_lh_slot, false);
+    node_nei->partial_lh_computed = PARTIAL_LH_DIRTY;
+    node_nei->dirty_path_epoch = dirty_path_epoch;
+    FOR_NEIGHBOR_IT(node, dad, it)
+        num_dirty += markReversePartialLhDirty((PhyloNode*) (*it)->node, node, force_depth - 1);
+    return num_dirty;
+}
+
+void PhyloTree::countReusedPartialLh(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    PhyloNeighbor *node_branch = (PhyloNeighbor*) dad_branch->node->findNeighbor(dad);
+    if (dad_branch->partial_lh_computed & 1)
+        num_partial_lh_reused++;
+    if (node_branch->partial_lh_computed & 1)
+        num_partial_lh_reused++;
+}
+
+void PhyloTree::writePartialLhInfo(ostream &out) {
+    out << "Partial likelihood vectors: " << num_partial_lh_computed << " computed, "
+        << num_partial_lh_reused << " reused, " << num_partial_lh_dirty << " invalidated by dirty-path tracking" << endl;
+    if (partial_lh_slots)
+        out << "Partial likelihood pool: " << num_partial_lh_slots << " blocks for " << (leafNum - 1) * 3
+            << " vectors, " << num_partial_lh_evicted << " evicted, " << num_partial_lh_overflow
+            << " allocated beyond the limit" << endl;
+}
+
 void PhyloTree::computeAllPartialLh(PhyloNode *node, PhyloNode *dad) {
-	if (!node) node = (PhyloNode*)root;
+	if (!node) {
+		updatePartialLhVersion();
+		node = (PhyloNode*)root;
+	}
 	FOR_NEIGHBOR_IT(node, dad, it) {
 		if ((((PhyloNeighbor*)*it)->partial_lh_computed & 1) == 0)
 			computePartialLikelihood((PhyloNeighbor*)*it, node);
@@ -464,15 +627,14 @@ void PhyloTree::computePartialParsimony(PhyloNeighbor *dad_branch, PhyloNode *da
         // external node
         setBitsAll(dad_branch->partial_pars, nstates * aln->size());
         dad_branch->partial_pars[pars_size - 1] = 0;
+        unsigned char *node_states = NULL;
+        if (node->name != ROOT_NAME) {
+            assert(node->id < aln->getNSeq());
+            node_states = getTipStates(node->id);
+        }
         for (ptn = 0; ptn < aln->size(); ptn++)
             if (!aln->at(ptn).is_const) {
-                char state;
-                if (node->name == ROOT_NAME) {
-                    state = STATE_UNKNOWN;
-                } else {
-                    assert(node->id < aln->getNSeq());
-                    state = (aln->at(ptn))[node->id];
-                }
+                char state = node_states ? node_states[ptn] : STATE_UNKNOWN;
                 if (state == STATE_UNKNOWN) {
                     // fill all entries with bit 1
                     //setBitsBlock(dad_branch->partial_pars, ptn, (1 << nstates) - 1);
@@ -490,7 +652,8 @@ void PhyloTree::computePartialParsimony(PhyloNeighbor *dad_branch, PhyloNode *da
             }
     } else {
         // internal node
-        memset(dad_branch->partial_pars, 127, pars_size * sizeof(int));
+        // all bits set, the intersection with the children follows
+        memset(dad_branch->partial_pars, 255, pars_size * sizeof(UINT));
         UINT *partial_pars_dad = dad_branch->partial_pars;
         int partial_pars = 0;
         //UINT *partial_pars_child1 = NULL, *partial_pars_child2 = NULL;
@@ -665,7 +828,7 @@ int PhyloTree::computeParsimonyScore(int ptn, int &states, PhyloNode *node, Phyl
             state = STATE_UNKNOWN;
         } else {
             assert(node->id < aln->getNSeq());
-            state = (*aln)[ptn][node->id];
+            state = getTipStates(node->id)[ptn];
         }
         if (state == STATE_UNKNOWN) {
             states = (1 << aln->num_states) - 1;
@@ -1040,45 +1203,303 @@ void PhyloTree::initializeAllPartialLh() {
     if (!tmp_scale_num2)
         tmp_scale_num2 = newScaleNum();
     if (!_pattern_lh)
-        _pattern_lh = new double[aln->size()];
+        _pattern_lh = MemArena::allocArray<double>(aln->size());
+    if (!_pattern_lh_derv)
+        _pattern_lh_derv = MemArena::allocArray<double>(aln->size() * 2);
     if (!theta_all)
-        theta_all = new double[block_size];
-    initializeAllPartialLh(index);
+        theta_all = MemArena::allocArray<double>(block_size);
+    if (!_pattern_lh || !_pattern_lh_derv || !theta_all)
+        outError("Not enough memory for pattern likelihoods");
+    // the kernels read the leaf states inside parallel regions
+    updateTipStates();
+    int indexlh;
+    initializeAllPartialLh(index, indexlh);
     assert(index == (nodeNum - 1) * 2);
+    assert(partial_lh_slots || indexlh == (nodeNum - 1) * 2 - leafNum);
 }
 
 uint64_t PhyloTree::getMemoryRequired() {
-	uint64_t block_size = ((aln->getNPattern() % 2) == 0) ? aln->getNPattern() : (aln->getNPattern() + 1);
+    uint64_t block_size = getPartialLhNPattern();
     block_size = block_size * aln->num_states;
     if (site_rate)
     	block_size *= site_rate->getNRate();
-    uint64_t mem_size = ((uint64_t) leafNum - 1) * 4 * block_size + 2;
+    if (usesFloatPartialLh())
+        block_size = ((block_size + 3) / 4) * 2;
+    // partial likelihoods of neighbors pointing to leaves are not stored, see getTipPartialLh()
+    uint64_t mem_size = getNumPartialLhBlocks(block_size) * block_size;
     return mem_size;
 }
 
-void PhyloTree::initializeAllPartialLh(int &index, PhyloNode *node, PhyloNode *dad) {
+uint64_t PhyloTree::getNumPartialLhBlocks(uint64_t block_size) {
+    uint64_t num_blocks = ((uint64_t) leafNum - 1) * 3;
+    if (lh_mem_limit <= 0)
+        return num_blocks;
+    uint64_t pool_blocks = ((uint64_t) lh_mem_limit << 20) / (block_size * sizeof(double));
+    // a kernel needs its own vector and those of two children at the same time
+    return min(num_blocks, max(pool_blocks, (uint64_t) 3));
+}
+
+void PhyloTree::initTipStates() {
+    int nstates = aln->num_states;
+    char max_state = nstates - 1;
+    vector<bool> present(128, false);
+    for (Alignment::iterator pit = aln->begin(); pit != aln->end(); pit++)
+        for (Pattern::iterator it = pit->begin(); it != pit->end(); it++) {
+            present[*it] = true;
+            if (*it != STATE_UNKNOWN && *it > max_state)
+                max_state = *it;
+        }
+    // the last entry is reserved for STATE_UNKNOWN
+    num_tip_states = max_state + 2;
+    // STATE_UNKNOWN is always needed for the root of a rooted tree
+    present[STATE_UNKNOWN] = true;
+    tip_state_list.clear();
+    for (int state = 0; state <= STATE_UNKNOWN; state++)
+        if (present[state] && (state <= max_state || state == STATE_UNKNOWN))
+            tip_state_list.push_back(getTipStateIndex(state));
+    if (tip_partial_lh_state)
+        delete[] tip_partial_lh_state;
+    tip_partial_lh_state = new double[num_tip_states * nstates];
+    memset(tip_partial_lh_state, 0, num_tip_states * nstates * sizeof(double));
+    for (int state = 0; state < num_tip_states; state++) {
+        double *tip_lh = tip_partial_lh_state + state * nstates;
+        if (state == num_tip_states - 1) {
+            for (int state2 = 0; state2 < nstates; state2++)
+                tip_lh[state2] = 1.0;
+        } else if (state < nstates) {
+            tip_lh[state] = 1.0;
+        } else {
+            // ambiguous character, for DNA, RNA
+            int ambi_state = state - (nstates - 1);
+            for (int state2 = 0; state2 < nstates && state2 <= 6; state2++)
+                if (ambi_state & (1 << state2))
+                    tip_lh[state2] = 1.0;
+        }
+    }
+}
+
+int PhyloTree::getNumTipStates() {
+    if (!num_tip_states)
+        initTipStates();
+    return num_tip_states;
+}
+
+double *PhyloTree::getTipPartialLh(Node *leaf) {
+    assert(leaf->isLeaf() && leaf->id < leafNum);
+    size_t block_size = getPartialLhNPattern();
+    block_size = block_size * model->num_states * site_rate->getNRate();
+    if (!central_tip_partial_lh) {
+        central_tip_partial_lh_size = (uint64_t) leafNum * block_size;
+        central_tip_partial_lh = MemArena::allocArray<double>(central_tip_partial_lh_size);
+        if (!central_tip_partial_lh)
+            outError("Not enough memory for partial likelihood vectors");
+    }
+    return central_tip_partial_lh + leaf->id * block_size;
+}
+
+void PhyloTree::checkPartialLhStorage(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    pinPartialLh(dad_branch, dad);
+    double *lh = dad_branch->partial_lh;
+    bool tip_storage = central_tip_partial_lh && lh >= central_tip_partial_lh
+            && lh < central_tip_partial_lh + central_tip_partial_lh_size;
+    bool central_storage = lh >= central_partial_lh && lh < central_partial_lh + central_partial_lh_size;
+    if (lh && !tip_storage && !central_storage
+            && find(extra_partial_lh.begin(), extra_partial_lh.end(), lh) != extra_partial_lh.end())
+        central_storage = true;
+    if (lh && !tip_storage && !central_storage)
+        return; // allocated by newPartialLh()
+    if (dad_branch->node->isLeaf()) {
+        if (central_storage) {
+            free_partial_lh.push_back(lh);
+            releasePartialLhSlot(dad_branch);
+        }
+        dad_branch->partial_lh = getTipPartialLh(dad_branch->node);
+        return;
+    }
+    if (central_storage) {
+        if (dad_branch->partial_lh_slot)
+            touchPartialLhSlot(dad_branch->partial_lh_slot);
+        return;
+    }
+    dad_branch->partial_lh = getFreePartialLh();
+    PartialLhSlot *slot = findPartialLhSlot(dad_branch->partial_lh);
+    if (slot) {
+        slot->owner = dad_branch;
+        touchPartialLhSlot(slot);
+        dad_branch->partial_lh_slot = slot;
+    }
+}
+
+void PhyloTree::pinPartialLh(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    if (!partial_lh_slots)
+        return;
+    dad_branch->partial_lh_pinned++;
+    FOR_NEIGHBOR_IT(dad_branch->node, dad, it) {
+        PhyloNeighbor *child = (PhyloNeighbor*) (*it);
+        child->partial_lh_pinned++;
+        if (child->partial_lh_slot)
+            touchPartialLhSlot(child->partial_lh_slot);
+    }
+}
+
+void PhyloTree::unpinPartialLh(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    if (!partial_lh_slots)
+        return;
+    dad_branch->partial_lh_pinned--;
+    FOR_NEIGHBOR_IT(dad_branch->node, dad, it)
+        ((PhyloNeighbor*) (*it))->partial_lh_pinned--;
+}
+
+PartialLhSlot *PhyloTree::findPartialLhSlot(double *lh) {
+    if (!partial_lh_slots || lh < central_partial_lh || lh >= central_partial_lh + central_partial_lh_size)
+        return NULL;
+    uint64_t index = (lh - central_partial_lh) / getCentralBlockSize();
+    assert(index < num_partial_lh_slots && partial_lh_slots[index].partial_lh == lh);
+    return partial_lh_slots + index;
+}
+
+double *PhyloTree::getFreePartialLh() {
+    double *lh;
+    if (!free_partial_lh.empty()) {
+        lh = free_partial_lh.back();
+        free_partial_lh.pop_back();
+        assert(!findPartialLhSlot(lh) || !findPartialLhSlot(lh)->owner);
+        return lh;
+    }
+    if (partial_lh_slots && (lh = evictPartialLh()))
+        return lh;
+    if (partial_lh_slots) {
+        if (!num_partial_lh_overflow)
+            cout << "NOTE: Memory limit of partial likelihoods is too small, allocating more memory" << endl;
+        num_partial_lh_overflow++;
+    }
+    // without lh_mem_limit all neighbors together never hold more blocks than initially reserved for both directions
+    extra_partial_lh.push_back(newPartialLh());
+    return extra_partial_lh.back();
+}
+
+double *PhyloTree::evictPartialLh() {
+    PartialLhSlot *victim;
+    // pinned vectors were used recently, so only few of them are skipped at the front of the list
+    for (victim = partial_lh_lru_first; victim; victim = victim->lru_next) {
+        // a block without owner was given back by a deleted neighbor (the free list is empty here)
+        if (!victim->owner)
+            break;
+        // vectors temporarily replaced by newPartialLh() (NNI, SPR) get their block back later
+        if (!victim->owner->partial_lh_pinned && victim->owner->partial_lh == victim->partial_lh)
+            break;
+    }
+    if (!victim)
+        return NULL;
+    if (victim->owner) {
+        if (victim->owner->partial_lh_computed & 1)
+            num_partial_lh_evicted++;
+        victim->owner->partial_lh = NULL;
+        victim->owner->partial_lh_computed &= ~1;
+        releasePartialLhSlot(victim->owner);
+    }
+    return victim->partial_lh;
+}
+
+void PhyloTree::touchPartialLhSlot(PartialLhSlot *slot, bool recent) {
+    if (slot == (recent ? partial_lh_lru_last : partial_lh_lru_first))
+        return;
+    // unlink
+    if (slot->lru_prev)
+        slot->lru_prev->lru_next = slot->lru_next;
+    else
+        partial_lh_lru_first = slot->lru_next;
+    if (slot->lru_next)
+        slot->lru_next->lru_prev = slot->lru_prev;
+    else
+        partial_lh_lru_last = slot->lru_prev;
+    if (recent) {
+        slot->lru_prev = partial_lh_lru_last;
+        slot->lru_next = NULL;
+        partial_lh_lru_last->lru_next = slot;
+        partial_lh_lru_last = slot;
+    } else {
+        slot->lru_prev = NULL;
+        slot->lru_next = partial_lh_lru_first;
+        partial_lh_lru_first->lru_prev = slot;
+        partial_lh_lru_first = slot;
+    }
+}
+
+void PhyloTree::releasePartialLhSlot(PhyloNeighbor *nei) {
+    if (!nei->partial_lh_slot)
+        return;
+    if (nei->partial_lh_slot->owner == nei)
+        nei->partial_lh_slot->owner = NULL;
+    nei->partial_lh_slot = NULL;
+}
+
+void PhyloTree::clearPartialLhSlots() {
+    for (uint64_t i = 0; i < num_partial_lh_slots; i++)
+        if (partial_lh_slots[i].owner)
+            releasePartialLhSlot(partial_lh_slots[i].owner);
+}
+
+void PhyloTree::releaseTipPartialLh(PhyloNeighbor *dad_branch) {
+    double *lh = dad_branch->partial_lh;
+    if (!lh || (lh >= central_tip_partial_lh && lh < central_tip_partial_lh + central_tip_partial_lh_size))
+        return;
+    if ((lh >= central_partial_lh && lh < central_partial_lh + central_partial_lh_size)
+            || find(extra_partial_lh.begin(), extra_partial_lh.end(), lh) != extra_partial_lh.end()) {
+        free_partial_lh.push_back(lh);
+        releasePartialLhSlot(dad_branch);
+        dad_branch->partial_lh = NULL;
+        dad_branch->partial_lh_computed &= ~1;
+    }
+}
+
+void PhyloTree::initializeAllPartialLh(int &index, int &indexlh, PhyloNode *node, PhyloNode *dad) {
     size_t pars_block_size = getBitsBlockSize();
     size_t scale_block_size = aln->size();
-    size_t block_size = ((aln->getNPattern() % 2) == 0) ? aln->getNPattern() : (aln->getNPattern() + 1);
-    block_size = block_size * model->num_states * site_rate->getNRate();
+    if (!node && !central_partial_lh) {
+        float_partial_lh = usesFloatPartialLh();
+        scaling_threshold = float_partial_lh ? SCALING_THRESHOLD_FLOAT : SCALING_THRESHOLD;
+        if (float_partial_lh && !float_scratch_lh)
+            float_scratch_lh = MemArena::allocArray<double>(getPartialLhNPattern() * model->num_states * site_rate->getNRate() * 3);
+    }
+    size_t block_size = getCentralBlockSize();
     if (!node) {
         node = (PhyloNode*) root;
         // allocate the big central partial likelihoods memory
         if (!central_partial_lh) {
-            uint64_t mem_size = ((uint64_t) leafNum - 1) * 4 * (uint64_t) block_size + 2;
-            central_partial_lh = new double[mem_size];
-            //central_partial_lh = (double*) Eigen::internal::conditional_aligned_malloc<true>((leafNum-1)*4*block_size);
+            if (float_partial_lh && verbose_mode >= VB_MED)
+                cout << "Storing partial likelihoods in single precision" << endl;
+            uint64_t num_blocks = getNumPartialLhBlocks(block_size);
+            uint64_t mem_size = num_blocks * (uint64_t) block_size;
+            central_partial_lh_size = mem_size;
+            central_partial_lh = MemArena::allocArray<double>(mem_size);
             if (!central_partial_lh)
                 outError("Not enough memory for partial likelihood vectors");
-
+            touchLhSlices(central_partial_lh, num_blocks, block_size * sizeof(double));
+            if (num_blocks < ((uint64_t) leafNum - 1) * 3) {
+                // vectors get blocks on demand and are evicted if none is free
+                cout << "Limiting partial likelihoods to " << num_blocks << " blocks ("
+                        << ((double) mem_size * sizeof(double) / 1024.0) / 1024 << " MB)" << endl;
+                num_partial_lh_slots = num_blocks;
+                partial_lh_slots = new PartialLhSlot[num_blocks];
+                for (uint64_t i = 0; i < num_blocks; i++) {
+                    partial_lh_slots[i].partial_lh = central_partial_lh + i * block_size;
+                    partial_lh_slots[i].owner = NULL;
+                    partial_lh_slots[i].lru_prev = i ? partial_lh_slots + i - 1 : NULL;
+                    partial_lh_slots[i].lru_next = (i + 1 < num_blocks) ? partial_lh_slots + i + 1 : NULL;
+                }
+                partial_lh_lru_first = partial_lh_slots;
+                partial_lh_lru_last = partial_lh_slots + num_blocks - 1;
+            }
         }
         if (!central_scale_num) {
             if (verbose_mode >= VB_MED)
-                cout << "Allocating " << (leafNum - 1) * 4 * scale_block_size * sizeof(UBYTE)
+                cout << "Allocating " << (leafNum - 1) * 4 * scale_block_size * sizeof(ScaleNum)
                         << " bytes for scale num vectors" << endl;
-            central_scale_num = new UBYTE[(leafNum - 1) * 4 * scale_block_size];
+            central_scale_num = new ScaleNum[(leafNum - 1) * 4 * scale_block_size];
             if (!central_scale_num)
                 outError("Not enough memory for scale num vectors");
+            touchLhSlices(central_scale_num, (leafNum - 1) * 4, scale_block_size * sizeof(ScaleNum));
         }
         if (!central_partial_pars) {
             if (verbose_mode >= VB_MED)
@@ -1087,46 +1508,379 @@ void PhyloTree::initializeAllPartialLh(int &index, PhyloNode *node, PhyloNode *d
             central_partial_pars = new UINT[(leafNum - 1) * 4 * pars_block_size];
             if (!central_partial_pars)
                 outError("Not enough memory for partial parsimony vectors");
+            touchLhSlices(central_partial_pars, (leafNum - 1) * 4, pars_block_size * sizeof(UINT));
         }
         index = 0;
+        indexlh = 0;
+        if (central_tip_partial_lh) {
+            // block size might have changed
+            MemArena::release(central_tip_partial_lh);
+            central_tip_partial_lh = NULL;
+        }
+        for (vector<double*>::iterator it = extra_partial_lh.begin(); it != extra_partial_lh.end(); it++)
+            delete[] (*it);
+        extra_partial_lh.clear();
+        free_partial_lh.clear();
+        clearPartialLhSlots();
     }
     if (dad) {
-        // make memory alignment 16
-        size_t mem_shift = 0;
-        if (((intptr_t) central_partial_lh) % 16 != 0)
-            mem_shift = 1;
         // assign a region in central_partial_lh to both Neihgbors (dad->node, and node->dad)
         PhyloNeighbor *nei = (PhyloNeighbor*) node->findNeighbor(dad);
         //assert(!nei->partial_lh);
-        nei->partial_lh = central_partial_lh + (index * block_size + mem_shift);
+        if (dad->isLeaf() || partial_lh_slots) {
+            nei->partial_lh = NULL;
+            nei->partial_lh_computed &= ~1;
+        } else {
+            nei->partial_lh = central_partial_lh + indexlh * block_size;
+            indexlh++;
+        }
         nei->scale_num = central_scale_num + (index * scale_block_size);
         nei->partial_pars = central_partial_pars + (index * pars_block_size);
         nei = (PhyloNeighbor*) dad->findNeighbor(node);
         //assert(!nei->partial_lh);
-        nei->partial_lh = central_partial_lh + ((index + 1) * block_size + mem_shift);
+        if (node->isLeaf() || partial_lh_slots) {
+            nei->partial_lh = NULL;
+            nei->partial_lh_computed &= ~1;
+        } else {
+            nei->partial_lh = central_partial_lh + indexlh * block_size;
+            indexlh++;
+        }
         nei->scale_num = central_scale_num + ((index + 1) * scale_block_size);
         nei->partial_pars = central_partial_pars + ((index + 1) * pars_block_size);
         index += 2;
         assert(index < nodeNum * 2 - 1);
     }
-    FOR_NEIGHBOR_IT(node, dad, it)initializeAllPartialLh(index, (PhyloNode*) (*it)->node, node);
+    FOR_NEIGHBOR_IT(node, dad, it)initializeAllPartialLh(index, indexlh, (PhyloNode*) (*it)->node, node);
+    if (node == root) {
+        // remaining blocks are used when a topology change redirects a neighbor from a leaf to an internal node
+        for (uint64_t i = indexlh; (i + 1) * block_size <= central_partial_lh_size; i++)
+            free_partial_lh.push_back(central_partial_lh + i * block_size);
+    }
+}
+
+void PhyloTree::updateTransVersion() {
+    int ncat = site_rate->getNRate();
+    bool changed = (model->getParamVersion() != trans_model_version || trans_rates.size() != ncat);
+    for (int cat = 0; !changed && cat < ncat; cat++)
+        changed = (trans_rates[cat] != site_rate->getRate(cat));
+    if (!changed)
+        return;
+    trans_model_version = model->getParamVersion();
+    trans_rates.resize(ncat);
+    for (int cat = 0; cat < ncat; cat++)
+        trans_rates[cat] = site_rate->getRate(cat);
+    trans_version++;
+}
+
+void PhyloTree::updatePartialLhVersion() {
+    updateTransVersion();
+    if (partial_lh_version == trans_version)
+        return;
+    clearAllPartialLH();
+    partial_lh_version = trans_version;
+}
+
+PhyloNeighbor *PhyloTree::prepareTransMatrix(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    int size = site_rate->getNRate() * model->num_states * model->num_states;
+    updateTransVersion();
+    // both directions of a branch share the cache of the neighbor pointing to the node with the larger ID
+    PhyloNeighbor *other = (PhyloNeighbor*) dad_branch->node->findNeighbor(dad);
+    if (dad_branch->node->id < dad->id) {
+        PhyloNeighbor *tmp = dad_branch;
+        dad_branch = other;
+        other = tmp;
+    }
+    // the other neighbor may have owned the cache before the topology was changed
+    other->deleteTransMatrix();
+    if (dad_branch->trans_mat_size == size)
+        return dad_branch;
+    dad_branch->deleteTransMatrix();
+    // the matrices and the derivatives in one aligned block, the derivatives are only computed on demand
+    dad_branch->trans_mat_size = size;
+    dad_branch->trans_mat = MemArena::allocArray<double>(size * 4);
+    dad_branch->trans_derv = dad_branch->trans_mat + size;
+    return dad_branch;
+}
+
+double *PhyloTree::getTransMatrix(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    int ncat = site_rate->getNRate();
+    int trans_size = model->num_states * model->num_states;
+    dad_branch = prepareTransMatrix(dad_branch, dad);
+    if (dad_branch->trans_mat_version == trans_version && dad_branch->trans_mat_length == dad_branch->length)
+        return dad_branch->trans_mat;
+    for (int cat = 0; cat < ncat; cat++)
+        model_factory->computeTransMatrix(dad_branch->length * site_rate->getRate(cat),
+                dad_branch->trans_mat + cat * trans_size);
+    dad_branch->trans_mat_version = trans_version;
+    dad_branch->trans_mat_length = dad_branch->length;
+    return dad_branch->trans_mat;
+}
+
+double *PhyloTree::getTransMatrixFreq(PhyloNeighbor *dad_branch, PhyloNode *dad, double *state_freq) {
+    double *trans_mat = getTransMatrix(dad_branch, dad);
+    int nstates = model->num_states;
+    int size = site_rate->getNRate() * nstates * nstates;
+    if (tmp_trans_mat_freq_size != size) {
+        if (tmp_trans_mat_freq)
+            MemArena::release(tmp_trans_mat_freq);
+        tmp_trans_mat_freq_size = size;
+        tmp_trans_mat_freq = MemArena::allocArray<double>(tmp_trans_mat_freq_size);
+    }
+    for (int i = 0; i < tmp_trans_mat_freq_size; i++)
+        tmp_trans_mat_freq[i] = trans_mat[i] * state_freq[(i / nstates) % nstates];
+    return tmp_trans_mat_freq;
+}
+
+double *PhyloTree::getTransDervFreq(PhyloNeighbor *dad_branch, PhyloNode *dad, double *state_freq) {
+    int ncat = site_rate->getNRate();
+    int trans_size = model->num_states * model->num_states;
+    dad_branch = prepareTransMatrix(dad_branch, dad);
+    if (dad_branch->trans_derv_version == trans_version && dad_branch->trans_derv_length == dad_branch->length)
+        return dad_branch->trans_derv;
+    double *trans_mat = dad_branch->trans_derv;
+    double *trans_derv1 = trans_mat + dad_branch->trans_mat_size;
+    double *trans_derv2 = trans_derv1 + dad_branch->trans_mat_size;
+    for (int cat = 0; cat < ncat; cat++)
+        model_factory->computeTransDervFreq(dad_branch->length, site_rate->getRate(cat), state_freq,
+                trans_mat + cat * trans_size, trans_derv1 + cat * trans_size, trans_derv2 + cat * trans_size);
+    dad_branch->trans_derv_version = trans_version;
+    dad_branch->trans_derv_length = dad_branch->length;
+    return dad_branch->trans_derv;
+}
+
+bool PhyloTree::usesFloatPartialLh() {
+    if (lh_float == 0 || !sse)
+        return false;
+    return lh_float > 0 || aln->getNPattern() > LH_FLOAT_MIN_PATTERNS;
+}
+
+size_t PhyloTree::getCentralBlockSize() {
+    size_t block_size = getPartialLhNPattern() * model->num_states * site_rate->getNRate();
+    if (!float_partial_lh)
+        return block_size;
+    // floats rounded up to a multiple of 16 bytes
+    return ((block_size + 3) / 4) * 2;
+}
+
+double *PhyloTree::unpackPartialLh(PhyloNeighbor *nei, int slot) {
+    if (!isFloatPartialLh(nei->partial_lh))
+        return nei->partial_lh;
+    size_t lh_size = getPartialLhNPattern() * model->num_states * site_rate->getNRate();
+    float *float_lh = (float*) nei->partial_lh;
+    double *lh = float_scratch_lh + slot * lh_size;
+    // e.g. the Newton steps of a branch length read the same vectors again
+    if (float_unpacked_lh[slot] == nei->partial_lh)
+        return lh;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (size_t i = 0; i < lh_size; i++)
+        lh[i] = float_lh[i];
+    float_unpacked_lh[slot] = nei->partial_lh;
+    return lh;
+}
+
+void PhyloTree::invalidateUnpackedLh() {
+    for (int slot = 0; slot < 3; slot++)
+        float_unpacked_lh[slot] = NULL;
+}
+
+double *PhyloTree::redirectPartialLh(PhyloNeighbor *nei) {
+    if (!isFloatPartialLh(nei->partial_lh))
+        return NULL;
+    double *float_lh = nei->partial_lh;
+    nei->partial_lh = float_scratch_lh;
+    return float_lh;
+}
+
+int PhyloTree::computeSiteRepeats(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    Node *node = dad_branch->node;
+    int nptn = aln->getNPattern();
+    dad_branch->num_site_repeats = 0;
+    // the classes of all patterns, followed by the first pattern of each class
+    if (!dad_branch->site_repeat)
+        dad_branch->site_repeat = new int[aln->size() * 2];
+    int *ptn_class = dad_branch->site_repeat;
+    int num_class = 1;
+    for (int ptn = 0; ptn < nptn; ptn++)
+        ptn_class[ptn] = 0;
+    IntVector table;
+    FOR_NEIGHBOR_IT(node, dad, it) if ((*it)->node->name != ROOT_NAME) {
+        PhyloNeighbor *child = (PhyloNeighbor*) (*it);
+        bool tip_child = child->node->isLeaf();
+        unsigned char *child_states = tip_child ? getTipStates(child->node->id) : NULL;
+        int num_child_class;
+        if (tip_child)
+            num_child_class = getNumTipStates();
+        else if (child->num_site_repeats && child->site_repeat_lh == child->partial_lh)
+            num_child_class = child->num_site_repeats;
+        else
+            return 0;
+        if ((size_t) num_class * num_child_class > max((size_t) SITE_REPEAT_TABLE_FACTOR * nptn, (size_t) 1 << 16))
+            return 0;
+        // refine the classes by those of the child
+        table.assign(num_class * num_child_class, -1);
+        num_class = 0;
+        for (int ptn = 0; ptn < nptn; ptn++) {
+            int child_class = tip_child ? getTipStateIndex(child_states[ptn]) : child->site_repeat[ptn];
+            int &new_class = table[ptn_class[ptn] * num_child_class + child_class];
+            if (new_class < 0)
+                new_class = num_class++;
+            ptn_class[ptn] = new_class;
+        }
+    }
+    int *first_ptn = ptn_class + aln->size();
+    for (int ptn = 0, cls = 0; ptn < nptn; ptn++)
+        if (ptn_class[ptn] == cls)
+            first_ptn[cls++] = ptn;
+    dad_branch->num_site_repeats = num_class;
+    return num_class;
+}
+
+void PhyloTree::packPartialLh(PhyloNeighbor *nei, double *float_lh) {
+    if (!float_lh)
+        return;
+    for (int slot = 0; slot < 3; slot++)
+        if (float_unpacked_lh[slot] == float_lh)
+            float_unpacked_lh[slot] = NULL;
+    size_t nptn = getPartialLhNPattern();
+    size_t block = model->num_states * site_rate->getNRate();
+    size_t lh_size = nptn * block;
+    double *lh = nei->partial_lh;
+    // the largest entry of every pattern must stay a normalized float with full precision,
+    // smaller entries may then be flushed to zero without changing the pattern likelihood
+    const double min_lh = FLT_MIN / FLT_EPSILON;
+    bool fallback = false;
+    for (size_t ptn = 0; ptn < aln->size() && !fallback; ptn++) {
+        double lh_max = 0.0;
+        double *lh_ptn = getPartialLhPattern(lh, ptn, block, isBlockedPartialLh());
+        int stride = isBlockedPartialLh() ? LH_BLOCK_PATTERNS : 1;
+        for (size_t i = 0; i < block; i++)
+            lh_max = max(lh_max, lh_ptn[i * stride]);
+        fallback = (lh_max > FLT_MAX) || (lh_max > 0.0 && lh_max < min_lh);
+    }
+    if (fallback) {
+        extra_partial_lh.push_back(newPartialLh());
+        free_partial_lh.push_back(float_lh);
+        releasePartialLhSlot(nei);
+        nei->partial_lh = extra_partial_lh.back();
+        memcpy(nei->partial_lh, lh, lh_size * sizeof(double));
+        num_float_fallback++;
+        if (verbose_mode >= VB_MAX)
+            cout << "Partial likelihoods kept in double precision (" << num_float_fallback << " vectors)" << endl;
+        return;
+    }
+    float *lh_float = (float*) float_lh;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (size_t i = 0; i < lh_size; i++)
+        lh_float[i] = (float) lh[i];
+    nei->partial_lh = float_lh;
+}
+
+size_t PhyloTree::getPartialLhNPattern() {
+    return ((aln->size() + LH_BLOCK_PATTERNS - 1) / LH_BLOCK_PATTERNS) * LH_BLOCK_PATTERNS;
+}
+
+bool PhyloTree::isBlockedPartialLh() {
+    if (lh_layout != LH_LAYOUT_BLOCKED || !sse)
+        return false;
+    // the generic kernels only support the pattern-by-pattern layout
+    return hasCompiledKernel(aln->num_states);
 }
 
 double *PhyloTree::newPartialLh() {
-    double *ret = new double[aln->size() * aln->num_states * site_rate->getNRate() + 2];
+    double *ret = new double[getPartialLhNPattern() * aln->num_states * site_rate->getNRate() + 2];
     return ret;
 }
 
 int PhyloTree::getPartialLhBytes() {
-	return (aln->size() * aln->num_states * site_rate->getNRate() + 2) * sizeof(double);
+	return (getPartialLhNPattern() * aln->num_states * site_rate->getNRate() + 2) * sizeof(double);
 }
 
 int PhyloTree::getScaleNumBytes() {
-	return (aln->size()) * sizeof(UBYTE);
+	return (aln->size()) * sizeof(ScaleNum);
+}
+
+ScaleNum *PhyloTree::newScaleNum() {
+    return new ScaleNum[aln->size()];
 }
 
-UBYTE *PhyloTree::newScaleNum() {
-    return new UBYTE[aln->size()];
+int64_t PhyloTree::sumScaleNum(ScaleNum *scale_num, int ptn_begin, int ptn_end) {
+    // integer sum, independent of the order of summation
+    int64_t sum = 0;
+    for (int ptn = ptn_begin; ptn < ptn_end; ptn++)
+        if (scale_num[ptn] > 0)
+            sum += (int64_t) scale_num[ptn] * aln->at(ptn).frequency;
+    return sum;
+}
+
+double PhyloTree::sumPatternLh(double *ptn_values, int ptn_begin, int ptn_end) {
+    if (ptn_end - ptn_begin > PAIRWISE_SUM_PATTERNS) {
+        int ptn_mid = ptn_begin + (ptn_end - ptn_begin) / 2;
+        return sumPatternLh(ptn_values, ptn_begin, ptn_mid) + sumPatternLh(ptn_values, ptn_mid, ptn_end);
+    }
+    double sum = 0.0;
+    for (int ptn = ptn_begin; ptn < ptn_end; ptn++)
+        sum += ptn_values[ptn] * aln->at(ptn).frequency;
+    return sum;
+}
+
+double *PhyloTree::getPtnInvar() {
+    int nptn = aln->size();
+    if (ptn_invar_aln != aln) {
+        MemArena::release(ptn_invar);
+        ptn_invar = MemArena::allocArray<double>(max(nptn, 1));
+        if (!ptn_invar)
+            outError("Not enough memory for pattern likelihoods");
+        const_ptn_mask.assign((nptn + 31) / 32, 0);
+        for (int ptn = 0; ptn < nptn; ptn++)
+            if ((*aln)[ptn].is_const && (*aln)[ptn][0] < aln->num_states)
+                const_ptn_mask[ptn / 32] |= 1U << (ptn % 32);
+        ptn_invar_aln = aln;
+        ptn_invar_version = 0;
+    }
+    updateTransVersion();
+    double p_invar = site_rate->getPInvar();
+    if (ptn_invar_version == trans_version && ptn_invar_pinv == p_invar)
+        return ptn_invar;
+    double *state_freq = scratch.push(aln->num_states);
+    model->getStateFrequency(state_freq);
+    memset(ptn_invar, 0, sizeof(double) * nptn);
+    if (p_invar > 0.0)
+        for (int word = 0; word < const_ptn_mask.size(); word++) {
+            // words without constant patterns are skipped at once
+            UINT bits = const_ptn_mask[word];
+            for (int ptn = word * 32; bits; ptn++, bits >>= 1)
+                if (bits & 1)
+                    ptn_invar[ptn] = p_invar * state_freq[(int) (*aln)[ptn][0]];
+        }
+    scratch.pop(state_freq);
+    ptn_invar_version = trans_version;
+    ptn_invar_pinv = p_invar;
+    return ptn_invar;
+}
+
+void PhyloTree::updateTipStates() {
+    int nptn = aln->size();
+    if (tip_states_aln == aln && tip_states_nptn == nptn)
+        return;
+    int nseq = aln->getNSeq();
+    // every sequence starts at a cache line and covers the padding of blocked partial likelihoods
+    tip_states_stride = (nptn + MEM_ARENA_ALIGN - 1) / MEM_ARENA_ALIGN * MEM_ARENA_ALIGN;
+    MemArena::release(tip_states);
+    tip_states = MemArena::allocArray<unsigned char>(max((size_t) nseq * tip_states_stride, (size_t) 1));
+    if (!tip_states)
+        outError("Not enough memory for leaf states");
+    memset(tip_states, STATE_UNKNOWN, (size_t) nseq * tip_states_stride);
+    for (int ptn = 0; ptn < nptn; ptn++) {
+        Pattern &pat = aln->at(ptn);
+        for (int seq = 0; seq < nseq; seq++)
+            tip_states[(size_t) seq * tip_states_stride + ptn] = pat[seq];
+    }
+    tip_states_aln = aln;
+    tip_states_nptn = nptn;
 }
 
 double PhyloTree::computeLikelihood(double *pattern_lh) {
@@ -1146,7 +1900,7 @@ double PhyloTree::computeLikelihood(double *pattern_lh) {
      ptn_scale   qqqqqq= new double[nptn];
      memset(ptn_scale, 0, sizeof (double) * nptn);
      for (int i = 0; i < nptn; i++) {
-     ptn_scale[i] = max(nei->scale_num[i],UBYTE(0)) * LOG_SCALING_THRESHOLD;
+     ptn_scale[i] = max(nei->scale_num[i],ScaleNum(0)) * LOG_SCALING_THRESHOLD;
      check += ptn_scale[i] * aln->at(i).frequency;
      }
      if (fabs(check-sum_scaling) > 1e-3) {
@@ -1169,7 +1923,7 @@ double PhyloTree::computeLikelihood(double *pattern_lh) {
         int nptn = aln->getNPattern();
         //double check_score = 0.0;
         for (int i = 0; i < nptn; i++) {
-            pattern_lh[i] += max(nei->scale_num[i], UBYTE(0)) * LOG_SCALING_THRESHOLD;
+            pattern_lh[i] += max(nei->scale_num[i], ScaleNum(0)) * LOG_SCALE_UNIT;
             //check_score += (pattern_lh[i] * (aln->at(i).frequency));
         }
         /*       if (fabs(score - check_score) > 1e-6) {
@@ -1208,8 +1962,8 @@ void PhyloTree::computePatternLikelihood(double *ptn_lh, double *cur_logl) {
     //double sum_scaling = 0.0;
     if (sum_scaling < 0.0) {
         for (int i = 0; i < nptn; i++) {
-        	ptn_lh[i] = _pattern_lh[i] + (max(UBYTE(0), current_it->scale_num[i]) +
-            	max(UBYTE(0), current_it_back->scale_num[i])) * LOG_SCALING_THRESHOLD;
+        	ptn_lh[i] = _pattern_lh[i] + (max(ScaleNum(0), current_it->scale_num[i]) +
+            	max(ScaleNum(0), current_it_back->scale_num[i])) * LOG_SCALE_UNIT;
         }
     } else
         memmove(ptn_lh, _pattern_lh, nptn * sizeof(double));
@@ -1652,6 +2406,8 @@ void PhyloTree::computeAllSubtreeDistForOneNode(PhyloNode* source, PhyloNode* so
 
 double PhyloTree::computeObservedBranchLength(PhyloNeighbor *dad_branch, PhyloNode *dad) {
     double obsLen = 0.0;
+    updatePartialLhVersion();
+    BranchPartialLhPin pin(this, dad_branch, dad);
     PhyloNode *node = (PhyloNode*) dad_branch->node;
     PhyloNeighbor *node_branch = (PhyloNeighbor*) node->findNeighbor(dad);
     assert(node_branch);
@@ -1680,18 +2436,21 @@ double PhyloTree::computeObservedBranchLength(PhyloNeighbor *dad_branch, PhyloNo
     model->getStateFrequency(tmp_state_freq);
 
     double cutoff = 0.2 / nstates;
+    bool blocked = isBlockedPartialLh();
+    int lh_stride = blocked ? LH_BLOCK_PATTERNS : 1;
+    double *node_partial_lh = unpackPartialLh(node_branch, 1);
+    double *dad_partial_lh = unpackPartialLh(dad_branch, 2);
     for (ptn = 0; ptn < nptn; ptn++) {
         // Compute the probability of each state for the current site
         double sum_prob1 = 0.0, sum_prob2 = 0.0;
-        size_t offset = ptn * block;
-        double *partial_lh_site = node_branch->partial_lh + (offset);
-        double *partial_lh_child = dad_branch->partial_lh + (offset);
+        double *partial_lh_site = getPartialLhPattern(node_partial_lh, ptn, block, blocked);
+        double *partial_lh_child = getPartialLhPattern(dad_partial_lh, ptn, block, blocked);
         for (state = 0; state < nstates; state++) {
             tmp_anscentral_state_prob1[state] = 0.0;
             tmp_anscentral_state_prob2[state] = 0.0;
             for (cat = 0; cat < numCat; cat++) {
-                tmp_anscentral_state_prob1[state] += partial_lh_site[nstates * cat + state];
-                tmp_anscentral_state_prob2[state] += partial_lh_child[nstates * cat + state];
+                tmp_anscentral_state_prob1[state] += partial_lh_site[(nstates * cat + state) * lh_stride];
+                tmp_anscentral_state_prob2[state] += partial_lh_child[(nstates * cat + state) * lh_stride];
             }
             tmp_anscentral_state_prob1[state] *= tmp_state_freq[state];
             tmp_anscentral_state_prob2[state] *= tmp_state_freq[state];
@@ -1791,6 +2550,11 @@ double PhyloTree::computeLikelihoodBranchNaive(PhyloNeighbor *dad_branch, PhyloN
         }
 
     bool not_ptn_cat = (site_rate->getPtnCat(0) < 0);
+    // partial likelihoods may come from the SSE kernels in the pattern-blocked layout
+    bool blocked = isBlockedPartialLh();
+    int lh_stride = blocked ? LH_BLOCK_PATTERNS : 1;
+    double *node_partial_lh = unpackPartialLh(node_branch, 1);
+    double *dad_partial_lh = unpackPartialLh(dad_branch, 2);
 
 #ifdef _OPENMP
 #pragma omp parallel for reduction(+: tree_lh) private(ptn, cat, state1, state2)
@@ -1813,16 +2577,16 @@ double PhyloTree::computeLikelihoodBranchNaive(PhyloNeighbor *dad_branch, PhyloN
                     trans_mat);
         for (cat = 0; cat < ncat; cat++) {
             double lh_cat = 0.0; // likelihood of the pattern's category
-            size_t lh_offset = cat * nstates + ptn * block;
-            double *partial_lh_site = node_branch->partial_lh + lh_offset;
-            double *partial_lh_child = dad_branch->partial_lh + lh_offset;
+            size_t lh_offset = cat * nstates * lh_stride;
+            double *partial_lh_site = getPartialLhPattern(node_partial_lh, ptn, block, blocked) + lh_offset;
+            double *partial_lh_child = getPartialLhPattern(dad_partial_lh, ptn, block, blocked) + lh_offset;
             if (dad_state < nstates) { // single state
                 // external node
                 double *trans_state = trans_mat + ((not_ptn_cat ? cat : ptn_cat) * trans_size + dad_offset);
                 if (model->isSiteSpecificModel())
                     trans_state += (nstates * nstates * model->getPtnModelID(ptn));
                 for (state2 = 0; state2 < nstates; state2++)
-                    lh_cat += partial_lh_child[state2] * trans_state[state2];
+                    lh_cat += partial_lh_child[state2 * lh_stride] * trans_state[state2];
             } else {
                 // internal node, or external node but ambiguous character
                 for (state1 = 0; state1 < nstates; state1++) {
@@ -1831,8 +2595,8 @@ double PhyloTree::computeLikelihoodBranchNaive(PhyloNeighbor *dad_branch, PhyloN
                     if (model->isSiteSpecificModel())
                         trans_state += (nstates * nstates * model->getPtnModelID(ptn));
                     for (state2 = 0; state2 < nstates; state2++)
-                        lh_state += partial_lh_child[state2] * trans_state[state2];
-                    lh_cat += lh_state * partial_lh_site[state1];
+                        lh_state += partial_lh_child[state2 * lh_stride] * trans_state[state2];
+                    lh_cat += lh_state * partial_lh_site[state1 * lh_stride];
                 }
             }
             lh_ptn += lh_cat;
@@ -1896,11 +2660,10 @@ void PhyloTree::computePartialLikelihoodNaive(PhyloNeighbor *dad_branch, PhyloNo
     size_t nptn = aln->size();
 
     dad_branch->lh_scale_factor = 0.0;
-    memset(dad_branch->scale_num, 0, aln->size() * sizeof(UBYTE));
+    memset(dad_branch->scale_num, 0, aln->size() * sizeof(ScaleNum));
 
+    checkPartialLhStorage(dad_branch, dad);
     assert(dad_branch->partial_lh);
-    //if (!dad_branch->partial_lh)
-    //	dad_branch->partial_lh = newPartialLh();
     if (node->isLeaf() && dad) {
         /* external node */
         memset(dad_branch->partial_lh, 0, lh_size * sizeof(double));
@@ -1950,17 +2713,14 @@ void PhyloTree::computePartialLikelihoodNaive(PhyloNeighbor *dad_branch, PhyloNo
         FOR_NEIGHBOR_IT(node, dad, it)if ((*it)->node->name != ROOT_NAME) {
             computePartialLikelihoodNaive((PhyloNeighbor*) (*it), (PhyloNode*) node, pattern_scale);
 
-            dad_branch->lh_scale_factor += ((PhyloNeighbor*) (*it))->lh_scale_factor;
-
             if (!site_rate->isSiteSpecificRate())
             for (cat = 0; cat < discrete_cat; cat++)
             model_factory->computeTransMatrix((*it)->length * site_rate->getRate(cat), trans_mat + (cat * trans_size));
 
             bool not_ptn_cat = (site_rate->getPtnCat(0) < 0);
 
-            double sum_scale = 0.0;
 #ifdef _OPENMP
-#pragma omp parallel for reduction(+: sum_scale) private(ptn, cat, partial_lh_site)
+#pragma omp parallel for private(ptn, cat, partial_lh_site)
 #endif
             for (ptn = 0; ptn < nptn; ptn++)
             if (((PhyloNeighbor*) (*it))->scale_num[ptn] >= 0) {
@@ -1988,39 +2748,21 @@ void PhyloTree::computePartialLikelihoodNaive(PhyloNeighbor *dad_branch, PhyloNo
                     }
                 }
                 // check if one should scale partial likelihoods
-                bool do_scale = true;
-                partial_lh_site = dad_branch->partial_lh + (ptn * block);
-                for (cat = 0; cat < block; cat++)
-                if (partial_lh_site[cat] > SCALING_THRESHOLD) {
-                    do_scale = false;
-                    break;
-                }
-                if (!do_scale) continue;
-                // now do the likelihood scaling
-                /*
-                 double lh_max = partial_lh_site[0];
-                 for (cat = 1; cat < block; cat++)
-                 if (lh_max < partial_lh_site[cat]) lh_max = partial_lh_site[cat];
-                 for (cat = 0; cat < block; cat++)
-                 partial_lh_site[cat] /= lh_max;
-                 dad_branch->lh_scale_factor += log(lh_max) * (*aln)[ptn].frequency;
-
-                 */
-                for (cat = 0; cat < block; cat++)
-                partial_lh_site[cat] /= SCALING_THRESHOLD;
-                sum_scale += LOG_SCALING_THRESHOLD * (*aln)[ptn].frequency;
-                dad_branch->scale_num[ptn] += 1;
-
+                int exponent = scalePartialLhSite(dad_branch->partial_lh + (ptn * block), block);
+                if (!exponent) continue;
+                dad_branch->scale_num[ptn] += exponent;
                 if (pattern_scale)
-                pattern_scale[ptn] += LOG_SCALING_THRESHOLD;
+                pattern_scale[ptn] += exponent * LOG_SCALE_UNIT;
             }
-            dad_branch->lh_scale_factor += sum_scale;
         }
+        dad_branch->lh_scale_factor = sumScaleNum(dad_branch->scale_num, 0, nptn) * LOG_SCALE_UNIT;
         delete[] trans_mat;
         //for (cat = ncat - 1; cat >= 0; cat--)
         //  delete [] trans_mat[cat];
     }
     dad_branch->partial_lh_computed |= 1;
+    num_partial_lh_computed++;
+    unpinPartialLh(dad_branch, dad);
 
 }
 
@@ -2242,7 +2984,7 @@ double PhyloTree::computeFuncDerv(double value, double &df, double &ddf) {
     current_it->length = value;
     current_it_back->length = value;
     double lh;
-    if (params->fast_branch_opt) {
+    if (isFastBranchOpt()) {
         // Pre-compute Theta vector
         if (!theta_computed) {
             computeTheta(current_it, (PhyloNode*) current_it_back->node);
@@ -2277,10 +3019,8 @@ double PhyloTree::optimizeOneBranch(PhyloNode *node1, PhyloNode *node2, bool cle
     current_it_back->length = optx;
     //curScore = -negative_lh;
 
-    if (clearLH && current_len != optx) {
-        node1->clearReversePartialLh(node2);
-        node2->clearReversePartialLh(node1);
-    }
+    if (clearLH && current_len != optx)
+        markBranchDirty(node1, node2);
 
     return -negative_lh;
 }
@@ -2523,6 +3263,8 @@ double PhyloTree::computeDist(double *dist_mat, double *var_mat) {
             col_id[pos] = row_id[pos] + 1;
         }
     }
+    // AlignmentPairwise reads the leaf states in parallel
+    updateTipStates();
     // compute the upper-triangle of distance matrix
 #ifdef _OPENMP
 #pragma omp parallel for private(pos)
@@ -2771,16 +3513,9 @@ void PhyloTree::doNNI(NNIMove &move, bool clearLH) {
      outError("Wrong ID");
      }*/
 
-    PhyloNeighbor *node12_it = (PhyloNeighbor*) node1->findNeighbor(node2); // return neighbor of node1 which points to node 2
-    PhyloNeighbor *node21_it = (PhyloNeighbor*) node2->findNeighbor(node1); // return neighbor of node2 which points to node 1
-
     if (clearLH) {
-        // clear partial likelihood vector
-        node12_it->clearPartialLh();
-        node21_it->clearPartialLh();
-
-        node2->clearReversePartialLh(node1);
-        node1->clearReversePartialLh(node2);
+        // clear partial likelihood vectors containing the swapped branch
+        markBranchDirty(node1, node2, true);
         //if (params->nni5Branches)
         //	clearAllPartialLH();
     }
@@ -2935,7 +3670,12 @@ NNIMove PhyloTree::getBestNNIForBran(PhyloNode *node1, PhyloNode *node2, NNIMove
 			computePatternLikelihood(nniMoves[cnt].ptnlh, &score);
 
 		if (save_all_trees == 2) {
-			saveCurrentTree(score); // BQM: for new bootstrap
+			if (!nni_subtree_keys.empty()) {
+				TopologyHash hash = computeNNITopologyHash(nni_topo_hash, nni_subtree_keys, nni_dad_ids,
+						node1, node2, node1_nei->node, node2_nei->node);
+				saveCurrentTree(score, &hash);
+			} else
+				saveCurrentTree(score); // BQM: for new bootstrap
 		}
 
         // else, swap back, also recover the branch lengths
@@ -3091,8 +3831,7 @@ double PhyloTree::swapNNIBranch(double cur_score, PhyloNode *node1, PhyloNode *n
 
         // if better: return
         if (score > cur_score) {
-            node2->clearReversePartialLh(node1);
-            node1->clearReversePartialLh(node2);
+            markBranchDirty(node1, node2, true);
             cur_score = score;
             cout << "Swapped neighbors :" << node1_nei->node->id << " and " << node2_nei->node->id << endl;
             break;
@@ -3327,6 +4066,7 @@ double PhyloTree::swapSPR_old(double cur_score, int cur_depth, PhyloNode *node1,
         // else, swap back
         node2->updateNeighbor(dad1, dad2, len2);
         dad2->updateNeighbor(dad1, node2, len2);
+        resetDirtyPath();
         node2_nei->clearPartialLh();
         dad2_nei->clearPartialLh();
         node1_nei->length = node1_dad1_len;
@@ -3389,6 +4129,7 @@ double PhyloTree::optimizeSPR(double cur_score, PhyloNode *node, PhyloNode *dad)
         sibling2_nei->partial_lh = newPartialLh();
         sibling1_nei->clearPartialLh();
         sibling2_nei->clearPartialLh();
+        resetDirtyPath();
 
         // now try to move the subtree to somewhere else
         vector<PhyloNeighbor*> spr_path;
@@ -3433,6 +4174,7 @@ double PhyloTree::optimizeSPR(double cur_score, PhyloNode *node, PhyloNode *dad)
         delete[] sibling2_nei->partial_lh;
         sibling1_nei->partial_lh = sibling1_partial_lh;
         sibling2_nei->partial_lh = sibling2_partial_lh;
+        resetDirtyPath();
         //clearAllPartialLH();
 
     }
@@ -3503,6 +4245,8 @@ double PhyloTree::swapSPR(double cur_score, int cur_depth, PhyloNode *node1, Phy
         // clear partial likelihood from dad1 to node1
         node1_nei->clearPartialLh();
 
+        resetDirtyPath();
+
         // set new legnth as suggested by Alexis
         node1_nei->length = 0.9;
         dad1_nei->length = 0.9;
@@ -3560,6 +4304,7 @@ double PhyloTree::swapSPR(double cur_score, int cur_depth, PhyloNode *node1, Phy
             (*it2)->unclearPartialLh();
             index++;
         }
+        resetDirtyPath();
 
         // add to candiate SPR moves
         // Tung : why adding negative SPR move ?
@@ -3664,34 +4409,255 @@ double PhyloTree::assessSPRMove(double cur_score, const SPRMove &spr) {
 }
 
 double PhyloTree::optimizeSPR() {
+    if (isSuperTree()) {
+        outWarning("SPR search is not supported for partition models");
+        return computeLikelihood();
+    }
     double cur_score = computeLikelihood();
-    //spr_radius = leafNum / 5;
-    spr_radius = 10;
+    spr_radius = params->spr_radius;
     for (int i = 0; i < 100; i++) {
-        cout << "i = " << i << endl;
-        spr_moves.clear();
-        double score = optimizeSPR_old(cur_score, (PhyloNode*) root->neighbors[0]->node);
-        clearAllPartialLH();
-        // why this?
-        if (score <= cur_score) {
-            for (SPRMoves::iterator it = spr_moves.begin(); it != spr_moves.end(); it++) {
-                //cout << (*it).score << endl;
-                score = assessSPRMove(cur_score, *it);
-                // if likelihood score improves, apply to SPR
-                if (score > cur_score)
-                    break;
+        rankSPRMoves();
+        if (spr_moves.empty())
+            break;
+        vector<SPRMove> moves(spr_moves.begin(), spr_moves.end());
+        DoubleVector scores;
+        evaluateSPRMoves(moves, scores);
+        int best = 0;
+        for (int j = 1; j < moves.size(); j++)
+            if (scores[j] > scores[best])
+                best = j;
+        if (scores[best] <= cur_score + TOL_LIKELIHOOD)
+            break;
+        TopologyHash hash;
+        if (save_all_trees == 2) {
+            vector<TopologyHash> subtree_keys;
+            IntVector dad_ids;
+            hash = computeTopologyHash(&subtree_keys, &dad_ids);
+            hash = computeSPRTopologyHash(hash, subtree_keys, dad_ids, moves[best].prune_node, moves[best].prune_dad,
+                    moves[best].regraft_node, moves[best].regraft_dad);
+        }
+        doSPR(moves[best]);
+        cur_score = optimizeAllBranches();
+        if (save_all_trees == 2)
+            saveCurrentTree(cur_score, &hash);
+        cout << "SPR " << i + 1 << " : " << cur_score << endl;
+    }
+    return cur_score;
+}
+
+void PhyloTree::rankSPRMoves() {
+    spr_moves.clear();
+    // all partial parsimony vectors are computed first, the threads below only read them
+    initializeAllPartialPars();
+    clearAllPartialLH();
+    NodeVector nodes1, nodes2;
+    getBranches(nodes1, nodes2);
+    PhyloNodeVector prune_nodes, prune_dads;
+    for (int i = 0; i < nodes1.size(); i++) {
+        computePartialParsimony((PhyloNeighbor*) nodes1[i]->findNeighbor(nodes2[i]), (PhyloNode*) nodes1[i]);
+        computePartialParsimony((PhyloNeighbor*) nodes2[i]->findNeighbor(nodes1[i]), (PhyloNode*) nodes2[i]);
+        if (nodes2[i]->degree() == 3) {
+            prune_nodes.push_back((PhyloNode*) nodes1[i]);
+            prune_dads.push_back((PhyloNode*) nodes2[i]);
+        }
+        if (nodes1[i]->degree() == 3) {
+            prune_nodes.push_back((PhyloNode*) nodes2[i]);
+            prune_dads.push_back((PhyloNode*) nodes1[i]);
+        }
+    }
+    int num_prunes = prune_nodes.size();
+    if (num_prunes == 0)
+        return;
+    size_t pars_size = getBitsBlockSize();
+#ifdef _OPENMP
+    int num_threads = min(omp_get_max_threads(), num_prunes);
+#pragma omp parallel num_threads(num_threads)
+#endif
+    {
+        SPRMoves moves;
+        UINT *pars_buf = new UINT[(spr_radius + 2) * pars_size];
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (int i = 0; i < num_prunes; i++) {
+            PhyloNode *node = prune_nodes[i];
+            PhyloNode *dad = prune_dads[i];
+            PhyloNeighbor *sibling1 = NULL, *sibling2 = NULL;
+            FOR_NEIGHBOR_IT(dad, node, it) {
+                if (!sibling1)
+                    sibling1 = (PhyloNeighbor*) (*it);
+                else
+                    sibling2 = (PhyloNeighbor*) (*it);
             }
-            if (score <= cur_score)
+            UINT *pars_prune = ((PhyloNeighbor*) dad->findNeighbor(node))->partial_pars;
+            // after pruning, the two siblings are joined by one branch
+            rankSPRRegrafts(node, dad, pars_prune, sibling2->partial_pars, (PhyloNode*) sibling1->node, dad, 1,
+                    moves, pars_buf);
+            rankSPRRegrafts(node, dad, pars_prune, sibling1->partial_pars, (PhyloNode*) sibling2->node, dad, 1,
+                    moves, pars_buf);
+        }
+        delete[] pars_buf;
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        for (SPRMoves::iterator it = moves.begin(); it != moves.end(); it++)
+            spr_moves.add(it->prune_node, it->prune_dad, it->regraft_node, it->regraft_dad, it->score);
+    }
+}
+
+void PhyloTree::rankSPRRegrafts(PhyloNode *prune_node, PhyloNode *prune_dad, UINT *pars_prune, UINT *pars_up,
+        PhyloNode *node, PhyloNode *dad, int depth, SPRMoves &moves, UINT *pars_buf) {
+    size_t pars_size = getBitsBlockSize();
+    UINT *pars_join = pars_buf;
+    UINT *pars_tree = pars_buf + pars_size;
+    UINT *pars_node = pars_buf + (depth + 1) * pars_size;
+    FOR_NEIGHBOR_IT(node, dad, it) {
+        // the pruned tree seen from the branch (node, child) on the side of node
+        FOR_NEIGHBOR_DECLARE(node, dad, it2)
+            if (it2 != it)
                 break;
-        } else {
+        joinPartialParsimony(pars_up, ((PhyloNeighbor*) (*it2))->partial_pars, pars_node);
+        // regraft to the middle of the branch (node, child)
+        joinPartialParsimony(pars_node, ((PhyloNeighbor*) (*it))->partial_pars, pars_join);
+        int score = joinPartialParsimony(pars_join, pars_prune, pars_tree);
+        PhyloNode *child = (PhyloNode*) (*it)->node;
+        moves.add(prune_node, prune_dad, child, node, -score);
+        if (depth < spr_radius && !child->isLeaf())
+            rankSPRRegrafts(prune_node, prune_dad, pars_prune, pars_node, child, node, depth + 1, moves, pars_buf);
+    }
+}
 
-            cur_score = optimizeAllBranches();
-            cout << "SPR " << i + 1 << " : " << cur_score << endl;
-            cur_score = score;
+/**
+        @return mask of the bits from bit to the end of its word, at most up to end
+*/
+static inline UINT getBitsWordMask(int bit, int end) {
+    int off = bit & BITS_MODULO;
+    int len = min(UINT_BITS - off, end - bit);
+    return ((len == UINT_BITS) ? ~0U : ((1U << len) - 1)) << off;
+}
+
+int PhyloTree::joinPartialParsimony(UINT *pars1, UINT *pars2, UINT *pars) {
+    int pars_size = getBitsBlockSize();
+    int nstates = aln->num_states;
+    int nptn = aln->size();
+    int score = pars1[pars_size - 1] + pars2[pars_size - 1];
+    int i, ptn;
+    for (i = 0; i < pars_size - 1; i++)
+        pars[i] = pars1[i] & pars2[i];
+    if (UINT_BITS % nstates == 0 && nstates < UINT_BITS) {
+        // no state set crosses a word: find the empty intersections of a whole word at once.
+        // Constant patterns have all bits set and are never empty
+        int ptn_per_word = UINT_BITS / nstates;
+        UINT low_bits = 0;
+        for (i = 0; i < ptn_per_word; i++)
+            low_bits |= 1U << (i * nstates);
+        UINT all_states = (1U << nstates) - 1;
+        for (i = 0; i < pars_size - 1; i++) {
+            UINT nonempty = pars[i];
+            for (int shift = 1; shift < nstates; shift <<= 1)
+                nonempty |= nonempty >> shift;
+            UINT empty = ~nonempty & low_bits;
+            ptn = i * ptn_per_word;
+            // the bits behind the last pattern are not used
+            if (ptn + ptn_per_word > nptn)
+                empty &= (1U << ((nptn - ptn) * nstates)) - 1;
+            if (!empty)
+                continue;
+            pars[i] |= (pars1[i] | pars2[i]) & (empty * all_states);
+            for (; empty; empty >>= nstates, ptn++)
+                if (empty & 1)
+                    score += aln->at(ptn).frequency;
         }
+    } else {
+        for (ptn = 0; ptn < nptn; ptn++)
+            if (!aln->at(ptn).is_const) {
+                int begin = ptn * nstates, end = begin + nstates, bit;
+                for (bit = begin; bit < end; bit = (bit | BITS_MODULO) + 1)
+                    if (pars[bit >> BITS_DIV] & getBitsWordMask(bit, end))
+                        break;
+                if (bit < end)
+                    continue;
+                for (bit = begin; bit < end; bit = (bit | BITS_MODULO) + 1) {
+                    int word = bit >> BITS_DIV;
+                    pars[word] |= (pars1[word] | pars2[word]) & getBitsWordMask(bit, end);
+                }
+                score += aln->at(ptn).frequency;
+            }
     }
-    return cur_score;
-    //return optimizeAllBranches();
+    pars[pars_size - 1] = score;
+    return score;
+}
+
+void PhyloTree::evaluateSPRMoves(vector<SPRMove> &moves, DoubleVector &scores) {
+    int num_moves = moves.size();
+    scores.resize(num_moves);
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = min(omp_get_max_threads(), num_moves);
+#endif
+    while (thread_trees.size() < num_threads)
+        thread_trees.push_back(new PhyloTree());
+    TreeSnapshot snapshot;
+    saveSnapshot(snapshot);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(num_threads)
+#endif
+    {
+        int thread_id = 0;
+#ifdef _OPENMP
+        thread_id = omp_get_thread_num();
+#endif
+        PhyloTree *tree = thread_trees[thread_id];
+        tree->copyWorkingTree(this);
+        NodeVector tree_nodes;
+        tree->getNodesByID(tree_nodes);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (int i = 0; i < num_moves; i++) {
+            SPRMove move;
+            move.prune_node = (PhyloNode*) tree_nodes[moves[i].prune_node->id];
+            move.prune_dad = (PhyloNode*) tree_nodes[moves[i].prune_dad->id];
+            move.regraft_node = (PhyloNode*) tree_nodes[moves[i].regraft_node->id];
+            move.regraft_dad = (PhyloNode*) tree_nodes[moves[i].regraft_dad->id];
+            tree->doSPR(move);
+            scores[i] = tree->optimizeAllBranches(2);
+            // back to the tree of this thread, only the vectors around the changed nodes are recomputed
+            tree->restoreSnapshot(snapshot);
+        }
+    }
+}
+
+void PhyloTree::doSPR(SPRMove &move) {
+    PhyloNode *node = move.prune_node;
+    PhyloNode *dad = move.prune_dad;
+    PhyloNode *node2 = move.regraft_node;
+    PhyloNode *dad2 = move.regraft_dad;
+    PhyloNeighbor *dad_nei1 = NULL, *dad_nei2 = NULL;
+    FOR_NEIGHBOR_IT(dad, node, it) {
+        if (!dad_nei1)
+            dad_nei1 = (PhyloNeighbor*) (*it);
+        else
+            dad_nei2 = (PhyloNeighbor*) (*it);
+    }
+    PhyloNode *sibling1 = (PhyloNode*) dad_nei1->node;
+    PhyloNode *sibling2 = (PhyloNode*) dad_nei2->node;
+    // remove the subtree leading to node
+    double sum_len = dad_nei1->length + dad_nei2->length;
+    sibling1->updateNeighbor(dad, sibling2, sum_len);
+    sibling2->updateNeighbor(dad, sibling1, sum_len);
+    // insert it in the middle of the branch (dad2, node2)
+    double len2 = node2->findNeighbor(dad2)->length;
+    dad_nei1->node = dad2;
+    dad_nei1->length = len2 / 2;
+    dad2->updateNeighbor(node2, dad, len2 / 2);
+    dad_nei2->node = node2;
+    dad_nei2->length = len2 / 2;
+    node2->updateNeighbor(dad2, dad, len2 / 2);
+    markBranchDirty(sibling1, sibling2, true);
+    markBranchDirty(dad, dad2, true);
+    markBranchDirty(dad, node2, true);
 }
 
 double PhyloTree::optimizeSPRBranches() {
@@ -4040,6 +5006,8 @@ void PhyloTree::reinsertLeaf(Node *leaf, Node *node, Node *dad) {
         }
         first = false;
     }
+    markBranchDirty((PhyloNode*) adjacent_node, (PhyloNode*) node, true);
+    markBranchDirty((PhyloNode*) adjacent_node, (PhyloNode*) dad, true);
 }
 
 bool PhyloTree::isSupportedNode(PhyloNode* node, int min_support) {
@@ -4190,7 +5158,7 @@ void PhyloTree::randomizeNeighbors(Node *node, Node *dad) {
         node = root;
     FOR_NEIGHBOR_IT(node, dad, it)randomizeNeighbors((*it)->node, node);
 
-    random_shuffle(node->neighbors.begin(), node->neighbors.end());
+    random_shuffle(node->neighbors.begin(), node->neighbors.end(), p_myrandom);
 }
 
 void PhyloTree::printTransMatrices(Node *node, Node *dad) {
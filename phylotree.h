@@ -30,6 +30,8 @@
 #include "phylonode.h"
 #include "optimization.h"
 #include "rateheterogeneity.h"
+#include "phylokernel.h"
+#include "memarena.h"
 
 
 const double MIN_BRANCH_LEN = 0.000001; // NEVER TOUCH THIS CONSTANT AGAIN PLEASE!
@@ -41,6 +43,16 @@ const double TOL_LIKELIHOOD_PARAMOPT = 0.01; // BQM: newly introduced for ModelF
 const static double SCALING_THRESHOLD = 1e-100;
 const static double SCALING_THRESHOLD_INVER = 1 / SCALING_THRESHOLD;
 const static double LOG_SCALING_THRESHOLD = log(SCALING_THRESHOLD);
+// partial likelihoods are scaled by powers of 2, log of the factor of one unit of scale_num
+const static double LOG_SCALE_UNIT = log(0.5);
+// pattern log-likelihoods are summed up pairwise down to ranges of this many patterns
+const static int PAIRWISE_SUM_PATTERNS = 32;
+// scaling threshold for partial likelihoods stored in single precision (2^-64)
+const static double SCALING_THRESHOLD_FLOAT = ldexp(1.0, -64);
+// alignments with more patterns store partial likelihoods in single precision by default
+const int LH_FLOAT_MIN_PATTERNS = 100000;
+// site repeats are tracked while the lookup table of a node has at most this many entries per pattern
+const int SITE_REPEAT_TABLE_FACTOR = 4;
 const int SPR_DEPTH = 2;
 
 using namespace Eigen;
@@ -54,10 +66,18 @@ typedef Array<double, Dynamic, Dynamic, RowMajor> RowMajorArrayXXd;
 typedef std::map< string, double > StringDoubleMap;
 typedef std::map< int, PhyloNode* > IntPhyloNodeMap;
 
+/**
+        generator of random_shuffle() based on random_int(), so that shuffles draw from
+        the random stream of the calling thread instead of rand()
+ */
+extern ptrdiff_t (*p_myrandom)(ptrdiff_t);
+
 #define MappedMat(NSTATES) Map<Matrix<double, NSTATES, NSTATES> >
 #define MappedArr2D(NSTATES) Map<Array<double, NSTATES, NSTATES> >
 #define MappedRowVec(NSTATES) Map<Matrix<double, 1, NSTATES> >
 #define MappedVec(NSTATES) Map<Matrix<double, NSTATES, 1> >
+// with an odd number of states, the vector of a pattern or category may start at an unaligned address
+#define LH_ALIGN(NSTATES) ((NSTATES) % 2 == 0 ? Aligned : Unaligned)
 #define Matrix(NSTATES) Matrix<double, NSTATES, NSTATES>
 #define RowVector(NSTATES) Matrix<double, 1, NSTATES>
 #define MappedRowArr2DDyn Map<Array<double, Dynamic, Dynamic, RowMajor> >
@@ -77,8 +97,17 @@ struct SPRMove {
 
 struct SPR_compare {
 
-    bool operator()(SPRMove s1, SPRMove s2) const {
-        return s1.score > s2.score;
+    bool operator()(const SPRMove &s1, const SPRMove &s2) const {
+        if (s1.score != s2.score)
+            return s1.score > s2.score;
+        // moves of the same score are ordered by their nodes, so that none of them is lost
+        if (s1.prune_node->id != s2.prune_node->id)
+            return s1.prune_node->id < s2.prune_node->id;
+        if (s1.prune_dad->id != s2.prune_dad->id)
+            return s1.prune_dad->id < s2.prune_dad->id;
+        if (s1.regraft_node->id != s2.regraft_node->id)
+            return s1.regraft_node->id < s2.regraft_node->id;
+        return s1.regraft_dad->id < s2.regraft_dad->id;
     }
 };
 
@@ -104,6 +133,31 @@ struct PruningInfo {
 
 };
 
+/**
+    a child of a vector computed by PhyloTree::computePartialLikelihoodSliced()
+*/
+struct LhSliceChild {
+    /** neighbor of the child */
+    PhyloNeighbor *child;
+    /** transition matrices of the branch to the child */
+    double *trans_mat;
+    /** lookup table of PhyloTree::computeTipLhTable() if the child is a leaf, NULL otherwise */
+    double *tip_lh_table;
+    /** TRUE if the child is a task of the same traversal, it then stays pinned until this task is done */
+    bool planned;
+};
+
+/**
+    a vector computed by PhyloTree::computePartialLikelihoodSliced()
+*/
+struct LhSliceTask {
+    PhyloNeighbor *dad_branch;
+    PhyloNode *dad;
+    vector<LhSliceChild> children;
+    /** sumScaleNum() per slice, summed up after all slices are done */
+    vector<int64_t> scale_sum;
+};
+
 struct SwapNNIParam {
     double nni1_score;
     double nni1_brlen;
@@ -205,6 +259,23 @@ public:
      */
     void copyPhyloTree(PhyloTree *tree);
 
+    /**
+            make this tree a working copy of another tree, to evaluate moves in a separate thread:
+            same topology, node IDs and branch lengths (see MTree::copyTreeExact()), the alignment,
+            model and rates of the other tree, but own partial likelihood vectors and scratch buffers.
+            The shared model and rates are not deleted with this tree
+            @param tree the tree to copy
+     */
+    void copyWorkingTree(PhyloTree *tree);
+
+    /**
+            restore a snapshot of saveSnapshot(), see MTree::restoreSnapshot(). Only the partial likelihood
+            vectors containing a changed node are invalidated, the others stay valid
+            @param snapshot the snapshot
+            @param changed_nodes (OUT) if not NULL, the nodes whose neighbors or branch lengths were changed
+     */
+    virtual void restoreSnapshot(TreeSnapshot &snapshot, NodeVector *changed_nodes = NULL);
+
 
     /**
             set the alignment, important to compute parsimony or likelihood score
@@ -371,12 +442,82 @@ public:
     virtual void initializeAllPartialLh();
 
     /**
-            initialize partial_lh vector of all PhyloNeighbors, allocating central_partial_lh
+            initialize partial_lh vector of all PhyloNeighbors, allocating central_partial_lh.
+            Neighbors pointing to a leaf get no partial_lh here, see getTipPartialLh()
             @param node the current node
             @param dad dad of the node, used to direct the search
-            @param index the index
+            @param index the index of scale_num and partial_pars vectors
+            @param indexlh the index of partial_lh vectors
+     */
+    virtual void initializeAllPartialLh(int &index, int &indexlh, PhyloNode *node = NULL, PhyloNode *dad = NULL);
+
+    /**
+            the SSE kernels use lookup tables for leaves, so that the partial likelihood vector
+            of a neighbor pointing to a leaf is only allocated on demand by this function
+            @param leaf the leaf node
+            @return partial_lh vector reserved for the leaf
+     */
+    double *getTipPartialLh(Node *leaf);
+
+    /**
+            make sure that a neighbor has the proper partial_lh storage before computing it:
+            the vector reserved for the leaf if it points to a leaf, otherwise a block of
+            central_partial_lh. This is needed because topology changes (IQP, SPR)
+            may redirect a neighbor from a leaf to an internal node and vice versa.
+            Vectors allocated by newPartialLh() are left untouched.
+            The vector and its children are pinned until the kernel calls unpinPartialLh().
+            @param dad_branch the neighbor
+            @param dad its dad, used to direct the tranversal
+     */
+    void checkPartialLhStorage(PhyloNeighbor *dad_branch, PhyloNode *dad);
+
+    /**
+            with lh_mem_limit: keep the partial likelihood vectors of dad_branch and its children
+            from being evicted while they are computed or read. No effect without lh_mem_limit.
+            @param dad_branch the neighbor
+            @param dad its dad, used to direct the tranversal
+     */
+    void pinPartialLh(PhyloNeighbor *dad_branch, PhyloNode *dad);
+
+    /**
+            undo pinPartialLh()
+            @param dad_branch the neighbor
+            @param dad its dad, used to direct the tranversal
+     */
+    void unpinPartialLh(PhyloNeighbor *dad_branch, PhyloNode *dad);
+
+    /**
+            @return TRUE if the partial likelihood vectors share a pool limited by lh_mem_limit
+     */
+    bool isPartialLhPooled() {
+        return partial_lh_slots != NULL;
+    }
+
+    /**
+            give the central_partial_lh block of a neighbor pointing to a leaf back to the pool,
+            as the SSE kernels do not need it
+            @param dad_branch the neighbor pointing to a leaf
+     */
+    void releaseTipPartialLh(PhyloNeighbor *dad_branch);
+
+    /**
+            @return the number of different tip states (including ambiguous states and gap) in the alignment
+     */
+    int getNumTipStates();
+
+    /**
+            @param state a character state of the alignment
+            @return index of the state in the tip lookup tables
+     */
+    inline int getTipStateIndex(char state) {
+        return (state == STATE_UNKNOWN) ? num_tip_states - 1 : state;
+    }
+
+    /**
+            compute the partial likelihood vector (one category) of a tip for all tip states,
+            stored into tip_partial_lh_state
      */
-    virtual void initializeAllPartialLh(int &index, PhyloNode *node = NULL, PhyloNode *dad = NULL);
+    void initTipStates();
 
 
     /**
@@ -384,6 +525,41 @@ public:
      */
     void clearAllPartialLH();
 
+    /**
+            dirty-path tracking: tell that the partial likelihood vectors containing the branch (node1,node2)
+            are not computed, after its length or the topology around it was changed.
+            The walk stops at vectors still marked PARTIAL_LH_DIRTY since an earlier call, because all
+            vectors containing those were marked then. Marked vectors are recomputed lazily along the path
+            to the next evaluated branch.
+            @param node1 one end of the branch
+            @param node2 the other end of the branch
+            @param topology_changed TRUE if subtrees were moved around the branch (NNI, SPR, leaf insertion)
+     */
+    void markBranchDirty(PhyloNode *node1, PhyloNode *node2, bool topology_changed = false);
+
+    /**
+            forget the marks of markBranchDirty(), must be called after the tree or partial likelihood
+            flags were restored by other means than recomputation
+     */
+    void resetDirtyPath() {
+        dirty_path_epoch++;
+    }
+
+    /**
+            print the number of partial likelihood vectors invalidated, recomputed and reused
+            @param out output stream
+     */
+    void writePartialLhInfo(ostream &out);
+
+    /**
+            NUMA benchmark: print for every thread how many pages of its pattern slice of the partial
+            likelihood vectors are stored on its own or another NUMA node, then time full likelihood
+            evaluations from scratch
+            @param num_evals number of likelihood evaluations
+            @param out output stream
+     */
+    void benchmarkNumaPlacement(int num_evals, ostream &out);
+
     /**
      * compute all partial likelihoods if not computed before
      */
@@ -397,14 +573,185 @@ public:
     /** get the number of bytes occupied by partial_lh */
     int getPartialLhBytes();
 
+    /**
+            @return number of patterns reserved in a partial likelihood vector: the number of
+            patterns rounded up to a multiple of LH_BLOCK_PATTERNS
+     */
+    size_t getPartialLhNPattern();
+
+    /**
+            @return TRUE if partial likelihood vectors are stored in the pattern-blocked layout.
+            This is only the case if lh_layout asks for it and the SSE kernels are used,
+            the Naive kernels always work on the pattern-major layout
+     */
+    bool isBlockedPartialLh();
+
+    /**
+            locate a pattern in a partial likelihood vector of either layout. Entry [cat][state]
+            of the pattern is found at index (cat*nstates+state) * (blocked ? LH_BLOCK_PATTERNS : 1)
+            @param partial_lh partial likelihood vector
+            @param ptn pattern index
+            @param block number of entries per pattern (ncat * nstates)
+            @param blocked result of isBlockedPartialLh()
+            @return pointer to entry [0][0] of the pattern
+     */
+    inline double *getPartialLhPattern(double *partial_lh, size_t ptn, size_t block, bool blocked) {
+        if (!blocked)
+            return partial_lh + ptn * block;
+        size_t ptn_in_block = ptn % LH_BLOCK_PATTERNS;
+        return partial_lh + ((ptn - ptn_in_block) * block + ptn_in_block);
+    }
+
+    /**
+            @return TRUE if central_partial_lh should store single precision partial likelihoods.
+            This requires lh_float and the SSE kernels; all kernels still compute in double precision
+            on copies made by unpackPartialLh()
+     */
+    bool usesFloatPartialLh();
+
+    /**
+            @return number of doubles of one block of central_partial_lh
+     */
+    size_t getCentralBlockSize();
+
+    /**
+            @param partial_lh a partial likelihood vector
+            @return TRUE if the vector is stored in single precision
+     */
+    inline bool isFloatPartialLh(double *partial_lh) {
+        return float_partial_lh && partial_lh >= central_partial_lh
+                && partial_lh < central_partial_lh + central_partial_lh_size;
+    }
+
+    /**
+            get the partial likelihoods of a neighbor in double precision. The whole vector is
+            converted, unless the scratch vector still holds it from the previous call
+            @param nei the neighbor
+            @param slot scratch vector (1 or 2) receiving the converted copy of a single precision vector
+            @return nei->partial_lh or the scratch vector
+     */
+    double *unpackPartialLh(PhyloNeighbor *nei, int slot);
+
+    /**
+            let a kernel compute the partial likelihoods of a neighbor with single precision storage
+            in double precision: nei->partial_lh is redirected to scratch vector 0
+            @param nei the neighbor
+            @return the single precision storage of nei to be passed to packPartialLh(), or NULL
+     */
+    double *redirectPartialLh(PhyloNeighbor *nei);
+
+    /**
+            convert the partial likelihoods computed after redirectPartialLh() back to single precision.
+            Vectors that over- or underflow in single precision keep a double precision vector
+            from extra_partial_lh instead.
+            @param nei the neighbor
+            @param float_lh single precision storage returned by redirectPartialLh()
+     */
+    void packPartialLh(PhyloNeighbor *nei, double *float_lh);
+
+    /**
+            forget the copies of unpackPartialLh(), needed after writing single precision
+            vectors other than by packPartialLh()
+     */
+    void invalidateUnpackedLh();
+
+    /**
+            classify the patterns into site repeats: patterns that are identical on the taxa below
+            dad_branch get the same class, numbered in order of first appearance. The classes are
+            stored in dad_branch->site_repeat and derived from those of the children, which must
+            be computed before.
+            @param dad_branch the branch leading to the subtree
+            @param dad its dad
+            @return number of classes, or 0 if the classes of a child are not available or the
+            lookup table would exceed SITE_REPEAT_TABLE_FACTOR entries per pattern (and 2^16 entries)
+     */
+    int computeSiteRepeats(PhyloNeighbor *dad_branch, PhyloNode *dad);
+
     /**
             allocate memory for a scale num vector
      */
-    UBYTE *newScaleNum();
+    ScaleNum *newScaleNum();
 
     /** get the number of bytes occupied by scale_num */
     int getScaleNumBytes();
 
+    /**
+            @param lh_max largest partial likelihood of a pattern
+            @return exponent of the power of 2 that brings lh_max into [0.5,1), 0 for lh_max = 0.
+            Limited to 1022 so that the factor is finite, denormals are scaled again later
+     */
+    static inline int getScaleExponent(double lh_max) {
+        int exponent;
+        frexp(lh_max, &exponent);
+        return min(-exponent, 1022);
+    }
+
+    /**
+            numerical scaling of the partial likelihoods of a pattern stored one after another:
+            if their maximum dropped to scaling_threshold or below, all are multiplied by a power of 2.
+            The maximum is taken with vector instructions and without early exit
+            @param lh partial likelihoods of the pattern
+            @param n number of entries
+            @return exponent to add to scale_num of the pattern, 0 if not scaled
+     */
+    inline int scalePartialLhSite(double *lh, int n) {
+        double lh_max = Map<ArrayXd>(lh, n).maxCoeff();
+        if (lh_max > scaling_threshold)
+            return 0;
+        int exponent = getScaleExponent(lh_max);
+        if (exponent)
+            Map<ArrayXd>(lh, n) *= ldexp(1.0, exponent);
+        return exponent;
+    }
+
+    /**
+            the scaling factor of a partial likelihood vector is applied lazily: the kernels only add
+            exponents to scale_num, the factor is derived once the vector is complete
+            @param scale_num scaling exponents of the vector
+            @param ptn_begin first pattern
+            @param ptn_end pattern after the last one
+            @return sum of the exponents of the patterns weighted by their frequency
+     */
+    int64_t sumScaleNum(ScaleNum *scale_num, int ptn_begin, int ptn_end);
+
+    /**
+            sum of pattern values weighted by their frequency. Ranges of patterns are halved down to
+            PAIRWISE_SUM_PATTERNS patterns and added up pairwise, so the order of summation is fixed
+            and the result is the same for any number of threads
+            @param ptn_values one value per pattern
+            @param ptn_begin first pattern
+            @param ptn_end pattern after the last one
+            @return sum of ptn_values[ptn] * frequency of ptn
+     */
+    double sumPatternLh(double *ptn_values, int ptn_begin, int ptn_end);
+
+    /**
+            get the likelihood contribution of the invariable category to each pattern,
+            p_invar * state_freq[state] for constant patterns and 0 otherwise. The array is only
+            recomputed if the model parameters, the rates or p_invar have changed, so the kernels
+            add it without looking up the Pattern objects
+            @return ptn_invar
+     */
+    double *getPtnInvar();
+
+    /**
+            build tip_states for the current alignment, if not done yet. Must be called outside of
+            parallel regions, getTipStates() is then safe to use from several threads
+     */
+    virtual void updateTipStates();
+
+    /**
+            get the states of a sequence at all patterns. They are stored taxon by taxon in one
+            contiguous array, so that the leaf paths of the kernels do not read the Pattern objects
+            @param seq_id sequence ID (node->id of a leaf)
+            @return state of every pattern, padded with STATE_UNKNOWN up to tip_states_stride
+     */
+    unsigned char *getTipStates(int seq_id) {
+        if (tip_states_aln != aln || tip_states_nptn != aln->size())
+            updateTipStates();
+        return tip_states + (size_t) seq_id * tip_states_stride;
+    }
+
     /**
             compute the partial likelihood at a subtree
             @param dad_branch the branch leading to the subtree
@@ -415,9 +762,169 @@ public:
     void computePartialLikelihoodNaive(PhyloNeighbor *dad_branch, PhyloNode *dad = NULL,
             double *pattern_scale = NULL);
 
+    /**
+            computePartialLikelihood() for both layouts (see isBlockedPartialLh()), the entries
+            of a pattern are found with getPartialLhPattern()
+     */
     template<int NSTATES>
     inline void computePartialLikelihoodSSE(PhyloNeighbor *dad_branch, PhyloNode *dad = NULL, double *pattern_scale = NULL);
 
+    /**
+            multiply the partial likelihoods of a child into a range of pattern blocks of dad_branch
+            and scale them, the inner loop of computePartialLikelihoodSSE() for the blocked layout
+            @param dad_branch the vector being computed
+            @param child a child of dad_branch
+            @param child_lh double precision partial likelihoods of the child, NULL for a leaf
+            @param trans_mat transition matrices of the branch to the child
+            @param tip_lh_table lookup table of computeTipLhTable() for a leaf
+            @param lk_funcs vectorized kernels
+            @param block_begin first pattern block
+            @param block_end pattern block after the last one
+            @param pattern_scale if not NULL, the log scaling factors are added per pattern
+     */
+    template<int NSTATES>
+    void computePartialLhBlockRange(PhyloNeighbor *dad_branch, PhyloNeighbor *child, double *child_lh,
+            double *trans_mat, double *tip_lh_table, LikelihoodKernelFuncs &lk_funcs,
+            int block_begin, int block_end, double *pattern_scale);
+
+    /**
+            computePartialLikelihoodSSE() for a whole traversal with several threads: the vectors
+            that are not computed are collected in post-order, then each thread computes its slice of
+            pattern blocks of all of them, and the scaling factors are summed up at the end.
+            With lh_mem_limit the traversal is computed in parts, see planSlicedPartialLh()
+            @param dad_branch the neighbor
+            @param dad its dad, used to direct the tranversal
+     */
+    template<int NSTATES>
+    void computePartialLikelihoodSliced(PhyloNeighbor *dad_branch, PhyloNode *dad);
+
+    /**
+            collect the vectors of computePartialLikelihoodSliced() into lh_slice_tasks
+            and prepare their storage, transition matrices and tip lookup tables. The storage of a
+            vector is taken after its children are planned. With lh_mem_limit, the tasks collected
+            so far are computed by runSlicedPartialLh() before they pin half of the pool
+            @param dad_branch the neighbor
+            @param dad its dad, used to direct the tranversal
+            @return TRUE if a task was added for dad_branch
+     */
+    template<int NSTATES>
+    bool planSlicedPartialLh(PhyloNeighbor *dad_branch, PhyloNode *dad);
+
+    /**
+            compute all tasks of lh_slice_tasks, each thread on its slice of pattern blocks, and
+            remove them. The children of a task are unpinned, its own vector stays pinned until
+            the task of its dad is done
+     */
+    template<int NSTATES>
+    void runSlicedPartialLh();
+
+    /**
+            @return number of threads of computePartialLikelihoodSliced(), each owning a fixed slice of
+            pattern blocks given by lh_slice_begin
+     */
+    int getNumLhSlices();
+
+    /**
+            first-touch NUMA placement: every thread writes the pages starting in its slice of
+            getNumLhSlices() in each of the freshly allocated vectors, so that the operating system
+            puts these pages on its node. Only done with OpenMP and more than one thread
+            @param mem start of the vectors
+            @param num_vectors number of vectors
+            @param vector_bytes size of one vector in bytes
+     */
+    void touchLhSlices(void *mem, uint64_t num_vectors, size_t vector_bytes);
+
+    /**
+            computePartialLikelihoodSSE() for a number of states without compiled kernel,
+            see hasCompiledKernel(). Uses the pattern-by-pattern layout
+     */
+    void computePartialLikelihoodGeneric(PhyloNeighbor *dad_branch, PhyloNode *dad = NULL, double *pattern_scale = NULL);
+
+    /**
+            @param nstates number of states
+            @return TRUE if the SSE kernels are instantiated for nstates, otherwise the generic kernels are used
+     */
+    static bool hasCompiledKernel(int nstates);
+
+    /**
+            increase trans_version if the model parameters or the rates of the categories
+            have changed since the last call
+     */
+    void updateTransVersion();
+
+    /**
+            invalidate all partial likelihood vectors if they were computed under other model
+            parameters or category rates than the current ones (see trans_version). Called at the
+            entry points of the likelihood functions, so that the optimizers of the model and rate
+            parameters do not have to clear the vectors after every change
+     */
+    void updatePartialLhVersion();
+
+    /**
+            allocate the transition matrix cache of a branch for the current number of
+            categories and states, and update trans_version. Both directions of a branch share
+            the cache held by the neighbor pointing to the node with the larger ID
+            @param dad_branch the branch
+            @param dad the node at the other end of dad_branch
+            @return the neighbor holding the cache
+     */
+    PhyloNeighbor *prepareTransMatrix(PhyloNeighbor *dad_branch, PhyloNode *dad);
+
+    /**
+            get the transition matrices of all rate categories for the length of a branch.
+            They are cached on the branch and only recomputed if the branch length,
+            the model parameters or the rates have changed
+            @param dad_branch the branch
+            @param dad the node at the other end of dad_branch
+            @return transition matrices, ncat blocks of size nstates*nstates
+     */
+    double *getTransMatrix(PhyloNeighbor *dad_branch, PhyloNode *dad);
+
+    /**
+            get the transition matrices of a branch with row i multiplied by state frequency i
+            @param dad_branch the branch
+            @param dad the node at the other end of dad_branch
+            @param state_freq state frequencies
+            @return transition matrices in a temporary array that is overwritten by the next call
+     */
+    double *getTransMatrixFreq(PhyloNeighbor *dad_branch, PhyloNode *dad, double *state_freq);
+
+    /**
+            get the transition matrices times state frequencies and their 1st and 2nd derivatives
+            for the length of a branch, cached on the branch like getTransMatrix()
+            @param dad_branch the branch
+            @param dad the node at the other end of dad_branch
+            @param state_freq state frequencies
+            @return 3 consecutive arrays of ncat * nstates * nstates entries
+     */
+    double *getTransDervFreq(PhyloNeighbor *dad_branch, PhyloNode *dad, double *state_freq);
+
+    /**
+            compute the lookup table of the tip-inner case: for each tip state s and category c,
+            tip_lh_table[s][c][j] = sum_i trans_mat[c][j][i] * tip_partial_lh_state[s][i]
+            @param trans_mat transition matrices of all categories
+            @param tip_lh_table (OUT) lookup table of size getNumTipStates() * ncat * NSTATES
+     */
+    template<int NSTATES>
+    void computeTipLhTable(double *trans_mat, double *tip_lh_table);
+
+    /**
+            compute the lookup table for a branch adjacent to a tip: for each tip state s and category c,
+            tip_lh_table[s][c][i] = sum_j tip_partial_lh_state[s][j] * trans_mat[c][j][i]
+            @param trans_mat transition matrices of all categories
+            @param tip_lh_table (OUT) lookup table of size getNumTipStates() * ncat * NSTATES
+     */
+    template<int NSTATES>
+    void computeTipBranchTable(double *trans_mat, double *tip_lh_table);
+
+    /**
+            computeTipLhTable() and computeTipBranchTable() for any number of states
+            @param trans_mat transition matrices of all categories
+            @param tip_lh_table (OUT) lookup table of size getNumTipStates() * ncat * nstates
+            @param transpose FALSE for computeTipLhTable(), TRUE for computeTipBranchTable()
+     */
+    void computeTipTableGeneric(double *trans_mat, double *tip_lh_table, bool transpose);
+
     /**
             compute tree likelihood on a branch. used to optimize branch length
             @param dad_branch the branch leading to the subtree
@@ -428,12 +935,21 @@ public:
      */
     virtual double computeLikelihoodBranch(PhyloNeighbor *dad_branch, PhyloNode *dad, double *pattern_lh = NULL);
 
+    /**
+            computeLikelihoodBranch() for both layouts, the patterns are taken in groups of
+            the stride of getPartialLhPattern(): single patterns or pattern blocks
+     */
     template<int NSTATES>
     inline double computeLikelihoodBranchSSE(PhyloNeighbor *dad_branch, PhyloNode *dad, double *pattern_lh = NULL);
 
     double computeLikelihoodBranchNaive(PhyloNeighbor *dad_branch, PhyloNode *dad,
             double *pattern_lh = NULL, double *pattern_rate = NULL);
 
+    /**
+            computeLikelihoodBranchSSE() for a number of states without compiled kernel
+     */
+    double computeLikelihoodBranchGeneric(PhyloNeighbor *dad_branch, PhyloNode *dad, double *pattern_lh = NULL);
+
     /**
             compute tree likelihood when a branch length collapses to zero
             @param dad_branch the branch leading to the subtree
@@ -545,6 +1061,11 @@ public:
 
     double computeLikelihoodDervNaive(PhyloNeighbor *dad_branch, PhyloNode *dad, double &df, double &ddf);
 
+    /**
+            computeLikelihoodDervSSE() for a number of states without compiled kernel
+     */
+    double computeLikelihoodDervGeneric(PhyloNeighbor *dad_branch, PhyloNode *dad, double &df, double &ddf);
+
     template<int NSTATES>
     inline double computeLikelihoodDervSSE(PhyloNeighbor *dad_branch, PhyloNode *dad, double &df, double &ddf);
 
@@ -713,8 +1234,18 @@ public:
             Auxilary functions and varialbes for speeding up branch length optimization (RAxML Trick)
      ****************************************************************************/
 
+    /**
+            TRUE if theta_all holds the vector of the branch being optimized
+     */
     bool theta_computed;
 
+    /**
+            @return TRUE if branch lengths are optimized on theta_all (computeTheta() once per branch,
+            then computeLikelihoodDervFast() per Newton step), i.e. for reversible GTR-type models
+            with the SSE kernels
+     */
+    bool isFastBranchOpt();
+
     double computeLikelihoodDervFast(PhyloNeighbor *dad_branch, PhyloNode *dad, double &df, double &ddf);
 
     double computeLikelihoodDervFastNaive(PhyloNeighbor *dad_branch, PhyloNode *dad, double &df, double &ddf);
@@ -731,7 +1262,8 @@ public:
 
     /**
      *	NSTATES x NUMCAT x (number of patterns) array
-     *	Used to store precomputed values when optimizing branch length
+     *	Used to store precomputed values when optimizing branch length.
+     *	computeThetaSSE() stores it as [pattern][category][state] in eigen space
      *	See Tung's report on 07.05.2012 for more information
      */
     double* theta_all;
@@ -922,15 +1454,62 @@ public:
 
     /****************************************************************************
             Subtree Pruning and Regrafting by maximum likelihood
-            NOTE: NOT DONE YET
      ****************************************************************************/
 
     /**
-            search by Subtree pruning and regrafting
+            search by Subtree pruning and regrafting: in each round the regrafts within spr_radius
+            branches of the pruning point are ranked by parsimony (see rankSPRMoves()), the best
+            MAX_SPR_MOVES of them are evaluated with all branch lengths optimized (see evaluateSPRMoves())
+            and the best one is applied if it improves the likelihood
             @return the likelihood of the tree
      */
     double optimizeSPR();
 
+    /**
+            rank all SPR moves with a regrafting branch at most spr_radius branches away from the
+            pruning point by the parsimony score of the resulting tree, without changing the tree.
+            The pruning points are scanned in parallel threads.
+            spr_moves gets the MAX_SPR_MOVES moves of the best parsimony score (score = -parsimony)
+     */
+    void rankSPRMoves();
+
+    /**
+            rank the regrafts of a pruned subtree onto the branches (node, child) beyond the branch (dad, node),
+            then recursively onto those further away up to spr_radius
+            @param prune_node, prune_dad the pruned subtree, at prune_node away from prune_dad
+            @param pars_prune partial parsimony of the pruned subtree
+            @param pars_up partial parsimony of the pruned tree on the side of dad
+            @param depth number of branches between the branches (node, child) and the pruning point
+            @param moves (IN/OUT) best moves found so far
+            @param pars_buf spr_radius + 2 partial parsimony vectors used as scratch buffers
+     */
+    void rankSPRRegrafts(PhyloNode *prune_node, PhyloNode *prune_dad, UINT *pars_prune, UINT *pars_up,
+            PhyloNode *node, PhyloNode *dad, int depth, SPRMoves &moves, UINT *pars_buf);
+
+    /**
+            Fitch step of two partial parsimony vectors
+            @param pars1, pars2 partial parsimony vectors of two subtrees
+            @param pars (OUT) partial parsimony vector of the two subtrees joined at a node, must differ from pars1 and pars2
+            @return parsimony score of the joined subtree
+     */
+    int joinPartialParsimony(UINT *pars1, UINT *pars2, UINT *pars);
+
+    /**
+            evaluate SPR moves in parallel threads, each on its own working copy of the tree
+            (see copyWorkingTree()). All branch lengths of the moved tree are optimized
+            @param moves SPR moves of this tree
+            @param scores (OUT) log-likelihood of the tree after each move
+     */
+    void evaluateSPRMoves(vector<SPRMove> &moves, DoubleVector &scores);
+
+    /**
+            apply an SPR move: the subtree at prune_node is cut off together with prune_dad, whose
+            two other branches are joined, and regrafted to the middle of the branch (regraft_dad, regraft_node).
+            The partial likelihoods around the changed branches are invalidated
+            @param move the SPR move
+     */
+    void doSPR(SPRMove &move);
+
     /**
             search by Subtree pruning and regrafting, then optimize branch lengths. Iterative until
             no tree improvement found.
@@ -1074,6 +1653,44 @@ public:
      */
     bool sse;
 
+    /**
+     *      instruction set of the vectorized likelihood kernels, only used if sse is TRUE
+     */
+    LikelihoodKernel lk_kernel;
+
+    /**
+     *      memory layout of partial likelihood vectors for the SSE kernels, see isBlockedPartialLh()
+     */
+    LikelihoodLayout lh_layout;
+
+    /**
+     *      storage precision of partial likelihoods: 1 for single, 0 for double precision,
+     *      -1 for single precision if the alignment has more than LH_FLOAT_MIN_PATTERNS patterns.
+     *      See usesFloatPartialLh()
+     */
+    int lh_float;
+
+    /**
+     *      memory limit in MB of the partial likelihood vectors, 0 for no limit.
+     *      With a limit below getMemoryRequired() the vectors share a pool of blocks,
+     *      the least recently used vector is evicted and recomputed when needed again.
+     *      Not supported for partitioned analyses
+     */
+    int lh_mem_limit;
+
+    /**
+     *      TRUE to compute the partial likelihoods of the pattern layout only once per site repeat,
+     *      i.e. per class of patterns that are identical on the taxa of the subtree. See computeSiteRepeats()
+     */
+    bool site_repeats;
+
+    /**
+     *      TRUE to compute the partial likelihoods of a whole traversal in one parallel region with
+     *      a fixed slice of patterns per thread (pattern-blocked layout, double precision).
+     *      See computePartialLikelihoodSliced()
+     */
+    bool lh_slice_traversal;
+
     /**
      * Current score of the tree;
      */
@@ -1114,6 +1731,18 @@ public:
     /** 2 to save all trees, 1 to save intermediate trees */
     int save_all_trees;
 
+    /**
+            hash of the tree whose NNIs are evaluated, used with nni_subtree_keys and nni_dad_ids
+            to hash the NNI trees in constant time when save_all_trees == 2
+     */
+    TopologyHash nni_topo_hash;
+
+    /** see MTree::computeTopologyHash(), empty if nni_topo_hash is not up to date */
+    vector<TopologyHash> nni_subtree_keys;
+
+    /** see MTree::computeTopologyHash() */
+    IntVector nni_dad_ids;
+
 protected:
     
     /**
@@ -1144,6 +1773,47 @@ protected:
      */
     double *_pattern_lh;
 
+    /**
+            internal pattern derivatives of the log-likelihood of the last computeLikelihoodDerv():
+            1st derivatives followed by 2nd derivatives, not weighted by pattern frequencies
+     */
+    double *_pattern_lh_derv;
+
+    /**
+            invariable site contribution of each pattern, see getPtnInvar()
+     */
+    double *ptn_invar;
+
+    /**
+            bit ptn of this mask is set if pattern ptn is constant with a known state, built
+            once per alignment by getPtnInvar()
+     */
+    vector<UINT> const_ptn_mask;
+
+    /**
+            alignment, trans_version and p_invar belonging to ptn_invar
+     */
+    Alignment *ptn_invar_aln;
+    int ptn_invar_version;
+    double ptn_invar_pinv;
+
+    /**
+            leaf states, tip_states[seq * tip_states_stride + ptn] is the state of sequence seq
+            at pattern ptn, see getTipStates()
+     */
+    unsigned char *tip_states;
+
+    /**
+            number of patterns of one sequence in tip_states, rounded up to a cache line
+     */
+    int tip_states_stride;
+
+    /**
+            alignment and its number of patterns belonging to tip_states
+     */
+    Alignment *tip_states_aln;
+    int tip_states_nptn;
+
 
     /**
             associated substitution model
@@ -1161,6 +1831,11 @@ protected:
      */
     RateHeterogeneity *site_rate;
 
+    /**
+            TRUE if model, model_factory and site_rate belong to another tree (see copyWorkingTree())
+     */
+    bool shares_model;
+
     /**
             current branch iterator, used by computeFunction() to optimize branch lengths
             and by computePatternLikelihood() to compute all pattern likelihoods
@@ -1182,6 +1857,11 @@ protected:
      */
     int spr_radius;
 
+    /**
+            working copies of the tree to evaluate moves in parallel threads, one per thread
+     */
+    vector<PhyloTree*> thread_trees;
+
 
     /**
             the main memory storing all partial likelihoods for all neighbors of the tree.
@@ -1189,12 +1869,193 @@ protected:
      */
     double *central_partial_lh;
 
+    /**
+            partial likelihoods of neighbors pointing to leaves, allocated on demand by getTipPartialLh()
+     */
+    double *central_tip_partial_lh;
+
+    /**
+            number of doubles in central_partial_lh and central_tip_partial_lh
+     */
+    uint64_t central_partial_lh_size, central_tip_partial_lh_size;
+
+    /**
+            blocks of central_partial_lh (or extra_partial_lh) not assigned to any neighbor
+     */
+    vector<double*> free_partial_lh;
+
+    /**
+            partial likelihood blocks allocated when all blocks of central_partial_lh are in use
+     */
+    vector<double*> extra_partial_lh;
+
+    /**
+            TRUE if central_partial_lh stores single precision partial likelihoods, see usesFloatPartialLh()
+     */
+    bool float_partial_lh;
+
+    /**
+            three double precision vectors used to convert single precision partial likelihoods
+     */
+    double *float_scratch_lh;
+
+    /**
+            single precision vector converted into each vector of float_scratch_lh by unpackPartialLh(),
+            NULL if unknown. A vector is converted again only after packPartialLh() wrote it
+     */
+    double *float_unpacked_lh[3];
+
+    /**
+            stack of temporary buffers of the likelihood kernels, reused across calls
+     */
+    ScratchStack scratch;
+
+    /**
+            number of partial likelihood vectors that fell back to double precision
+     */
+    int num_float_fallback;
+
+    /**
+            current epoch of markBranchDirty(), marks of other epochs are ignored
+     */
+    int dirty_path_epoch;
+
+    /**
+            number of partial likelihood vectors invalidated by markBranchDirty()
+     */
+    uint64_t num_partial_lh_dirty;
+
+    /**
+            number of partial likelihood vectors computed
+     */
+    uint64_t num_partial_lh_computed;
+
+    /**
+            number of partial likelihood vectors found computed when the likelihood of a branch was evaluated
+     */
+    uint64_t num_partial_lh_reused;
+
+    /**
+            first pattern block of each slice of getNumLhSlices(), and the number of blocks at the end
+     */
+    vector<int> lh_slice_begin;
+
+    /**
+            vectors of the running computePartialLikelihoodSliced() in post-order
+     */
+    vector<LhSliceTask> lh_slice_tasks;
+
+    /**
+            blocks of central_partial_lh with their owners if the memory is limited by lh_mem_limit,
+            NULL otherwise
+     */
+    PartialLhSlot *partial_lh_slots;
+
+    /**
+            number of blocks in partial_lh_slots
+     */
+    uint64_t num_partial_lh_slots;
+
+    /**
+            least and most recently used block of partial_lh_slots, the others are linked in between
+     */
+    PartialLhSlot *partial_lh_lru_first, *partial_lh_lru_last;
+
+    /**
+            number of partial likelihood vectors evicted from partial_lh_slots
+     */
+    uint64_t num_partial_lh_evicted;
+
+    /**
+            number of blocks allocated beyond lh_mem_limit because all vectors of the pool were pinned
+     */
+    uint64_t num_partial_lh_overflow;
+
+    /**
+            @param block_size number of doubles of one partial likelihood block
+            @return number of partial likelihood blocks to allocate, fewer than (leafNum-1)*3 if limited by lh_mem_limit
+     */
+    uint64_t getNumPartialLhBlocks(uint64_t block_size);
+
+    /**
+            @return the block of partial_lh_slots containing lh, NULL if lh is not in the pool
+     */
+    PartialLhSlot *findPartialLhSlot(double *lh);
+
+    /**
+            @return a block not assigned to any neighbor: from free_partial_lh, taken from an
+            unpinned vector of partial_lh_slots, or newly allocated in extra_partial_lh
+     */
+    double *getFreePartialLh();
+
+    /**
+            with lh_mem_limit: evict the least recently used unpinned vector
+            @return its block or NULL if all vectors are pinned
+     */
+    double *evictPartialLh();
+
+    /**
+            move a block to one end of the list of partial_lh_slots
+            @param slot the block
+            @param recent TRUE for the most recently used end, FALSE to make it the next to evict
+     */
+    void touchPartialLhSlot(PartialLhSlot *slot, bool recent = true);
+
+    /**
+            detach a neighbor from its block in partial_lh_slots, the block is not put into free_partial_lh
+            @param nei the neighbor
+     */
+    void releasePartialLhSlot(PhyloNeighbor *nei);
+
+    /**
+            detach all blocks of partial_lh_slots from their owners
+     */
+    void clearPartialLhSlots();
+
+    /**
+            mark the partial likelihood vectors of node in reverse direction of dad as not computed
+            @param node a node
+            @param dad a neighbor of node
+            @param force_depth number of levels marked regardless of earlier marks
+            @return number of vectors that were computed before
+     */
+    int markReversePartialLhDirty(PhyloNode *node, PhyloNode *dad, int force_depth);
+
+    /**
+            count the partial likelihood vectors of the branch that are already computed
+            @param dad_branch the branch leading to the subtree
+            @param dad its dad, used to direct the tranversal
+     */
+    void countReusedPartialLh(PhyloNeighbor *dad_branch, PhyloNode *dad);
+
+    /**
+            partial likelihoods of a pattern are scaled when all entries drop below scaling_threshold
+            (SCALING_THRESHOLD or SCALING_THRESHOLD_FLOAT)
+     */
+    double scaling_threshold;
+
+    /**
+            number of tip states, see getNumTipStates()
+     */
+    int num_tip_states;
+
+    /**
+            partial likelihood vector of one category for each tip state, see initTipStates()
+     */
+    double *tip_partial_lh_state;
+
+    /**
+            indices of the tip states occurring in the alignment, only these entries of the
+            tip lookup tables are computed
+     */
+    IntVector tip_state_list;
+
 
     /**
             the main memory storing all scaling event numbers for all neighbors of the tree.
             The variable scale_num in PhyloNeighbor will be assigned to a region inside this variable.
      */
-    UBYTE *central_scale_num;
+    ScaleNum *central_scale_num;
 
     /**
             the main memory storing all partial parsimony states for all neighbors of the tree.
@@ -1228,8 +2089,32 @@ protected:
      * Temporary scale num array: used when swapping branch and recalculate the
      * likelihood --> avoid calling malloc
      */
-    UBYTE *tmp_scale_num1;
-    UBYTE *tmp_scale_num2;
+    ScaleNum *tmp_scale_num1;
+    ScaleNum *tmp_scale_num2;
+
+    /**
+     * Temporary transition matrices times state frequencies, see getTransMatrixFreq()
+     */
+    double *tmp_trans_mat_freq;
+    int tmp_trans_mat_freq_size;
+
+    /**
+            version of the transition matrices cached on the branches, increased whenever
+            the model parameters or the rates of the categories change, see updateTransVersion()
+     */
+    int trans_version;
+
+    /**
+            model parameter version and category rates belonging to trans_version
+     */
+    int trans_model_version;
+    DoubleVector trans_rates;
+
+    /**
+            trans_version under which all computed partial likelihood vectors were computed,
+            see updatePartialLhVersion()
+     */
+    int partial_lh_version;
 
     /****************************************************************************
             Vector of bit blocks, used for parsimony function
@@ -1295,10 +2180,41 @@ protected:
      */
     void setBitsBlock(UINT* &bit_vec, int index, UINT *bits_entry);
 
-    virtual void saveCurrentTree(double logl) {
-    } // save current tree
+    virtual void saveCurrentTree(double logl, TopologyHash *hash = NULL) {
+    } // save current tree, hash of its topology if already known
+
+
+};
 
+/**
+    pins the partial likelihood vectors of both ends of a branch for the lifetime of the object,
+    so that computing one end does not evict the other with PhyloTree::lh_mem_limit
+*/
+class BranchPartialLhPin {
+public:
+    BranchPartialLhPin(PhyloTree *tree, PhyloNeighbor *dad_branch, PhyloNode *dad) {
+        this->tree = tree;
+        this->dad_branch = dad_branch;
+        this->dad = dad;
+        node_branch = NULL;
+        if (!tree->isPartialLhPooled())
+            return;
+        node_branch = (PhyloNeighbor*) dad_branch->node->findNeighbor(dad);
+        tree->pinPartialLh(dad_branch, dad);
+        tree->pinPartialLh(node_branch, (PhyloNode*) dad_branch->node);
+    }
+
+    ~BranchPartialLhPin() {
+        if (!node_branch)
+            return;
+        tree->unpinPartialLh(dad_branch, dad);
+        tree->unpinPartialLh(node_branch, (PhyloNode*) dad_branch->node);
+    }
 
+private:
+    PhyloTree *tree;
+    PhyloNeighbor *dad_branch, *node_branch;
+    PhyloNode *dad;
 };
 
 #endif
@@ -19,10 +19,291 @@
  ***************************************************************************/
 #include "phylotree.h"
 #include "gtrmodel.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+#include "timeutil.h"
 
 /* BQM: to ignore all-gapp subtree at an alignment site */
 #define IGNORE_GAP_LH
 
+/**
+    cases of a switch over the number of states for which the SSE kernels are compiled:
+    KERNEL is the kernel template, ARGS its arguments in parentheses. Only binary data, DNA,
+    amino acids and codons are instantiated, the generic kernels handle the other numbers of states
+*/
+#define LH_KERNEL_CASES(KERNEL, ARGS) \
+        case 2: return KERNEL<2> ARGS; \
+        case 4: return KERNEL<4> ARGS; \
+        case 20: return KERNEL<20> ARGS; \
+        case 61: return KERNEL<61> ARGS;
+
+/**
+    @return upper bound of the number of threads of the next parallel region,
+    to give each thread its own part of a scratch buffer
+*/
+static inline int getMaxThreads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/**
+    @return part of a scratch buffer of getMaxThreads() * size doubles of the calling thread
+*/
+static inline double *getThreadBuffer(double *buffer, int size) {
+#ifdef _OPENMP
+    return buffer + omp_get_thread_num() * size;
+#else
+    return buffer;
+#endif
+}
+
+/** used by PhyloTree::hasCompiledKernel() to list the cases of LH_KERNEL_CASES */
+template<int NSTATES>
+inline bool isCompiledKernel() {
+    return true;
+}
+
+LikelihoodKernel detectLikelihoodKernel() {
+    static int detected = -1;
+    if (detected >= 0)
+        return (LikelihoodKernel) detected;
+    detected = LK_SSE3;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    // __builtin_cpu_supports also checks that the OS saves the extended registers
+    __builtin_cpu_init();
+#ifdef HAVE_AVX_KERNEL
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        detected = LK_AVX2;
+#endif
+#ifdef HAVE_AVX512_KERNEL
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("fma"))
+        detected = LK_AVX512;
+#endif
+#endif
+    return (LikelihoodKernel) detected;
+}
+
+const char *getLikelihoodKernelName(LikelihoodKernel kernel) {
+    switch (kernel) {
+    case LK_AVX512:
+        return "AVX-512";
+    case LK_AVX2:
+        return "AVX2";
+    default:
+        return "SSE3";
+    }
+}
+
+void getLikelihoodKernel(LikelihoodKernel kernel, int nstates, LikelihoodKernelFuncs &funcs) {
+    memset(&funcs, 0, sizeof(LikelihoodKernelFuncs));
+#ifdef HAVE_AVX_KERNEL
+    if (kernel >= LK_AVX2)
+        getLikelihoodKernelAVX(nstates, funcs);
+#endif
+#ifdef HAVE_AVX512_KERNEL
+    if (kernel >= LK_AVX512) {
+        // take the AVX-512 kernels that exist and keep AVX2 for the others
+        LikelihoodKernelFuncs funcs512;
+        getLikelihoodKernelAVX512(nstates, funcs512);
+        if (funcs512.partialLhProduct) {
+            funcs.partialLhProduct = funcs512.partialLhProduct;
+            funcs.branchLh = funcs512.branchLh;
+            funcs.branchDerv = funcs512.branchDerv;
+        }
+        if (funcs512.partialLhProductBlock) {
+            funcs.partialLhProductBlock = funcs512.partialLhProductBlock;
+            funcs.branchLhBlock = funcs512.branchLhBlock;
+            funcs.branchDervBlock = funcs512.branchDervBlock;
+        }
+    }
+#endif
+}
+
+template<int NSTATES>
+void PhyloTree::computeTipLhTable(double *trans_mat, double *tip_lh_table) {
+    int numCat = site_rate->getNRate();
+    getNumTipStates();
+    for (IntVector::iterator it = tip_state_list.begin(); it != tip_state_list.end(); it++) {
+        int state = *it;
+        MappedVec(NSTATES) ei_tip_lh(tip_partial_lh_state + state * NSTATES);
+        for (int cat = 0; cat < numCat; cat++) {
+            // trans_mat is row-major, i.e. the transpose of the column-major Eigen matrix
+            MappedMat(NSTATES) ei_trans_state(trans_mat + cat * NSTATES * NSTATES);
+            MappedVec(NSTATES) ei_table(tip_lh_table + (state * numCat + cat) * NSTATES);
+            ei_table.noalias() = ei_trans_state.transpose() * ei_tip_lh;
+        }
+    }
+}
+
+template<int NSTATES>
+void PhyloTree::computeTipBranchTable(double *trans_mat, double *tip_lh_table) {
+    int numCat = site_rate->getNRate();
+    getNumTipStates();
+    for (IntVector::iterator it = tip_state_list.begin(); it != tip_state_list.end(); it++) {
+        int state = *it;
+        MappedVec(NSTATES) ei_tip_lh(tip_partial_lh_state + state * NSTATES);
+        for (int cat = 0; cat < numCat; cat++) {
+            MappedMat(NSTATES) ei_trans_state(trans_mat + cat * NSTATES * NSTATES);
+            MappedVec(NSTATES) ei_table(tip_lh_table + (state * numCat + cat) * NSTATES);
+            ei_table.noalias() = ei_trans_state * ei_tip_lh;
+        }
+    }
+}
+
+/****************************************************************************
+ Eigen versions of the functions of LikelihoodKernelFuncs for the numbers of states
+ without AVX kernel, see getLikelihoodKernelSSE()
+ ****************************************************************************/
+
+/**
+    LH_BLOCK_PATTERNS entries of the same [category][state] of consecutive patterns
+*/
+typedef Array<double, LH_BLOCK_PATTERNS, 1> LhBlockArray;
+
+/**
+    one row of a transition matrix times the child partial likelihoods of a pattern block
+    @param trans_row row of the transition matrix
+    @param partial_lh_child child partial likelihoods of one category of the pattern block
+*/
+template<int NSTATES>
+static inline LhBlockArray productRowBlock(const double *trans_row, const double *partial_lh_child) {
+    LhBlockArray prod = trans_row[0] * Map<const LhBlockArray, Aligned>(partial_lh_child);
+    for (int i = 1; i < NSTATES; i++)
+        prod += trans_row[i] * Map<const LhBlockArray, Aligned>(partial_lh_child + i * LH_BLOCK_PATTERNS);
+    return prod;
+}
+
+/** PartialLhProductFunc with Eigen */
+template<int NSTATES>
+static void partialLhProductEigen(double *partial_lh, const double *partial_lh_child, const double *trans_mat,
+        int ncat) {
+    for (int cat = 0; cat < ncat; cat++) {
+        Map<const Matrix<double, 1, NSTATES> > ei_partial_lh_child(partial_lh_child + cat * NSTATES);
+        MappedRowVec(NSTATES) ei_partial_lh_site(partial_lh + cat * NSTATES);
+        Map<const Matrix<double, NSTATES, NSTATES> > ei_trans_state(trans_mat + cat * NSTATES * NSTATES);
+        ei_partial_lh_site.array() *= (ei_partial_lh_child * ei_trans_state).array();
+    }
+}
+
+/** BranchLhFunc with Eigen */
+template<int NSTATES>
+static double branchLhEigen(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+        int ncat) {
+    double lh_ptn = 0.0;
+    for (int cat = 0; cat < ncat; cat++) {
+        Map<const Matrix<double, 1, NSTATES> > ei_partial_lh_site(partial_lh_site + cat * NSTATES);
+        Map<const Matrix<double, 1, NSTATES> > ei_partial_lh_child(partial_lh_child + cat * NSTATES);
+        Map<const Matrix<double, NSTATES, NSTATES> > ei_trans_state(trans_mat + cat * NSTATES * NSTATES);
+        lh_ptn += (ei_partial_lh_child * ei_trans_state).dot(ei_partial_lh_site);
+    }
+    return lh_ptn;
+}
+
+/** BranchDervFunc with Eigen */
+template<int NSTATES>
+static double branchDervEigen(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+        const double *trans_derv1, const double *trans_derv2, int ncat, double &lh_derv1, double &lh_derv2) {
+    double lh_ptn = 0.0;
+    lh_derv1 = lh_derv2 = 0.0;
+    for (int cat = 0; cat < ncat; cat++) {
+        int trans_offset = cat * NSTATES * NSTATES;
+        Map<const Matrix<double, 1, NSTATES> > ei_partial_lh_site(partial_lh_site + cat * NSTATES);
+        Map<const Matrix<double, 1, NSTATES> > ei_partial_lh_child(partial_lh_child + cat * NSTATES);
+        Map<const Matrix<double, NSTATES, NSTATES> > ei_trans_state(trans_mat + trans_offset);
+        Map<const Matrix<double, NSTATES, NSTATES> > ei_derv1_state(trans_derv1 + trans_offset);
+        Map<const Matrix<double, NSTATES, NSTATES> > ei_derv2_state(trans_derv2 + trans_offset);
+        lh_ptn += (ei_partial_lh_child * ei_trans_state).dot(ei_partial_lh_site);
+        lh_derv1 += (ei_partial_lh_child * ei_derv1_state).dot(ei_partial_lh_site);
+        lh_derv2 += (ei_partial_lh_child * ei_derv2_state).dot(ei_partial_lh_site);
+    }
+    return lh_ptn;
+}
+
+/** PartialLhProductFunc for a pattern block with Eigen */
+template<int NSTATES>
+static void partialLhProductBlockEigen(double *partial_lh, const double *partial_lh_child, const double *trans_mat,
+        int ncat) {
+    for (int cat = 0; cat < ncat; cat++) {
+        for (int i = 0; i < NSTATES; i++)
+            Map<LhBlockArray, Aligned>(partial_lh + i * LH_BLOCK_PATTERNS) *=
+                    productRowBlock<NSTATES>(trans_mat + i * NSTATES, partial_lh_child);
+        partial_lh += NSTATES * LH_BLOCK_PATTERNS;
+        partial_lh_child += NSTATES * LH_BLOCK_PATTERNS;
+        trans_mat += NSTATES * NSTATES;
+    }
+}
+
+/** BranchLhBlockFunc with Eigen */
+template<int NSTATES>
+static void branchLhBlockEigen(const double *partial_lh_site, const double *partial_lh_child, const double *trans_mat,
+        int ncat, double *lh) {
+    LhBlockArray lh_sum = LhBlockArray::Zero();
+    for (int cat = 0; cat < ncat; cat++) {
+        for (int j = 0; j < NSTATES; j++)
+            lh_sum += productRowBlock<NSTATES>(trans_mat + j * NSTATES, partial_lh_child)
+                    * Map<const LhBlockArray, Aligned>(partial_lh_site + j * LH_BLOCK_PATTERNS);
+        partial_lh_site += NSTATES * LH_BLOCK_PATTERNS;
+        partial_lh_child += NSTATES * LH_BLOCK_PATTERNS;
+        trans_mat += NSTATES * NSTATES;
+    }
+    Map<LhBlockArray, Aligned> ei_lh(lh);
+    ei_lh = lh_sum;
+}
+
+/** BranchDervBlockFunc with Eigen */
+template<int NSTATES>
+static void branchDervBlockEigen(const double *partial_lh_site, const double *partial_lh_child,
+        const double *trans_mat, const double *trans_derv1, const double *trans_derv2, int ncat,
+        double *lh, double *lh_derv1, double *lh_derv2) {
+    LhBlockArray lh_sum = LhBlockArray::Zero();
+    LhBlockArray derv1_sum = LhBlockArray::Zero();
+    LhBlockArray derv2_sum = LhBlockArray::Zero();
+    for (int cat = 0; cat < ncat; cat++) {
+        int trans_offset = cat * NSTATES * NSTATES;
+        for (int j = 0; j < NSTATES; j++) {
+            Map<const LhBlockArray, Aligned> ei_site(partial_lh_site + j * LH_BLOCK_PATTERNS);
+            lh_sum += productRowBlock<NSTATES>(trans_mat + trans_offset + j * NSTATES, partial_lh_child) * ei_site;
+            derv1_sum += productRowBlock<NSTATES>(trans_derv1 + trans_offset + j * NSTATES, partial_lh_child) * ei_site;
+            derv2_sum += productRowBlock<NSTATES>(trans_derv2 + trans_offset + j * NSTATES, partial_lh_child) * ei_site;
+        }
+        partial_lh_site += NSTATES * LH_BLOCK_PATTERNS;
+        partial_lh_child += NSTATES * LH_BLOCK_PATTERNS;
+    }
+    Map<LhBlockArray, Aligned> ei_lh(lh), ei_lh_derv1(lh_derv1), ei_lh_derv2(lh_derv2);
+    ei_lh = lh_sum;
+    ei_lh_derv1 = derv1_sum;
+    ei_lh_derv2 = derv2_sum;
+}
+
+/**
+    getLikelihoodKernel() with the missing functions taken from their Eigen versions, so that
+    the SSE kernels call the functions of both layouts without checking for NULL
+*/
+template<int NSTATES>
+static void getLikelihoodKernelSSE(LikelihoodKernel kernel, LikelihoodKernelFuncs &funcs) {
+    getLikelihoodKernel(kernel, NSTATES, funcs);
+    if (!funcs.partialLhProduct)
+        funcs.partialLhProduct = partialLhProductEigen<NSTATES>;
+    if (!funcs.branchLh)
+        funcs.branchLh = branchLhEigen<NSTATES>;
+    if (!funcs.branchDerv)
+        funcs.branchDerv = branchDervEigen<NSTATES>;
+    if (!funcs.partialLhProductBlock)
+        funcs.partialLhProductBlock = partialLhProductBlockEigen<NSTATES>;
+    if (!funcs.branchLhBlock)
+        funcs.branchLhBlock = branchLhBlockEigen<NSTATES>;
+    if (!funcs.branchDervBlock)
+        funcs.branchDervBlock = branchDervBlockEigen<NSTATES>;
+}
+
 template<int NSTATES>
 inline double PhyloTree::computeLikelihoodBranchSSE(PhyloNeighbor *dad_branch, PhyloNode *dad, double *pattern_lh) {
     PhyloNode *node = (PhyloNode*) dad_branch->node; // Node A
@@ -40,70 +321,87 @@ inline double PhyloTree::computeLikelihoodBranchSSE(PhyloNeighbor *dad_branch, P
         node_branch = tmp_nei;
         //cout << "swapped\n";
     }
+    // the partial likelihood of a leaf is replaced by a lookup table
+    bool tip_dad = dad->isLeaf();
+    if (tip_dad)
+        releaseTipPartialLh(node_branch);
     if ((dad_branch->partial_lh_computed & 1) == 0)
         computePartialLikelihoodSSE<NSTATES>(dad_branch, dad);
-    if ((node_branch->partial_lh_computed & 1) == 0)
+    if (!tip_dad && (node_branch->partial_lh_computed & 1) == 0)
         computePartialLikelihoodSSE<NSTATES>(node_branch, node);
 
     // now combine likelihood at the branch
-    double tree_lh = node_branch->lh_scale_factor + dad_branch->lh_scale_factor;
-    int ptn, cat, state1, state2;
-    double *partial_lh_site;
-    double *partial_lh_child;
-    double *trans_state;
+    double tree_lh = dad_branch->lh_scale_factor;
+    if (!tip_dad)
+        tree_lh += node_branch->lh_scale_factor;
+    int group;
     double p_invar = site_rate->getPInvar();
+    double *ptn_invar = getPtnInvar();
     int numCat = site_rate->getNRate();
-    int numStates = model->num_states;
-    int tranSize = numStates * numStates;
     int alnSize = getAlnNPattern();
-    int block = numStates * numCat;
+    int block = NSTATES * numCat;
+    // the entries of a pattern are lh_stride apart (see getPartialLhPattern()), so the patterns
+    // are taken in groups of lh_stride: single patterns or the pattern blocks of the blocked layout
+    bool blocked = isBlockedPartialLh();
+    int lh_stride = blocked ? LH_BLOCK_PATTERNS : 1;
+    size_t lh_group = (size_t) block * lh_stride;
+    int num_groups = (alnSize + lh_stride - 1) / lh_stride;
 
     double p_var_cat = (1.0 - p_invar) / (double) numCat;
 
-    EIGEN_ALIGN16 double *trans_mat_orig = new double[numCat * tranSize + 1];
-    double *trans_mat = trans_mat_orig;
-    if (((intptr_t) trans_mat) % 16 != 0)
-        trans_mat = trans_mat + 1;
     EIGEN_ALIGN16 double state_freq[NSTATES];
     model->getStateFrequency(state_freq);
-    for (cat = 0; cat < numCat; cat++) {
-        double *trans_cat = trans_mat + (cat * tranSize);
-        model_factory->computeTransMatrix(dad_branch->length * site_rate->getRate(cat), trans_cat);
-        for (state1 = 0; state1 < NSTATES; state1++) {
-            double *trans_mat_state = trans_cat + (state1 * NSTATES);
-            for (state2 = 0; state2 < NSTATES; state2++)
-                trans_mat_state[state2] *= state_freq[state1];
-        }
+    double *trans_mat = getTransMatrixFreq(dad_branch, dad, state_freq);
+
+    double *tip_lh_table = NULL;
+    unsigned char *dad_states = NULL;
+    if (tip_dad) {
+        tip_lh_table = scratch.push(getNumTipStates() * block);
+        computeTipBranchTable<NSTATES>(trans_mat, tip_lh_table);
+        if (dad->name != ROOT_NAME)
+            dad_states = getTipStates(dad->id);
     }
 
+    LikelihoodKernelFuncs lk_funcs;
+    getLikelihoodKernelSSE<NSTATES>(lk_kernel, lk_funcs);
+    double *node_partial_lh = tip_dad ? NULL : unpackPartialLh(node_branch, 1);
+    double *dad_partial_lh = unpackPartialLh(dad_branch, 2);
+
 #ifdef _OPENMP
-#pragma omp parallel for reduction(+: tree_lh) private(ptn, cat)
+#pragma omp parallel for
 #endif
-    for (ptn = 0; ptn < alnSize; ++ptn) {
-        double lh_ptn = 0.0; // likelihood of the pattern
-        for (cat = 0; cat < numCat; cat++) {
-            partial_lh_site = node_branch->partial_lh + (ptn * block + cat * NSTATES);
-            partial_lh_child = dad_branch->partial_lh + (ptn * block + cat * NSTATES);
-            trans_state = trans_mat + cat * tranSize;
-            Map<Matrix<double, 1, NSTATES>, Aligned> eigen_partial_lh_child(&partial_lh_child[0]);
-            Map<Matrix<double, 1, NSTATES>, Aligned> eigen_partial_lh_site(&partial_lh_site[0]);
-            Map<Matrix<double, NSTATES, NSTATES>, Aligned> eigen_trans_state(&trans_state[0]);
-            lh_ptn += (eigen_partial_lh_child * eigen_trans_state).dot(eigen_partial_lh_site);
-        }
-
-        lh_ptn *= p_var_cat;
-        if ((*aln)[ptn].is_const && (*aln)[ptn][0] < NSTATES) {
-            lh_ptn += p_invar * state_freq[(int) (*aln)[ptn][0]];
+    for (group = 0; group < num_groups; group++) {
+        double *partial_lh_site = tip_dad ? NULL : node_partial_lh + group * lh_group;
+        double *partial_lh_child = dad_partial_lh + group * lh_group;
+        int ptn_start = group * lh_stride;
+        int num_lanes = min(lh_stride, alnSize - ptn_start);
+        EIGEN_ALIGN16 double lh_group_ptn[LH_BLOCK_PATTERNS];
+        if (tip_dad) {
+            for (int lane = 0; lane < num_lanes; lane++) {
+                char state = dad_states ? dad_states[ptn_start + lane] : STATE_UNKNOWN;
+                double *tip_lh = tip_lh_table + getTipStateIndex(state) * block;
+                double lh_ptn = 0.0;
+                for (int i = 0; i < block; i++)
+                    lh_ptn += partial_lh_child[i * lh_stride + lane] * tip_lh[i];
+                lh_group_ptn[lane] = lh_ptn;
+            }
+        } else if (blocked)
+            lk_funcs.branchLhBlock(partial_lh_site, partial_lh_child, trans_mat, numCat, lh_group_ptn);
+        else
+            lh_group_ptn[0] = lk_funcs.branchLh(partial_lh_site, partial_lh_child, trans_mat, numCat);
+        for (int lane = 0; lane < num_lanes; lane++) {
+            int ptn = ptn_start + lane;
+            double lh_ptn = lh_group_ptn[lane] * p_var_cat;
+            lh_ptn += ptn_invar[ptn];
+            // BQM: pattern_lh contains the LOG-likelihood, not likelihood
+            _pattern_lh[ptn] = log(lh_ptn);
         }
-        lh_ptn = log(lh_ptn);
-        tree_lh += lh_ptn * (aln->at(ptn).frequency);
-        _pattern_lh[ptn] = lh_ptn;
-        // BQM: pattern_lh contains the LOG-likelihood, not likelihood
     }
+    tree_lh += sumPatternLh(_pattern_lh, 0, alnSize);
     if (pattern_lh) {
         memmove(pattern_lh, _pattern_lh, alnSize * sizeof(double));
     }
-    delete[] trans_mat_orig;
+    scratch.pop(tip_lh_table);
     return tree_lh;
 }
 
@@ -113,154 +411,157 @@ void PhyloTree::computePartialLikelihoodSSE(PhyloNeighbor *dad_branch, PhyloNode
     if (dad_branch->partial_lh_computed & 1)
         return;
     Node *node = dad_branch->node;
-    int ptn, cat;
-    //double *trans_state;
+    bool blocked = isBlockedPartialLh();
+    // with several threads, a whole traversal is computed at once, each thread on its own slice of pattern blocks.
+    // Single precision storage packs whole vectors and is done by the loops below
+    if (blocked && lh_slice_traversal && !float_partial_lh && !pattern_scale && !(node->isLeaf() && dad)
+            && lh_slice_tasks.empty() && getNumLhSlices() > 1)
+        return computePartialLikelihoodSliced<NSTATES>(dad_branch, dad);
+    int ptn, i;
     double *partial_lh_site;
-    double *partial_lh_child;
-    //double *partial_lh_block;
-    //bool do_scale = true;
-    //double freq;
     dad_branch->lh_scale_factor = 0.0;
-    memset(dad_branch->scale_num, 0, aln->size() * sizeof(UBYTE));
+    memset(dad_branch->scale_num, 0, aln->size() * sizeof(ScaleNum));
 
     int numCat = site_rate->getNRate();
-    int numStates = model->num_states;
-    int tranSize = numStates * numStates;
     int alnSize = getAlnNPattern();
-    int block = numStates * numCat;
-    size_t lh_size = aln->size() * block;
+    int block = NSTATES * numCat;
+    // the entries of a pattern are lh_stride apart, see getPartialLhPattern()
+    int lh_stride = blocked ? LH_BLOCK_PATTERNS : 1;
+    int nptn = getPartialLhNPattern();
+    size_t lh_size = (size_t) nptn * block;
+
+    checkPartialLhStorage(dad_branch, dad);
 
     if (node->isLeaf() && dad) {
-        // external node
-        memset(dad_branch->partial_lh, 0, lh_size * sizeof(double));
-        //double *partial_lh_site;
-        for (ptn = 0; ptn < alnSize; ++ptn) {
+        // external node: only needed by callers other than the SSE kernels, which use tip lookup tables
+        getNumTipStates();
+        unsigned char *node_states = (node->name == ROOT_NAME) ? NULL : getTipStates(node->id);
+        for (ptn = 0; ptn < nptn; ++ptn) {
             char state;
-            partial_lh_site = dad_branch->partial_lh + (ptn * block);
-
-            if (node->name == ROOT_NAME) {
+            if (node->name == ROOT_NAME || ptn >= alnSize) {
                 state = STATE_UNKNOWN;
             } else {
-                state = (aln->at(ptn))[node->id];
+                state = node_states[ptn];
             }
-
-            if (state == STATE_UNKNOWN) {
 #ifdef IGNORE_GAP_LH
+            if (state == STATE_UNKNOWN && ptn < alnSize)
                 dad_branch->scale_num[ptn] = -1;
 #endif
-                for (int state2 = 0; state2 < block; state2++) {
-                    partial_lh_site[state2] = 1.0;
-                }
-            } else if (state < NSTATES) {
-                cat = 0;
-                double *_par_lh_site = partial_lh_site + state;
-                while (true) {
-                    *_par_lh_site = 1.0;
-                    ++cat;
-                    if (cat == numCat)
-                        break;
-                    _par_lh_site += NSTATES;
-                }
-            } else {
-                // ambiguous character, for DNA, RNA
-                state = state - (NSTATES - 1);
-                for (int state2 = 0; state2 < NSTATES && state2 <= 6; state2++)
-                    if (state & (1 << state2)) {
-                        cat = 0;
-                        double *_par_lh_site = partial_lh_site + state2;
-                        while (true) {
-                            *_par_lh_site = 1.0;
-                            ++cat;
-                            if (cat == numCat)
-                                break;
-                            _par_lh_site += NSTATES;
-                        }
-                    }
-            }
+            double *tip_lh = tip_partial_lh_state + getTipStateIndex(state) * NSTATES;
+            partial_lh_site = getPartialLhPattern(dad_branch->partial_lh, ptn, block, blocked);
+            for (i = 0; i < block; i++)
+                partial_lh_site[i * lh_stride] = tip_lh[i % NSTATES];
         }
     } else {
         // internal node
-        EIGEN_ALIGN16 double *trans_mat_orig = new double[numCat * tranSize + 2];
-        double *trans_mat = trans_mat_orig;
-        if (((intptr_t) trans_mat) % 16 != 0)
-            trans_mat = trans_mat + 1;
-        for (ptn = 0; ptn < lh_size; ++ptn)
-            dad_branch->partial_lh[ptn] = 1.0;
+        double *trans_mat;
+        double *tip_lh_table = NULL;
+        LikelihoodKernelFuncs lk_funcs;
+        getLikelihoodKernelSSE<NSTATES>(lk_kernel, lk_funcs);
+        // in single precision mode the children are computed first, then this vector is
+        // computed in double precision scratch memory and packed by packPartialLh().
+        // Site repeats also need the children first (pattern_scale is kept for all patterns)
+        bool use_repeats = site_repeats && !blocked && !pattern_scale;
+        double *float_lh = NULL;
+        if (float_partial_lh || use_repeats) {
+            FOR_NEIGHBOR_IT(node, dad, it)
+                if ((*it)->node->name != ROOT_NAME && !(*it)->node->isLeaf())
+                    computePartialLikelihoodSSE<NSTATES>((PhyloNeighbor*) (*it), (PhyloNode*) node, pattern_scale);
+            float_lh = redirectPartialLh(dad_branch);
+        }
+        // only the first pattern of each class of site repeats is computed, with the summed frequency
+        int num_ptn = alnSize;
+        int *ptn_list = NULL;
+        dad_branch->num_site_repeats = 0;
+        if (use_repeats && (num_ptn = computeSiteRepeats(dad_branch, dad)) > 0 && num_ptn < alnSize)
+            ptn_list = dad_branch->site_repeat + aln->size();
+        else
+            num_ptn = alnSize;
+        for (size_t j = 0; j < lh_size; ++j)
+            dad_branch->partial_lh[j] = 1.0;
 #ifdef IGNORE_GAP_LH
         for (ptn = 0; ptn < alnSize; ptn++)
             dad_branch->scale_num[ptn] = -1;
 #endif
         FOR_NEIGHBOR_IT(node, dad, it)if ((*it)->node->name != ROOT_NAME) {
-            computePartialLikelihoodSSE<NSTATES > ((PhyloNeighbor*) (*it), (PhyloNode*) node, pattern_scale);
-            dad_branch->lh_scale_factor += ((PhyloNeighbor*) (*it))->lh_scale_factor;
-            for (cat = 0; cat < numCat; cat++) {
-                model_factory->computeTransMatrix((*it)->length * site_rate->getRate(cat), &trans_mat[cat * tranSize]);
+            PhyloNeighbor *child = (PhyloNeighbor*) (*it);
+            trans_mat = getTransMatrix(child, (PhyloNode*) node);
+            // for a leaf child (tip-inner and tip-tip cases) the product of the transition matrix
+            // and the tip partial likelihood is looked up by the tip state
+            bool tip_child = child->node->isLeaf();
+            unsigned char *child_states = tip_child ? getTipStates(child->node->id) : NULL;
+            double *child_lh = NULL;
+            if (tip_child) {
+                releaseTipPartialLh(child);
+                if (!tip_lh_table)
+                    tip_lh_table = scratch.push(getNumTipStates() * block);
+                computeTipLhTable<NSTATES>(trans_mat, tip_lh_table);
+            } else {
+                computePartialLikelihoodSSE<NSTATES > (child, (PhyloNode*) node, pattern_scale);
+                child_lh = unpackPartialLh(child, 1);
             }
-            partial_lh_site = dad_branch->partial_lh;
-            partial_lh_child = ((PhyloNeighbor*) (*it))->partial_lh;
-            double sum_scale = 0.0;
+            if (blocked) {
+                int ptn_block, num_blocks = nptn / LH_BLOCK_PATTERNS;
 #ifdef _OPENMP
-#pragma omp parallel for reduction(+: sum_scale) private(ptn, cat, partial_lh_site, partial_lh_child)
+#pragma omp parallel for
 #endif
-            for (ptn = 0; ptn < alnSize; ++ptn)
-#ifdef IGNORE_GAP_LH
-            if (((PhyloNeighbor*) (*it))->scale_num[ptn] < 0) {
-#ifndef _OPENMP
-                partial_lh_site += NSTATES * numCat;
-                partial_lh_child += NSTATES * numCat;
-#endif
-            } else
+                for (ptn_block = 0; ptn_block < num_blocks; ptn_block++)
+                    computePartialLhBlockRange<NSTATES>(dad_branch, child, child_lh, trans_mat, tip_lh_table, lk_funcs,
+                            ptn_block, ptn_block + 1, pattern_scale);
+                continue;
+            }
+#ifdef _OPENMP
+#pragma omp parallel for private(ptn, partial_lh_site)
 #endif
-            {
+            for (i = 0; i < num_ptn; ++i) {
+                ptn = ptn_list ? ptn_list[i] : i;
+                partial_lh_site = dad_branch->partial_lh + ptn * block;
+                char tip_state = tip_child ? child_states[ptn] : 0;
 #ifdef IGNORE_GAP_LH
+                if (tip_child ? (tip_state == STATE_UNKNOWN) : (child->scale_num[ptn] < 0))
+                    continue;
                 if (dad_branch->scale_num[ptn] < 0)
-                dad_branch->scale_num[ptn] = 0;
+                    dad_branch->scale_num[ptn] = 0;
 #endif
-#ifdef _OPENMP
-                int lh_offset = ptn*block;
-                partial_lh_site = dad_branch->partial_lh + lh_offset;
-                partial_lh_child = ((PhyloNeighbor*) (*it))->partial_lh + lh_offset;
-#endif
-                dad_branch->scale_num[ptn] += ((PhyloNeighbor*) (*it))->scale_num[ptn];
-                double *partial_lh_block = partial_lh_site;
-                double freq = aln->at(ptn).frequency;
-                double *trans_state = trans_mat;
-                cat = 0;
-                bool do_scale = true;
-                while (true) {
-                    ++cat;
-                    MappedRowVec(NSTATES) ei_partial_lh_child(partial_lh_child);
-                    MappedRowVec(NSTATES) ei_partial_lh_site(partial_lh_site);
-                    MappedMat(NSTATES) ei_trans_state(trans_state);
-                    //ei_partial_lh_site.noalias() = (ei_partial_lh_child * ei_trans_state).cwiseProduct(ei_partial_lh_site);
-                    ei_partial_lh_site.array() *= (ei_partial_lh_child * ei_trans_state).array();
-                    partial_lh_site += NSTATES;
-                    partial_lh_child += NSTATES;
-                    if (cat == numCat)
-                    break;
-                    else
-                    trans_state += tranSize;
+                if (tip_child) {
+                    Map<Array<double, Dynamic, 1>, LH_ALIGN(NSTATES)> ei_partial_lh_site(partial_lh_site, block);
+                    Map<Array<double, Dynamic, 1>, LH_ALIGN(NSTATES)> ei_tip_lh(tip_lh_table + getTipStateIndex(tip_state) * block, block);
+                    ei_partial_lh_site *= ei_tip_lh;
+                } else {
+                    dad_branch->scale_num[ptn] += child->scale_num[ptn];
+                    lk_funcs.partialLhProduct(partial_lh_site, child_lh + ptn * block, trans_mat, numCat);
                 }
-                for (cat = 0; cat < block; cat++)
-                if (partial_lh_block[cat] > SCALING_THRESHOLD) {
-                    do_scale = false;
-                    break;
-                }
-                if (do_scale) {
-                    Map<VectorXd, Aligned> ei_lh_block(partial_lh_block, block);
-                    ei_lh_block *= SCALING_THRESHOLD_INVER;
-                    sum_scale += LOG_SCALING_THRESHOLD * freq;
-                    dad_branch->scale_num[ptn] += 1;
+                int exponent = scalePartialLhSite(partial_lh_site, block);
+                if (exponent) {
+                    dad_branch->scale_num[ptn] += exponent;
                     if (pattern_scale)
-                    pattern_scale[ptn] += LOG_SCALING_THRESHOLD;
+                        pattern_scale[ptn] += exponent * LOG_SCALE_UNIT;
                 }
             }
-            dad_branch->lh_scale_factor += sum_scale;
         }
-        delete[] trans_mat_orig;
+        scratch.pop(tip_lh_table);
+        if (ptn_list) {
+            // copy the first pattern of each class to the other patterns of the class
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+            for (ptn = 0; ptn < alnSize; ptn++) {
+                int first_ptn = ptn_list[dad_branch->site_repeat[ptn]];
+                if (first_ptn == ptn)
+                    continue;
+                memcpy(dad_branch->partial_lh + ptn * block, dad_branch->partial_lh + first_ptn * block,
+                        block * sizeof(double));
+                dad_branch->scale_num[ptn] = dad_branch->scale_num[first_ptn];
+            }
+        }
+        dad_branch->lh_scale_factor = sumScaleNum(dad_branch->scale_num, 0, alnSize) * LOG_SCALE_UNIT;
+        packPartialLh(dad_branch, float_lh);
+        dad_branch->site_repeat_lh = dad_branch->partial_lh;
     }
 
     dad_branch->partial_lh_computed |= 1;
+    num_partial_lh_computed++;
+    unpinPartialLh(dad_branch, dad);
 }
 
 /****************************************************************************
@@ -280,122 +581,839 @@ inline double PhyloTree::computeLikelihoodDervSSE(PhyloNeighbor *dad_branch, Phy
         dad_branch = node_branch;
         node_branch = tmp_nei;
     }
+    // the partial likelihood of a leaf is replaced by a lookup table
+    bool tip_dad = dad->isLeaf();
+    if (tip_dad)
+        releaseTipPartialLh(node_branch);
     if ((dad_branch->partial_lh_computed & 1) == 0)
         computePartialLikelihoodSSE<NSTATES>(dad_branch, dad);
-    if ((node_branch->partial_lh_computed & 1) == 0)
+    if (!tip_dad && (node_branch->partial_lh_computed & 1) == 0)
         computePartialLikelihoodSSE<NSTATES>(node_branch, node);
     // now combine likelihood at the branch
-    double tree_lh = node_branch->lh_scale_factor + dad_branch->lh_scale_factor;
+    double tree_lh = dad_branch->lh_scale_factor;
+    if (!tip_dad)
+        tree_lh += node_branch->lh_scale_factor;
     df = ddf = 0.0;
-    int cat = 0;
-    double *partial_lh_site = node_branch->partial_lh;
-    double *partial_lh_child = dad_branch->partial_lh;
-    double lh_ptn; // likelihood of the pattern
-    double lh_ptn_derv1;
-    double lh_ptn_derv2;
-    double derv1_frac;
-    double derv2_frac;
-    double *trans_state;
-    double *derv1_state;
-    double *derv2_state;
+    int group;
     double p_invar = site_rate->getPInvar();
+    double *ptn_invar = getPtnInvar();
 
     int numCat = site_rate->getNRate();
-    int numStates = model->num_states;
-    int tranSize = numStates * numStates;
+    int tranSize = NSTATES * NSTATES;
     int alnSize = getAlnNPattern();
+    int block = numCat * NSTATES;
+    // patterns in groups of lh_stride as in computeLikelihoodBranchSSE()
+    bool blocked = isBlockedPartialLh();
+    int lh_stride = blocked ? LH_BLOCK_PATTERNS : 1;
+    size_t lh_group = (size_t) block * lh_stride;
+    int num_groups = (alnSize + lh_stride - 1) / lh_stride;
     double p_var_cat = (1.0 - p_invar) / (double) numCat;
     double state_freq[NSTATES];
     model->getStateFrequency(state_freq);
-    double *trans_mat_orig EIGEN_ALIGN16 = new double[numCat * tranSize + 1];
-    double *trans_derv1_orig EIGEN_ALIGN16 = new double[numCat * tranSize + 1];
-    double *trans_derv2_orig EIGEN_ALIGN16 = new double[numCat * tranSize + 1];
-    // make alignment 16
-    double *trans_mat = trans_mat_orig, *trans_derv1 = trans_derv1_orig, *trans_derv2 = trans_derv2_orig;
-    if (((intptr_t) trans_mat) % 16 != 0)
-        trans_mat = trans_mat + 1;
-    if (((intptr_t) trans_derv1) % 16 != 0)
-        trans_derv1 = trans_derv1 + 1;
-    if (((intptr_t) trans_derv2) % 16 != 0)
-        trans_derv2 = trans_derv2 + 1;
+    double *trans_mat = getTransDervFreq(dad_branch, dad, state_freq);
+    double *trans_derv1 = trans_mat + numCat * tranSize;
+    double *trans_derv2 = trans_derv1 + numCat * tranSize;
+    LikelihoodKernelFuncs lk_funcs;
+    getLikelihoodKernelSSE<NSTATES>(lk_kernel, lk_funcs);
+    // lookup tables for all states of a leaf
+    double *tip_lh_table = NULL, *tip_derv1_table = NULL, *tip_derv2_table = NULL;
+    unsigned char *dad_states = NULL;
+    if (tip_dad) {
+        int table_size = getNumTipStates() * block;
+        tip_lh_table = scratch.push(table_size * 3);
+        tip_derv1_table = tip_lh_table + table_size;
+        tip_derv2_table = tip_derv1_table + table_size;
+        computeTipBranchTable<NSTATES>(trans_mat, tip_lh_table);
+        computeTipBranchTable<NSTATES>(trans_derv1, tip_derv1_table);
+        computeTipBranchTable<NSTATES>(trans_derv2, tip_derv2_table);
+        if (dad->name != ROOT_NAME)
+            dad_states = getTipStates(dad->id);
+    }
+    double *node_partial_lh = tip_dad ? NULL : unpackPartialLh(node_branch, 1);
+    double *dad_partial_lh = unpackPartialLh(dad_branch, 2);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (group = 0; group < num_groups; group++) {
+        double *partial_lh_site = tip_dad ? NULL : node_partial_lh + group * lh_group;
+        double *partial_lh_child = dad_partial_lh + group * lh_group;
+        int ptn_start = group * lh_stride;
+        int num_lanes = min(lh_stride, alnSize - ptn_start);
+        EIGEN_ALIGN16 double lh_group_ptn[LH_BLOCK_PATTERNS];
+        EIGEN_ALIGN16 double derv1_group_ptn[LH_BLOCK_PATTERNS];
+        EIGEN_ALIGN16 double derv2_group_ptn[LH_BLOCK_PATTERNS];
+        if (tip_dad) {
+            for (int lane = 0; lane < num_lanes; lane++) {
+                char state = dad_states ? dad_states[ptn_start + lane] : STATE_UNKNOWN;
+                int table_offset = getTipStateIndex(state) * block;
+                double *tip_lh = tip_lh_table + table_offset;
+                double *tip_derv1 = tip_derv1_table + table_offset;
+                double *tip_derv2 = tip_derv2_table + table_offset;
+                double lh_ptn = 0.0, lh_ptn_derv1 = 0.0, lh_ptn_derv2 = 0.0;
+                for (int i = 0; i < block; i++) {
+                    double lh_child = partial_lh_child[i * lh_stride + lane];
+                    lh_ptn += lh_child * tip_lh[i];
+                    lh_ptn_derv1 += lh_child * tip_derv1[i];
+                    lh_ptn_derv2 += lh_child * tip_derv2[i];
+                }
+                lh_group_ptn[lane] = lh_ptn;
+                derv1_group_ptn[lane] = lh_ptn_derv1;
+                derv2_group_ptn[lane] = lh_ptn_derv2;
+            }
+        } else if (blocked)
+            lk_funcs.branchDervBlock(partial_lh_site, partial_lh_child, trans_mat, trans_derv1, trans_derv2, numCat,
+                    lh_group_ptn, derv1_group_ptn, derv2_group_ptn);
+        else
+            lh_group_ptn[0] = lk_funcs.branchDerv(partial_lh_site, partial_lh_child, trans_mat, trans_derv1,
+                    trans_derv2, numCat, derv1_group_ptn[0], derv2_group_ptn[0]);
+        for (int lane = 0; lane < num_lanes; lane++) {
+            int ptn = ptn_start + lane;
+            double lh_ptn = lh_group_ptn[lane] * p_var_cat;
+            double lh_ptn_derv1 = derv1_group_ptn[lane];
+            double lh_ptn_derv2 = derv2_group_ptn[lane];
+            double derv1_frac, derv2_frac;
+            lh_ptn += ptn_invar[ptn];
+            double pad = p_var_cat / lh_ptn;
+            if (std::isinf(pad)) {
+                lh_ptn_derv1 *= p_var_cat;
+                lh_ptn_derv2 *= p_var_cat;
+                derv1_frac = lh_ptn_derv1 / lh_ptn;
+                derv2_frac = lh_ptn_derv2 / lh_ptn;
+            } else {
+                derv1_frac = lh_ptn_derv1 * pad;
+                derv2_frac = lh_ptn_derv2 * pad;
+            }
+            _pattern_lh_derv[ptn] = derv1_frac;
+            _pattern_lh_derv[alnSize + ptn] = derv2_frac - derv1_frac * derv1_frac;
+            _pattern_lh[ptn] = log(lh_ptn);
+        }
+    }
+    scratch.pop(tip_lh_table);
+    tree_lh += sumPatternLh(_pattern_lh, 0, alnSize);
+    df = sumPatternLh(_pattern_lh_derv, 0, alnSize);
+    ddf = sumPatternLh(_pattern_lh_derv + alnSize, 0, alnSize);
+    return tree_lh;
+}
 
-    int discrete_cat = site_rate->getNDiscreteRate();
-    if (!site_rate->isSiteSpecificRate())
-        for (cat = 0; cat < discrete_cat; cat++) {
-            double *trans_cat = trans_mat + (cat * tranSize);
-            double *derv1_cat = trans_derv1 + (cat * tranSize);
-            double *derv2_cat = trans_derv2 + (cat * tranSize);
-            double rate_val = site_rate->getRate(cat);
-            model_factory->computeTransDervFreq(dad_branch->length, rate_val, state_freq, trans_cat, derv1_cat,
-                    derv2_cat);
-        }
-    int dad_state = STATE_UNKNOWN;
-    double my_df = 0.0;
-    double my_ddf = 0.0;
+/****************************************************************************
+ kernels for the pattern-blocked layout of partial likelihoods
+ ****************************************************************************/
+
+template<int NSTATES>
+void PhyloTree::computePartialLhBlockRange(PhyloNeighbor *dad_branch, PhyloNeighbor *child, double *child_lh,
+        double *trans_mat, double *tip_lh_table, LikelihoodKernelFuncs &lk_funcs,
+        int block_begin, int block_end, double *pattern_scale) {
+    int ptn, i;
+    double *partial_lh_site;
+    int numCat = site_rate->getNRate();
+    int alnSize = getAlnNPattern();
+    int block = NSTATES * numCat;
+    int lh_block = block * LH_BLOCK_PATTERNS;
+    bool tip_child = child->node->isLeaf();
+    unsigned char *child_states = tip_child ? getTipStates(child->node->id) : NULL;
+    for (int ptn_block = block_begin; ptn_block < block_end; ptn_block++) {
+        double *partial_lh_block = dad_branch->partial_lh + (size_t) ptn_block * lh_block;
+        // all patterns of the block at once
+        if (!tip_child)
+            lk_funcs.partialLhProductBlock(partial_lh_block, child_lh + (size_t) ptn_block * lh_block, trans_mat,
+                    numCat);
+        // lookup of the tip child is done pattern by pattern
+        bool scale_lane[LH_BLOCK_PATTERNS];
+        for (int lane = 0; lane < LH_BLOCK_PATTERNS; lane++) {
+            scale_lane[lane] = false;
+            ptn = ptn_block * LH_BLOCK_PATTERNS + lane;
+            if (ptn >= alnSize)
+                continue;
+            char tip_state = tip_child ? child_states[ptn] : 0;
+#ifdef IGNORE_GAP_LH
+            if (tip_child ? (tip_state == STATE_UNKNOWN) : (child->scale_num[ptn] < 0))
+                continue;
+            if (dad_branch->scale_num[ptn] < 0)
+                dad_branch->scale_num[ptn] = 0;
+#endif
+            scale_lane[lane] = true;
+            partial_lh_site = partial_lh_block + lane;
+            if (tip_child) {
+                double *tip_lh = tip_lh_table + getTipStateIndex(tip_state) * block;
+                for (i = 0; i < block; i++)
+                    partial_lh_site[i * LH_BLOCK_PATTERNS] *= tip_lh[i];
+            } else
+                dad_branch->scale_num[ptn] += child->scale_num[ptn];
+        }
+        // scaling of all patterns of the block at once: the maxima are taken with vector
+        // instructions, only patterns below the threshold need their own exponent
+        LhBlockArray lh_max = Map<LhBlockArray, Aligned>(partial_lh_block);
+        for (i = 1; i < block; i++)
+            lh_max = lh_max.max(Map<LhBlockArray, Aligned>(partial_lh_block + i * LH_BLOCK_PATTERNS));
+        if ((lh_max > scaling_threshold).all())
+            continue;
+        LhBlockArray scale = LhBlockArray::Ones();
+        bool do_scale = false;
+        for (int lane = 0; lane < LH_BLOCK_PATTERNS; lane++) {
+            if (!scale_lane[lane] || lh_max[lane] > scaling_threshold)
+                continue;
+            int exponent = getScaleExponent(lh_max[lane]);
+            if (!exponent)
+                continue;
+            ptn = ptn_block * LH_BLOCK_PATTERNS + lane;
+            scale[lane] = ldexp(1.0, exponent);
+            dad_branch->scale_num[ptn] += exponent;
+            if (pattern_scale)
+                pattern_scale[ptn] += exponent * LOG_SCALE_UNIT;
+            do_scale = true;
+        }
+        if (do_scale)
+            for (i = 0; i < block; i++)
+                Map<LhBlockArray, Aligned>(partial_lh_block + i * LH_BLOCK_PATTERNS) *= scale;
+    }
+}
+
+int PhyloTree::getNumLhSlices() {
 #ifdef _OPENMP
-#pragma omp parallel for reduction(+: tree_lh, my_df, my_ddf) private(cat, partial_lh_child, partial_lh_site,\
-		lh_ptn, lh_ptn_derv1, lh_ptn_derv2, derv1_frac, derv2_frac, dad_state, trans_state, derv1_state, derv2_state)
+    // e.g. partitions of a supertree are already computed in parallel
+    int num_threads = omp_in_parallel() ? 1 : omp_get_max_threads();
+#else
+    int num_threads = 1;
 #endif
-    for (int ptn = 0; ptn < alnSize; ++ptn) {
+    int num_blocks = getPartialLhNPattern() / LH_BLOCK_PATTERNS;
+    int num_slices = min(num_threads, num_blocks);
+    if (lh_slice_begin.size() != num_slices + 1 || lh_slice_begin.back() != num_blocks) {
+        // the slices stay the same as long as the number of threads and patterns do not change
+        lh_slice_begin.resize(num_slices + 1);
+        for (int i = 0; i <= num_slices; i++)
+            lh_slice_begin[i] = (int) ((int64_t) num_blocks * i / num_slices);
+    }
+    return num_slices;
+}
+
+void PhyloTree::touchLhSlices(void *mem, uint64_t num_vectors, size_t vector_bytes) {
 #ifdef _OPENMP
-        int lh_offset = ptn*numCat*numStates;
-        partial_lh_site = node_branch->partial_lh + lh_offset;
-        partial_lh_child = dad_branch->partial_lh + lh_offset;
+    int num_slices = getNumLhSlices();
+    if (num_slices <= 1)
+        return;
+    int num_blocks = lh_slice_begin.back();
+#ifdef __linux__
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+#else
+    uintptr_t page_size = 4096;
 #endif
-        lh_ptn = 0.0;
-        lh_ptn_derv1 = 0.0;
-        lh_ptn_derv2 = 0.0;
-        double freq = aln->at(ptn).frequency;
-        int padding = 0;
-        dad_state = STATE_UNKNOWN; // FOR TUNG: This is missing in your codes!
-        if (dad->isLeaf()) {
-            dad_state = (*aln)[ptn][dad->id];
-        }
-        padding = dad_state * NSTATES;
-        if (dad_state < NSTATES) {
-            //external node
-            trans_state = trans_mat + padding;
-            derv1_state = trans_derv1 + padding;
-            derv2_state = trans_derv2 + padding;
-            for (cat = 0; cat < numCat; cat++) {
-                MappedVec(NSTATES)ei_partial_lh_child(partial_lh_child);
-                MappedVec(NSTATES) ei_trans_state(trans_state);
-                MappedVec(NSTATES) ei_derv1_state(derv1_state);
-                MappedVec(NSTATES) ei_derv2_state(derv2_state);
-                lh_ptn += ei_partial_lh_child.dot(ei_trans_state);
-                lh_ptn_derv1 += ei_partial_lh_child.dot(ei_derv1_state);
-                lh_ptn_derv2 += ei_partial_lh_child.dot(ei_derv2_state);
-                partial_lh_child += NSTATES;
-                partial_lh_site += NSTATES;
-                trans_state += tranSize;
-                derv1_state += tranSize;
-                derv2_state += tranSize;
+#pragma omp parallel num_threads(num_slices)
+    {
+        int first_slice = omp_get_thread_num(), slice_step = omp_get_num_threads();
+        for (int slice = first_slice; slice < num_slices; slice += slice_step) {
+            // same proportion of every vector as the pattern blocks of the slice, also for
+            // single precision, scale number and parsimony vectors
+            size_t begin = vector_bytes * lh_slice_begin[slice] / num_blocks;
+            size_t end = vector_bytes * lh_slice_begin[slice + 1] / num_blocks;
+            // one write per page starting inside the slice places the whole page
+            for (uint64_t v = 0; v < num_vectors; v++) {
+                uintptr_t vec = (uintptr_t) mem + v * vector_bytes;
+                for (uintptr_t page = (vec + begin + page_size - 1) / page_size * page_size;
+                        page < vec + end; page += page_size)
+                    *(volatile char*) page = 0;
+            }
+        }
+    }
+#endif
+}
+
+void PhyloTree::benchmarkNumaPlacement(int num_evals, ostream &out) {
+    if (!central_partial_lh)
+        initializeAllPartialLh();
+    int num_slices = getNumLhSlices();
+    int num_blocks = lh_slice_begin.back();
+    size_t vector_bytes = getCentralBlockSize() * sizeof(double);
+    uint64_t num_vectors = central_partial_lh_size * sizeof(double) / vector_bytes;
+    vector<int> slice_node(num_slices, -1);
+    vector<uint64_t> local_pages(num_slices, 0), remote_pages(num_slices, 0), absent_pages(num_slices, 0);
+    out << "NUMA benchmark with " << num_slices << " pattern slice(s) of "
+            << num_vectors << " partial likelihood vectors" << endl;
+#if defined(__linux__) && defined(SYS_move_pages) && defined(SYS_getcpu)
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(num_slices)
+#endif
+    {
+#ifdef _OPENMP
+        int first_slice = omp_get_thread_num(), slice_step = omp_get_num_threads();
+#else
+        int first_slice = 0, slice_step = 1;
+#endif
+        unsigned cpu, node;
+        bool known_node = syscall(SYS_getcpu, &cpu, &node, NULL) == 0;
+        for (int slice = first_slice; slice < num_slices; slice += slice_step) {
+            if (!known_node)
+                continue;
+            slice_node[slice] = node;
+            // pages starting inside the slice of a vector, as first touched by touchLhSlices()
+            vector<void*> pages;
+            size_t begin = vector_bytes * lh_slice_begin[slice] / num_blocks;
+            size_t end = vector_bytes * lh_slice_begin[slice + 1] / num_blocks;
+            for (uint64_t v = 0; v < num_vectors; v++) {
+                uintptr_t vec = (uintptr_t) central_partial_lh + v * vector_bytes;
+                for (uintptr_t page = (vec + begin + page_size - 1) / page_size * page_size;
+                        page < vec + end; page += page_size)
+                    pages.push_back((void*) page);
+            }
+            if (pages.empty())
+                continue;
+            // move_pages() without target nodes only reports the node of every page
+            vector<int> status(pages.size());
+            if (syscall(SYS_move_pages, 0, (unsigned long) pages.size(), &pages[0], NULL, &status[0], 0) != 0)
+                continue;
+            for (size_t i = 0; i < status.size(); i++)
+                if (status[i] < 0)
+                    absent_pages[slice]++;
+                else if (status[i] == (int) node)
+                    local_pages[slice]++;
+                else
+                    remote_pages[slice]++;
+        }
+    }
+    uint64_t total_local = 0, total_remote = 0;
+    for (int slice = 0; slice < num_slices; slice++) {
+        if (slice_node[slice] < 0) {
+            out << "  Slice " << slice << ": NUMA node of the thread unknown" << endl;
+            continue;
+        }
+        out << "  Slice " << slice << " (thread on node " << slice_node[slice] << "): " << local_pages[slice]
+                << " local pages, " << remote_pages[slice] << " remote pages, " << absent_pages[slice]
+                << " pages not allocated" << endl;
+        total_local += local_pages[slice];
+        total_remote += remote_pages[slice];
+    }
+    if (total_local + total_remote > 0)
+        out << "Remote access ratio: " << 100.0 * total_remote / (total_local + total_remote)
+                << "% of " << total_local + total_remote << " pages" << endl;
+    if (!getenv("OMP_PROC_BIND"))
+        out << "NOTE: Threads may migrate between nodes, set OMP_PROC_BIND=true to pin them" << endl;
+#else
+    out << "NOTE: NUMA placement of pages cannot be queried on this platform" << endl;
+#endif
+    double start_time = getRealTime();
+    double tree_lh = 0.0;
+    for (int i = 0; i < num_evals; i++) {
+        clearAllPartialLH();
+        tree_lh = computeLikelihood();
+    }
+    double eval_time = getRealTime() - start_time;
+    out << num_evals << " likelihood evaluations from scratch took " << eval_time << " seconds (wall-clock), "
+            << eval_time / num_evals << " seconds each, log-likelihood " << tree_lh << endl;
+}
+
+template<int NSTATES>
+bool PhyloTree::planSlicedPartialLh(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    if (dad_branch->partial_lh_computed & 1)
+        return false;
+    Node *node = dad_branch->node;
+    int block = NSTATES * site_rate->getNRate();
+    LhSliceTask task;
+    task.dad_branch = dad_branch;
+    task.dad = dad;
+    // children that are already computed must not be evicted while their siblings are planned
+    pinPartialLh(dad_branch, dad);
+    FOR_NEIGHBOR_IT(node, dad, it)if ((*it)->node->name != ROOT_NAME) {
+        LhSliceChild child;
+        child.child = (PhyloNeighbor*) (*it);
+        child.trans_mat = NULL;
+        child.tip_lh_table = NULL;
+        child.planned = !child.child->node->isLeaf() && planSlicedPartialLh<NSTATES>(child.child, (PhyloNode*) node);
+        task.children.push_back(child);
+    }
+    // the pending tasks pin their vectors, keep half of the pool for the callers and for eviction
+    if (partial_lh_slots && lh_slice_tasks.size() >= num_partial_lh_slots / 2)
+        runSlicedPartialLh<NSTATES>();
+    dad_branch->lh_scale_factor = 0.0;
+    memset(dad_branch->scale_num, 0, aln->size() * sizeof(ScaleNum));
+    checkPartialLhStorage(dad_branch, dad);
+    unpinPartialLh(dad_branch, dad);
+#ifdef IGNORE_GAP_LH
+    for (int ptn = 0; ptn < getAlnNPattern(); ptn++)
+        dad_branch->scale_num[ptn] = -1;
+#endif
+    for (vector<LhSliceChild>::iterator it = task.children.begin(); it != task.children.end(); it++) {
+        it->trans_mat = getTransMatrix(it->child, (PhyloNode*) node);
+        if (it->child->node->isLeaf()) {
+            releaseTipPartialLh(it->child);
+            it->tip_lh_table = scratch.push(getNumTipStates() * block);
+            computeTipLhTable<NSTATES>(it->trans_mat, it->tip_lh_table);
+        }
+    }
+    lh_slice_tasks.push_back(task);
+    return true;
+}
+
+template<int NSTATES>
+void PhyloTree::runSlicedPartialLh() {
+    int num_slices = getNumLhSlices();
+    int num_tasks = lh_slice_tasks.size();
+    size_t lh_block = NSTATES * site_rate->getNRate() * LH_BLOCK_PATTERNS;
+    LikelihoodKernelFuncs lk_funcs;
+    getLikelihoodKernelSSE<NSTATES>(lk_kernel, lk_funcs);
+    int alnSize = getAlnNPattern();
+    for (int j = 0; j < num_tasks; j++)
+        lh_slice_tasks[j].scale_sum.assign(num_slices, 0);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(num_slices)
+#endif
+    {
+#ifdef _OPENMP
+        int first_slice = omp_get_thread_num(), slice_step = omp_get_num_threads();
+#else
+        int first_slice = 0, slice_step = 1;
+#endif
+        // the runtime may grant fewer threads than slices, then a thread takes several slices
+        for (int slice = first_slice; slice < num_slices; slice += slice_step) {
+            int block_begin = lh_slice_begin[slice], block_end = lh_slice_begin[slice + 1];
+            // the patterns of a slice only depend on the same patterns of the children,
+            // so every thread runs the whole post-order traversal without synchronization
+            for (int j = 0; j < num_tasks; j++) {
+                LhSliceTask &task = lh_slice_tasks[j];
+                double *partial_lh = task.dad_branch->partial_lh + block_begin * lh_block;
+                for (size_t k = 0; k < (block_end - block_begin) * lh_block; k++)
+                    partial_lh[k] = 1.0;
+                for (int c = 0; c < task.children.size(); c++) {
+                    LhSliceChild &child = task.children[c];
+                    computePartialLhBlockRange<NSTATES>(task.dad_branch, child.child,
+                            child.tip_lh_table ? NULL : child.child->partial_lh, child.trans_mat, child.tip_lh_table,
+                            lk_funcs, block_begin, block_end, NULL);
+                }
+                task.scale_sum[slice] = sumScaleNum(task.dad_branch->scale_num, block_begin * LH_BLOCK_PATTERNS,
+                        min(block_end * LH_BLOCK_PATTERNS, alnSize));
             }
+        }
+    }
+    // reduce the scaling exponents of the slices
+    for (int j = 0; j < num_tasks; j++) {
+        LhSliceTask &task = lh_slice_tasks[j];
+        int64_t scale_sum = 0;
+        for (int slice = 0; slice < num_slices; slice++)
+            scale_sum += task.scale_sum[slice];
+        task.dad_branch->lh_scale_factor = scale_sum * LOG_SCALE_UNIT;
+        task.dad_branch->partial_lh_computed |= 1;
+        num_partial_lh_computed++;
+        // release the pin of checkPartialLhStorage() on the children and the own pin of planned children
+        if (partial_lh_slots)
+            for (int c = 0; c < task.children.size(); c++)
+                task.children[c].child->partial_lh_pinned -= task.children[c].planned ? 2 : 1;
+    }
+    lh_slice_tasks.clear();
+}
+
+template<int NSTATES>
+void PhyloTree::computePartialLikelihoodSliced(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    // all tip tables of the traversal are released at once with this mark
+    double *scratch_mark = scratch.push(0);
+    planSlicedPartialLh<NSTATES>(dad_branch, dad);
+    runSlicedPartialLh<NSTATES>();
+    // the root of the traversal has no dad task
+    if (partial_lh_slots)
+        dad_branch->partial_lh_pinned--;
+    scratch.pop(scratch_mark);
+}
+
+/****************************************************************************
+ generic kernels for a number of states without compiled SSE kernel
+ ****************************************************************************/
+
+/**
+    number of states rounded up to 4 doubles, the width of an AVX register
+*/
+static inline int getPaddedNStates(int nstates) {
+    return (nstates + 3) & ~3;
+}
+
+/**
+    store the transition matrices column by column, each column padded with zeros to nstates_pad
+    entries: trans_col[cat][j][i] = trans_mat[cat][i][j]. The product with a vector is then a sum
+    of scaled columns, which the compiler vectorizes over the full padded length
+    @param trans_mat row-major transition matrices of all categories
+    @param nstates number of states
+    @param ncat number of categories
+    @param trans_col (OUT) ncat * nstates * getPaddedNStates(nstates) entries
+*/
+static void padTransMatrixColumns(double *trans_mat, int nstates, int ncat, double *trans_col) {
+    int nstates_pad = getPaddedNStates(nstates);
+    for (int cat = 0; cat < ncat; cat++, trans_mat += nstates * nstates)
+        for (int j = 0; j < nstates; j++, trans_col += nstates_pad) {
+            int i;
+            for (i = 0; i < nstates; i++)
+                trans_col[i] = trans_mat[i * nstates + j];
+            for (; i < nstates_pad; i++)
+                trans_col[i] = 0.0;
+        }
+}
+
+/**
+    lh_prod = trans * lh for one category with the columns from padTransMatrixColumns().
+    4 columns are added per pass to save loads and stores of lh_prod
+*/
+static inline void productTransColumns(double *trans_col, double *lh, int nstates, int nstates_pad, double *lh_prod) {
+    int i, j;
+    for (i = 0; i < nstates_pad; i++)
+        lh_prod[i] = 0.0;
+    for (j = 0; j + 3 < nstates; j += 4, trans_col += 4 * nstates_pad) {
+        double lh0 = lh[j], lh1 = lh[j + 1], lh2 = lh[j + 2], lh3 = lh[j + 3];
+        double *col1 = trans_col + nstates_pad, *col2 = col1 + nstates_pad, *col3 = col2 + nstates_pad;
+        for (i = 0; i < nstates_pad; i++)
+            lh_prod[i] += trans_col[i] * lh0 + col1[i] * lh1 + col2[i] * lh2 + col3[i] * lh3;
+    }
+    for (; j < nstates; j++, trans_col += nstates_pad) {
+        double lh_state = lh[j];
+        for (i = 0; i < nstates_pad; i++)
+            lh_prod[i] += trans_col[i] * lh_state;
+    }
+}
+
+bool PhyloTree::hasCompiledKernel(int nstates) {
+    switch (nstates) {
+    LH_KERNEL_CASES(isCompiledKernel, ())
+    default:
+        return false;
+    }
+}
+
+void PhyloTree::computeTipTableGeneric(double *trans_mat, double *tip_lh_table, bool transpose) {
+    int numCat = site_rate->getNRate();
+    int nstates = aln->num_states;
+    getNumTipStates();
+    for (IntVector::iterator it = tip_state_list.begin(); it != tip_state_list.end(); it++) {
+        int state = *it;
+        double *tip_lh = tip_partial_lh_state + state * nstates;
+        for (int cat = 0; cat < numCat; cat++) {
+            double *trans_state = trans_mat + cat * nstates * nstates;
+            double *table = tip_lh_table + (state * numCat + cat) * nstates;
+            for (int i = 0; i < nstates; i++) {
+                double lh = 0.0;
+                for (int j = 0; j < nstates; j++)
+                    lh += (transpose ? trans_state[j * nstates + i] : trans_state[i * nstates + j]) * tip_lh[j];
+                table[i] = lh;
+            }
+        }
+    }
+}
+
+void PhyloTree::computePartialLikelihoodGeneric(PhyloNeighbor *dad_branch, PhyloNode *dad, double *pattern_scale) {
+    // don't recompute the likelihood
+    if (dad_branch->partial_lh_computed & 1)
+        return;
+    Node *node = dad_branch->node;
+    int ptn, cat, i;
+    double *partial_lh_site;
+    dad_branch->lh_scale_factor = 0.0;
+    memset(dad_branch->scale_num, 0, aln->size() * sizeof(ScaleNum));
+
+    int numCat = site_rate->getNRate();
+    int nstates = aln->num_states;
+    int nstates_pad = getPaddedNStates(nstates);
+    int alnSize = getAlnNPattern();
+    int block = nstates * numCat;
+    size_t lh_size = aln->size() * block;
+
+    checkPartialLhStorage(dad_branch, dad);
+
+    if (node->isLeaf() && dad) {
+        // external node: only needed by callers other than the kernels, which use tip lookup tables
+        getNumTipStates();
+        unsigned char *node_states = (node->name == ROOT_NAME) ? NULL : getTipStates(node->id);
+        for (ptn = 0; ptn < alnSize; ++ptn) {
+            char state = (node->name == ROOT_NAME) ? STATE_UNKNOWN : node_states[ptn];
+#ifdef IGNORE_GAP_LH
+            if (state == STATE_UNKNOWN)
+                dad_branch->scale_num[ptn] = -1;
+#endif
+            double *tip_lh = tip_partial_lh_state + getTipStateIndex(state) * nstates;
+            partial_lh_site = dad_branch->partial_lh + ptn * block;
+            for (cat = 0; cat < numCat; cat++, partial_lh_site += nstates)
+                memcpy(partial_lh_site, tip_lh, nstates * sizeof(double));
+        }
+    } else {
+        // internal node
+        double *tip_lh_table = NULL;
+        double *trans_col = scratch.push(numCat * nstates * nstates_pad);
+        double *lh_prod_all = scratch.push(getMaxThreads() * nstates_pad);
+        double *float_lh = NULL;
+        if (float_partial_lh) {
+            FOR_NEIGHBOR_IT(node, dad, it)
+                if ((*it)->node->name != ROOT_NAME && !(*it)->node->isLeaf())
+                    computePartialLikelihoodGeneric((PhyloNeighbor*) (*it), (PhyloNode*) node, pattern_scale);
+            float_lh = redirectPartialLh(dad_branch);
+        }
+        for (size_t j = 0; j < lh_size; ++j)
+            dad_branch->partial_lh[j] = 1.0;
+#ifdef IGNORE_GAP_LH
+        for (ptn = 0; ptn < alnSize; ptn++)
+            dad_branch->scale_num[ptn] = -1;
+#endif
+        FOR_NEIGHBOR_IT(node, dad, it)if ((*it)->node->name != ROOT_NAME) {
+            PhyloNeighbor *child = (PhyloNeighbor*) (*it);
+            double *trans_mat = getTransMatrix(child, (PhyloNode*) node);
+            bool tip_child = child->node->isLeaf();
+            unsigned char *child_states = tip_child ? getTipStates(child->node->id) : NULL;
+            double *child_lh = NULL;
+            if (tip_child) {
+                releaseTipPartialLh(child);
+                if (!tip_lh_table)
+                    tip_lh_table = scratch.push(getNumTipStates() * block);
+                computeTipTableGeneric(trans_mat, tip_lh_table, false);
+            } else {
+                computePartialLikelihoodGeneric(child, (PhyloNode*) node, pattern_scale);
+                child_lh = unpackPartialLh(child, 1);
+                padTransMatrixColumns(trans_mat, nstates, numCat, trans_col);
+            }
+#ifdef _OPENMP
+#pragma omp parallel private(ptn, cat, i, partial_lh_site)
+#endif
+            {
+            double *lh_prod = getThreadBuffer(lh_prod_all, nstates_pad);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+            for (ptn = 0; ptn < alnSize; ++ptn) {
+                partial_lh_site = dad_branch->partial_lh + ptn * block;
+                char tip_state = tip_child ? child_states[ptn] : 0;
+#ifdef IGNORE_GAP_LH
+                if (tip_child ? (tip_state == STATE_UNKNOWN) : (child->scale_num[ptn] < 0))
+                    continue;
+                if (dad_branch->scale_num[ptn] < 0)
+                    dad_branch->scale_num[ptn] = 0;
+#endif
+                if (tip_child) {
+                    double *tip_lh = tip_lh_table + getTipStateIndex(tip_state) * block;
+                    for (i = 0; i < block; i++)
+                        partial_lh_site[i] *= tip_lh[i];
+                } else {
+                    dad_branch->scale_num[ptn] += child->scale_num[ptn];
+                    double *partial_lh_child = child_lh + ptn * block;
+                    for (cat = 0; cat < numCat; cat++) {
+                        productTransColumns(trans_col + cat * nstates * nstates_pad, partial_lh_child + cat * nstates,
+                                nstates, nstates_pad, lh_prod);
+                        for (i = 0; i < nstates; i++)
+                            partial_lh_site[cat * nstates + i] *= lh_prod[i];
+                    }
+                }
+                int exponent = scalePartialLhSite(partial_lh_site, block);
+                if (exponent) {
+                    dad_branch->scale_num[ptn] += exponent;
+                    if (pattern_scale)
+                        pattern_scale[ptn] += exponent * LOG_SCALE_UNIT;
+                }
+            }
+            }
+        }
+        scratch.pop(tip_lh_table);
+        scratch.pop(lh_prod_all);
+        scratch.pop(trans_col);
+        dad_branch->lh_scale_factor = sumScaleNum(dad_branch->scale_num, 0, alnSize) * LOG_SCALE_UNIT;
+        packPartialLh(dad_branch, float_lh);
+    }
+
+    dad_branch->partial_lh_computed |= 1;
+    num_partial_lh_computed++;
+    unpinPartialLh(dad_branch, dad);
+}
+
+double PhyloTree::computeLikelihoodBranchGeneric(PhyloNeighbor *dad_branch, PhyloNode *dad, double *pattern_lh) {
+    PhyloNode *node = (PhyloNode*) dad_branch->node;
+    PhyloNeighbor *node_branch = (PhyloNeighbor*) node->findNeighbor(dad);
+    assert(node_branch);
+    if (!central_partial_lh)
+        initializeAllPartialLh();
+    // swap node and dad if dad is a leaf
+    if (node->isLeaf()) {
+        PhyloNode *tmp_node = dad;
+        dad = node;
+        node = tmp_node;
+        PhyloNeighbor *tmp_nei = dad_branch;
+        dad_branch = node_branch;
+        node_branch = tmp_nei;
+    }
+    // the partial likelihood of a leaf is replaced by a lookup table
+    bool tip_dad = dad->isLeaf();
+    if (tip_dad)
+        releaseTipPartialLh(node_branch);
+    if ((dad_branch->partial_lh_computed & 1) == 0)
+        computePartialLikelihoodGeneric(dad_branch, dad);
+    if (!tip_dad && (node_branch->partial_lh_computed & 1) == 0)
+        computePartialLikelihoodGeneric(node_branch, node);
+
+    double tree_lh = dad_branch->lh_scale_factor;
+    if (!tip_dad)
+        tree_lh += node_branch->lh_scale_factor;
+    int ptn, cat, i;
+    double p_invar = site_rate->getPInvar();
+    double *ptn_invar = getPtnInvar();
+    int numCat = site_rate->getNRate();
+    int nstates = aln->num_states;
+    int nstates_pad = getPaddedNStates(nstates);
+    int alnSize = getAlnNPattern();
+    int block = nstates * numCat;
+    double p_var_cat = (1.0 - p_invar) / (double) numCat;
+
+    double *state_freq = scratch.push(nstates);
+    model->getStateFrequency(state_freq);
+    double *trans_mat = getTransMatrixFreq(dad_branch, dad, state_freq);
+
+    double *tip_lh_table = NULL;
+    double *trans_col = NULL;
+    unsigned char *dad_states = NULL;
+    if (tip_dad) {
+        tip_lh_table = scratch.push(getNumTipStates() * block);
+        computeTipTableGeneric(trans_mat, tip_lh_table, true);
+        if (dad->name != ROOT_NAME)
+            dad_states = getTipStates(dad->id);
+    } else {
+        trans_col = scratch.push(numCat * nstates * nstates_pad);
+        padTransMatrixColumns(trans_mat, nstates, numCat, trans_col);
+    }
+    double *node_partial_lh = tip_dad ? NULL : unpackPartialLh(node_branch, 1);
+    double *dad_partial_lh = unpackPartialLh(dad_branch, 2);
+    double *lh_prod_all = scratch.push(getMaxThreads() * nstates_pad);
+
+#ifdef _OPENMP
+#pragma omp parallel private(ptn, cat, i)
+#endif
+    {
+    double *lh_prod = getThreadBuffer(lh_prod_all, nstates_pad);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+    for (ptn = 0; ptn < alnSize; ++ptn) {
+        double lh_ptn = 0.0;
+        double *partial_lh_child = dad_partial_lh + ptn * block;
+        if (tip_dad) {
+            char state = dad_states ? dad_states[ptn] : STATE_UNKNOWN;
+            double *tip_lh = tip_lh_table + getTipStateIndex(state) * block;
+            for (i = 0; i < block; i++)
+                lh_ptn += partial_lh_child[i] * tip_lh[i];
         } else {
-            // internal node, or external node but ambiguous character
-            trans_state = trans_mat;
-            derv1_state = trans_derv1;
-            derv2_state = trans_derv2;
+            double *partial_lh_site = node_partial_lh + ptn * block;
             for (cat = 0; cat < numCat; cat++) {
-                MappedRowVec(NSTATES) ei_partial_lh_site(partial_lh_site);
-                MappedRowVec(NSTATES) ei_partial_lh_child(partial_lh_child);
-                MappedMat(NSTATES) ei_trans_state(trans_state);
-                MappedMat(NSTATES) ei_derv1_state(derv1_state);
-                MappedMat(NSTATES) ei_derv2_state(derv2_state);
-                lh_ptn += (ei_partial_lh_child * ei_trans_state).dot(ei_partial_lh_site);
-                lh_ptn_derv1 += (ei_partial_lh_child * ei_derv1_state).dot(ei_partial_lh_site);
-                lh_ptn_derv2 += (ei_partial_lh_child * ei_derv2_state).dot(ei_partial_lh_site);
-                partial_lh_site += NSTATES;
-                partial_lh_child += NSTATES;
-                trans_state += tranSize;
-                derv1_state += tranSize;
-                derv2_state += tranSize;
+                productTransColumns(trans_col + cat * nstates * nstates_pad, partial_lh_child + cat * nstates,
+                        nstates, nstates_pad, lh_prod);
+                for (i = 0; i < nstates; i++)
+                    lh_ptn += partial_lh_site[cat * nstates + i] * lh_prod[i];
             }
         }
-        lh_ptn = lh_ptn * p_var_cat;
-        if ((*aln)[ptn].is_const && (*aln)[ptn][0] < NSTATES) {
-            lh_ptn += p_invar * state_freq[(int) (*aln)[ptn][0]];
+        lh_ptn *= p_var_cat;
+        lh_ptn += ptn_invar[ptn];
+        lh_ptn = log(lh_ptn);
+        _pattern_lh[ptn] = lh_ptn;
+    }
+    }
+    scratch.pop(lh_prod_all);
+    tree_lh += sumPatternLh(_pattern_lh, 0, alnSize);
+    if (pattern_lh) {
+        memmove(pattern_lh, _pattern_lh, alnSize * sizeof(double));
+    }
+    scratch.pop(trans_col);
+    scratch.pop(state_freq);
+    return tree_lh;
+}
+
+double PhyloTree::computeLikelihoodDervGeneric(PhyloNeighbor *dad_branch, PhyloNode *dad, double &df, double &ddf) {
+    PhyloNode *node = (PhyloNode*) dad_branch->node;
+    PhyloNeighbor *node_branch = (PhyloNeighbor*) node->findNeighbor(dad);
+    // swap node and dad if node is a leaf
+    if (node->isLeaf()) {
+        PhyloNode *tmp_node = dad;
+        dad = node;
+        node = tmp_node;
+        PhyloNeighbor *tmp_nei = dad_branch;
+        dad_branch = node_branch;
+        node_branch = tmp_nei;
+    }
+    bool tip_dad = dad->isLeaf();
+    if (tip_dad)
+        releaseTipPartialLh(node_branch);
+    if ((dad_branch->partial_lh_computed & 1) == 0)
+        computePartialLikelihoodGeneric(dad_branch, dad);
+    if (!tip_dad && (node_branch->partial_lh_computed & 1) == 0)
+        computePartialLikelihoodGeneric(node_branch, node);
+    double tree_lh = dad_branch->lh_scale_factor;
+    if (!tip_dad)
+        tree_lh += node_branch->lh_scale_factor;
+    df = ddf = 0.0;
+    int ptn, cat, i;
+    double p_invar = site_rate->getPInvar();
+    double *ptn_invar = getPtnInvar();
+    int numCat = site_rate->getNRate();
+    int nstates = aln->num_states;
+    int nstates_pad = getPaddedNStates(nstates);
+    int tranSize = nstates * nstates;
+    int alnSize = getAlnNPattern();
+    int block = numCat * nstates;
+    double p_var_cat = (1.0 - p_invar) / (double) numCat;
+    double *state_freq = scratch.push(nstates);
+    model->getStateFrequency(state_freq);
+    double *trans_mat = getTransDervFreq(dad_branch, dad, state_freq);
+    double *trans_derv1 = trans_mat + numCat * tranSize;
+    double *trans_derv2 = trans_derv1 + numCat * tranSize;
+    // lookup tables for all states of a leaf, or the padded columns of the 3 matrices
+    double *tip_lh_table = NULL, *tip_derv1_table = NULL, *tip_derv2_table = NULL;
+    double *trans_col = NULL;
+    int col_size = numCat * nstates * nstates_pad;
+    unsigned char *dad_states = NULL;
+    if (tip_dad) {
+        int table_size = getNumTipStates() * block;
+        tip_lh_table = scratch.push(table_size * 3);
+        tip_derv1_table = tip_lh_table + table_size;
+        tip_derv2_table = tip_derv1_table + table_size;
+        computeTipTableGeneric(trans_mat, tip_lh_table, true);
+        computeTipTableGeneric(trans_derv1, tip_derv1_table, true);
+        computeTipTableGeneric(trans_derv2, tip_derv2_table, true);
+        if (dad->name != ROOT_NAME)
+            dad_states = getTipStates(dad->id);
+    } else {
+        trans_col = scratch.push(col_size * 3);
+        padTransMatrixColumns(trans_mat, nstates, numCat, trans_col);
+        padTransMatrixColumns(trans_derv1, nstates, numCat, trans_col + col_size);
+        padTransMatrixColumns(trans_derv2, nstates, numCat, trans_col + 2 * col_size);
+    }
+    double *node_partial_lh = tip_dad ? NULL : unpackPartialLh(node_branch, 1);
+    double *dad_partial_lh = unpackPartialLh(dad_branch, 2);
+    double *lh_prod_all = scratch.push(getMaxThreads() * nstates_pad * 3);
+#ifdef _OPENMP
+#pragma omp parallel private(ptn, cat, i)
+#endif
+    {
+    double *lh_prod = getThreadBuffer(lh_prod_all, nstates_pad * 3);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+    for (ptn = 0; ptn < alnSize; ++ptn) {
+        double lh_ptn = 0.0, lh_ptn_derv1 = 0.0, lh_ptn_derv2 = 0.0;
+        double *partial_lh_child = dad_partial_lh + ptn * block;
+        if (tip_dad) {
+            char state = dad_states ? dad_states[ptn] : STATE_UNKNOWN;
+            int table_offset = getTipStateIndex(state) * block;
+            for (i = 0; i < block; i++) {
+                double lh_child = partial_lh_child[i];
+                lh_ptn += lh_child * tip_lh_table[table_offset + i];
+                lh_ptn_derv1 += lh_child * tip_derv1_table[table_offset + i];
+                lh_ptn_derv2 += lh_child * tip_derv2_table[table_offset + i];
+            }
+        } else {
+            double *partial_lh_site = node_partial_lh + ptn * block;
+            for (cat = 0; cat < numCat; cat++) {
+                int col_offset = cat * nstates * nstates_pad;
+                productTransColumns(trans_col + col_offset, partial_lh_child + cat * nstates,
+                        nstates, nstates_pad, lh_prod);
+                productTransColumns(trans_col + col_size + col_offset, partial_lh_child + cat * nstates,
+                        nstates, nstates_pad, lh_prod + nstates_pad);
+                productTransColumns(trans_col + 2 * col_size + col_offset, partial_lh_child + cat * nstates,
+                        nstates, nstates_pad, lh_prod + 2 * nstates_pad);
+                for (i = 0; i < nstates; i++) {
+                    double lh_site = partial_lh_site[cat * nstates + i];
+                    lh_ptn += lh_site * lh_prod[i];
+                    lh_ptn_derv1 += lh_site * lh_prod[nstates_pad + i];
+                    lh_ptn_derv2 += lh_site * lh_prod[2 * nstates_pad + i];
+                }
+            }
         }
+        double derv1_frac, derv2_frac;
+        lh_ptn *= p_var_cat;
+        lh_ptn += ptn_invar[ptn];
         double pad = p_var_cat / lh_ptn;
         if (std::isinf(pad)) {
             lh_ptn_derv1 *= p_var_cat;
@@ -406,37 +1424,118 @@ inline double PhyloTree::computeLikelihoodDervSSE(PhyloNeighbor *dad_branch, Phy
             derv1_frac = lh_ptn_derv1 * pad;
             derv2_frac = lh_ptn_derv2 * pad;
         }
-        double tmp1 = derv1_frac * freq;
-        double tmp2 = derv2_frac * freq;
-        my_df += tmp1;
-        my_ddf += tmp2 - tmp1 * derv1_frac;
-        lh_ptn = log(lh_ptn);
-        tree_lh += lh_ptn * freq;
-        _pattern_lh[ptn] = lh_ptn;
+        _pattern_lh_derv[ptn] = derv1_frac;
+        _pattern_lh_derv[alnSize + ptn] = derv2_frac - derv1_frac * derv1_frac;
+        _pattern_lh[ptn] = log(lh_ptn);
     }
-    delete[] trans_derv2_orig;
-    delete[] trans_derv1_orig;
-    delete[] trans_mat_orig;
-    df = my_df;
-    ddf = my_ddf;
+    }
+    scratch.pop(lh_prod_all);
+    scratch.pop(trans_col);
+    scratch.pop(state_freq);
+    tree_lh += sumPatternLh(_pattern_lh, 0, alnSize);
+    df = sumPatternLh(_pattern_lh_derv, 0, alnSize);
+    ddf = sumPatternLh(_pattern_lh_derv + alnSize, 0, alnSize);
     return tree_lh;
 }
 
 template<int NSTATES>
 void PhyloTree::computeThetaSSE(PhyloNeighbor *dad_branch, PhyloNode *dad) {
-    cout << "This has not been implemented yet" << endl;
-    exit(1);
+    PhyloNode *node = (PhyloNode*) dad_branch->node;
+    PhyloNeighbor *node_branch = (PhyloNeighbor*) node->findNeighbor(dad);
+    assert(node_branch);
+    // swap node and dad if node is a leaf
+    if (node->isLeaf()) {
+        PhyloNode *tmp_node = dad;
+        dad = node;
+        node = tmp_node;
+        PhyloNeighbor *tmp_nei = dad_branch;
+        dad_branch = node_branch;
+        node_branch = tmp_nei;
+    }
+    // the partial likelihood of a leaf is replaced by a lookup table
+    bool tip_dad = dad->isLeaf();
+    if (tip_dad)
+        releaseTipPartialLh(node_branch);
+    if ((dad_branch->partial_lh_computed & 1) == 0)
+        computePartialLikelihoodSSE<NSTATES>(dad_branch, dad);
+    if (!tip_dad && (node_branch->partial_lh_computed & 1) == 0)
+        computePartialLikelihoodSSE<NSTATES>(node_branch, node);
+
+    // P(t) = U exp(lambda*t) U^-1, thus the likelihood at the branch is
+    // sum_i exp(lambda_i*r_c*t) * (sum_x pi_x L_node(x) U_xi) * (sum_y U^-1_iy L_dad(y))
+    GTRModel *gtr_model = (GTRModel*) model;
+    double **eigenvectors = gtr_model->getEigenvectors();
+    double **inv_eigenvectors = gtr_model->getInverseEigenvectors();
+    double state_freq[NSTATES];
+    model->getStateFrequency(state_freq);
+    Matrix<double, NSTATES, NSTATES> ei_node_proj, ei_dad_proj;
+    for (int i = 0; i < NSTATES; i++)
+        for (int x = 0; x < NSTATES; x++) {
+            ei_node_proj(i, x) = state_freq[x] * eigenvectors[x][i];
+            ei_dad_proj(i, x) = inv_eigenvectors[i][x];
+        }
+    // projection of all tip states of the leaf
+    double *tip_proj = NULL;
+    if (tip_dad) {
+        tip_proj = scratch.push(getNumTipStates() * NSTATES);
+        for (IntVector::iterator it = tip_state_list.begin(); it != tip_state_list.end(); it++) {
+            MappedVec(NSTATES) ei_tip_lh(tip_partial_lh_state + (*it) * NSTATES);
+            MappedVec(NSTATES) ei_tip_proj(tip_proj + (*it) * NSTATES);
+            ei_tip_proj.noalias() = ei_node_proj * ei_tip_lh;
+        }
+    }
+
+    int numCat = site_rate->getNRate();
+    int block = numCat * NSTATES;
+    int alnSize = getAlnNPattern();
+    bool blocked = isBlockedPartialLh();
+    int stride = blocked ? LH_BLOCK_PATTERNS : 1;
+    typedef Map<Matrix<double, NSTATES, 1>, Unaligned, InnerStride<> > StridedVec;
+    double *node_partial_lh = tip_dad ? NULL : unpackPartialLh(node_branch, 1);
+    double *dad_partial_lh = unpackPartialLh(dad_branch, 2);
+    unsigned char *dad_states = NULL;
+    if (tip_dad && dad->name != ROOT_NAME)
+        dad_states = getTipStates(dad->id);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (int ptn = 0; ptn < alnSize; ++ptn) {
+        double *partial_lh_site = tip_dad ? NULL : getPartialLhPattern(node_partial_lh, ptn, block, blocked);
+        double *partial_lh_child = getPartialLhPattern(dad_partial_lh, ptn, block, blocked);
+        double *theta_ptn = theta_all + (size_t)ptn * block;
+        for (int cat = 0; cat < numCat; cat++) {
+            StridedVec ei_partial_lh_child(partial_lh_child + cat * NSTATES * stride, NSTATES, 1, InnerStride<>(stride));
+            MappedVec(NSTATES) ei_theta(theta_ptn + cat * NSTATES);
+            ei_theta.noalias() = ei_dad_proj * ei_partial_lh_child;
+            if (tip_dad) {
+                int dad_state = getTipStateIndex(dad_states ? dad_states[ptn] : STATE_UNKNOWN);
+                ei_theta.array() *= MappedVec(NSTATES)(tip_proj + dad_state * NSTATES).array();
+            } else {
+                StridedVec ei_partial_lh_site(partial_lh_site + cat * NSTATES * stride, NSTATES, 1, InnerStride<>(stride));
+                ei_theta.array() *= (ei_node_proj * ei_partial_lh_site).array();
+            }
+        }
+    }
+    scratch.pop(tip_proj);
+}
+
+bool PhyloTree::isFastBranchOpt() {
+    if (!params || !params->fast_branch_opt || !sse || isSuperTree())
+        return false;
+    if (!hasCompiledKernel(aln->num_states))
+        return false;
+    if (!model->isReversible() || model->isSiteSpecificModel() || !dynamic_cast<GTRModel*>(model))
+        return false;
+    return !site_rate->isSiteSpecificRate() && site_rate->getNDiscreteRate() == site_rate->getNRate();
 }
 
 void PhyloTree::computeTheta(PhyloNeighbor *dad_branch, PhyloNode *dad) {
+    updatePartialLhVersion();
+    countReusedPartialLh(dad_branch, dad);
+    BranchPartialLhPin pin(this, dad_branch, dad);
     if (sse) {
         switch (aln->num_states) {
-        case 2:
-            return computeThetaSSE<2>(dad_branch, dad);
-        case 4:
-            return computeThetaSSE<4>(dad_branch, dad);
-        case 20:
-            return computeThetaSSE<20>(dad_branch, dad);
+        LH_KERNEL_CASES(computeThetaSSE, (dad_branch, dad))
         default:
             computeThetaNaive(dad_branch, dad);
             break;
@@ -505,18 +1604,9 @@ void PhyloTree::computeThetaNaive(PhyloNeighbor *dad_branch, PhyloNode *dad) {
 void PhyloTree::computePartialLikelihood(PhyloNeighbor *dad_branch, PhyloNode *dad, double *pattern_scale) {
     if (sse) {
         switch (aln->num_states) {
-        case 2:
-            return computePartialLikelihoodSSE<2>(dad_branch, dad, pattern_scale);
-        case 4:
-            return computePartialLikelihoodSSE<4>(dad_branch, dad, pattern_scale);
-        case 20:
-            return computePartialLikelihoodSSE<20>(dad_branch, dad, pattern_scale);
-        /*
-        case 61:
-            return computePartialLikelihoodSSE<61>(dad_branch, dad, pattern_scale);
-        */
+        LH_KERNEL_CASES(computePartialLikelihoodSSE, (dad_branch, dad, pattern_scale))
         default:
-            return computePartialLikelihoodNaive(dad_branch, dad, pattern_scale);
+            return computePartialLikelihoodGeneric(dad_branch, dad, pattern_scale);
         }
     } else {
         return computePartialLikelihoodNaive(dad_branch, dad, pattern_scale);
@@ -541,20 +1631,14 @@ void PhyloTree::initiateMyEigenCoeff() {
 }
 
 double PhyloTree::computeLikelihoodBranch(PhyloNeighbor *dad_branch, PhyloNode *dad, double *pattern_lh) {
+    updatePartialLhVersion();
+    countReusedPartialLh(dad_branch, dad);
+    BranchPartialLhPin pin(this, dad_branch, dad);
     if (sse) {
         switch (aln->num_states) {
-        case 2:
-            return computeLikelihoodBranchSSE<2>(dad_branch, dad, pattern_lh);
-        case 4:
-            return computeLikelihoodBranchSSE<4>(dad_branch, dad, pattern_lh);
-        case 20:
-            return computeLikelihoodBranchSSE<20>(dad_branch, dad, pattern_lh);
-        /*
-        case 61:
-            return computeLikelihoodBranchSSE<61>(dad_branch, dad, pattern_lh);
-        */
+        LH_KERNEL_CASES(computeLikelihoodBranchSSE, (dad_branch, dad, pattern_lh))
         default:
-            return computeLikelihoodBranchNaive(dad_branch, dad, pattern_lh);
+            return computeLikelihoodBranchGeneric(dad_branch, dad, pattern_lh);
         }
     } else {
         return computeLikelihoodBranchNaive(dad_branch, dad, pattern_lh);
@@ -567,22 +1651,14 @@ double PhyloTree::computeLikelihoodBranch(PhyloNeighbor *dad_branch, PhyloNode *
  * have a if and switch here.
  */
 double PhyloTree::computeLikelihoodDerv(PhyloNeighbor *dad_branch, PhyloNode *dad, double &df, double &ddf) {
+    updatePartialLhVersion();
+    countReusedPartialLh(dad_branch, dad);
+    BranchPartialLhPin pin(this, dad_branch, dad);
     if (sse) {
         switch (aln->num_states) {
-        case 2:
-            return computeLikelihoodDervSSE<2>(dad_branch, dad, df, ddf);
-        case 4:
-            return computeLikelihoodDervSSE<4>(dad_branch, dad, df, ddf);
-        case 20:
-            return computeLikelihoodDervSSE<20>(dad_branch, dad, df, ddf);
-        /*
-        case 61:
-            return computeLikelihoodDervSSE<61>(dad_branch, dad, df, ddf);
-        */
+        LH_KERNEL_CASES(computeLikelihoodDervSSE, (dad_branch, dad, df, ddf))
         default:
-            return computeLikelihoodDervNaive(dad_branch, dad, df, ddf);
-            //cout << "Wrong number of states: " << aln->num_states << endl;
-            //return -1.0;
+            return computeLikelihoodDervGeneric(dad_branch, dad, df, ddf);
         }
     } else {
         return computeLikelihoodDervNaive(dad_branch, dad, df, ddf);
@@ -590,14 +1666,10 @@ double PhyloTree::computeLikelihoodDerv(PhyloNeighbor *dad_branch, PhyloNode *da
 }
 
 double PhyloTree::computeLikelihoodDervFast(PhyloNeighbor *dad_branch, PhyloNode *dad, double &df, double &ddf) {
+    updatePartialLhVersion();
     if (sse) {
         switch (aln->num_states) {
-        case 2:
-            return computeLikelihoodDervFastSSE<2>(dad_branch, dad, df, ddf);
-        case 4:
-            return computeLikelihoodDervFastSSE<4>(dad_branch, dad, df, ddf);
-        case 20:
-            return computeLikelihoodDervFastSSE<20>(dad_branch, dad, df, ddf);
+        LH_KERNEL_CASES(computeLikelihoodDervFastSSE, (dad_branch, dad, df, ddf))
         default:
             return computeLikelihoodDervFastNaive(dad_branch, dad, df, ddf);
             //cout << "Bad number of states: " << aln->num_states << endl;
@@ -636,6 +1708,7 @@ double PhyloTree::computeLikelihoodDervFastNaive(PhyloNeighbor *dad_branch, Phyl
     double my_df = 0.0;
     double my_ddf = 0.0;
     double p_invar = site_rate->getPInvar();
+    double *ptn_invar = getPtnInvar();
     int ncat = site_rate->getNRate();
     double p_var_cat = (1.0 - p_invar) / (double) ncat;
     double derv1_frac;
@@ -686,9 +1759,7 @@ double PhyloTree::computeLikelihoodDervFastNaive(PhyloNeighbor *dad_branch, Phyl
         }
         theta_ptn += pointer_jump;
         lh_ptn = lh_ptn * p_var_cat;
-        if ((*aln)[ptn].is_const && (*aln)[ptn][0] < nstates) {
-            lh_ptn += p_invar * state_freq[(int) (*aln)[ptn][0]];
-        }
+        lh_ptn += ptn_invar[ptn];
         double pad = p_var_cat / lh_ptn;
         if (std::isinf(pad)) {
             lh_ptn_derv1 *= p_var_cat;
@@ -736,91 +1807,47 @@ double PhyloTree::computeLikelihoodDervFastSSE(PhyloNeighbor *dad_branch, PhyloN
         node_branch = tmp_nei;
     }
     // now combine likelihood at the branch
-    double tree_lh = node_branch->lh_scale_factor + dad_branch->lh_scale_factor;
-    double lh_ptn = 0.0;
-    double lh_ptn_derv1 = 0.0;
-    double lh_ptn_derv2 = 0.0;
+    double tree_lh = dad_branch->lh_scale_factor;
+    if (!dad->isLeaf())
+        tree_lh += node_branch->lh_scale_factor;
     double p_invar = site_rate->getPInvar();
+    double *ptn_invar = getPtnInvar();
     int numCat = site_rate->getNRate();
     double p_var_cat = (1.0 - p_invar) / (double) numCat;
-    double derv1_frac;
-    double derv2_frac;
     double state_freq[NSTATES];
-    int discrete_cat = site_rate->getNDiscreteRate();
     model->getStateFrequency(state_freq);
-    double* rates = new double[discrete_cat];
-    for (int i = 0; i < numCat; i++) {
-    	rates[i] = site_rate->getRate(i);
+    double *eigenvalues = ((GTRModel*) model)->getEigenvalues();
+    int block = numCat * NSTATES;
+    // exp(lambda_i*r_c*t) and its 1st and 2nd derivative w.r.t. t, [category][state]
+    double *expo_time = scratch.push(block * 3);
+    double *expo_time_derv1 = expo_time + block;
+    double *expo_time_derv2 = expo_time_derv1 + block;
+    for (int cat = 0; cat < numCat; cat++) {
+        double rate = site_rate->getRate(cat);
+        for (int i = 0; i < NSTATES; i++) {
+            double rate_lambda = rate * eigenvalues[i];
+            int index = cat * NSTATES + i;
+            expo_time[index] = exp(rate_lambda * dad_branch->length);
+            expo_time_derv1[index] = expo_time[index] * rate_lambda;
+            expo_time_derv2[index] = expo_time_derv1[index] * rate_lambda;
+        }
     }
-    Map<Matrix<double, Dynamic, 1>, Aligned> ei_rates(rates, discrete_cat);
-    Map<Matrix<double, 1, NSTATES>, Aligned> ei_eigenvalues(dynamic_cast<GTRModel*>(model)->getEigenvalues());
-    Matrix(NSTATES)ei_rates_times_lambdas = ei_rates * ei_eigenvalues;
-    Matrix(NSTATES)expo_time =
-    (ei_rates_times_lambdas * dad_branch->length).array().exp();
-    Matrix(NSTATES)expo_time_derv1 = expo_time.cwiseProduct(
-            ei_rates_times_lambdas);
-    Matrix(NSTATES)expo_time_derv2 = expo_time_derv1.cwiseProduct(
-            ei_rates_times_lambdas);
-    double *theta_ptn = theta_all;
-    int num_patterns = aln->getNPattern();
+    Map<VectorXd> ei_expo_time(expo_time, block);
+    Map<VectorXd> ei_expo_time_derv1(expo_time_derv1, block);
+    Map<VectorXd> ei_expo_time_derv2(expo_time_derv2, block);
+    int num_patterns = getAlnNPattern();
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
     for (int ptn = 0; ptn < num_patterns; ++ptn) {
-        lh_ptn = 0.0;
-        lh_ptn_derv1 = 0.0;
-        lh_ptn_derv2 = 0.0;
-        /*
-         for (int k = 0; k < discrete_cat; k++) {
-         for (int i = 0; i < num_states; i++) {
-         double x =theta_ptn[k*num_states+i] *
-         exp(site_rate->getRates()[k]*dad_branch->length*dynamic_cast<GTRModel*> (model)->getEigenvalues()[i]);
-         //cout << exp(site_rate->getRates()[k]*dad_branch->length*dynamic_cast<GTRModel*> (model)->getEigenvalues()[i]) << " ";
-         lh_ptn += x;
-         //cout << x << " ";
-         //cout << theta_ptn[k*num_states+i] << " ";
-         double y = x * site_rate->getRates()[k] * dynamic_cast<GTRModel*> (model)->getEigenvalues()[i];
-         //cout << y << " ";
-         //cout << site_rate->getRates()[k] * dynamic_cast<GTRModel*> (model)->getEigenvalues()[i] << " ";
-         lh_ptn_derv1 += y;
-         lh_ptn_derv2 += y*site_rate->getRates()[k] * dynamic_cast<GTRModel*> (model)->getEigenvalues()[i];
-
-         }
-         }
-         */
-
-        Map<Matrix<double, Dynamic, Dynamic, RowMajor>, Aligned> ei_theta_ptn(theta_ptn, discrete_cat, NSTATES);
-        //Map<Matrix<double, NSTATES, NSTATES, RowMajor>, Aligned> ei_theta_ptn(theta_ptn);
-        //cout << "ei_theta_ptn" << endl;
-        //cout << ei_theta_ptn << endl;
-        //ArrayXXd ei_theta_times_expo = ei_theta_ptn * expo_time;
-
-        lh_ptn = ei_theta_ptn.cwiseProduct(expo_time).sum();
-        lh_ptn_derv1 = ei_theta_ptn.cwiseProduct(expo_time_derv1).sum();
-        lh_ptn_derv2 = ei_theta_ptn.cwiseProduct(expo_time_derv2).sum();
-
-        /*
-         for (int cat = 0; cat < discrete_cat; ++cat) {
-         MappedRowVec(NSTATES) ei_theta_ptn_cat(theta_ptn);
-         lh_ptn += ei_theta_ptn_cat.dot(expo_time.row(cat));
-         lh_ptn_derv1 += ei_theta_ptn_cat.dot(expo_time_derv1.row(cat));
-         lh_ptn_derv2 += ei_theta_ptn_cat.dot(expo_time_derv2.row(cat));
-         theta_ptn += NSTATES;
-         }
-         */
-
-        /*
-         ArrayXXd ei_theta_times_expo_derv1 = ei_rates_times_lambdas * ei_theta_times_expo;
-         ArrayXXd ei_theta_times_expo_derv1 = ei_theta_ptn.cwiseProduct(expo_time_derv1);
-
-         ArrayXXd ei_theta_times_expo_derv2 = ei_theta_ptn.cwiseProduct(expo_time_derv2);
-         lh_ptn = ei_theta_times_expo.sum();
-         lh_ptn_derv1 = ei_theta_times_expo_derv1.sum();
-         lh_ptn_derv2 = (ei_theta_times_expo_derv1 * ei_rates_times_lambdas).sum();
-         */
-        theta_ptn += NSTATES * discrete_cat;
+        Map<VectorXd> ei_theta_ptn(theta_all + (size_t)ptn * block, block);
+        double lh_ptn = ei_theta_ptn.dot(ei_expo_time);
+        double lh_ptn_derv1 = ei_theta_ptn.dot(ei_expo_time_derv1);
+        double lh_ptn_derv2 = ei_theta_ptn.dot(ei_expo_time_derv2);
+        double derv1_frac, derv2_frac;
 
         lh_ptn = lh_ptn * p_var_cat;
-        if ((*aln)[ptn].is_const && (*aln)[ptn][0] < NSTATES) {
-            lh_ptn += p_invar * state_freq[(int) (*aln)[ptn][0]];
-        }
+        lh_ptn += ptn_invar[ptn];
 
         double pad = p_var_cat / lh_ptn;
         if (std::isinf(pad)) {
@@ -832,14 +1859,13 @@ double PhyloTree::computeLikelihoodDervFastSSE(PhyloNeighbor *dad_branch, PhyloN
             derv1_frac = lh_ptn_derv1 * pad;
             derv2_frac = lh_ptn_derv2 * pad;
         }
-        double tmp1 = derv1_frac * aln->at(ptn).frequency;
-        double tmp2 = derv2_frac * aln->at(ptn).frequency;
-        df += tmp1;
-        ddf += tmp2 - tmp1 * derv1_frac;
-        lh_ptn = log(lh_ptn);
-        tree_lh += lh_ptn * aln->at(ptn).frequency;
-        _pattern_lh[ptn] = lh_ptn;
+        _pattern_lh_derv[ptn] = derv1_frac;
+        _pattern_lh_derv[num_patterns + ptn] = derv2_frac - derv1_frac * derv1_frac;
+        _pattern_lh[ptn] = log(lh_ptn);
     }
+    scratch.pop(expo_time);
+    tree_lh += sumPatternLh(_pattern_lh, 0, num_patterns);
+    df = sumPatternLh(_pattern_lh_derv, 0, num_patterns);
+    ddf = sumPatternLh(_pattern_lh_derv + num_patterns, 0, num_patterns);
     return tree_lh;
-
 }
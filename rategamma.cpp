@@ -111,14 +111,12 @@ void RateGamma::computeRatesMean () {
 double RateGamma::computeFunction(double shape) {
 	gamma_shape = shape;
 	computeRates();
-	phylo_tree->clearAllPartialLH();
 	return -phylo_tree->computeLikelihood();
 }
 
 double RateGamma::targetFunk(double x[]) {
 	getVariables(x);
 	computeRates();
-	phylo_tree->clearAllPartialLH();
 	return -phylo_tree->computeLikelihood();
 }
 
@@ -151,7 +149,6 @@ double RateGamma::optimizeParameters(double epsilon) {
 	optx = minimizeOneDimen(MIN_GAMMA_SHAPE, current_shape, MAX_GAMMA_SHAPE, max(epsilon, TOL_GAMMA_SHAPE), &negative_lh, &ferror);
 	gamma_shape = optx;
 	computeRates();
-	phylo_tree->clearAllPartialLH();
 	return -negative_lh;
 }
 
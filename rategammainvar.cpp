@@ -35,7 +35,6 @@ double RateGammaInvar::computeFunction(double value) {
 		p_invar = value;
 	// need to compute rates again if p_inv or Gamma shape changes!
 	computeRates();
-	phylo_tree->clearAllPartialLH();
 	return -phylo_tree->computeLikelihood();
 }
 
@@ -66,7 +65,6 @@ double RateGammaInvar::targetFunk(double x[]) {
 	getVariables(x);
 	// need to compute rates again if p_inv or Gamma shape changes!
 	RateGamma::computeRates();
-	phylo_tree->clearAllPartialLH();
 	return -phylo_tree->computeLikelihood();
 }
 
@@ -85,7 +83,6 @@ double RateGammaInvar::optimizeParameters(double epsilon) {
 		tree_lh = RateGamma::optimizeParameters(epsilon);
 		cur_optimize = 1;
 		tree_lh = RateInvar::optimizeParameters(epsilon);
-		phylo_tree->clearAllPartialLH();
 		return tree_lh;
 	}
 
@@ -114,8 +111,6 @@ double RateGammaInvar::optimizeParameters(double epsilon) {
 
 	getVariables(variables);
 
-	phylo_tree->clearAllPartialLH();
-
 	delete [] bound_check;
 	delete [] lower_bound;
 	delete [] upper_bound;
@@ -19,6 +19,7 @@
  ***************************************************************************/
 
 #include "tools.h"
+#include "memarena.h"
 
 VerboseMode verbose_mode;
 
@@ -639,11 +640,13 @@ void parseArg(int argc, char *argv[], Params &params) {
     params.parsimony = false;
     params.parsimony_tree = false;
     params.tree_spr = false;
+    params.spr_radius = 6;
     params.nexus_output = false;
     params.k_representative = 4;
     params.loglh_epsilon = 0.000001;
     params.numSmoothTree = 1;
     params.nni5Branches = false;
+    params.parallel_nni = false;
     params.nniThresHold = 0.1;
     params.leastSquareBranch = false;
     params.leastSquareNNI = false;
@@ -657,7 +660,9 @@ void parseArg(int argc, char *argv[], Params &params) {
     params.stop_confidence = 0.95;
     params.model_name = "";
     params.model_set = NULL;
-    params.store_trans_matrix = false;
+    params.store_trans_matrix = true;
+    params.trans_cache_size = 32;
+    params.lh_mem_limit = 0;
     //params.freq_type = FREQ_EMPIRICAL;
     params.freq_type = FREQ_UNKNOWN;
     params.num_rate_cats = 4;
@@ -679,6 +684,13 @@ void parseArg(int argc, char *argv[], Params &params) {
     params.aLRT_replicates = 0;
     params.localbp_replicates = 0;
     params.SSE = true;
+    params.AVX = true;
+    params.lh_block_layout = true;
+    params.lh_float = -1;
+    params.site_repeats = false;
+    params.lh_slice_traversal = true;
+    params.numa_benchmark = 0;
+    params.huge_page = HUGE_PAGE_NONE;
     params.print_site_lh = false;
     params.print_tree_lh = false;
     params.nni_lh = false;
@@ -743,12 +755,14 @@ void parseArg(int argc, char *argv[], Params &params) {
     params.binary_aln_file = NULL;
     params.maxtime = 1000000;
     params.reinsert_par = false;
-    params.fast_branch_opt = false;
+    params.fast_branch_opt = true;
     params.par_vs_bionj = false;
     params.tabu = false;
     params.cherry = false;
     params.ilsnni = false;
     params.random_restart = false;
+    params.num_starts = 1;
+    params.migration_interval = 10;
     params.avh_test = 0;
     params.site_freq_file = NULL;
 #ifdef _OPENMP
@@ -766,6 +780,8 @@ void parseArg(int argc, char *argv[], Params &params) {
     gettimeofday(&tv, &tz);
     //params.ran_seed = (unsigned) (tv.tv_sec+tv.tv_usec);
     params.ran_seed = (unsigned) (tv.tv_usec);
+    // -srep needs the pattern layout, checked after all options are read
+    bool lh_block_option = false;
 
     for (cnt = 1; cnt < argc; cnt++) {
         try {
@@ -1236,6 +1252,13 @@ void parseArg(int argc, char *argv[], Params &params) {
             } else if (strcmp(argv[cnt], "-spr") == 0) {
                 // subtree pruning and regrafting
                 params.tree_spr = true;
+            } else if (strcmp(argv[cnt], "-sprrad") == 0) {
+                cnt++;
+                if (cnt >= argc)
+                    throw "Use -sprrad <radius>";
+                params.spr_radius = convert_int(argv[cnt]);
+                if (params.spr_radius < 1)
+                    throw "SPR radius must be positive";
             } else if (strcmp(argv[cnt], "-krep") == 0) {
                 cnt++;
                 if (cnt >= argc)
@@ -1289,6 +1312,22 @@ void parseArg(int argc, char *argv[], Params &params) {
                     throw "Wrong mean rate for MH model";
             } else if (strcmp(argv[cnt], "-mstore") == 0) {
                 params.store_trans_matrix = true;
+            } else if (strcmp(argv[cnt], "-nomstore") == 0) {
+                params.store_trans_matrix = false;
+            } else if (strcmp(argv[cnt], "-mcache") == 0) {
+                cnt++;
+                if (cnt >= argc)
+                    throw "Use -mcache <MB>";
+                params.trans_cache_size = convert_int(argv[cnt]);
+                if (params.trans_cache_size < 0)
+                    throw "Transition matrix cache size must be non-negative";
+            } else if (strcmp(argv[cnt], "-lhmem") == 0) {
+                cnt++;
+                if (cnt >= argc)
+                    throw "Use -lhmem <MB>";
+                params.lh_mem_limit = convert_int(argv[cnt]);
+                if (params.lh_mem_limit < 0)
+                    throw "Memory limit of partial likelihoods must be non-negative";
             } else if (strcmp(argv[cnt], "-nni_lh") == 0) {
                 params.nni_lh = true;
             } else if (strcmp(argv[cnt], "-lmd") == 0) {
@@ -1305,6 +1344,41 @@ void parseArg(int argc, char *argv[], Params &params) {
                     throw "Confidence level of the adaptive NNI search must be >= 0.75 and <= 1";
             } else if (strcmp(argv[cnt], "-nosse") == 0) {
                 params.SSE = false;
+            } else if (strcmp(argv[cnt], "-noavx") == 0) {
+                params.AVX = false;
+            } else if (strcmp(argv[cnt], "-lhblock") == 0) {
+                params.lh_block_layout = true;
+                lh_block_option = true;
+            } else if (strcmp(argv[cnt], "-nolhblock") == 0) {
+                params.lh_block_layout = false;
+                lh_block_option = false;
+            } else if (strcmp(argv[cnt], "-lhfloat") == 0) {
+                params.lh_float = 1;
+            } else if (strcmp(argv[cnt], "-nolhfloat") == 0) {
+                params.lh_float = 0;
+            } else if (strcmp(argv[cnt], "-nolhslice") == 0) {
+                params.lh_slice_traversal = false;
+            } else if (strcmp(argv[cnt], "-numabench") == 0) {
+                cnt++;
+                if (cnt >= argc)
+                    throw "Use -numabench <number_of_evaluations>";
+                params.numa_benchmark = convert_int(argv[cnt]);
+                if (params.numa_benchmark < 1)
+                    throw "Number of evaluations of the NUMA benchmark must be positive";
+            } else if (strcmp(argv[cnt], "-hugepage") == 0) {
+                cnt++;
+                if (cnt >= argc)
+                    throw "Use -hugepage none|thp|tlb";
+                if (strcmp(argv[cnt], "none") == 0)
+                    params.huge_page = HUGE_PAGE_NONE;
+                else if (strcmp(argv[cnt], "thp") == 0)
+                    params.huge_page = HUGE_PAGE_TRANSPARENT;
+                else if (strcmp(argv[cnt], "tlb") == 0)
+                    params.huge_page = HUGE_PAGE_EXPLICIT;
+                else
+                    throw "Use -hugepage none|thp|tlb";
+            } else if (strcmp(argv[cnt], "-srep") == 0) {
+                params.site_repeats = true;
             } else if (strcmp(argv[cnt], "-f") == 0) {
                 cnt++;
                 if (cnt >= argc)
@@ -1653,12 +1727,16 @@ void parseArg(int argc, char *argv[], Params &params) {
             	params.ilsnni = true;
             } else if (strcmp(argv[cnt], "-fast_bran") == 0) {
                 params.fast_branch_opt = true;
+            } else if (strcmp(argv[cnt], "-nofast_bran") == 0) {
+                params.fast_branch_opt = false;
             } else if (strcmp(argv[cnt], "-lsbran") == 0) {
                 params.leastSquareBranch = true;
             } else if (strcmp(argv[cnt], "-fivebran") == 0 || strcmp(argv[cnt], "-nni5") == 0) {
             	params.nni5Branches = true;
             } else if (strcmp(argv[cnt], "-onebran") == 0 || strcmp(argv[cnt], "-nni1") == 0) {
             	params.nni5Branches = false;
+            } else if (strcmp(argv[cnt], "-pnni") == 0) {
+            	params.parallel_nni = true;
             } else if (strcmp(argv[cnt], "-nniThreshold") == 0) {
             	cnt++;
             	if (cnt >= argc)
@@ -1697,6 +1775,20 @@ void parseArg(int argc, char *argv[], Params &params) {
                 params.loglh_epsilon = convert_double(argv[cnt]);
             } else if (strcmp(argv[cnt], "-random_restart") == 0) {
                 params.random_restart = true;
+            } else if (strcmp(argv[cnt], "-nstarts") == 0) {
+                cnt++;
+                if (cnt >= argc)
+                    throw "Use -nstarts <#trajectories>";
+                params.num_starts = convert_int(argv[cnt]);
+                if (params.num_starts < 1)
+                    throw "Number of trajectories must be positive";
+            } else if (strcmp(argv[cnt], "-migrate") == 0) {
+                cnt++;
+                if (cnt >= argc)
+                    throw "Use -migrate <#iterations>";
+                params.migration_interval = convert_int(argv[cnt]);
+                if (params.migration_interval < 1)
+                    throw "Migration interval must be positive";
             } else if (strcmp(argv[cnt], "-pb") == 0) { // Enable parsimony branch length estimation
                 params.parbran = true;
             } else if (strcmp(argv[cnt], "-wbt") == 0) {
@@ -1772,6 +1864,11 @@ void parseArg(int argc, char *argv[], Params &params) {
         }
 
     } // for
+    if (params.site_repeats) {
+        if (lh_block_option)
+            outError("Option -lhblock cannot be used with -srep");
+        params.lh_block_layout = false;
+    }
     if (!params.user_file && !params.aln_file && !params.ngs_file && !params.ngs_mapped_reads && !params.partition_file)
 #ifdef IQ_TREE
         usage_iqtree(argv, false);
@@ -1934,7 +2031,38 @@ void usage_iqtree(char* argv[], bool full_command) {
             << "  -spc <level>         Confidence level for NNI adaptive search (default 0.95)" << endl
             << "  -sp_iter <number>    #iterations before NNI adaptive heuristic is started" << endl
             << "  -lmd <lambda>        lambda parameter for the PhyML search (default 0.75)" << endl
+            << "  -pnni                Evaluate the NNIs of different branches in parallel threads," << endl
+            << "                       each with its own copy of the partial likelihoods" << endl
+            << "  -nstarts <num>       Run <num> IQPNNI trajectories in parallel threads, sharing" << endl
+            << "                       the candidate trees (default: 1)" << endl
+            << "  -migrate <#iter>     Copy the best tree to all trajectories every <#iter> iterations" << endl
+            << "                       of each trajectory (default: 10)" << endl
+            << "  -spr                 Search by subtree pruning and regrafting (SPR) instead of IQPNNI" << endl
+            << "  -sprrad <radius>     SPR: Max. #branches between pruning and regrafting point" << endl
+            << "                       (default: 6)" << endl
             << "  -nosse               Disable SSE instructions" << endl
+            << "  -noavx               Disable AVX2/AVX-512 likelihood kernels" << endl
+            << "  -lhblock             Store partial likelihoods in blocks of patterns, so that the" << endl
+            << "                       SIMD kernels work on several patterns at once (default)" << endl
+            << "  -nolhblock           Store partial likelihoods pattern by pattern (no blocking)" << endl
+            << "  -lhfloat             Store partial likelihoods in single precision to save memory," << endl
+            << "                       they are converted to double precision for computing" << endl
+            << "  -nolhfloat           Store partial likelihoods in double precision (default: float" << endl
+            << "                       if more than 100000 patterns)" << endl
+            << "  -srep                Compute partial likelihoods once per pattern repeated in" << endl
+            << "                       a subtree (implies -nolhblock)" << endl
+            << "  -nolhslice           Parallelize each likelihood loop separately instead of" << endl
+            << "                       giving each thread a fixed slice of patterns per traversal" << endl
+            << "  -numabench <num>     Report on which NUMA node the pattern slices of the threads" << endl
+            << "                       are stored and time <num> likelihood evaluations" << endl
+            << "  -hugepage <mode>     Back likelihood buffers by transparent huge pages (thp)," << endl
+            << "                       reserved huge pages (tlb) or normal pages (none, default)" << endl
+            << "  -mcache <MB>         Memory limit of transition matrix cache (default: 32)" << endl
+            << "  -lhmem <MB>          Memory limit of partial likelihood vectors, vectors are" << endl
+            << "                       recomputed when evicted (default: 0 for no limit)" << endl
+            << "  -nomstore            Disable transition matrix cache" << endl
+            << "  -nofast_bran         Recompute transition matrices in every Newton step" << endl
+            << "                       of branch length optimization" << endl
             << "  -wt                  Writing all intermediate trees into .treels file" << endl
             << "  -d <file>            Reading genetic distances from file (default: JC)" << endl
             << "  -fixbr               Fix branch lengths of <treefile>" << endl
@@ -2223,6 +2351,32 @@ int init_random(int seed) {
 
 /******************/
 
+/* stream of random_double() in the calling thread, NULL for the stream of init_random() */
+static int *thread_randstream = NULL;
+#ifdef _OPENMP
+#pragma omp threadprivate(thread_randstream)
+#endif
+
+int *new_random_stream(int seed, int stream_id, int num_streams) {
+#if RAN_TYPE == RAN_SPRNG
+    // stream 0 of a seed is taken by init_random()
+    return init_sprng(stream_id + 1, num_streams + 1, seed, SPRNG_DEFAULT);
+#else
+    return NULL;
+#endif
+}
+
+void free_random_stream(int *stream) {
+#if RAN_TYPE == RAN_SPRNG
+    if (stream)
+        free_sprng(stream);
+#endif
+}
+
+void set_thread_random_stream(int *stream) {
+    thread_randstream = stream;
+}
+
 /* returns a random integer in the range [0; n - 1] */
 int random_int(int n) {
     return (int) floor(random_double() * n);
@@ -2234,6 +2388,8 @@ double random_double() {
 #if RAN_TYPE == RAN_STANDARD
     return ((double) rand()) / ((double) RAND_MAX + 1);
 #elif RAN_TYPE == RAN_SPRNG
+    if (thread_randstream)
+        return sprng(thread_randstream);
     return sprng(randstream);
 #else /* NO_SPRNG */
     return randomunitintervall();
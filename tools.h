@@ -374,6 +374,12 @@ struct Params {
 	 *  Optimize 5 branches on NNI tree
 	 */
 	bool nni5Branches;
+
+	/**
+	 *  TRUE to evaluate the NNIs of different branches in parallel threads,
+	 *  each with its own copy of the tree and of the partial likelihoods
+	 */
+	bool parallel_nni;
     
     /**
      *  Number of smoothTree iteration carried out in Phylolib for IQP Tree
@@ -425,6 +431,16 @@ struct Params {
      */
     bool random_restart;
 
+    /**
+     *  number of IQPNNI trajectories run in parallel threads, sharing the candidate trees
+     */
+    int num_starts;
+
+    /**
+     *  number of iterations of each trajectory between two migrations of the best tree
+     */
+    int migration_interval;
+
     /**
      *  Turn on parsimony branch length estimation
      */
@@ -883,6 +899,11 @@ struct Params {
      */
     bool tree_spr;
 
+    /**
+            maximal number of branches between the pruning and the regrafting point of an SPR move
+     */
+    int spr_radius;
+
     /**
             true if printing out of optimal sets in NEXUS format
      */
@@ -931,6 +952,16 @@ struct Params {
      */
     bool store_trans_matrix;
 
+    /**
+            memory limit of the transition matrix cache in MB
+     */
+    int trans_cache_size;
+
+    /**
+            memory limit of the partial likelihood vectors in MB, 0 for no limit
+     */
+    int lh_mem_limit;
+
     /**
             state frequency type
      */
@@ -1054,6 +1085,42 @@ struct Params {
             SSE Option
      */
     bool SSE;
+
+    /**
+            FALSE to restrict the likelihood kernels to SSE even if the CPU supports AVX2/AVX-512
+     */
+    bool AVX;
+
+    /**
+            TRUE to store partial likelihoods in the pattern-blocked layout for the SSE kernels
+     */
+    bool lh_block_layout;
+
+    /**
+            1 to store partial likelihoods in single precision, 0 for double precision,
+            -1 to use single precision for alignments with many patterns
+     */
+    int lh_float;
+
+    /**
+            TRUE to compute partial likelihoods only once per site repeat (pattern layout only)
+     */
+    bool site_repeats;
+
+    /**
+            TRUE to compute partial likelihoods traversal by traversal with a fixed pattern slice per thread
+     */
+    bool lh_slice_traversal;
+
+    /**
+            number of likelihood evaluations of the NUMA benchmark, 0 to skip the benchmark
+     */
+    int numa_benchmark;
+
+    /**
+            huge pages of the likelihood buffers, one of HugePageMode in memarena.h
+     */
+    int huge_page;
     /**
             TRUE to print site log-likelihood
      */
@@ -1713,6 +1780,27 @@ double computePValueChiSquare(double x, int df);
  */
 int init_random(int seed);
 
+/**
+ * create a random stream that is independent of the stream of init_random()
+ * and of the other streams with the same seed
+ * @param seed seed for generator
+ * @param stream_id number of the stream, from 0 to num_streams - 1
+ * @param num_streams number of streams created with this seed
+ * @return the stream, to be released with free_random_stream()
+ */
+int *new_random_stream(int seed, int stream_id, int num_streams);
+
+/**
+ * release a stream of new_random_stream()
+ */
+void free_random_stream(int *stream);
+
+/**
+ * let random_double() draw from another stream in the calling thread
+ * @param stream a stream of new_random_stream(), NULL for the stream of init_random()
+ */
+void set_thread_random_stream(int *stream);
+
 /**
  * returns a random integer in the range [0; n - 1] 
  * @param n upper-bound of random number
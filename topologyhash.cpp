@@ -0,0 +1,113 @@
+//
+// C++ Implementation: topologyhash
+//
+// Description: hashes of unrooted tree topologies, used as keys of the candidate trees
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "topologyhash.h"
+#include "mtree.h"
+
+/**
+	finalizer of the splitmix64 generator, a bijective mixing of 64 bits
+*/
+static inline uint64_t mixBits(uint64_t x) {
+	x ^= x >> 30;
+	x *= UINT64_C(0xbf58476d1ce4e5b9);
+	x ^= x >> 27;
+	x *= UINT64_C(0x94d049bb133111eb);
+	x ^= x >> 31;
+	return x;
+}
+
+TopologyHash TopologyHash::taxonKey(int taxon_id) {
+	// independent of the random number generator, so that hashing does not change the search
+	TopologyHash key;
+	key.lo = mixBits((taxon_id + 1) * UINT64_C(0x9e3779b97f4a7c15));
+	key.hi = mixBits((taxon_id + 1) * UINT64_C(0xd1b54a32d192ed03) + UINT64_C(0x8cb92ba72f3d8dd7));
+	return key;
+}
+
+TopologyHash TopologyHash::splitHash(const TopologyHash &key_sum) {
+	// non-linear in the key sum, otherwise different trees would often have the same sum of splits
+	uint64_t a = mixBits(key_sum.lo + UINT64_C(0x2545f4914f6cdd1d));
+	uint64_t b = mixBits(key_sum.hi + UINT64_C(0x9e3779b97f4a7c15));
+	TopologyHash hash;
+	hash.lo = mixBits(a ^ ((b << 32) | (b >> 32)));
+	hash.hi = mixBits(a + b);
+	hash.check = mixBits((a * UINT64_C(0xd1b54a32d192ed03)) ^ b);
+	return hash;
+}
+
+int TopologyIntMap::findTopology(TopologyHash hash) {
+	for (iterator it = find(hash); it != end(); it = find(hash)) {
+		if (checks[it->second] == hash.check)
+			return it->second;
+		// same key as a different topology
+		hash.lo++;
+	}
+	return -1;
+}
+
+void TopologyIntMap::insertTopology(TopologyHash hash, int index) {
+	for (iterator it = find(hash); it != end(); it = find(hash)) {
+		assert(checks[it->second] != hash.check);
+		hash.lo++;
+	}
+	(*this)[hash] = index;
+	if (index >= checks.size())
+		checks.resize(index + 1);
+	checks[index] = hash.check;
+}
+
+void TopologyIntMap::storeTopology(MTree *tree, int index) {
+	pair<IntVector, int> &topo = topologies[index];
+	if (topo.second++ == 0)
+		tree->getTopology(topo.first);
+}
+
+void TopologyIntMap::releaseTopology(int index) {
+	map<int, pair<IntVector, int> >::iterator it = topologies.find(index);
+	assert(it != topologies.end());
+	if (--it->second.second == 0)
+		topologies.erase(it);
+}
+
+void TopologyIntMap::printTopology(ostream &out, int index) {
+	assert(topologies.find(index) != topologies.end());
+	IntVector &topo = topologies[index].first;
+	// topo[0] is taxon 0, the root of the canonical topology
+	int pos = 1;
+	if (topo.size() > 1 && topo[pos] < 0) {
+		// unroot by printing taxon 0 as one more child of its neighbor
+		int children = -topo[pos++];
+		out << "(" << topo[0];
+		for (int i = 0; i < children; i++) {
+			out << ",";
+			printTopology(out, topo, pos);
+		}
+		out << ")";
+	} else {
+		out << "(" << topo[0];
+		if (topo.size() > 1)
+			out << "," << topo[pos];
+		out << ")";
+	}
+	out << ";";
+}
+
+void TopologyIntMap::printTopology(ostream &out, IntVector &topo, int &pos) {
+	int value = topo[pos++];
+	if (value >= 0) {
+		out << value;
+		return;
+	}
+	out << "(";
+	for (int i = 0; i < -value; i++) {
+		if (i > 0) out << ",";
+		printTopology(out, topo, pos);
+	}
+	out << ")";
+}
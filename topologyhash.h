@@ -0,0 +1,162 @@
+//
+// C++ Interface: topologyhash
+//
+// Description: hashes of unrooted tree topologies, used as keys of the candidate trees
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef TOPOLOGYHASH_H
+#define TOPOLOGYHASH_H
+
+#include "tools.h"
+
+class MTree;
+
+/**
+Hash of an unrooted tree topology, the sum of the hashes of its internal splits
+(see MTree::computeTopologyHash()). The 128-bit key (lo, hi) identifies the topology, check is
+a further 64 bits that tell apart two topologies with the same key. All parts are added
+independently modulo 2^64.
+*/
+struct TopologyHash {
+	/** lower 64 bits of the key */
+	uint64_t lo;
+
+	/** upper 64 bits of the key */
+	uint64_t hi;
+
+	/** secondary check, not part of the key */
+	uint64_t check;
+
+	TopologyHash() {
+		lo = hi = check = 0;
+	}
+
+	TopologyHash &operator+=(const TopologyHash &hash) {
+		lo += hash.lo;
+		hi += hash.hi;
+		check += hash.check;
+		return *this;
+	}
+
+	TopologyHash &operator-=(const TopologyHash &hash) {
+		lo -= hash.lo;
+		hi -= hash.hi;
+		check -= hash.check;
+		return *this;
+	}
+
+	/** compare the keys only */
+	bool operator==(const TopologyHash &hash) const {
+		return lo == hash.lo && hi == hash.hi;
+	}
+
+	/** order by the keys only */
+	bool operator<(const TopologyHash &hash) const {
+		return hi < hash.hi || (hi == hash.hi && lo < hash.lo);
+	}
+
+	/**
+		@param taxon_id a taxon ID
+		@return the pseudo-random key of the taxon, which only depends on its ID
+	*/
+	static TopologyHash taxonKey(int taxon_id);
+
+	/**
+		@param key_sum sum of the taxon keys of the side of a split without taxon 0
+		@return hash of the split
+	*/
+	static TopologyHash splitHash(const TopologyHash &key_sum);
+};
+
+#ifdef USE_HASH_MAP
+/*
+	Define the hash function of TopologyHash
+*/
+struct hashfunc_TopologyHash {
+	size_t operator()(const TopologyHash &hash) const {
+		return (size_t) hash.lo;
+	}
+};
+#endif // USE_HASH_MAP
+
+/**
+Set of distinct tree topologies, each mapped to an index (e.g. the candidate trees of IQTree).
+Topologies are looked up by the key of their TopologyHash, only the key and the check of each
+topology are kept. A topology whose key is taken by a topology with a different check is stored
+under the next free key. The canonical topologies (MTree::getTopology()) are only stored for the
+indices that have to be converted back into trees, see storeTopology().
+
+Unlike the NEWICK strings used before, topologies are not compared exactly. Two different
+topologies are merged if both the key and the check match, i.e. if their 192-bit hashes are equal.
+Treating TopologyHash::splitHash() as a random function, this happens with probability at most
+n^2/2^193 for n distinct topologies (below 10^-40 for n = 10^9). Comparing canonical topologies
+would cost one MTree::getTopology() per lookup, which the incremental hashes of
+MTree::computeNNITopologyHash() and MTree::computeSPRTopologyHash() avoid.
+*/
+#ifdef USE_HASH_MAP
+class TopologyIntMap : public unordered_map<TopologyHash, int, hashfunc_TopologyHash>
+#else
+class TopologyIntMap : public map<TopologyHash, int>
+#endif
+{
+public:
+
+	/**
+		@param hash hash of a topology
+		@return index of the topology, -1 if not found
+	*/
+	int findTopology(TopologyHash hash);
+
+	/**
+		add a topology, which must not be in the set yet
+		@param hash hash of the topology
+		@param index index of the topology
+	*/
+	void insertTopology(TopologyHash hash, int index);
+
+	/**
+		keep the canonical topology of a tree for printTopology(). Every call must be matched by
+		one call of releaseTopology(), the topology is computed only by the first call
+		@param tree a tree
+		@param index index of the topology of tree
+	*/
+	void storeTopology(MTree *tree, int index);
+
+	/**
+		release a topology kept by storeTopology()
+		@param index index of the topology
+	*/
+	void releaseTopology(int index);
+
+	/**
+		print a topology kept by storeTopology() in NEWICK format with taxon IDs as names
+		@param out output stream
+		@param index index of the topology
+	*/
+	void printTopology(ostream &out, int index);
+
+protected:
+
+	/**
+		check of the topology of each index, see TopologyHash::check
+	*/
+	vector<uint64_t> checks;
+
+	/**
+		canonical topologies kept by storeTopology() and their number of storeTopology() calls
+	*/
+	map<int, pair<IntVector, int> > topologies;
+
+	/**
+		print the subtree starting at position pos of a canonical topology
+		@param out output stream
+		@param topo canonical topology
+		@param pos (IN/OUT) position, moved behind the subtree
+	*/
+	void printTopology(ostream &out, IntVector &topo, int &pos);
+};
+
+#endif
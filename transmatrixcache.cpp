@@ -0,0 +1,184 @@
+/***************************************************************************
+ *   Copyright (C) 2009 by BUI Quang Minh   *
+ *   minh.bui@univie.ac.at   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include <string.h>
+#include <assert.h>
+#include "transmatrixcache.h"
+#include "memarena.h"
+
+TransMatrixCache::TransMatrixCache() {
+	num_sets = 0;
+	matrix_size = 0;
+	entry_size = 0;
+	storage = NULL;
+	for (int i = 0; i < TRANS_CACHE_SHARDS; i++) {
+		shards[i].slots = NULL;
+		shards[i].clock = shards[i].hits = shards[i].misses = 0;
+#ifdef _OPENMP
+		omp_init_lock(&shards[i].lock);
+#endif
+	}
+}
+
+TransMatrixCache::~TransMatrixCache() {
+	freeMemory();
+#ifdef _OPENMP
+	for (int i = 0; i < TRANS_CACHE_SHARDS; i++)
+		omp_destroy_lock(&shards[i].lock);
+#endif
+}
+
+void TransMatrixCache::freeMemory() {
+	for (int i = 0; i < TRANS_CACHE_SHARDS; i++) {
+		if (shards[i].slots) delete [] shards[i].slots;
+		shards[i].slots = NULL;
+	}
+	MemArena::release(storage);
+	storage = NULL;
+	num_sets = 0;
+}
+
+void TransMatrixCache::init(int mat_size, int capacity_mb) {
+	freeMemory();
+	matrix_size = mat_size;
+	// 3 matrices per entry, padded to a multiple of 8 doubles (64 bytes)
+	entry_size = ((mat_size * 3 + 7) / 8) * 8;
+	size_t entry_bytes = entry_size * sizeof(double);
+	size_t num_entries = ((size_t)capacity_mb << 20) / entry_bytes;
+	num_sets = num_entries / (TRANS_CACHE_SHARDS * TRANS_CACHE_WAYS);
+	if (num_sets < 1) num_sets = 1;
+	int slots_per_shard = num_sets * TRANS_CACHE_WAYS;
+	storage = MemArena::allocArray<double>((size_t)entry_size * slots_per_shard * TRANS_CACHE_SHARDS);
+	double *mat = storage;
+	for (int i = 0; i < TRANS_CACHE_SHARDS; i++) {
+		shards[i].slots = new TransCacheSlot[slots_per_shard];
+		for (int j = 0; j < slots_per_shard; j++, mat += entry_size)
+			shards[i].slots[j].mat = mat;
+	}
+	clear();
+}
+
+void TransMatrixCache::clear() {
+	for (int i = 0; i < TRANS_CACHE_SHARDS; i++) {
+		TransCacheShard &shard = shards[i];
+		shard.clock = 0;
+		if (!shard.slots) continue;
+		for (int j = 0; j < num_sets * TRANS_CACHE_WAYS; j++) {
+			shard.slots[j].time = -1.0;
+			shard.slots[j].version = -1;
+			shard.slots[j].state = TRANS_CACHE_NONE;
+			shard.slots[j].last_used = 0;
+		}
+	}
+}
+
+uint64_t TransMatrixCache::hashKey(double time, int version) {
+	uint64_t h;
+	memcpy(&h, &time, sizeof(h));
+	h ^= (uint64_t)version * UINT64_C(0x9E3779B97F4A7C15);
+	// finalizer of splitmix64
+	h = (h ^ (h >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+	h = (h ^ (h >> 27)) * UINT64_C(0x94D049BB133111EB);
+	return h ^ (h >> 31);
+}
+
+TransCacheSlot *TransMatrixCache::findSlot(TransCacheShard &shard, uint64_t hash, double time, int version) {
+	TransCacheSlot *set = shard.slots + ((hash / TRANS_CACHE_SHARDS) % num_sets) * TRANS_CACHE_WAYS;
+	for (int i = 0; i < TRANS_CACHE_WAYS; i++)
+		if (set[i].time == time && set[i].version == version)
+			return &set[i];
+	return NULL;
+}
+
+TransCacheShard &TransMatrixCache::lockShard(uint64_t hash) {
+	TransCacheShard &shard = shards[hash % TRANS_CACHE_SHARDS];
+#ifdef _OPENMP
+	omp_set_lock(&shard.lock);
+#endif
+	return shard;
+}
+
+void TransMatrixCache::unlockShard(TransCacheShard &shard) {
+#ifdef _OPENMP
+	omp_unset_lock(&shard.lock);
+#endif
+}
+
+bool TransMatrixCache::lookup(double time, int version, int state, double *trans_matrix,
+		double *trans_derv1, double *trans_derv2) {
+	assert(storage);
+	uint64_t hash = hashKey(time, version);
+	TransCacheShard &shard = lockShard(hash);
+	TransCacheSlot *slot = findSlot(shard, hash, time, version);
+	bool found = slot && slot->state >= state;
+	if (found) {
+		slot->last_used = ++shard.clock;
+		memcpy(trans_matrix, slot->mat, matrix_size * sizeof(double));
+		if (state == TRANS_CACHE_DERV) {
+			memcpy(trans_derv1, slot->mat + matrix_size, matrix_size * sizeof(double));
+			memcpy(trans_derv2, slot->mat + 2 * matrix_size, matrix_size * sizeof(double));
+		}
+		shard.hits++;
+	} else
+		shard.misses++;
+	unlockShard(shard);
+	return found;
+}
+
+void TransMatrixCache::insert(double time, int version, int state, const double *trans_matrix,
+		const double *trans_derv1, const double *trans_derv2) {
+	assert(storage);
+	uint64_t hash = hashKey(time, version);
+	TransCacheShard &shard = lockShard(hash);
+	TransCacheSlot *slot = findSlot(shard, hash, time, version);
+	if (!slot) {
+		// take over the least recently used entry of the set
+		TransCacheSlot *set = shard.slots + ((hash / TRANS_CACHE_SHARDS) % num_sets) * TRANS_CACHE_WAYS;
+		slot = set;
+		for (int i = 1; i < TRANS_CACHE_WAYS; i++)
+			if (set[i].last_used < slot->last_used) slot = &set[i];
+		slot->time = time;
+		slot->version = version;
+		slot->state = TRANS_CACHE_NONE;
+	}
+	slot->last_used = ++shard.clock;
+	if (state > slot->state) {
+		memcpy(slot->mat, trans_matrix, matrix_size * sizeof(double));
+		if (state == TRANS_CACHE_DERV) {
+			memcpy(slot->mat + matrix_size, trans_derv1, matrix_size * sizeof(double));
+			memcpy(slot->mat + 2 * matrix_size, trans_derv2, matrix_size * sizeof(double));
+		}
+		slot->state = state;
+	}
+	unlockShard(shard);
+}
+
+uint64_t TransMatrixCache::getNumHits() {
+	uint64_t hits = 0;
+	for (int i = 0; i < TRANS_CACHE_SHARDS; i++)
+		hits += shards[i].hits;
+	return hits;
+}
+
+uint64_t TransMatrixCache::getNumMisses() {
+	uint64_t misses = 0;
+	for (int i = 0; i < TRANS_CACHE_SHARDS; i++)
+		misses += shards[i].misses;
+	return misses;
+}
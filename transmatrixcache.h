@@ -0,0 +1,190 @@
+/***************************************************************************
+ *   Copyright (C) 2009 by BUI Quang Minh   *
+ *   minh.bui@univie.ac.at   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef TRANSMATRIXCACHE_H
+#define TRANSMATRIXCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/** number of shards, each guarded by its own lock */
+#define TRANS_CACHE_SHARDS 16
+
+/** number of entries per set, replacement is LRU within a set */
+#define TRANS_CACHE_WAYS 4
+
+/**
+	what has been computed for a cache entry
+*/
+enum TransCacheState {TRANS_CACHE_NONE, TRANS_CACHE_MATRIX, TRANS_CACHE_DERV};
+
+/**
+	one entry of the transition matrix cache
+*/
+struct TransCacheSlot {
+	/** evolutionary time */
+	double time;
+	/** parameter version of the model that computed the matrices */
+	int version;
+	/** one of TransCacheState */
+	int state;
+	/** time stamp of the last access within the shard, for LRU replacement */
+	uint64_t last_used;
+	/** 3 consecutive matrices: transition matrix, 1st and 2nd derivative */
+	double *mat;
+};
+
+/**
+	one independently locked part of the cache
+*/
+struct TransCacheShard {
+	/** nsets * TRANS_CACHE_WAYS entries */
+	TransCacheSlot *slots;
+	/** access counter used as LRU time stamp */
+	uint64_t clock;
+	/** number of lookups answered from the cache */
+	uint64_t hits;
+	/** number of lookups that needed (re)computation */
+	uint64_t misses;
+#ifdef _OPENMP
+	omp_lock_t lock;
+#endif
+};
+
+/**
+Bounded cache of transition matrices (and their derivatives) keyed by evolutionary time and
+model parameter version. The cache is split into shards with one lock each; every shard is a
+set-associative table with least-recently-used replacement inside a set. All storage is
+allocated once with MemArena. lookup() and insert() copy the matrices from and into the cache
+while holding the shard lock, so callers only ever work on their own buffers.
+*/
+class TransMatrixCache
+{
+public:
+
+	TransMatrixCache();
+
+	~TransMatrixCache();
+
+	/**
+		(re)allocate the cache, dropping all entries
+		@param mat_size number of entries of one matrix (num_states * num_states)
+		@param capacity_mb memory limit in MB, at least TRANS_CACHE_SHARDS*TRANS_CACHE_WAYS entries are kept
+	*/
+	void init(int mat_size, int capacity_mb);
+
+	/**
+		drop all entries, keeping the allocated storage
+	*/
+	void clear();
+
+	/**
+		@return TRUE if init() was called for this matrix size
+	*/
+	bool isInitialized(int mat_size) { return storage != NULL && mat_size == matrix_size; }
+
+	/**
+		look up an entry and copy its matrices. The shard is only locked during the lookup,
+		so that a miss is computed by the caller without blocking other threads
+		@param time evolutionary time
+		@param version parameter version of the model
+		@param state what is needed, TRANS_CACHE_MATRIX or TRANS_CACHE_DERV
+		@param trans_matrix (OUT) transition matrix
+		@param trans_derv1 (OUT) 1st derivative, only for TRANS_CACHE_DERV
+		@param trans_derv2 (OUT) 2nd derivative, only for TRANS_CACHE_DERV
+		@return TRUE if the entry was found with at least state computed, FALSE on a miss
+	*/
+	bool lookup(double time, int version, int state, double *trans_matrix,
+			double *trans_derv1 = NULL, double *trans_derv2 = NULL);
+
+	/**
+		store the matrices computed after a miss of lookup(). The least recently used entry of the
+		set is taken over, unless another thread has already stored the same or more
+		@param time evolutionary time
+		@param version parameter version of the model
+		@param state what is given, TRANS_CACHE_MATRIX or TRANS_CACHE_DERV
+		@param trans_matrix transition matrix
+		@param trans_derv1 1st derivative, only for TRANS_CACHE_DERV
+		@param trans_derv2 2nd derivative, only for TRANS_CACHE_DERV
+	*/
+	void insert(double time, int version, int state, const double *trans_matrix,
+			const double *trans_derv1 = NULL, const double *trans_derv2 = NULL);
+
+	/**
+		@return number of entries the cache can hold
+	*/
+	int getCapacity() { return TRANS_CACHE_SHARDS * num_sets * TRANS_CACHE_WAYS; }
+
+	/**
+		@return total number of lookups answered from the cache
+	*/
+	uint64_t getNumHits();
+
+	/**
+		@return total number of lookups that needed (re)computation
+	*/
+	uint64_t getNumMisses();
+
+protected:
+
+	/**
+		free all memory
+	*/
+	void freeMemory();
+
+	/**
+		@return hash value of the key
+	*/
+	uint64_t hashKey(double time, int version);
+
+	/**
+		@return the slot holding the key or NULL
+	*/
+	TransCacheSlot *findSlot(TransCacheShard &shard, uint64_t hash, double time, int version);
+
+	/**
+		@return the shard of a key, locked
+	*/
+	TransCacheShard &lockShard(uint64_t hash);
+
+	/**
+		unlock a shard of lockShard()
+	*/
+	void unlockShard(TransCacheShard &shard);
+
+	/** shards of the cache */
+	TransCacheShard shards[TRANS_CACHE_SHARDS];
+
+	/** number of sets per shard */
+	int num_sets;
+
+	/** number of doubles of one matrix */
+	int matrix_size;
+
+	/** number of doubles of one entry (3 matrices rounded up to a cache line) */
+	int entry_size;
+
+	/** 64-byte aligned storage for all entries, see MemArena::allocArray() */
+	double *storage;
+};
+
+#endif